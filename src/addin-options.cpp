@@ -27,6 +27,7 @@
 #include "common.h"
 #include "cpphelp.h"
 #include "oomhelp.h"
+#include "metrics.h"
 
 #include <string>
 
@@ -277,6 +278,10 @@ open_gpgolconfig (LPVOID arg)
   log_debug ("%s:%s:stderr:\n'%s'",
              SRCNAME, __func__, mystderr.toString ().c_str ());
   read_options ();
+  if ((opt.enable_debug & DBG_METRICS))
+    {
+      Metrics::instance ()->dump_to_log ();
+    }
   return 0;
 }
 
@@ -0,0 +1,206 @@
+/* addrcache.cpp - Cache for resolved address book entries
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+
+#include "addrcache.h"
+
+AddressCache::AddressCache (std::chrono::seconds ttl,
+                            std::chrono::seconds negative_ttl) :
+  m_ttl (ttl),
+  m_negative_ttl (negative_ttl),
+  m_hits (0),
+  m_misses (0)
+{
+}
+
+AddressCache *
+AddressCache::instance ()
+{
+  /* Intentionally leaked like the other singletons.  */
+  static AddressCache *s_cache = new AddressCache ();
+  return s_cache;
+}
+
+/* When a result expires.  OK is false for failures.  */
+std::chrono::steady_clock::time_point
+AddressCache::expires (bool ok) const
+{
+  return std::chrono::steady_clock::now () + (ok ? m_ttl : m_negative_ttl);
+}
+
+static bool
+fresh (const std::chrono::steady_clock::time_point &expires)
+{
+  return std::chrono::steady_clock::now () < expires;
+}
+
+bool
+AddressCache::smtp_address (AddressDirectory &dir, const std::string &id,
+                            std::string *r_addr, bool refresh)
+{
+  const bool cacheable = dir.cacheable (id);
+  if (cacheable && !refresh)
+    {
+      std::lock_guard<std::mutex> lock (m_mutex);
+      const auto it = m_items.find (id);
+      if (it != m_items.end () && it->second.smtp_known &&
+          fresh (it->second.smtp_expires))
+        {
+          m_hits++;
+          *r_addr = it->second.smtp;
+          return !r_addr->empty ();
+        }
+    }
+
+  std::string addr;
+  if (!dir.resolve_smtp (id, &addr))
+    {
+      addr.clear ();
+    }
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+  m_misses++;
+  if (cacheable)
+    {
+      item_s &item = m_items[id];
+      item.smtp_known = true;
+      item.smtp_expires = expires (!addr.empty ());
+      item.smtp = addr;
+    }
+  *r_addr = addr;
+  return !addr.empty ();
+}
+
+bool
+AddressCache::expand_group (AddressDirectory &dir, const std::string &id,
+                            std::vector<member_s> *r_members, bool refresh)
+{
+  std::set<std::string> visited;
+  return expand (dir, id, visited, r_members, refresh);
+}
+
+bool
+AddressCache::expand (AddressDirectory &dir, const std::string &id,
+                      std::set<std::string> &visited,
+                      std::vector<member_s> *r_members, bool refresh)
+{
+  if (!visited.insert (id).second)
+    {
+      log_debug ("%s:%s: Group contains itself.", SRCNAME, __func__);
+      return false;
+    }
+
+  const bool cacheable = dir.cacheable (id);
+  if (cacheable && !refresh)
+    {
+      std::lock_guard<std::mutex> lock (m_mutex);
+      const auto it = m_items.find (id);
+      if (it != m_items.end () && it->second.group_known &&
+          fresh (it->second.group_expires))
+        {
+          m_hits++;
+          if (!it->second.is_group)
+            {
+              return false;
+            }
+          *r_members = it->second.members;
+          return !r_members->empty ();
+        }
+    }
+
+  std::vector<AddressDirectory::entry_s> entries;
+  const bool is_group = dir.group_members (id, &entries);
+  std::vector<member_s> members;
+  bool complete = true;
+  for (const auto &entry: entries)
+    {
+      if (entry.is_group)
+        {
+          std::vector<member_s> sub;
+          if (expand (dir, entry.id, visited, &sub, refresh))
+            {
+              members.insert (members.end (), sub.begin (), sub.end ());
+              continue;
+            }
+        }
+      member_s member;
+      member.id = entry.id;
+      member.name = entry.name;
+      if (!entry.addr.empty ())
+        {
+          member.addr = entry.addr;
+          members.push_back (member);
+          continue;
+        }
+      if (smtp_address (dir, entry.id, &member.addr, refresh))
+        {
+          members.push_back (member);
+          continue;
+        }
+      log_debug ("%s:%s: Failed to resolve a member.", SRCNAME, __func__);
+      complete = false;
+    }
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+  m_misses++;
+  if (cacheable)
+    {
+      item_s &item = m_items[id];
+      item.group_known = true;
+      item.group_expires = expires (!is_group ||
+                                    (complete && !members.empty ()));
+      item.is_group = is_group;
+      item.members = members;
+    }
+  if (!is_group)
+    {
+      return false;
+    }
+  *r_members = members;
+  return !members.empty ();
+}
+
+void
+AddressCache::invalidate (const std::string &id)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  m_items.erase (id);
+}
+
+void
+AddressCache::clear ()
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  m_items.clear ();
+}
+
+size_t
+AddressCache::hits () const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_hits;
+}
+
+size_t
+AddressCache::misses () const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_misses;
+}
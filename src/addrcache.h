@@ -0,0 +1,146 @@
+/* addrcache.h - Cache for resolved address book entries
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ADDRCACHE_H
+#define ADDRCACHE_H
+
+#include "config.h"
+
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/** The address book as needed to resolve recipients.  Entries are
+  known by their id.  Every call is expected to be slow. */
+class AddressDirectory
+{
+public:
+  struct entry_s
+  {
+    std::string id;
+    std::string name;
+    /* The address if the entry has one of type SMTP. */
+    std::string addr;
+    bool is_group;
+  };
+
+  virtual ~AddressDirectory () {}
+
+  /** Find the SMTP address of a non SMTP entry, e.g. through
+    Exchange.  Returns false if there is none. */
+  virtual bool resolve_smtp (const std::string &id, std::string *r_addr) = 0;
+
+  /** If id is a distribution list set r_members to its direct
+    members and return true. */
+  virtual bool group_members (const std::string &id,
+                              std::vector<entry_s> *r_members) = 0;
+
+  /** Whether results for id may be cached.  Ids that are only
+    valid for one walk through the recipients must not be. */
+  virtual bool cacheable (const std::string &id) const
+  {
+    return !id.empty ();
+  }
+};
+
+/** Caches the SMTP addresses and group members of address book
+  entries for the session.
+
+  Groups are expanded recursively to the addresses of their
+  members.  Lists that contain themselves are only expanded once.
+  Results are cached for the time to live so that the directory
+  is only asked again once they are stale or were invalidated.
+  A failure might just mean that Exchange is not reachable right
+  now.  So addresses that could not be resolved and groups with
+  members that could not be resolved are only kept for the much
+  shorter negative time to live.
+
+  The cache is thread safe but the directory is called without a
+  lock, so concurrent misses for the same id might both ask it. */
+class AddressCache
+{
+public:
+  struct member_s
+  {
+    std::string id;
+    std::string name;
+    std::string addr;
+  };
+
+  explicit AddressCache (std::chrono::seconds ttl =
+                           std::chrono::seconds (600),
+                         std::chrono::seconds negative_ttl =
+                           std::chrono::seconds (30));
+
+  /** The shared cache. */
+  static AddressCache *instance ();
+
+  /** Get the SMTP address of id.  Returns false if it can not be
+    resolved.  If refresh is true the directory is asked even if
+    the address is cached and the cache is updated. */
+  bool smtp_address (AddressDirectory &dir, const std::string &id,
+                     std::string *r_addr, bool refresh = false);
+
+  /** If id is a group set r_members to the addresses of its
+    members and return true.  Returns false for other entries and
+    for groups without resolvable members.  If refresh is true the
+    group and its members are looked up in the directory again. */
+  bool expand_group (AddressDirectory &dir, const std::string &id,
+                     std::vector<member_s> *r_members,
+                     bool refresh = false);
+
+  /** Drop what is known about id. */
+  void invalidate (const std::string &id);
+
+  /** Drop everything. */
+  void clear ();
+
+  /** Statistics for the debug log and tests. */
+  size_t hits () const;
+  size_t misses () const;
+
+private:
+  struct item_s
+  {
+    item_s () : smtp_known (false), group_known (false), is_group (false) {}
+    bool smtp_known;
+    std::chrono::steady_clock::time_point smtp_expires;
+    std::string smtp;          /* Empty if it could not be resolved. */
+    bool group_known;
+    std::chrono::steady_clock::time_point group_expires;
+    bool is_group;
+    std::vector<member_s> members;
+  };
+
+  std::chrono::steady_clock::time_point expires (bool ok) const;
+  bool expand (AddressDirectory &dir, const std::string &id,
+               std::set<std::string> &visited,
+               std::vector<member_s> *r_members, bool refresh);
+
+  const std::chrono::seconds m_ttl;
+  const std::chrono::seconds m_negative_ttl;
+  mutable std::mutex m_mutex;
+  std::unordered_map<std::string, item_s> m_items;
+  size_t m_hits;
+  size_t m_misses;
+};
+
+#endif // ADDRCACHE_H
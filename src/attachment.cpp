@@ -22,10 +22,18 @@
 #include "config.h"
 #include "common_indep.h"
 #include "attachment.h"
+#include "metrics.h"
 
 #include <climits>
 
-Attachment::Attachment()
+static Metrics::Gauge *
+bytes_gauge ()
+{
+  static auto s_gauge = Metrics::instance ()->gauge ("attachment.bytes");
+  return s_gauge;
+}
+
+Attachment::Attachment() : m_size (0)
 {
   memdbg_ctor ("Attachment");
 }
@@ -33,6 +41,8 @@ Attachment::Attachment()
 Attachment::~Attachment()
 {
   memdbg_dtor ("Attachment");
+  bytes_gauge ()->add (-(int64_t) m_size);
+  memdbg_account (MEMDBG_PARSER, -(long long) m_size);
   log_debug ("%s:%s", SRCNAME, __func__);
 }
 
@@ -66,6 +76,19 @@ Attachment::get_data()
   return m_data;
 }
 
+ssize_t
+Attachment::write (const char *buf, size_t len)
+{
+  const ssize_t ret = m_data.write (buf, len);
+  if (ret > 0)
+    {
+      m_size += ret;
+      bytes_gauge ()->add (ret);
+      memdbg_account (MEMDBG_PARSER, ret);
+    }
+  return ret;
+}
+
 void
 Attachment::set_content_id(const char *cid)
 {
@@ -50,8 +50,13 @@ public:
   /* get the underlying data structure */
   GpgME::Data& get_data();
 
+  /* Append to the data.  Unlike writing to get_data this
+     accounts the size in the attachment.bytes metric. */
+  ssize_t write (const char *buf, size_t len);
+
 private:
   GpgME::Data m_data;
+  size_t m_size;
   std::string m_utf8DisplayName;
   attachtype_t m_type;
   std::string m_cid;
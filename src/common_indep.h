@@ -207,6 +207,11 @@ struct
   int combinedOpsEnabled;    /* Enable S/MIME and OpenPGP combined operations. */
   int splitBCCMails;         /* Split BCC recipients in their own mails. */
   int encryptSubject;        /* Encrypt the subject with protected headers. */
+  int max_mime_depth;        /* Limits for parsing a MIME mail.  Zero */
+  int max_mime_parts;        /* selects the built-in default. */
+  int max_mime_attachments;
+  int max_mime_header_lines;
+  int resolver_service;      /* Keep resolver.exe running in server mode. */
 
   /* The forms revision number of the binary.  */
   int forms_revision;
@@ -0,0 +1,305 @@
+/* confsnapshot.cpp - Persisted snapshot of the gpgconf options
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+#include "cpphelp.h"
+
+#include "confsnapshot.h"
+
+#include <gpgme.h>
+
+#include <stdio.h>
+
+#define SNAPSHOT_NAME "gpgol-gpgconf.txt"
+#define SNAPSHOT_HEADER "# GpgOL gpgconf snapshot v1"
+
+bool
+ConfigSnapshot::source_s::operator== (const source_s &other) const
+{
+  return path == other.path && exists == other.exists &&
+         (!exists || (mtime == other.mtime && size == other.size));
+}
+
+std::vector<std::string>
+ConfigSnapshot::config_files ()
+{
+  std::vector<std::string> ret;
+  for (const char *dirname: { "homedir", "sysconfdir" })
+    {
+      const char *dir = gpgme_get_dirinfo (dirname);
+      if (!dir)
+        {
+          continue;
+        }
+      for (const char *name: { "gpg.conf", "gpgsm.conf", "dirmngr.conf",
+                               "gpgconf.conf" })
+        {
+          ret.push_back (std::string (dir) + "/" + name);
+        }
+    }
+  return ret;
+}
+
+ConfigSnapshot::sources_t
+ConfigSnapshot::stat_files (const std::vector<std::string> &files)
+{
+  sources_t ret;
+  for (const auto &file: files)
+    {
+      source_s source;
+      source.path = file;
+      source.mtime = 0;
+      source.size = 0;
+      source.exists = gpgol_stat (file, &source.mtime, &source.size);
+      ret.push_back (source);
+    }
+  return ret;
+}
+
+std::string
+ConfigSnapshot::default_path ()
+{
+  const char *homedir = gpgme_get_dirinfo ("homedir");
+  if (!homedir)
+    {
+      return std::string ();
+    }
+  return std::string (homedir) + "/" SNAPSHOT_NAME;
+}
+
+void
+ConfigSnapshot::set (const std::string &component, const std::string &option,
+                     const std::string &value)
+{
+  m_components.insert (component);
+  if (option.empty ())
+    {
+      return;
+    }
+  if (value.find_first_of ("\r\n") != std::string::npos)
+    {
+      log_debug ("%s:%s: Skipping multi line value of %s",
+                 SRCNAME, __func__, option.c_str ());
+      return;
+    }
+  m_options[std::make_pair (component, option)] = value;
+}
+
+bool
+ConfigSnapshot::get (const std::string &component, const std::string &option,
+                     std::string *r_value) const
+{
+  const auto it = m_options.find (std::make_pair (component, option));
+  if (it == m_options.end ())
+    {
+      return false;
+    }
+  *r_value = it->second;
+  return true;
+}
+
+bool
+ConfigSnapshot::flag (const std::string &component,
+                      const std::string &option) const
+{
+  std::string value;
+  return get (component, option, &value) && value == "1";
+}
+
+bool
+ConfigSnapshot::has_component (const std::string &component) const
+{
+  return m_components.count (component);
+}
+
+bool
+ConfigSnapshot::empty () const
+{
+  return m_components.empty ();
+}
+
+void
+ConfigSnapshot::set_sources (const sources_t &sources)
+{
+  m_sources = sources;
+}
+
+const ConfigSnapshot::sources_t &
+ConfigSnapshot::sources () const
+{
+  return m_sources;
+}
+
+bool
+ConfigSnapshot::current () const
+{
+  std::vector<std::string> files;
+  for (const auto &source: m_sources)
+    {
+      files.push_back (source.path);
+    }
+  return stat_files (files) == m_sources;
+}
+
+bool
+ConfigSnapshot::same (const ConfigSnapshot &other) const
+{
+  return m_components == other.m_components &&
+         m_options == other.m_options && m_sources == other.m_sources;
+}
+
+/* The file has one line per file, component and option:
+   file <exists> <mtime> <size> <path>
+   comp <component>
+   opt <component> <option> <value>  */
+bool
+ConfigSnapshot::save (const std::string &path) const
+{
+  if (path.empty ())
+    {
+      return false;
+    }
+  const std::string tmp = path + ".tmp";
+  FILE *fp = gpgol_fopen (tmp, "wb");
+  if (!fp)
+    {
+      log_error ("%s:%s: Failed to write '%s'",
+                 SRCNAME, __func__, tmp.c_str ());
+      return false;
+    }
+  fputs (SNAPSHOT_HEADER "\n", fp);
+  for (const auto &source: m_sources)
+    {
+      const std::string line = "file " +
+                               std::to_string (source.exists ? 1 : 0) + " " +
+                               std::to_string (source.mtime) + " " +
+                               std::to_string (source.size) + " " +
+                               source.path + "\n";
+      fputs (line.c_str (), fp);
+    }
+  for (const auto &component: m_components)
+    {
+      fputs (("comp " + component + "\n").c_str (), fp);
+    }
+  for (const auto &pair: m_options)
+    {
+      const std::string line = "opt " + pair.first.first + " " +
+                               pair.first.second + " " + pair.second + "\n";
+      fputs (line.c_str (), fp);
+    }
+  if (fclose (fp))
+    {
+      log_error ("%s:%s: Failed to write '%s'",
+                 SRCNAME, __func__, tmp.c_str ());
+      return false;
+    }
+  if (!gpgol_replace_file (tmp, path))
+    {
+      log_error ("%s:%s: Failed to replace '%s'",
+                 SRCNAME, __func__, path.c_str ());
+      return false;
+    }
+  return true;
+}
+
+/* Split off the next space separated field of line at pos.  */
+static std::string
+next_field (const std::string &line, size_t *pos)
+{
+  const size_t end = line.find (' ', *pos);
+  std::string ret = line.substr (*pos, end == std::string::npos ?
+                                       std::string::npos : end - *pos);
+  *pos = end == std::string::npos ? line.size () : end + 1;
+  return ret;
+}
+
+bool
+ConfigSnapshot::load (const std::string &path)
+{
+  if (path.empty ())
+    {
+      return false;
+    }
+  FILE *fp = gpgol_fopen (path, "rb");
+  if (!fp)
+    {
+      log_debug ("%s:%s: No snapshot at '%s'",
+                 SRCNAME, __func__, path.c_str ());
+      return false;
+    }
+  std::string content;
+  char buf[4096];
+  size_t nread;
+  while ((nread = fread (buf, 1, sizeof buf, fp)) > 0)
+    {
+      content.append (buf, nread);
+    }
+  fclose (fp);
+
+  const auto lines = gpgol_split (content, '\n');
+  if (lines.empty () || lines[0] != SNAPSHOT_HEADER)
+    {
+      log_debug ("%s:%s: Ignoring snapshot with unknown format.",
+                 SRCNAME, __func__);
+      return false;
+    }
+
+  ConfigSnapshot snapshot;
+  for (size_t i = 1; i < lines.size (); i++)
+    {
+      const auto &line = lines[i];
+      size_t pos = 0;
+      const auto what = next_field (line, &pos);
+      if (what == "file")
+        {
+          source_s source;
+          source.exists = next_field (line, &pos) == "1";
+          source.mtime = strtoll (next_field (line, &pos).c_str (),
+                                  nullptr, 10);
+          source.size = strtoll (next_field (line, &pos).c_str (),
+                                 nullptr, 10);
+          source.path = line.substr (pos);
+          snapshot.m_sources.push_back (source);
+        }
+      else if (what == "comp")
+        {
+          snapshot.set (line.substr (pos), std::string (), std::string ());
+        }
+      else if (what == "opt")
+        {
+          const auto component = next_field (line, &pos);
+          const auto option = next_field (line, &pos);
+          snapshot.set (component, option, line.substr (pos));
+        }
+      else if (!line.empty ())
+        {
+          log_debug ("%s:%s: Ignoring invalid line in snapshot.",
+                     SRCNAME, __func__);
+        }
+    }
+  if (snapshot.m_sources.empty () || snapshot.empty ())
+    {
+      log_debug ("%s:%s: Snapshot incomplete.", SRCNAME, __func__);
+      return false;
+    }
+  *this = snapshot;
+  log_debug ("%s:%s: Loaded " SIZE_T_FORMAT " options.",
+             SRCNAME, __func__, m_options.size ());
+  return true;
+}
@@ -0,0 +1,97 @@
+/* confsnapshot.h - Persisted snapshot of the gpgconf options
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CONFSNAPSHOT_H
+#define CONFSNAPSHOT_H
+
+#include "config.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+/** The values of the gpgconf options at some point in time.
+
+  Listing the options with gpgconf runs each component and takes
+  a while.  Until it is done GpgOL does not know e.g. whether a
+  verification might go online.  The snapshot is saved to a file
+  in the GnuPG home directory together with the state of the
+  configuration files it came from.  At the next start it is
+  used right away as long as these files did not change.
+
+  Flags have the value "1" or "0", for lists only the first value
+  is kept. */
+class ConfigSnapshot
+{
+public:
+  /** The state of a configuration file. */
+  struct source_s
+  {
+    std::string path;
+    bool exists;
+    long long mtime;
+    long long size;
+
+    bool operator== (const source_s &other) const;
+  };
+  typedef std::vector<source_s> sources_t;
+
+  /** The configuration files of gpg, gpgsm, dirmngr and gpgconf in
+    the home and the system configuration directory. */
+  static std::vector<std::string> config_files ();
+
+  /** The current state of files. */
+  static sources_t stat_files (const std::vector<std::string> &files);
+
+  /** Where the snapshot is saved. */
+  static std::string default_path ();
+
+  void set (const std::string &component, const std::string &option,
+            const std::string &value);
+  bool get (const std::string &component, const std::string &option,
+            std::string *r_value) const;
+  /** True if the flag option is set. */
+  bool flag (const std::string &component,
+             const std::string &option) const;
+  bool has_component (const std::string &component) const;
+  bool empty () const;
+
+  void set_sources (const sources_t &sources);
+  const sources_t &sources () const;
+
+  /** True if none of the files changed since the snapshot was
+    taken. */
+  bool current () const;
+
+  /** True if the options and files are the same as in other. */
+  bool same (const ConfigSnapshot &other) const;
+
+  bool save (const std::string &path) const;
+  /** Replace this by the snapshot in path.  Returns false if there
+    is no valid snapshot. */
+  bool load (const std::string &path);
+
+private:
+  std::set<std::string> m_components;
+  std::map<std::pair<std::string, std::string>, std::string> m_options;
+  sources_t m_sources;
+};
+
+#endif // CONFSNAPSHOT_H
@@ -0,0 +1,165 @@
+/* contextpool.cpp - Pool of reusable GpgME contexts
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+
+#include "contextpool.h"
+
+#include <gpgme++/context.h>
+
+static int
+proto_index (GpgME::Protocol protocol)
+{
+  switch (protocol)
+    {
+      case GpgME::OpenPGP:
+        return 0;
+      case GpgME::CMS:
+        return 1;
+      default:
+        return -1;
+    }
+}
+
+/* Undo everything our callers set for a single operation. */
+static void
+reset_context (GpgME::Context *ctx)
+{
+  ctx->setSender (nullptr);
+  ctx->setOffline (false);
+  ctx->setFlag ("auto-key-retrieve", "0");
+  ctx->setArmor (false);
+  ctx->setTextMode (false);
+  ctx->setKeyListMode (GpgME::KeyListMode::Local);
+  ctx->clearSigningKeys ();
+}
+
+void
+ContextPool::Returner::operator() (GpgME::Context *ctx) const
+{
+  if (!ctx)
+    {
+      return;
+    }
+  if (m_pool)
+    {
+      m_pool->put (ctx);
+      return;
+    }
+  delete ctx;
+}
+
+ContextPool::ContextPool (size_t max_idle) :
+  m_max_idle (max_idle)
+{
+}
+
+ContextPool::~ContextPool ()
+{
+  clear ();
+}
+
+ContextPool *
+ContextPool::instance ()
+{
+  /* Leaked on purpose. The contexts might be used until the
+     very end.  */
+  static ContextPool *s_pool = new ContextPool ();
+  return s_pool;
+}
+
+ContextPool::Handle
+ContextPool::get (GpgME::Protocol protocol)
+{
+  const int idx = proto_index (protocol);
+  if (idx >= 0)
+    {
+      std::lock_guard<std::mutex> lock (m_mutex);
+      if (!m_idle[idx].empty ())
+        {
+          GpgME::Context *ctx = m_idle[idx].back ();
+          m_idle[idx].pop_back ();
+          return Handle (ctx, Returner (this));
+        }
+    }
+
+  auto ctx = GpgME::Context::create (protocol);
+  if (!ctx)
+    {
+      log_error ("%s:%s: Failed to create context for %i.",
+                 SRCNAME, __func__, (int) protocol);
+      return Handle (nullptr, Returner (this));
+    }
+  log_debug ("%s:%s: Created new context for %i.",
+             SRCNAME, __func__, (int) protocol);
+  return Handle (ctx.release (), Returner (idx >= 0 ? this : nullptr));
+}
+
+void
+ContextPool::put (GpgME::Context *ctx)
+{
+  const int idx = proto_index (ctx->protocol ());
+  if (idx >= 0)
+    {
+      reset_context (ctx);
+      std::lock_guard<std::mutex> lock (m_mutex);
+      if (m_idle[idx].size () < m_max_idle)
+        {
+          m_idle[idx].push_back (ctx);
+          return;
+        }
+    }
+  delete ctx;
+}
+
+void
+ContextPool::discard (Handle &handle)
+{
+  delete handle.release ();
+}
+
+void
+ContextPool::clear ()
+{
+  std::vector<GpgME::Context *> release;
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    for (auto &idle: m_idle)
+      {
+        release.insert (release.end (), idle.begin (), idle.end ());
+        idle.clear ();
+      }
+  }
+  for (auto ctx: release)
+    {
+      delete ctx;
+    }
+}
+
+size_t
+ContextPool::idle (GpgME::Protocol protocol)
+{
+  const int idx = proto_index (protocol);
+  if (idx < 0)
+    {
+      return 0;
+    }
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_idle[idx].size ();
+}
@@ -0,0 +1,94 @@
+/* contextpool.h - Pool of reusable GpgME contexts
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CONTEXTPOOL_H
+#define CONTEXTPOOL_H
+
+#include "config.h"
+
+#include <gpgme++/global.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace GpgME
+{
+  class Context;
+} // namespace GpgME
+
+/** Keeps idle GpgME contexts per protocol so that the setup cost
+  of a context is not paid for every mail and every key operation.
+
+  A context is checked out with get and automatically returned
+  when the handle goes out of scope.  The state that our callers
+  change per operation (sender, offline, flags, armor, textmode,
+  keylist mode and signing keys) is reset on return so that a
+  checked out context always looks like a fresh one.
+
+  A context must only be used by the thread that checked it out.
+  Operations have to be finished before the handle goes out of
+  scope.  A caller that stops e.g. a keylisting early has to
+  discard the context instead, as only destroying it ends the
+  engine process of the pending operation. */
+class ContextPool
+{
+public:
+  /* Returns a context to the pool on destruction. */
+  class Returner
+  {
+  public:
+    Returner () : m_pool (nullptr) {}
+    explicit Returner (ContextPool *pool) : m_pool (pool) {}
+    void operator() (GpgME::Context *ctx) const;
+  private:
+    ContextPool *m_pool;
+  };
+
+  typedef std::unique_ptr<GpgME::Context, Returner> Handle;
+
+  /** Create a pool keeping up to max_idle contexts per protocol. */
+  explicit ContextPool (size_t max_idle = 4);
+  ~ContextPool ();
+
+  /** The global pool. */
+  static ContextPool *instance ();
+
+  /** Check out a context for protocol.  The handle is null if
+    no context could be created (e.g. broken installation). */
+  Handle get (GpgME::Protocol protocol);
+
+  /** Destroy the context of handle instead of returning it to
+    the pool.  The handle is null afterwards. */
+  static void discard (Handle &handle);
+
+  /** Release all idle contexts. */
+  void clear ();
+
+  /** Number of idle contexts for protocol. */
+  size_t idle (GpgME::Protocol protocol);
+
+private:
+  void put (GpgME::Context *ctx);
+
+  std::mutex m_mutex;
+  std::vector<GpgME::Context *> m_idle[2];
+  size_t m_max_idle;
+};
+
+#endif // CONTEXTPOOL_H
@@ -30,10 +30,13 @@
 #include <vector>
 #include <iterator>
 
+#include <sys/stat.h>
+
 #include "common_indep.h"
 
 #ifdef HAVE_W32_SYSTEM
 # include "common.h"
+# include "w32-gettext.h"
 # include <windows.h>
 #else
 #include "common_indep.h"
@@ -327,3 +330,59 @@ asprintf_s (const char *fmt, ...)
   va_end (a);
   return ret;
 }
+
+FILE *
+gpgol_fopen (const std::string &path, const char *mode)
+{
+#ifdef HAVE_W32_SYSTEM
+  wchar_t *wpath = utf8_to_wchar (path.c_str ());
+  wchar_t *wmode = utf8_to_wchar (mode);
+  FILE *ret = nullptr;
+  if (wpath && wmode)
+    {
+      ret = _wfopen (wpath, wmode);
+    }
+  xfree (wpath);
+  xfree (wmode);
+  return ret;
+#else
+  return fopen (path.c_str (), mode);
+#endif
+}
+
+bool
+gpgol_replace_file (const std::string &src, const std::string &dst)
+{
+#ifdef HAVE_W32_SYSTEM
+  wchar_t *wsrc = utf8_to_wchar (src.c_str ());
+  wchar_t *wdst = utf8_to_wchar (dst.c_str ());
+  bool ret = wsrc && wdst &&
+             MoveFileExW (wsrc, wdst, MOVEFILE_REPLACE_EXISTING);
+  xfree (wsrc);
+  xfree (wdst);
+  return ret;
+#else
+  return !rename (src.c_str (), dst.c_str ());
+#endif
+}
+
+bool
+gpgol_stat (const std::string &path, long long *r_mtime, long long *r_size)
+{
+#ifdef HAVE_W32_SYSTEM
+  wchar_t *wpath = utf8_to_wchar (path.c_str ());
+  struct _stat64 st;
+  const bool ret = wpath && !_wstat64 (wpath, &st);
+  xfree (wpath);
+#else
+  struct stat st;
+  const bool ret = !stat (path.c_str (), &st);
+#endif
+  if (!ret)
+    {
+      return false;
+    }
+  *r_mtime = (long long) st.st_mtime;
+  *r_size = (long long) st.st_size;
+  return true;
+}
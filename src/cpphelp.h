@@ -21,6 +21,8 @@
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
+
 #include <string>
 #include <vector>
 #include <map>
@@ -70,6 +72,17 @@ const char *to_cstr (const GpgME::Protocol &prot);
 void find_and_replace(std::string& source, const std::string &find,
                       const std::string &replace);
 
+/* Open a file with an utf-8 encoded path. */
+FILE *gpgol_fopen (const std::string &path, const char *mode);
+
+/* Replace dst by src.  Returns false on error. */
+bool gpgol_replace_file (const std::string &src, const std::string &dst);
+
+/* Get the modification time and size of a file with an utf-8
+   encoded path.  Returns false if it does not exist. */
+bool gpgol_stat (const std::string &path, long long *r_mtime,
+                 long long *r_size);
+
 std::string asprintf_s (const char *fmt, ...) __attribute__ ((format (printf,1,2)));
 #define S_(a) std::string (utf8_gettext (a))
 #endif // CPPHELP_H
@@ -29,9 +29,14 @@
 #include "wks-helper.h"
 #include "overlay.h"
 #include "keycache.h"
+#include "pipedataprovider.h"
+#include "splitcrypt.h"
+#include "workerpool.h"
 #include "mymapitags.h"
 #include "recipient.h"
 #include "windowmessages.h"
+#include "metrics.h"
+#include "resolverservice.h"
 
 #include <gpgme++/context.h>
 #include <gpgme++/signingresult.h>
@@ -49,12 +54,62 @@ sink_data_write (sink_t sink, const void *data, size_t datalen)
   return 0;
 }
 
+static int
+sink_string_write (sink_t sink, const void *data, size_t datalen)
+{
+  auto str = static_cast<std::string *>(sink->cb_data);
+  str->append (static_cast<const char *>(data), datalen);
+  return 0;
+}
+
+static int
+sink_pipe_write (sink_t sink, const void *data, size_t datalen)
+{
+  auto pipe = static_cast<PipeDataProvider *>(sink->cb_data);
+  return pipe->write (data, datalen) < 0 ? -1 : 0;
+}
+
 static int
 create_sign_attach (sink_t sink, protocol_t protocol,
                     GpgME::Data &signature,
                     GpgME::Data &signedData,
                     const char *micalg);
 
+/* Arguments for the thread that produces the multipart/signed
+   structure which is consumed by the encryption.  */
+struct sign_attach_producer_s
+{
+  PipeDataProvider *pipe;
+  protocol_t protocol;
+  GpgME::Data *signature;
+  GpgME::Data *signedData;
+  const char *micalg;
+};
+
+static DWORD WINAPI
+do_produce_sign_attach (LPVOID arg)
+{
+  TSTART;
+  auto args = static_cast<sign_attach_producer_s *>(arg);
+
+  struct sink_s sinkmem;
+  sink_t sink = &sinkmem;
+  memset (sink, 0, sizeof *sink);
+  sink->cb_data = args->pipe;
+  sink->writefnc = sink_pipe_write;
+
+  int rc = create_sign_attach (sink, args->protocol, *args->signature,
+                               *args->signedData, args->micalg);
+  if (rc)
+    {
+      log_error ("%s:%s: Failed to create the signed part.",
+                 SRCNAME, __func__);
+    }
+  /* Tell the consumer that we are done.  */
+  args->pipe->close_write (rc != 0);
+  TRETURN rc ? 1 : 0;
+}
+
 /** We have some C Style cruft in here as this was historically how
   GpgOL worked directly in the MAPI data objects. To reduce the regression
   risk the new object oriented way for crypto reused as much as possible
@@ -66,7 +121,8 @@ CryptController::CryptController (Mail *mail, bool encrypt, bool sign,
     m_encrypt (encrypt),
     m_sign (sign),
     m_crypto_success (false),
-    m_proto (proto)
+    m_proto (proto),
+    m_input_size (0)
 {
   TSTART;
   memdbg_ctor ("CryptController");
@@ -82,6 +138,7 @@ CryptController::~CryptController()
 {
   TSTART;
   memdbg_dtor ("CryptController");
+  memdbg_account (MEMDBG_MIMEMAKER, -m_input_size);
   log_debug ("%s:%s:%p",
              SRCNAME, __func__, m_mail);
   TRETURN;
@@ -182,6 +239,11 @@ CryptController::collect_data ()
 
   mapi_release_attach_table (att_table);
 
+  const long long size = std::max ((long long) m_input.seek (0, SEEK_END),
+                                   0LL);
+  memdbg_account (MEMDBG_MIMEMAKER, size - m_input_size);
+  m_input_size = size;
+
   /* Set the input buffer to start. */
   m_input.seek (0, SEEK_SET);
   TRETURN 0;
@@ -319,58 +381,23 @@ CryptController::lookup_fingerprints (const std::vector<std::string> &sigFprs,
 
 
 int
-CryptController::parse_output (GpgME::Data &resolverOutput)
+CryptController::parse_output (const std::string &resolverOutput)
 {
   TSTART;
-  std::istringstream ss(resolverOutput.toString());
-  std::string line;
-
-  std::vector<std::string> sigFprs;
-  std::vector<std::pair<std::string, std::string>> recpFprs;
-  while (std::getline (ss, line))
+  resolver_output_s result;
+  int ret = parse_resolver_output (resolverOutput, &result);
+  if (ret)
     {
-      rtrim (line);
-      if (line == "cancel")
-        {
-          log_debug ("%s:%s: resolver canceled",
-                     SRCNAME, __func__);
-          TRETURN -2;
-        }
-      if (line == "unencrypted")
-        {
-          log_debug ("%s:%s: FIXME resolver wants unencrypted",
-                     SRCNAME, __func__);
-          TRETURN -1;
-        }
-      std::istringstream lss (line);
-
-      // First is sig or enc
-      std::string what;
-      std::string how;
-      std::string fingerprint;
-      std::string mbox;
-
-      std::getline (lss, what, ':');
-      std::getline (lss, how, ':');
-      std::getline (lss, fingerprint, ':');
-      std::getline (lss, mbox, ':');
-
-      if (m_proto == GpgME::UnknownProtocol)
-        {
-          /* TODO: Allow mixed */
-          m_proto = (how == "smime") ? GpgME::CMS : GpgME::OpenPGP;
-        }
+      TRETURN ret;
+    }
 
-      if (what == "sig")
-        {
-          sigFprs.push_back (fingerprint);
-          continue;
-        }
-      if (what == "enc")
-        {
-          recpFprs.push_back(std::make_pair(mbox, fingerprint));
-        }
+  if (m_proto == GpgME::UnknownProtocol && !result.proto.empty ())
+    {
+      /* TODO: Allow mixed */
+      m_proto = (result.proto == "smime") ? GpgME::CMS : GpgME::OpenPGP;
     }
+  const auto &sigFprs = result.sig_fprs;
+  const auto &recpFprs = result.recp_fprs;
 
   if (m_sign && sigFprs.empty())
     {
@@ -643,6 +670,59 @@ CryptController::clear_keys ()
   m_signer_keys.clear ();
 }
 
+/* Spawn a new resolver process with args.  Returns -1 on error.  */
+int
+CryptController::spawn_resolver (const std::vector<std::string> &args,
+                                 std::string *r_output)
+{
+  TSTART;
+  auto ctx = GpgME::Context::createForEngine (GpgME::SpawnEngine);
+  if (!ctx)
+    {
+      // can't happen
+      TRACEPOINT;
+      TRETURN -1;
+    }
+
+  // Convert our collected vector to c strings
+  // It's a bit overhead but should be quick for such small
+  // data.
+  char **cargs = vector_to_cArray (args);
+  log_data ("%s:%s: Spawn args:",
+            SRCNAME, __func__);
+  for (size_t i = 0; cargs && cargs[i]; i++)
+    {
+      log_data (SIZE_T_FORMAT ": '%s'", i, cargs[i]);
+    }
+
+  GpgME::Data mystdin (GpgME::Data::null), mystdout, mystderr;
+  GpgME::Error err = ctx->spawn (cargs[0], const_cast <const char**> (cargs),
+                                 mystdin, mystdout, mystderr,
+                                 (GpgME::Context::SpawnFlags) (
+                                  GpgME::Context::SpawnAllowSetFg |
+                                  GpgME::Context::SpawnShowWindow));
+  // Somehow Qt messes up which window to bring back to front.
+  // So we do it manually.
+  bring_to_front (m_mail->getWindow ());
+
+  // We need to create an overlay while encrypting as pinentry can take a while
+  start_crypto_overlay();
+
+  log_data ("Resolver stdout:\n'%s'", mystdout.toString ().c_str ());
+  log_data ("Resolver stderr:\n'%s'", mystderr.toString ().c_str ());
+
+  release_cArray (cargs);
+
+  if (err)
+    {
+      log_debug ("%s:%s: Resolver spawn finished Err code: %i asString: %s",
+                 SRCNAME, __func__, err.code(), err.asString());
+    }
+
+  *r_output = mystdout.toString ();
+  TRETURN 0;
+}
+
 int
 CryptController::resolve_keys ()
 {
@@ -828,58 +908,38 @@ CryptController::resolve_keys ()
       args.push_back (std::string ("cms"));
     }
 
-  // Args are prepared. Spawn the resolver.
-  auto ctx = GpgME::Context::createForEngine (GpgME::SpawnEngine);
-  if (!ctx)
+  // Args are prepared. Use the running resolver if enabled.
+  std::string output;
+  const auto result = opt.resolver_service ?
+    ResolverService::instance ()->resolve (
+      std::vector<std::string> (args.begin () + 1, args.end ()), &output) :
+    ResolverService::NotAvailable;
+  if (result == ResolverService::Resolved)
     {
-      // can't happen
-      TRACEPOINT;
-      TRETURN -1;
+      log_debug ("%s:%s: Resolved through the resolver service.",
+                 SRCNAME, __func__);
+      bring_to_front (wnd);
+      start_crypto_overlay();
+      log_data ("Resolver output:\n'%s'", output.c_str ());
     }
-
-
-  // Convert our collected vector to c strings
-  // It's a bit overhead but should be quick for such small
-  // data.
-  char **cargs = vector_to_cArray (args);
-  log_data ("%s:%s: Spawn args:",
-            SRCNAME, __func__);
-  for (size_t i = 0; cargs && cargs[i]; i++)
+  else if (result == ResolverService::Failed)
     {
-      log_data (SIZE_T_FORMAT ": '%s'", i, cargs[i]);
+      /* The helper may have shown its dialog already.  Spawning
+         the resolver now could show it a second time.  */
+      log_error ("%s:%s: Resolver service failed.", SRCNAME, __func__);
+      TRETURN -1;
     }
-
-  GpgME::Data mystdin (GpgME::Data::null), mystdout, mystderr;
-  GpgME::Error err = ctx->spawn (cargs[0], const_cast <const char**> (cargs),
-                                 mystdin, mystdout, mystderr,
-                                 (GpgME::Context::SpawnFlags) (
-                                  GpgME::Context::SpawnAllowSetFg |
-                                  GpgME::Context::SpawnShowWindow));
-  // Somehow Qt messes up which window to bring back to front.
-  // So we do it manually.
-  bring_to_front (wnd);
-
-  // We need to create an overlay while encrypting as pinentry can take a while
-  start_crypto_overlay();
-
-  log_data ("Resolver stdout:\n'%s'", mystdout.toString ().c_str ());
-  log_data ("Resolver stderr:\n'%s'", mystderr.toString ().c_str ());
-
-  release_cArray (cargs);
-
-  if (err)
+  else if (spawn_resolver (args, &output))
     {
-      log_debug ("%s:%s: Resolver spawn finished Err code: %i asString: %s",
-                 SRCNAME, __func__, err.code(), err.asString());
+      TRETURN -1;
     }
 
-  int ret = parse_output (mystdout);
+  int ret = parse_output (output);
   if (ret == -1)
     {
       log_debug ("%s:%s: Failed to parse / resolve keys.",
                  SRCNAME, __func__);
-      log_data ("Resolver stdout:\n'%s'", mystdout.toString ().c_str ());
-      log_data ("Resolver stderr:\n'%s'", mystderr.toString ().c_str ());
+      log_data ("Resolver output:\n'%s'", output.c_str ());
       TRETURN -1;
     }
 
@@ -932,6 +992,7 @@ CryptController::do_crypto (GpgME::Error &err, std::string &r_diag)
               log_debug ("%s:%s: Have both BCC and normal recipients."
                          " Need to send multiple mails.",
                          SRCNAME, __func__);
+              prepare_split_crypto ();
               do_in_ui_thread_async (SEND_MULTIPLE_MAILS, m_mail);
               /* Cancel the crypto of this mail */
               TRETURN -3;
@@ -959,6 +1020,22 @@ CryptController::do_crypto (GpgME::Error &err, std::string &r_diag)
       m_bodyInput = GpgME::Data(GpgME::Data::null);
     }
 
+  if (!do_inline && take_split_result ())
+    {
+      static auto s_split = Metrics::instance ()->counter ("crypt.split");
+      s_split->add ();
+      log_debug ("%s:%s: Crypto done sucessfuly through split.",
+                 SRCNAME, __func__);
+      m_crypto_success = true;
+      TRETURN 0;
+    }
+
+  /* Key resolution might wait for the user so only the
+     crypto operation itself is timed.  */
+  static auto s_crypto_time =
+    Metrics::instance ()->histogram ("crypt.crypto_usecs");
+  MetricsTimer timer (s_crypto_time);
+
   auto ctx = GpgME::Context::create(m_proto);
 
   if (!ctx)
@@ -1048,30 +1125,54 @@ CryptController::do_crypto (GpgME::Error &err, std::string &r_diag)
       // We now have plaintext in m_input
       // The detached signature in m_output
 
-      // Set up the sink object to construct the multipart/signed
-      GpgME::Data multipart;
-      struct sink_s sinkmem;
-      sink_t sink = &sinkmem;
-      memset (sink, 0, sizeof *sink);
-      sink->cb_data = &multipart;
-      sink->writefnc = sink_data_write;
-
-      if (create_sign_attach (sink,
-                              m_proto == GpgME::CMS ?
-                                         PROTOCOL_SMIME : PROTOCOL_OPENPGP,
-                              m_output, m_input, m_micalg.c_str ()))
+      // Construct the multipart/signed in a second thread and
+      // stream it through a bounded pipe directly into the
+      // encryption. This way we never hold a complete copy of
+      // the multipart in memory and building the MIME structure
+      // overlaps with the encryption.
+      PipeDataProvider pipe;
+      GpgME::Data multipart (&pipe);
+      GpgME::Data encrypted;
+      sign_attach_producer_s producer_args;
+      producer_args.pipe = &pipe;
+      producer_args.protocol = m_proto == GpgME::CMS ?
+                                          PROTOCOL_SMIME : PROTOCOL_OPENPGP;
+      producer_args.signature = &m_output;
+      producer_args.signedData = &m_input;
+      producer_args.micalg = m_micalg.c_str ();
+
+      HANDLE producer = CreateThread (nullptr, 0, do_produce_sign_attach,
+                                      (LPVOID) &producer_args, 0,
+                                      nullptr);
+      if (!producer)
         {
-          TRACEPOINT;
+          log_error_w32 (-1, "%s:%s: Failed to create producer thread.",
+                         SRCNAME, __func__);
           TRETURN -1;
         }
 
-      // Now we have the multipart throw away the rest.
-      m_output = GpgME::Data ();
-      m_input = GpgME::Data ();
-      multipart.seek (0, SEEK_SET);
       const auto encResult = ctx->encrypt (m_enc_keys, multipart,
-                                           m_output,
+                                           encrypted,
                                            GpgME::Context::AlwaysTrust);
+      // If the encryption stopped reading early the producer might
+      // still wait for room in the pipe.
+      pipe.abort ();
+      WaitForSingleObject (producer, INFINITE);
+      DWORD producer_rc = 0;
+      GetExitCodeThread (producer, &producer_rc);
+      CloseHandle (producer);
+
+      // Now we have the encrypted multipart throw away the rest.
+      m_input = GpgME::Data ();
+      m_output = encrypted;
+      log_debug ("%s:%s: Streamed " SIZE_T_FORMAT " bytes of signed data "
+                 "to encryption.", SRCNAME, __func__, pipe.total ());
+      if (producer_rc && !encResult.error ())
+        {
+          log_error ("%s:%s: Producer failed but encryption did not.",
+                     SRCNAME, __func__);
+          TRETURN -1;
+        }
       err = encResult.error();
       if (err)
         {
@@ -1099,6 +1200,9 @@ CryptController::do_crypto (GpgME::Error &err, std::string &r_diag)
       const auto result = ctx->encrypt (m_enc_keys, do_inline ? m_bodyInput : m_input,
                                         m_output,
                                         GpgME::Context::AlwaysTrust);
+      // The plaintext is not needed anymore.
+      m_input = GpgME::Data ();
+      m_bodyInput = GpgME::Data ();
       err = result.error();
       if (err)
         {
@@ -1162,6 +1266,168 @@ CryptController::do_crypto (GpgME::Error &err, std::string &r_diag)
   TRETURN 0;
 }
 
+/* Splitting a mail for its BCC recipients sends a copy of the
+   mail for each BCC recipient.  Instead of doing the crypto for
+   each copy one after the other we encrypt the plaintext of this
+   mail to all the recipient sets of the split at once on the
+   worker pool.  Each copy (and we, once all copies are out)
+   then picks up its result in take_split_result.
+
+   The sets are built like Mail::splitCopyMailCallback splits
+   the recipients.  If anything does not fit, e.g. a recipient
+   with keys for both protocols, nothing is prepared and the
+   copies do their own crypto.  */
+void
+CryptController::prepare_split_crypto ()
+{
+  TSTART;
+  if (!m_encrypt || m_mail->getDoPGPInline () ||
+      !m_mail->splitBatch ().empty ())
+    {
+      TRETURN;
+    }
+
+  std::vector<GpgME::Key> originatorKeys;
+  std::vector<GpgME::Key> normalKeys;
+  std::vector<std::vector<GpgME::Key> > sets;
+  for (const auto &recp: m_recipients)
+    {
+      const auto &keys = recp.keys ();
+      for (const auto &key: keys)
+        {
+          if (key.protocol () != m_proto)
+            {
+              log_debug ("%s:%s: Recipient with keys for multiple protocols."
+                         " Not preparing the split.", SRCNAME, __func__);
+              TRETURN;
+            }
+        }
+      if (recp.type () == Recipient::olOriginator)
+        {
+          originatorKeys.insert (originatorKeys.end (), keys.begin (),
+                                 keys.end ());
+        }
+      else if (recp.type () == Recipient::olBCC)
+        {
+          sets.push_back (keys);
+        }
+      else
+        {
+          normalKeys.insert (normalKeys.end (), keys.begin (), keys.end ());
+        }
+    }
+  for (auto &set: sets)
+    {
+      set.insert (set.end (), originatorKeys.begin (), originatorKeys.end ());
+    }
+  normalKeys.insert (normalKeys.end (), originatorKeys.begin (),
+                     originatorKeys.end ());
+  sets.push_back (normalKeys);
+
+  /* Create the plaintext that is shared by all encryptions. */
+  auto plaintext = std::make_shared<std::string> ();
+  if (m_sign)
+    {
+      auto ctx = GpgME::Context::create (m_proto);
+      if (!ctx)
+        {
+          TRACEPOINT;
+          TRETURN;
+        }
+      for (const auto &key: m_signer_keys)
+        {
+          if (key.protocol () == m_proto)
+            {
+              ctx->addSigningKey (key);
+            }
+        }
+      ctx->setTextMode (m_proto == GpgME::OpenPGP);
+      ctx->setArmor (m_proto == GpgME::OpenPGP);
+
+      GpgME::Data signature;
+      const auto sigResult = ctx->sign (m_input, signature,
+                                        GpgME::Detached);
+      if (sigResult.error ())
+        {
+          log_debug ("%s:%s: Signing failed with %s. Not preparing "
+                     "the split.", SRCNAME, __func__,
+                     sigResult.error ().asString ());
+          TRETURN;
+        }
+      parse_micalg (sigResult);
+
+      struct sink_s sinkmem;
+      sink_t sink = &sinkmem;
+      memset (sink, 0, sizeof *sink);
+      sink->cb_data = plaintext.get ();
+      sink->writefnc = sink_string_write;
+      if (create_sign_attach (sink,
+                              m_proto == GpgME::CMS ?
+                                         PROTOCOL_SMIME : PROTOCOL_OPENPGP,
+                              signature, m_input, m_micalg.c_str ()))
+        {
+          TRACEPOINT;
+          TRETURN;
+        }
+    }
+  else
+    {
+      *plaintext = m_input.toString ();
+    }
+
+  const auto results = split_encrypt (m_proto, plaintext, sets,
+                                      WorkerPool::instance ());
+
+  const auto cache = SplitCryptCache::instance ();
+  const auto batch = cache->new_batch ();
+  int prepared = 0;
+  for (const auto &result: results)
+    {
+      if (!result.ciphertext)
+        {
+          continue;
+        }
+      cache->put (batch, m_proto, m_sign, result.keys, result.ciphertext);
+      prepared++;
+    }
+  log_debug ("%s:%s: Prepared %i of " SIZE_T_FORMAT " mails for batch %s.",
+             SRCNAME, __func__, prepared, sets.size (), batch.c_str ());
+  if (prepared)
+    {
+      m_mail->setSplitBatch (batch);
+    }
+  TRETURN;
+}
+
+/* Check if prepare_split_crypto already did the work for us. */
+bool
+CryptController::take_split_result ()
+{
+  TSTART;
+  const auto batch = m_mail->splitBatch ();
+  if (batch.empty () || !m_encrypt)
+    {
+      TRETURN false;
+    }
+
+  /* Whatever happens this mail is done with the split. */
+  m_mail->setSplitBatch (std::string ());
+  const auto cache = SplitCryptCache::instance ();
+  /* Results that are never taken expire in the cache. */
+  const auto ciphertext = cache->take (batch, m_proto, m_sign, m_enc_keys);
+
+  if (!ciphertext)
+    {
+      log_debug ("%s:%s: No prepared result in batch %s.",
+                 SRCNAME, __func__, batch.c_str ());
+      TRETURN false;
+    }
+
+  m_input = GpgME::Data ();
+  m_output = GpgME::Data (ciphertext->c_str (), ciphertext->size ());
+  TRETURN true;
+}
+
 static int
 write_data (sink_t sink, GpgME::Data &data)
 {
@@ -1171,12 +1437,17 @@ write_data (sink_t sink, GpgME::Data &data)
       TRETURN -1;
     }
 
-  char buf[4096];
-  size_t nread;
+  char buf[16384];
+  ssize_t nread;
   data.seek (0, SEEK_SET);
-  while ((nread = data.read (buf, 4096)) > 0)
+  while ((nread = data.read (buf, sizeof buf)) > 0)
     {
-      sink->writefnc (sink, buf, nread);
+      if (sink->writefnc (sink, buf, nread))
+        {
+          log_error ("%s:%s: Write to sink failed.",
+                     SRCNAME, __func__);
+          TRETURN -1;
+        }
     }
 
   TRETURN 0;
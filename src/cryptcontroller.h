@@ -98,7 +98,9 @@ private:
   int resolve_keys ();
   int resolve_keys_cached ();
   bool resolve_through_protocol (GpgME::Protocol proto);
-  int parse_output (GpgME::Data &resolverOutput);
+  int spawn_resolver (const std::vector<std::string> &args,
+                      std::string *r_output);
+  int parse_output (const std::string &resolverOutput);
   int lookup_fingerprints (const std::vector<std::string> &sigFprs,
                            const std::vector<std::pair<std::string, std::string> > &recpFprs);
 
@@ -106,6 +108,9 @@ private:
 
   void start_crypto_overlay ();
 
+  void prepare_split_crypto ();
+  bool take_split_result ();
+
 private:
   Mail *m_mail;
   GpgME::Data m_input, m_bodyInput, m_signedData, m_output;
@@ -117,6 +122,8 @@ private:
   std::vector<GpgME::Key> m_enc_keys;
   std::vector<Recipient> m_recipients;
   std::unique_ptr<Overlay> m_overlay;
+  /* Size of the MIME structure accounted in memdbg. */
+  long long m_input_size;
 };
 
 #endif
@@ -18,19 +18,64 @@
  */
 
 #include "common_indep.h"
+#include "mpscring.h"
+#include "sha256.h"
 
 #include <gpg-error.h>
+#ifndef HAVE_W32_SYSTEM
+# include <unistd.h>
+#endif
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <random>
 #include <string>
-#include <unordered_map>
+#include <thread>
+#include <vector>
 
 /* The malloced name of the logfile and the logging stream.  If
    LOGFILE is NULL, no logging is done. */
 static char *logfile;
 static FILE *logfp;
 
+/* Protects the logfile and logfp and serializes the writers.  */
 GPGRT_LOCK_DEFINE (log_lock);
 
+/* Messages are formatted by the calling thread and then queued.
+   A writer thread takes them from the queue and writes them in
+   batches so that a log call does not have to wait for the disk.
+   The file is flushed after each batch, which happens at least
+   every LOG_FLUSH_MSECS or right away after an error.  */
+#define LOG_RING_SIZE 8192
+#define LOG_FLUSH_MSECS 250
+/* Upper limit for a single message. */
+#define LOG_MAX_MSG (64 * 1024 * 1024)
+
+struct log_record_s
+{
+  long long secs;       /* Seconds since the epoch.  */
+  unsigned long tid;    /* Thread id of the caller.  */
+  int level;            /* 1 for errors.  */
+  std::string *msg;     /* The formatted message including a linefeed.  */
+};
+
+struct log_queue_s
+{
+  log_queue_s () : ring (LOG_RING_SIZE), want_flush (false),
+    stopped (false) {}
+  MpscRing<log_record_s> ring;
+  std::mutex wake_mutex;
+  std::condition_variable wake;
+  std::atomic<bool> want_flush;
+  /* After log_shutdown callers write synchronously. */
+  std::atomic<bool> stopped;
+  std::thread writer;
+};
+
+static log_queue_s *log_queue (void);
+
 /* Acquire the mutex for logging.  Returns 0 on success. */
 static int
 lock_log (void)
@@ -48,6 +93,154 @@ unlock_log (void)
   gpgrt_lock_unlock (&log_lock);
 }
 
+static unsigned long
+current_tid (void)
+{
+#ifdef HAVE_W32_SYSTEM
+  return (unsigned long)GetCurrentThreadId ();
+#else
+  static std::atomic<unsigned long> s_next (1);
+  static thread_local unsigned long s_tid;
+  if (!s_tid)
+    s_tid = s_next++;
+  return s_tid;
+#endif
+}
+
+/* Open the log stream if needed.  Called with the log lock held. */
+static bool
+open_logfp (void)
+{
+  if (!logfile)
+    return false;
+  if (!strcmp (logfile, "stdout"))
+    {
+      logfp = stdout;
+    }
+  else if (!strcmp (logfile, "stderr"))
+    {
+      logfp = stderr;
+    }
+  if (!logfp)
+    logfp = fopen (logfile, "a+");
+  return !!logfp;
+}
+
+static void
+close_logfp (void)
+{
+  if (logfp && logfp != stdout && logfp != stderr)
+    fclose (logfp);
+  logfp = NULL;
+}
+
+/* Write out everything that is queued.  Called with the log lock
+   held.  */
+static void
+drain_queue (log_queue_s *queue)
+{
+  log_record_s rec;
+  bool any = false;
+  bool have_fp = open_logfp ();
+
+  while (queue->ring.pop (rec))
+    {
+      if (have_fp)
+        {
+#ifdef HAVE_W32_SYSTEM
+          /* UTC time of day as HH:mm:ss.  */
+          const long long tod = rec.secs % 86400;
+          fprintf (logfp, "%02d:%02d:%02d/%lu/",
+                   (int)(tod / 3600), (int)(tod / 60 % 60), (int)(tod % 60),
+                   rec.tid);
+#endif
+          if (rec.level == 1)
+            fputs ("ERROR/", logfp);
+          fwrite (rec.msg->data (), 1, rec.msg->size (), logfp);
+          any = true;
+        }
+      delete rec.msg;
+    }
+  if (any)
+    fflush (logfp);
+}
+
+static void
+log_writer_thread (log_queue_s *queue)
+{
+  while (!queue->stopped)
+    {
+      {
+        std::unique_lock<std::mutex> lock (queue->wake_mutex);
+        queue->wake.wait_for (lock,
+                              std::chrono::milliseconds (LOG_FLUSH_MSECS),
+                              [queue] {
+                                return queue->want_flush.load () ||
+                                       queue->stopped.load () ||
+                                       queue->ring.size () >=
+                                       queue->ring.capacity () / 2;
+                              });
+      }
+      queue->want_flush = false;
+      lock_log ();
+      drain_queue (queue);
+      unlock_log ();
+    }
+}
+
+/* Drain the queue on exit.  The writer thread might already be
+   gone (e.g. killed on process exit while it held the lock) so we
+   do not wait forever.  */
+static void
+log_flush_at_exit (void)
+{
+  for (int i = 0; i < 100; i++)
+    {
+      if (!gpgrt_lock_trylock (&log_lock))
+        {
+          drain_queue (log_queue ());
+          unlock_log ();
+          return;
+        }
+      std::this_thread::sleep_for (std::chrono::milliseconds (1));
+    }
+}
+
+/* The queue is created on first use and never freed as messages
+   might be logged until the very end.  */
+static log_queue_s *
+log_queue (void)
+{
+  static log_queue_s *s_queue = [] {
+    auto queue = new log_queue_s;
+    queue->writer = std::thread (log_writer_thread, queue);
+    atexit (log_flush_at_exit);
+    return queue;
+  } ();
+  return s_queue;
+}
+
+void
+log_flush (void)
+{
+  if (lock_log ())
+    return;
+  drain_queue (log_queue ());
+  unlock_log ();
+}
+
+void
+log_shutdown (void)
+{
+  log_queue_s *queue = log_queue ();
+  if (queue->stopped.exchange (true))
+    return;
+  queue->wake.notify_one ();
+  if (queue->writer.joinable ())
+    queue->writer.join ();
+  log_flush ();
+}
+
 const char *
 get_log_file (void)
 {
@@ -59,11 +252,9 @@ set_log_file (const char *name)
 {
   if (!lock_log ())
     {
-      if (logfp)
-        {
-          fclose (logfp);
-          logfp = NULL;
-        }
+      /* Pending messages still belong into the old file. */
+      drain_queue (log_queue ());
+      close_logfp ();
       free (logfile);
       if (!name || *name == '\"' || !*name)
         logfile = NULL;
@@ -74,6 +265,45 @@ set_log_file (const char *name)
     }
 }
 
+/* Append the formatted message to OUT.  */
+static void
+format_append (std::string &out, const char *fmt, va_list a)
+{
+  char buf[512];
+  va_list ap;
+  int n;
+
+  va_copy (ap, a);
+  n = vsnprintf (buf, sizeof buf, fmt, ap);
+  va_end (ap);
+  if (n >= 0 && (size_t) n < sizeof buf)
+    {
+      out.append (buf, n);
+      return;
+    }
+
+  /* The msvcrt version returns -1 if the buffer is too small so
+     we might need to grow more than once.  */
+  std::vector<char> big (n >= 0 ? (size_t) n + 1 : 2 * sizeof buf);
+  for (;;)
+    {
+      va_copy (ap, a);
+      n = vsnprintf (big.data (), big.size (), fmt, ap);
+      va_end (ap);
+      if (n >= 0 && (size_t) n < big.size ())
+        {
+          out.append (big.data (), n);
+          return;
+        }
+      if (big.size () >= LOG_MAX_MSG)
+        {
+          out.append (big.data (), big.size () - 1);
+          return;
+        }
+      big.resize (n >= 0 ? (size_t) n + 1 : big.size () * 2);
+    }
+}
+
 static void
 do_log (const char *fmt, va_list a, int w32err, int err,
         const void *buf, size_t buflen)
@@ -84,55 +314,17 @@ do_log (const char *fmt, va_list a, int w32err, int err,
 #ifdef HAVE_W32_SYSTEM
   if (!opt.enable_debug)
     return;
-
-  if (lock_log ())
-    {
-      OutputDebugStringA ("GpgOL: Failed to log.");
-      return;
-    }
 #endif
 
-  if (!strcmp (logfile, "stdout"))
-    {
-      logfp = stdout;
-    }
-  else if (!strcmp (logfile, "stderr"))
-    {
-      logfp = stderr;
-    }
-  if (!logfp)
-    logfp = fopen (logfile, "a+");
-#ifdef HAVE_W32_SYSTEM
-  if (!logfp)
-    {
-      unlock_log ();
-      return;
-    }
-
-  char time_str[9];
-  SYSTEMTIME utc_time;
-  GetSystemTime (&utc_time);
-  if (GetTimeFormatA (LOCALE_INVARIANT,
-                      TIME_FORCE24HOURFORMAT | LOCALE_USE_CP_ACP,
-                      &utc_time,
-                      "HH:mm:ss",
-                      time_str,
-                      9))
-    {
-      fprintf (logfp, "%s/%lu/",
-               time_str,
-               (unsigned long)GetCurrentThreadId ());
-    }
-  else
-    {
-      fprintf (logfp, "unknown/%lu/",
-               (unsigned long)GetCurrentThreadId ());
-    }
-#endif
+  log_record_s rec;
+  rec.secs = std::chrono::duration_cast<std::chrono::seconds> (
+               std::chrono::system_clock::now ().time_since_epoch ()).count ();
+  rec.tid = current_tid ();
+  rec.level = err;
+  rec.msg = new std::string;
 
-  if (err == 1)
-    fputs ("ERROR/", logfp);
-  vfprintf (logfp, fmt, a);
+  std::string &line = *rec.msg;
+  format_append (line, fmt, a);
 #ifdef HAVE_W32_SYSTEM
   if (w32err)
     {
@@ -141,12 +333,13 @@ do_log (const char *fmt, va_list a, int w32err, int err,
       FormatMessage (FORMAT_MESSAGE_FROM_SYSTEM, NULL, w32err,
                      MAKELANGID (LANG_NEUTRAL, SUBLANG_DEFAULT),
                      tmpbuf, sizeof (tmpbuf)-1, NULL);
-      fputs (": ", logfp);
+      line += ": ";
       if (*tmpbuf && tmpbuf[strlen (tmpbuf)-1] == '\n')
         tmpbuf[strlen (tmpbuf)-1] = 0;
       if (*tmpbuf && tmpbuf[strlen (tmpbuf)-1] == '\r')
         tmpbuf[strlen (tmpbuf)-1] = 0;
-      fprintf (logfp, "%s (%d)", tmpbuf, w32err);
+      line += tmpbuf;
+      line += " (" + std::to_string (w32err) + ")";
     }
 #else
   (void) w32err;
@@ -156,16 +349,40 @@ do_log (const char *fmt, va_list a, int w32err, int err,
       const unsigned char *p = (const unsigned char*)buf;
 
       for ( ; buflen; buflen--, p++)
-        fprintf (logfp, "%02X", *p);
-      putc ('\n', logfp);
+        {
+          line += tohex (*p >> 4);
+          line += tohex (*p & 15);
+        }
+      line += '\n';
     }
   else if ( *fmt && fmt[strlen (fmt) - 1] != '\n')
-    putc ('\n', logfp);
+    line += '\n';
 
-  fflush (logfp);
-#ifdef HAVE_W32_SYSTEM
-  unlock_log ();
-#endif
+  log_queue_s *queue = log_queue ();
+  while (!queue->ring.push (rec))
+    {
+      if (queue->stopped)
+        {
+          log_flush ();
+          continue;
+        }
+      /* The writer is behind.  Wake it up and wait for room. */
+      queue->wake.notify_one ();
+      std::this_thread::yield ();
+    }
+  if (queue->stopped)
+    {
+      log_flush ();
+    }
+  else if (err == 1)
+    {
+      queue->want_flush = true;
+      queue->wake.notify_one ();
+    }
+  else if (queue->ring.size () >= queue->ring.capacity () / 2)
+    {
+      queue->wake.notify_one ();
+    }
 }
 
 const char *
@@ -307,15 +524,262 @@ log_window_hierarchy (HWND window, const char *fmt, ...)
 }
 #endif
 
-GPGRT_LOCK_DEFINE (anon_str_lock);
+/* Spans are kept in per thread buffers so that recording needs no
+   lock.  A buffer is a ring over a fixed table of chunks.  Only the
+   owning thread appends and publishes the new count, a dump reads
+   from the cleared count up to the published count.  A full buffer
+   drops new spans until span_clear frees its slots, which can't
+   happen during a dump.  Buffers of finished threads are kept for
+   the dump, the spans not yet cleared are limited by
+   SPAN_MAX_EVENTS.  */
+#define SPAN_CHUNK 4096
+#define SPAN_MAX_CHUNKS 64
+#define SPAN_SLOTS (SPAN_CHUNK * SPAN_MAX_CHUNKS)
+#define SPAN_MAX_EVENTS (1024 * 1024)
+
+struct span_event_s
+{
+  const char *file;
+  const char *func;
+  long long start;   /* Microseconds since span_base.  */
+  long long dur;
+};
+
+struct span_buffer_s
+{
+  span_buffer_s () : tid (current_tid ()), count (0), cleared (0)
+  {
+    memset (chunks, 0, sizeof chunks);
+  }
+  unsigned long tid;
+  span_event_s *chunks[SPAN_MAX_CHUNKS];
+  std::atomic<size_t> count;
+  std::atomic<size_t> cleared; /* Events before this are dropped.  */
+};
+
+static const auto span_base = std::chrono::steady_clock::now ();
+static std::mutex span_buffers_mutex;
+static std::vector<span_buffer_s *> span_buffers;
+static std::atomic<size_t> span_total (0); /* Spans not cleared.  */
+static std::atomic<size_t> span_dropped (0);
+
+long long
+span_now (void)
+{
+  /* Plus one as zero means not recording.  */
+  return std::chrono::duration_cast<std::chrono::microseconds> (
+           std::chrono::steady_clock::now () - span_base).count () + 1;
+}
+
+static span_buffer_s *
+span_buffer (void)
+{
+  static thread_local span_buffer_s *t_buffer;
+  if (!t_buffer)
+    {
+      t_buffer = new span_buffer_s;
+      std::lock_guard<std::mutex> lock (span_buffers_mutex);
+      span_buffers.push_back (t_buffer);
+    }
+  return t_buffer;
+}
+
+void
+span_record (const char *file, const char *func, long long start)
+{
+  const long long end = span_now ();
+  span_buffer_s *buffer = span_buffer ();
+  const size_t n = buffer->count.load (std::memory_order_relaxed);
+
+  if (n - buffer->cleared.load (std::memory_order_acquire) >= SPAN_SLOTS)
+    {
+      span_dropped++;
+      return;
+    }
+  if (span_total.fetch_add (1) >= SPAN_MAX_EVENTS)
+    {
+      span_total--;
+      span_dropped++;
+      return;
+    }
+  const size_t slot = n % SPAN_SLOTS;
+  span_event_s *&chunk = buffer->chunks[slot / SPAN_CHUNK];
+  if (!chunk)
+    chunk = new span_event_s[SPAN_CHUNK];
+  span_event_s &event = chunk[slot % SPAN_CHUNK];
+  event.file = file;
+  event.func = func;
+  event.start = start;
+  event.dur = end - start;
+  buffer->count.store (n + 1, std::memory_order_release);
+}
+
+/* Escape a string for JSON.  */
+static std::string
+json_str (const char *s)
+{
+  std::string ret = "\"";
+  for (; s && *s; s++)
+    {
+      if (*s == '"' || *s == '\\')
+        ret += '\\';
+      if ((unsigned char)*s < 0x20)
+        continue;
+      ret += *s;
+    }
+  return ret + "\"";
+}
+
+bool
+span_dump (const char *filename)
+{
+  FILE *fp = fopen (filename, "wb");
+  if (!fp)
+    {
+      log_error ("%s:%s: Failed to open '%s'", SRCNAME, __func__, filename);
+      return false;
+    }
+
+  /* Keep the lock so that the slots we read are not cleared and
+     reused meanwhile.  */
+  std::unique_lock<std::mutex> lock (span_buffers_mutex);
+  size_t written = 0;
+  fputs ("{\"traceEvents\":[\n", fp);
+  for (const auto buffer: span_buffers)
+    {
+      const size_t count = buffer->count.load (std::memory_order_acquire);
+      for (size_t i = buffer->cleared; i < count; i++)
+        {
+          const size_t slot = i % SPAN_SLOTS;
+          const span_event_s &event =
+            buffer->chunks[slot / SPAN_CHUNK][slot % SPAN_CHUNK];
+          const std::string line =
+            std::string (written ? ",\n" : "") +
+            "{\"name\":" + json_str (event.func) +
+            ",\"cat\":" + json_str (log_srcname (event.file)) +
+            ",\"ph\":\"X\",\"ts\":" + std::to_string (event.start) +
+            ",\"dur\":" + std::to_string (event.dur) +
+            ",\"pid\":1,\"tid\":" + std::to_string (buffer->tid) + "}";
+          fputs (line.c_str (), fp);
+          written++;
+        }
+    }
+  fputs (("\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":" +
+          std::to_string (span_dropped.load ()) + "}}\n").c_str (), fp);
+  lock.unlock ();
+  if (fclose (fp))
+    {
+      log_error ("%s:%s: Failed to write '%s'", SRCNAME, __func__, filename);
+      return false;
+    }
+  log_debug ("%s:%s: Wrote " SIZE_T_FORMAT " spans to '%s'",
+             SRCNAME, __func__, written, filename);
+  return true;
+}
+
+void
+span_clear (void)
+{
+  std::lock_guard<std::mutex> lock (span_buffers_mutex);
+  for (const auto buffer: span_buffers)
+    {
+      const size_t count = buffer->count.load (std::memory_order_acquire);
+      span_total -= count - buffer->cleared;
+      buffer->cleared.store (count, std::memory_order_release);
+    }
+  span_dropped = 0;
+}
+
+/* anonstr replaces a string by a keyed hash so that the same
+   value can be followed through a log without revealing it.  The
+   key is created per process so the names are only stable within
+   a session and can't be computed for a guessed address.  Nothing
+   is stored per string, the inner and outer HMAC states for the
+   key are computed once and then each call hashes only the data.  */
+#define ANON_HASH_BYTES 6
+#define ANON_BUFS 16
+#define ANON_PREFIX "gpgol_str_"
+#define ANON_LEN (sizeof ANON_PREFIX + 2 * ANON_HASH_BYTES)
+/* The same few addresses and fingerprints show up again and again
+   so a small cache per thread saves most of the hashing.  Longer
+   strings are not cached.  */
+#define ANON_CACHE_SLOTS 32
+#define ANON_CACHE_MAXLEN 64
+
+struct anon_cache_slot_s
+{
+  size_t len;
+  char data[ANON_CACHE_MAXLEN];
+  char anon[ANON_LEN];
+};
+
+struct anon_key_s
+{
+  sha256_context_t inner;
+  sha256_context_t outer;
+};
+
+/* The key is derived from std::random_device mixed with values
+   that differ from process to process in case the device is not
+   really random.  */
+static void
+anon_key_init (anon_key_s *r_key)
+{
+  sha256_context_t ctx;
+  unsigned char key[SHA256_DIGEST_LEN];
+  unsigned char pad[64];
+  long long values[4];
+  int i;
+
+  values[0] = std::chrono::steady_clock::now ().time_since_epoch ().count ();
+  values[1] = std::chrono::system_clock::now ().time_since_epoch ().count ();
+  values[2] = (long long) (uintptr_t) &ctx;
+#ifdef HAVE_W32_SYSTEM
+  values[3] = (long long) GetCurrentProcessId ();
+#else
+  values[3] = (long long) getpid ();
+#endif
+  sha256_init (&ctx);
+  sha256_write (&ctx, values, sizeof values);
+  std::random_device rd;
+  for (i = 0; i < 8; i++)
+    {
+      const unsigned int r = rd ();
+      sha256_write (&ctx, &r, sizeof r);
+    }
+  sha256_final (&ctx, key);
+
+  memset (pad, 0x36, sizeof pad);
+  for (i = 0; i < SHA256_DIGEST_LEN; i++)
+    {
+      pad[i] ^= key[i];
+    }
+  sha256_init (&r_key->inner);
+  sha256_write (&r_key->inner, pad, sizeof pad);
 
-/* Weel ok this survives unload but we don't want races
-   and it makes a bit of sense to keep the strings constant. */
-static std::unordered_map<std::string, std::string> str_map;
+  memset (pad, 0x5c, sizeof pad);
+  for (i = 0; i < SHA256_DIGEST_LEN; i++)
+    {
+      pad[i] ^= key[i];
+    }
+  sha256_init (&r_key->outer);
+  sha256_write (&r_key->outer, pad, sizeof pad);
+  memset (key, 0, sizeof key);
+}
 
 const char *anonstr (const char *data)
 {
-  static int64_t cnt;
+  static const anon_key_s *s_key = [] {
+    anon_key_s *key = new anon_key_s;
+    anon_key_init (key);
+    return key;
+  } ();
+  /* A few results per thread stay valid so that one log call
+     can use several of them.  */
+  static thread_local char t_bufs[ANON_BUFS][ANON_LEN];
+  static thread_local unsigned int t_next;
+  static thread_local anon_cache_slot_s t_cache[ANON_CACHE_SLOTS];
+
   if (opt.enable_debug & DBG_DATA)
     {
       return data;
@@ -324,26 +788,51 @@ const char *anonstr (const char *data)
     {
       return "gpgol_str_null";
     }
-  if (!strlen (data))
+  if (!*data)
     {
       return "gpgol_str_empty";
     }
 
-  gpgol_lock (&anon_str_lock);
-  const std::string strData (data);
-  auto it = str_map.find (strData);
-
-  if (it == str_map.end ())
+  const size_t len = strlen (data);
+  char *buf = t_bufs[t_next++ % ANON_BUFS];
+  anon_cache_slot_s *slot = nullptr;
+  if (len <= ANON_CACHE_MAXLEN)
     {
-      const auto anon = std::string ("gpgol_string_") + std::to_string (++cnt);
-      str_map.insert (std::make_pair (strData, anon));
-      it = str_map.find (strData);
+      /* FNV-1a to pick the slot.  */
+      uint32_t h = 2166136261u;
+      for (size_t i = 0; i < len; i++)
+        {
+          h = (h ^ (unsigned char) data[i]) * 16777619u;
+        }
+      slot = &t_cache[h % ANON_CACHE_SLOTS];
+      if (slot->len == len && !memcmp (slot->data, data, len))
+        {
+          memcpy (buf, slot->anon, ANON_LEN);
+          return buf;
+        }
     }
 
-  // As the data is saved in our map we can return
-  // the c_str as it won't be touched as const.
+  unsigned char digest[SHA256_DIGEST_LEN];
+  sha256_context_t ctx = s_key->inner;
+  sha256_write (&ctx, data, len);
+  sha256_final (&ctx, digest);
+  ctx = s_key->outer;
+  sha256_write (&ctx, digest, sizeof digest);
+  sha256_final (&ctx, digest);
 
-  gpgol_unlock (&anon_str_lock);
+  char *p = stpcpy (buf, ANON_PREFIX);
+  for (int i = 0; i < ANON_HASH_BYTES; i++)
+    {
+      *p++ = tohex_lower (digest[i] >> 4);
+      *p++ = tohex_lower (digest[i] & 15);
+    }
+  *p = 0;
 
-  return it->second.c_str();
+  if (slot)
+    {
+      slot->len = len;
+      memcpy (slot->data, data, len);
+      memcpy (slot->anon, buf, ANON_LEN);
+    }
+  return buf;
 }
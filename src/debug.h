@@ -54,6 +54,12 @@ extern "C" {
 #define DBG_MEMORY         (1<<2) // 4
 #define DBG_TRACE          (1<<3) // 8
 #define DBG_DATA           (1<<4) // 16
+/* Record TSTART spans for span_dump.  Bits 5 to 10 are taken by
+   the compatibility values in main.c.  */
+#define DBG_SPANS          (1<<11) // 2048
+/* Dump the runtime metrics to the log when the options dialog
+   is closed and next to the log file on shutdown.  */
+#define DBG_METRICS        (1<<12) // 4096
 
 void log_debug (const char *fmt, ...) __attribute__ ((format (printf,1,2)));
 void log_error (const char *fmt, ...) __attribute__ ((format (printf,1,2)));
@@ -131,7 +137,13 @@ const char *log_srcname (const char *s);
                            SRCNAME, __func__, __LINE__);
 #define TRACEPOINT log_trace ("%s:%s:%d", \
                               SRCNAME, __func__, __LINE__);
-#define TSTART log_trace ("%s:%s:%d enter", SRCNAME, __func__, __LINE__);
+#ifdef __cplusplus
+# define TSTART GpgolSpan gpgol_span_ (__FILE__, __func__, \
+                                    (opt.enable_debug & DBG_SPANS)); \
+                log_trace ("%s:%s:%d enter", SRCNAME, __func__, __LINE__);
+#else
+# define TSTART log_trace ("%s:%s:%d enter", SRCNAME, __func__, __LINE__);
+#endif
 #define TRETURN log_trace ("%s:%s:%d: return", SRCNAME, __func__, \
                            __LINE__); \
                    return
@@ -142,6 +154,11 @@ const char *log_srcname (const char *s);
 
 const char *get_log_file (void);
 void set_log_file (const char *name);
+/* Write out all queued log messages. */
+void log_flush (void);
+/* Stop the log writer thread. Later messages are written
+   synchronously. */
+void log_shutdown (void);
 
 #ifdef _WIN64
 #define SIZE_T_FORMAT "%I64u"
@@ -155,6 +172,41 @@ void set_log_file (const char *name);
 
 #ifdef __cplusplus
 }
+
+/* Spans record the time spent between TSTART and leaving the
+   scope per thread.  This costs only a flag check unless
+   DBG_SPANS is set.  The recorded spans can be written in the
+   Chrome trace format which chrome://tracing and Perfetto read. */
+long long span_now (void);
+void span_record (const char *file, const char *func, long long start);
+
+class GpgolSpan
+{
+public:
+  GpgolSpan (const char *file, const char *func, bool enabled) :
+    m_file (file), m_func (func),
+    m_start (enabled ? span_now () : 0)
+  {
+  }
+  ~GpgolSpan ()
+  {
+    if (m_start)
+      span_record (m_file, m_func, m_start);
+  }
+private:
+  GpgolSpan (const GpgolSpan &);
+  GpgolSpan &operator= (const GpgolSpan &);
+
+  const char *m_file;
+  const char *m_func;
+  long long m_start;
+};
+
+/* Write the recorded spans as JSON to filename.  Returns false
+   on error. */
+bool span_dump (const char *filename);
+/* Drop the recorded spans. */
+void span_clear (void);
 #endif
 
 #endif // DEBUG_H
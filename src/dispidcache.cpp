@@ -0,0 +1,122 @@
+/* dispidcache.cpp - Cache for the dispids of OOM members
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+
+#include "dispidcache.h"
+
+DispidCache::DispidCache () :
+  m_hits (0),
+  m_misses (0)
+{
+}
+
+DispidCache *
+DispidCache::instance ()
+{
+  /* Intentionally leaked like the other singletons.  The types
+     stay referenced until the DLL is unloaded.  */
+  static DispidCache *s_cache = new DispidCache ();
+  return s_cache;
+}
+
+bool
+DispidCache::lookup (const void *type, const char *name,
+                     const Resolver &resolve, dispid_t *r_dispid,
+                     bool *r_new_type)
+{
+  if (r_new_type)
+    {
+      *r_new_type = false;
+    }
+  if (!name || !r_dispid)
+    {
+      return false;
+    }
+  if (!type)
+    {
+      return resolve (name, r_dispid);
+    }
+
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    const auto it = m_dispids.find (type);
+    if (it == m_dispids.end ())
+      {
+        /* Remember the type even if the lookup fails so that the
+           caller keeps its reference only once.  */
+        m_dispids[type];
+        if (r_new_type)
+          {
+            *r_new_type = true;
+          }
+      }
+    else
+      {
+        const auto entry = it->second.find (name);
+        if (entry != it->second.end ())
+          {
+            m_hits++;
+            *r_dispid = entry->second;
+            return true;
+          }
+      }
+    m_misses++;
+  }
+
+  /* Not under the lock as this calls into Outlook.  */
+  dispid_t dispid;
+  if (!resolve (name, &dispid))
+    {
+      return false;
+    }
+  std::lock_guard<std::mutex> lock (m_mutex);
+  m_dispids[type][name] = dispid;
+  *r_dispid = dispid;
+  return true;
+}
+
+void
+DispidCache::invalidate (const void *type, const char *name)
+{
+  if (!type || !name)
+    {
+      return;
+    }
+  std::lock_guard<std::mutex> lock (m_mutex);
+  const auto it = m_dispids.find (type);
+  if (it != m_dispids.end ())
+    {
+      it->second.erase (name);
+    }
+}
+
+size_t
+DispidCache::hits () const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_hits;
+}
+
+size_t
+DispidCache::misses () const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_misses;
+}
@@ -0,0 +1,81 @@
+/* dispidcache.h - Cache for the dispids of OOM members
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DISPIDCACHE_H
+#define DISPIDCACHE_H
+
+#include "config.h"
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/** Caches the dispids of OOM members.
+
+  Looking up a dispid means a call into Outlook with the name
+  converted to wide chars.  The dispids of a member are defined by
+  the type library, so they are cached per type and name and all
+  objects of a type share the entries.  The type is an opaque
+  pointer, for COM objects their ITypeInfo.  Objects without a type
+  are not cached as their members might be dynamic.  Failed lookups
+  are not cached either.
+
+  A type pointer must not be reused for another type while the
+  cache knows it.  So the caller keeps a reference to each type
+  that lookup reports as new.  Outlook has only a few hundred types
+  and the cache lives as long as the add-in.
+
+  The cache is thread safe. */
+class DispidCache
+{
+public:
+  typedef long dispid_t;
+  /** Looks up name on a miss.  Returns false if it is unknown. */
+  typedef std::function<bool (const char *name, dispid_t *r_dispid)> Resolver;
+
+  DispidCache ();
+
+  /** The shared cache. */
+  static DispidCache *instance ();
+
+  /** Get the dispid of name for type.  Calls resolve if it is not
+    cached.  Returns false if resolve failed.  If r_new_type is
+    given it is set to true if type was not known before. */
+  bool lookup (const void *type, const char *name,
+               const Resolver &resolve, dispid_t *r_dispid,
+               bool *r_new_type = nullptr);
+
+  /** Drop the entry of name for type, e.g. when an invoke with the
+    cached dispid reported an unknown member.  The type stays
+    known. */
+  void invalidate (const void *type, const char *name);
+
+  /** Statistics for the debug log and tests. */
+  size_t hits () const;
+  size_t misses () const;
+
+private:
+  mutable std::mutex m_mutex;
+  std::unordered_map<const void *,
+                     std::unordered_map<std::string, dispid_t> > m_dispids;
+  size_t m_hits;
+  size_t m_misses;
+};
+
+#endif // DISPIDCACHE_H
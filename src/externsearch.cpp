@@ -0,0 +1,362 @@
+/* externsearch.cpp - Back-off and limits for external key searches
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+#include "cpphelp.h"
+
+#include "externsearch.h"
+#include "sha256.h"
+
+#include <gpgme.h>
+
+#include <algorithm>
+#include <stdio.h>
+#include <time.h>
+
+#define STATE_NAME "gpgol-extern-search.txt"
+#define STATE_HEADER "# GpgOL extern search back-off v1"
+
+/* Addresses of a domain that have to find nothing in a row before
+   the domain backs off.  */
+#define DOMAIN_MIN_FAILURES 3
+
+/* Entries kept at most.  */
+#define MAX_ENTRIES 5000
+
+/* The key for a lowercased string with a prefix telling addresses
+   and domains apart.  */
+static std::string
+make_key (char prefix, std::string str)
+{
+  unsigned char digest[SHA256_DIGEST_LEN];
+
+  std::transform (str.begin (), str.end (), str.begin (), ::tolower);
+  sha256_buffer (str.c_str (), str.size (), digest);
+  std::string ret (1, prefix);
+  ret += ':';
+  for (int i = 0; i < SHA256_DIGEST_LEN; i++)
+    {
+      ret += tohex_lower (digest[i] >> 4);
+      ret += tohex_lower (digest[i] & 15);
+    }
+  return ret;
+}
+
+static std::string
+domain_key (const std::string &addr)
+{
+  const size_t at = addr.rfind ('@');
+  if (at == std::string::npos || at + 1 == addr.size ())
+    {
+      return std::string ();
+    }
+  return make_key ('d', addr.substr (at + 1));
+}
+
+ExternSearch::ExternSearch (const std::string &path, int max_active,
+                            long long base_secs, long long max_secs) :
+  m_path (path),
+  m_active (0),
+  m_max_active (max_active > 0 ? max_active : 1),
+  m_base_secs (base_secs),
+  m_max_secs (max_secs),
+  m_clock ([] () { return (long long) time (nullptr); })
+{
+  load ();
+}
+
+ExternSearch *
+ExternSearch::instance ()
+{
+  static ExternSearch *s_search = [] {
+    const char *homedir = gpgme_get_dirinfo ("homedir");
+    std::string path;
+    if (homedir)
+      {
+        path = std::string (homedir) + "/" STATE_NAME;
+      }
+    return new ExternSearch (path);
+  } ();
+  return s_search;
+}
+
+long long
+ExternSearch::backoff (int failures) const
+{
+  long long ret = m_base_secs;
+  for (int i = 1; i < failures && ret < m_max_secs; i++)
+    {
+      ret *= 2;
+    }
+  return std::min (ret, m_max_secs);
+}
+
+bool
+ExternSearch::wanted_locked (const std::string &addr_key,
+                             const std::string &domain_key)
+{
+  const long long now = m_clock ();
+  for (const auto &key: { addr_key, domain_key })
+    {
+      const auto it = m_entries.find (key);
+      if (it != m_entries.end () && it->second.next > now)
+        {
+          return false;
+        }
+    }
+  return true;
+}
+
+bool
+ExternSearch::wanted (const std::string &addr)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return wanted_locked (make_key ('a', addr), domain_key (addr));
+}
+
+bool
+ExternSearch::run (const std::string &addr, const Search &search)
+{
+  const std::string akey = make_key ('a', addr);
+  const std::string dkey = domain_key (addr);
+
+  std::unique_lock<std::mutex> lock (m_mutex);
+  if (!wanted_locked (akey, dkey))
+    {
+      log_debug ("%s:%s: Skipping search for %s, nothing found recently.",
+                 SRCNAME, __func__, anonstr (addr.c_str ()));
+      return false;
+    }
+  if (m_active >= m_max_active)
+    {
+      log_debug ("%s:%s: Waiting for one of %i searches.",
+                 SRCNAME, __func__, m_active);
+      m_cond.wait (lock, [this] () { return m_active < m_max_active; });
+      /* A search that finished meanwhile might have been for the
+         same address or domain.  */
+      if (!wanted_locked (akey, dkey))
+        {
+          return false;
+        }
+    }
+  m_active++;
+  lock.unlock ();
+
+  Result result = Failed;
+  try
+    {
+      result = search ();
+    }
+  catch (...)
+    {
+      lock.lock ();
+      m_active--;
+      m_cond.notify_one ();
+      throw;
+    }
+
+  lock.lock ();
+  m_active--;
+  m_cond.notify_one ();
+  if (result == Failed)
+    {
+      log_debug ("%s:%s: Search for %s failed.  Not backing off.",
+                 SRCNAME, __func__, anonstr (addr.c_str ()));
+      return false;
+    }
+  record (akey, dkey, result == Found);
+  return result == Found;
+}
+
+/* Called with the mutex held.  */
+void
+ExternSearch::record (const std::string &addr_key,
+                      const std::string &domain_key, bool found)
+{
+  if (found)
+    {
+      bool changed = m_entries.erase (addr_key);
+      changed |= !domain_key.empty () && m_entries.erase (domain_key);
+      if (changed)
+        {
+          save ();
+        }
+      return;
+    }
+
+  const long long now = m_clock ();
+  entry_s &entry = m_entries[addr_key];
+  entry.failures++;
+  entry.next = now + backoff (entry.failures);
+  if (!domain_key.empty ())
+    {
+      entry_s &dentry = m_entries[domain_key];
+      dentry.failures++;
+      dentry.next = dentry.failures < DOMAIN_MIN_FAILURES ? 0 :
+        now + backoff (dentry.failures - DOMAIN_MIN_FAILURES + 1);
+    }
+  prune ();
+  save ();
+}
+
+void
+ExternSearch::forget (const std::string &addr)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  bool changed = m_entries.erase (make_key ('a', addr));
+  const auto dkey = domain_key (addr);
+  changed |= !dkey.empty () && m_entries.erase (dkey);
+  if (changed)
+    {
+      save ();
+    }
+}
+
+void
+ExternSearch::set_clock (const Clock &clock)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  m_clock = clock;
+}
+
+size_t
+ExternSearch::size ()
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_entries.size ();
+}
+
+/* Drop entries that no longer hold anything back for the maximum
+   time and the ones that expire first if there are too many.
+   Called with the mutex held.  */
+void
+ExternSearch::prune ()
+{
+  const long long now = m_clock ();
+  for (auto it = m_entries.begin (); it != m_entries.end (); )
+    {
+      if (it->second.next && it->second.next + m_max_secs < now)
+        {
+          it = m_entries.erase (it);
+        }
+      else
+        {
+          ++it;
+        }
+    }
+  while (m_entries.size () > MAX_ENTRIES)
+    {
+      auto oldest = m_entries.begin ();
+      for (auto it = m_entries.begin (); it != m_entries.end (); ++it)
+        {
+          if (it->second.next < oldest->second.next)
+            {
+              oldest = it;
+            }
+        }
+      m_entries.erase (oldest);
+    }
+}
+
+/* The file has one line per entry:
+   <key> <failures> <next>  */
+void
+ExternSearch::load ()
+{
+  if (m_path.empty ())
+    {
+      return;
+    }
+  FILE *fp = gpgol_fopen (m_path, "rb");
+  if (!fp)
+    {
+      log_debug ("%s:%s: No state at '%s'",
+                 SRCNAME, __func__, m_path.c_str ());
+      return;
+    }
+  std::string content;
+  char buf[4096];
+  size_t nread;
+  while ((nread = fread (buf, 1, sizeof buf, fp)) > 0)
+    {
+      content.append (buf, nread);
+    }
+  fclose (fp);
+
+  for (auto sline: gpgol_split (content, '\n'))
+    {
+      trim (sline);
+      if (sline.empty () || sline[0] == '#')
+        {
+          continue;
+        }
+      const auto fields = gpgol_split (sline, ' ');
+      if (fields.size () < 3 || fields[0].size () != 2 + 2 * SHA256_DIGEST_LEN)
+        {
+          log_debug ("%s:%s: Ignoring invalid line in state.",
+                     SRCNAME, __func__);
+          continue;
+        }
+      entry_s entry;
+      entry.failures = atoi (fields[1].c_str ());
+      entry.next = strtoll (fields[2].c_str (), nullptr, 10);
+      m_entries[fields[0]] = entry;
+    }
+  prune ();
+  log_debug ("%s:%s: Loaded " SIZE_T_FORMAT " entries.",
+             SRCNAME, __func__, m_entries.size ());
+}
+
+/* Called with the mutex held.  Searches are slow anyway so we
+   just write the whole state each time.  */
+void
+ExternSearch::save ()
+{
+  if (m_path.empty ())
+    {
+      return;
+    }
+  const std::string tmp = m_path + ".tmp";
+  FILE *fp = gpgol_fopen (tmp, "wb");
+  if (!fp)
+    {
+      log_error ("%s:%s: Failed to write '%s'",
+                 SRCNAME, __func__, tmp.c_str ());
+      return;
+    }
+  fputs (STATE_HEADER "\n", fp);
+  for (const auto &pair: m_entries)
+    {
+      const std::string line = pair.first + " " +
+                               std::to_string (pair.second.failures) + " " +
+                               std::to_string (pair.second.next) + "\n";
+      fputs (line.c_str (), fp);
+    }
+  if (fclose (fp))
+    {
+      log_error ("%s:%s: Failed to write '%s'",
+                 SRCNAME, __func__, tmp.c_str ());
+      return;
+    }
+  if (!gpgol_replace_file (tmp, m_path))
+    {
+      log_error ("%s:%s: Failed to replace '%s'",
+                 SRCNAME, __func__, m_path.c_str ());
+    }
+}
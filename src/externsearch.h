@@ -0,0 +1,116 @@
+/* externsearch.h - Back-off and limits for external key searches
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef EXTERNSEARCH_H
+#define EXTERNSEARCH_H
+
+#include "config.h"
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+/** Guards searches for keys on external servers.
+
+  A search for an address that found nothing is not repeated
+  until a back-off time passed.  The time doubles with each
+  further search that finds nothing, up to a maximum.  If several
+  addresses of a domain found nothing in a row the whole domain
+  backs off the same way, as the domain most likely has no
+  directory at all.  A successful search clears both.  A search
+  that failed, e.g. because the server could not be reached, does
+  not count either way.
+
+  At most max_active searches run at the same time, further ones
+  wait for a free slot.
+
+  Like the ImportLedger the state is saved to a file in the GnuPG
+  home directory.  Only digests of the addresses and domains are
+  stored. */
+class ExternSearch
+{
+public:
+  /** The outcome of a search. */
+  enum Result
+    {
+      Found,
+      NotFound,
+      Failed            /* The search did not finish.  */
+    };
+  /** The search. */
+  typedef std::function<Result ()> Search;
+  /** Returns the current time in seconds. */
+  typedef std::function<long long ()> Clock;
+
+  /** Create the state stored in path.  An empty path keeps it
+    only in memory.  The back-off starts with base_secs and is
+    capped at max_secs. */
+  explicit ExternSearch (const std::string &path = std::string (),
+                         int max_active = 2,
+                         long long base_secs = 3600,
+                         long long max_secs = 30 * 24 * 3600);
+
+  /** The state for the current GnuPG home directory. */
+  static ExternSearch *instance ();
+
+  /** Run search for addr unless addr or its domain back off.
+    Returns false if the search was skipped, failed or found
+    nothing. */
+  bool run (const std::string &addr, const Search &search);
+
+  /** Whether a search for addr would run now. */
+  bool wanted (const std::string &addr);
+
+  /** Forget about addr and its domain. */
+  void forget (const std::string &addr);
+
+  /** Use clock instead of the system time.  For tests. */
+  void set_clock (const Clock &clock);
+
+  size_t size ();
+
+private:
+  struct entry_s
+  {
+    int failures;     /* Searches in a row that found nothing.  */
+    long long next;   /* Time when a search is allowed again.  */
+  };
+
+  bool wanted_locked (const std::string &addr_key,
+                      const std::string &domain_key);
+  void record (const std::string &addr_key, const std::string &domain_key,
+               bool found);
+  long long backoff (int failures) const;
+  void prune ();
+  void load ();
+  void save ();
+
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::map<std::string, entry_s> m_entries;
+  std::string m_path;
+  int m_active;
+  const int m_max_active;
+  const long long m_base_secs;
+  const long long m_max_secs;
+  Clock m_clock;
+};
+
+#endif // EXTERNSEARCH_H
@@ -50,6 +50,8 @@
 #include "dispcache.h"
 #include "categorymanager.h"
 #include "keycache.h"
+#include "metrics.h"
+#include "taskgraph.h"
 
 #include <gpg-error.h>
 #include <list>
@@ -370,6 +372,23 @@ GpgolAddin::OnDisconnection (ext_DisconnectMode RemoveMode,
      "Unexpected error" in that case. Weird. */
 
   shutdown ();
+  if ((opt.enable_debug & DBG_SPANS) && *get_log_file ())
+    {
+      const std::string trace = std::string (get_log_file ()) + ".trace.json";
+      span_dump (trace.c_str ());
+    }
+  if ((opt.enable_debug & DBG_METRICS))
+    {
+      Metrics::instance ()->dump_to_log ();
+      if (*get_log_file ())
+        {
+          const std::string file = std::string (get_log_file ()) +
+                                   ".metrics.txt";
+          Metrics::instance ()->dump_to_file (file.c_str ());
+        }
+    }
+  /* The writer thread must be gone before we might be unloaded. */
+  log_shutdown ();
   can_unload = true;
   return S_OK;
 }
@@ -473,8 +492,8 @@ install_explorer_sinks (LPDISPATCH application)
   return ret;
 }
 
-static DWORD WINAPI
-init_gpgme_config (LPVOID)
+static void
+init_gpgme_config ()
 {
   /* This is a check we need to do anyway. GpgME++ caches
      the configuration once it is accessed for the first time
@@ -482,7 +501,6 @@ init_gpgme_config (LPVOID)
   bool de_vs_mode = in_de_vs_mode ();
   log_debug ("%s:%s: init_gpgme_config de_vs_mode %i",
              SRCNAME, __func__, de_vs_mode);
-  return 0;
 }
 
 STDMETHODIMP
@@ -523,10 +541,12 @@ GpgolAddin::OnStartupComplete (SAFEARRAY** custom)
   m_explorersEventSink = install_explorer_sinks (m_application);
   check_html_preferred ();
 
-  CloseHandle (CreateThread (NULL, 0, init_gpgme_config, nullptr, 0,
-                             NULL));
-
-  KeyCache::instance ()->populate ();
+  /* Everything slow that has to be done once runs in parallel.
+     The log shows how long each task took.  */
+  auto startup = std::make_shared<TaskGraph> ("startup");
+  startup->add ("de-vs check", init_gpgme_config);
+  KeyCache::instance ()->populate (startup.get ());
+  TaskGraph::run_detached (startup);
   return S_OK;
 }
 
@@ -0,0 +1,181 @@
+/* handletable.h - Generation counted handles for objects
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef HANDLETABLE_H
+#define HANDLETABLE_H
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/** A table of live objects that hands out handles for them.
+
+  A handle is the index of a slot and the generation of the slot
+  when the object was added.  Removing an object bumps the
+  generation so old handles of a reused slot no longer resolve.
+  Handles can thus be kept in other threads or in delayed
+  callbacks and be checked in constant time whether the object
+  still exists.  The handle 0 is never valid.
+
+  For code that only has a pointer, contains looks it up in a
+  hash of the live objects.  Unlike a handle this can not tell a
+  new object at the address of a deleted one apart.
+
+  The table does not own the objects.  It is thread safe but an
+  object returned by get might be removed right after; callers
+  need their own lock against deletion while they use it. */
+template <typename T>
+class HandleTable
+{
+public:
+  typedef uint64_t handle_t;
+
+  /** Add obj and return its handle.  Adding an object twice
+    returns the handle it already has. */
+  handle_t add (T *obj)
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    const auto it = m_index.find (obj);
+    if (it != m_index.end ())
+      {
+        return make_handle (it->second);
+      }
+    uint32_t idx;
+    if (m_free.empty ())
+      {
+        idx = (uint32_t) m_slots.size ();
+        m_slots.push_back (slot_s ());
+      }
+    else
+      {
+        idx = m_free.back ();
+        m_free.pop_back ();
+      }
+    m_slots[idx].obj = obj;
+    m_index[obj] = idx;
+    return make_handle (idx);
+  }
+
+  /** Remove the object with handle.  Returns false if the handle
+    is no longer valid. */
+  bool remove (handle_t handle)
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    slot_s *slot = lookup (handle);
+    if (!slot)
+      {
+        return false;
+      }
+    release ((uint32_t) (handle & 0xffffffff));
+    return true;
+  }
+
+  /** Remove obj.  Returns false if it was not in the table. */
+  bool remove (const T *obj)
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    const auto it = m_index.find (obj);
+    if (it == m_index.end ())
+      {
+        return false;
+      }
+    release (it->second);
+    return true;
+  }
+
+  /** The object for handle or null if it was removed. */
+  T *get (handle_t handle) const
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    const slot_s *slot = lookup (handle);
+    return slot ? slot->obj : nullptr;
+  }
+
+  /** The handle of obj or 0 if it is not in the table. */
+  handle_t find (const T *obj) const
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    const auto it = m_index.find (obj);
+    return it == m_index.end () ? 0 : make_handle (it->second);
+  }
+
+  bool contains (const T *obj) const
+  {
+    return !!find (obj);
+  }
+
+  size_t size () const
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    return m_index.size ();
+  }
+
+private:
+  struct slot_s
+  {
+    slot_s () : obj (nullptr), generation (1) {}
+    T *obj;
+    uint32_t generation;  /* Never 0 so that handle 0 is invalid. */
+  };
+
+  handle_t make_handle (uint32_t idx) const
+  {
+    return ((handle_t) m_slots[idx].generation << 32) | idx;
+  }
+
+  const slot_s *lookup (handle_t handle) const
+  {
+    const uint32_t idx = (uint32_t) (handle & 0xffffffff);
+    if (idx >= m_slots.size ())
+      {
+        return nullptr;
+      }
+    const slot_s &slot = m_slots[idx];
+    if (!slot.obj || slot.generation != (uint32_t) (handle >> 32))
+      {
+        return nullptr;
+      }
+    return &slot;
+  }
+
+  slot_s *lookup (handle_t handle)
+  {
+    return const_cast<slot_s *> (static_cast<const HandleTable *> (this)
+                                   ->lookup (handle));
+  }
+
+  void release (uint32_t idx)
+  {
+    slot_s &slot = m_slots[idx];
+    m_index.erase (slot.obj);
+    slot.obj = nullptr;
+    if (!++slot.generation)
+      {
+        slot.generation = 1;
+      }
+    m_free.push_back (idx);
+  }
+
+  mutable std::mutex m_mutex;
+  std::vector<slot_s> m_slots;
+  std::vector<uint32_t> m_free;
+  std::unordered_map<const T *, uint32_t> m_index;
+};
+
+#endif // HANDLETABLE_H
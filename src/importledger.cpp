@@ -0,0 +1,256 @@
+/* importledger.cpp - Remember which key data was already imported
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+#include "cpphelp.h"
+
+#include "importledger.h"
+#include "sha256.h"
+
+#include <gpgme.h>
+#include <gpgme++/data.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#define LEDGER_NAME "gpgol-import-ledger.txt"
+#define LEDGER_HEADER "# GpgOL import ledger v1"
+
+static std::string
+to_hex (const unsigned char *digest)
+{
+  std::string ret;
+  for (int i = 0; i < SHA256_DIGEST_LEN; i++)
+    {
+      ret += tohex_lower (digest[i] >> 4);
+      ret += tohex_lower (digest[i] & 15);
+    }
+  return ret;
+}
+
+ImportLedger::ImportLedger (const std::string &path, size_t max_entries) :
+  m_path (path),
+  m_max_entries (max_entries)
+{
+  load ();
+}
+
+ImportLedger *
+ImportLedger::instance ()
+{
+  static ImportLedger *s_ledger = [] {
+    const char *homedir = gpgme_get_dirinfo ("homedir");
+    std::string path;
+    if (homedir)
+      {
+        path = std::string (homedir) + "/" LEDGER_NAME;
+      }
+    return new ImportLedger (path);
+  } ();
+  return s_ledger;
+}
+
+std::string
+ImportLedger::digest (GpgME::Protocol proto, const char *data, size_t len)
+{
+  sha256_context_t ctx;
+  unsigned char digest[SHA256_DIGEST_LEN];
+
+  sha256_init (&ctx);
+  sha256_write (&ctx, to_cstr (proto), strlen (to_cstr (proto)) + 1);
+  sha256_write (&ctx, data, len);
+  sha256_final (&ctx, digest);
+  return to_hex (digest);
+}
+
+std::string
+ImportLedger::digest (GpgME::Protocol proto, GpgME::Data data)
+{
+  sha256_context_t ctx;
+  unsigned char digest[SHA256_DIGEST_LEN];
+  char buf[4096];
+  ssize_t nread;
+
+  sha256_init (&ctx);
+  sha256_write (&ctx, to_cstr (proto), strlen (to_cstr (proto)) + 1);
+  data.seek (0, SEEK_SET);
+  while ((nread = data.read (buf, sizeof buf)) > 0)
+    {
+      sha256_write (&ctx, buf, (size_t) nread);
+    }
+  data.seek (0, SEEK_SET);
+  sha256_final (&ctx, digest);
+  return to_hex (digest);
+}
+
+bool
+ImportLedger::lookup (const std::string &digest, entry_s &r_entry)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  const auto it = m_entries.find (digest);
+  if (it == m_entries.end ())
+    {
+      return false;
+    }
+  r_entry = it->second;
+  return true;
+}
+
+void
+ImportLedger::record (const std::string &digest,
+                      const std::vector<std::string> &fprs)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  entry_s &entry = m_entries[digest];
+  entry.when = (long long) time (nullptr);
+  entry.fprs = fprs;
+
+  while (m_entries.size () > m_max_entries)
+    {
+      auto oldest = m_entries.begin ();
+      for (auto it = m_entries.begin (); it != m_entries.end (); ++it)
+        {
+          if (it->second.when < oldest->second.when)
+            {
+              oldest = it;
+            }
+        }
+      m_entries.erase (oldest);
+    }
+  save ();
+}
+
+void
+ImportLedger::forget (const std::string &digest)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  if (m_entries.erase (digest))
+    {
+      save ();
+    }
+}
+
+size_t
+ImportLedger::size ()
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_entries.size ();
+}
+
+/* The file has one line per entry:
+   <digest> <ok> <time> <fpr>,<fpr>...
+   Older versions also recorded failed imports with ok 0.  */
+void
+ImportLedger::load ()
+{
+  if (m_path.empty ())
+    {
+      return;
+    }
+  FILE *fp = gpgol_fopen (m_path, "rb");
+  if (!fp)
+    {
+      log_debug ("%s:%s: No ledger at '%s'",
+                 SRCNAME, __func__, m_path.c_str ());
+      return;
+    }
+  std::string content;
+  char buf[4096];
+  size_t nread;
+  while ((nread = fread (buf, 1, sizeof buf, fp)) > 0)
+    {
+      content.append (buf, nread);
+    }
+  fclose (fp);
+
+  for (auto sline: gpgol_split (content, '\n'))
+    {
+      trim (sline);
+      if (sline.empty () || sline[0] == '#')
+        {
+          continue;
+        }
+      const auto fields = gpgol_split (sline, ' ');
+      if (fields.size () < 3 || fields[0].size () != 2 * SHA256_DIGEST_LEN)
+        {
+          log_debug ("%s:%s: Ignoring invalid line in ledger.",
+                     SRCNAME, __func__);
+          continue;
+        }
+      if (fields[1] != "1")
+        {
+          continue;
+        }
+      entry_s entry;
+      entry.when = strtoll (fields[2].c_str (), nullptr, 10);
+      if (fields.size () > 3)
+        {
+          for (const auto &fpr: gpgol_split (fields[3], ','))
+            {
+              if (!fpr.empty ())
+                {
+                  entry.fprs.push_back (fpr);
+                }
+            }
+        }
+      m_entries[fields[0]] = entry;
+    }
+  log_debug ("%s:%s: Loaded " SIZE_T_FORMAT " entries.",
+             SRCNAME, __func__, m_entries.size ());
+}
+
+/* Called with the mutex held.  Imports are rare so we just
+   write the whole ledger each time.  */
+void
+ImportLedger::save ()
+{
+  if (m_path.empty ())
+    {
+      return;
+    }
+  const std::string tmp = m_path + ".tmp";
+  FILE *fp = gpgol_fopen (tmp, "wb");
+  if (!fp)
+    {
+      log_error ("%s:%s: Failed to write '%s'",
+                 SRCNAME, __func__, tmp.c_str ());
+      return;
+    }
+  fputs (LEDGER_HEADER "\n", fp);
+  for (const auto &pair: m_entries)
+    {
+      std::string fprs;
+      join (pair.second.fprs, ",", fprs);
+      const std::string line = pair.first + " 1 " +
+                               std::to_string (pair.second.when) + " " +
+                               fprs + "\n";
+      fputs (line.c_str (), fp);
+    }
+  if (fclose (fp))
+    {
+      log_error ("%s:%s: Failed to write '%s'",
+                 SRCNAME, __func__, tmp.c_str ());
+      return;
+    }
+  if (!gpgol_replace_file (tmp, m_path))
+    {
+      log_error ("%s:%s: Failed to replace '%s'",
+                 SRCNAME, __func__, m_path.c_str ());
+    }
+}
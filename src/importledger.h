@@ -0,0 +1,95 @@
+/* importledger.h - Remember which key data was already imported
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef IMPORTLEDGER_H
+#define IMPORTLEDGER_H
+
+#include "config.h"
+
+#include <gpgme++/global.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace GpgME
+{
+  class Data;
+} // namespace GpgME
+
+/** A ledger of key imports keyed by a digest of the key data.
+
+  Autocrypt headers, key attachments and the address book hand
+  us the same key material again and again. If the same data was
+  already imported successfully and its keys are still known we
+  can skip the import. Failed imports are not recorded as they
+  are tried again anyway.
+
+  The ledger is kept in memory and saved to a file in the
+  GnuPG home directory so that it is tied to the keyring it
+  describes. Only the digest and the fingerprints are stored,
+  never the key data itself. */
+class ImportLedger
+{
+public:
+  struct entry_s
+  {
+    long long when;                /* Time of the import.  */
+    std::vector<std::string> fprs; /* Fingerprints of the imported keys. */
+  };
+
+  /** Create a ledger stored in path. An empty path keeps it only
+    in memory. At most max_entries are kept, the oldest are dropped
+    first. */
+  explicit ImportLedger (const std::string &path = std::string (),
+                         size_t max_entries = 1000);
+
+  /** The ledger for the current GnuPG home directory. */
+  static ImportLedger *instance ();
+
+  /** Digest to identify data for protocol. The data is read
+    and rewound. */
+  static std::string digest (GpgME::Protocol proto, const char *data,
+                             size_t len);
+  static std::string digest (GpgME::Protocol proto, GpgME::Data data);
+
+  /** Look up a previous import. Returns false if there is none. */
+  bool lookup (const std::string &digest, entry_s &r_entry);
+
+  /** Record a successful import of the keys fprs and save the
+    ledger. */
+  void record (const std::string &digest,
+               const std::vector<std::string> &fprs);
+
+  /** Forget about an import, e.g. because the key is gone. */
+  void forget (const std::string &digest);
+
+  size_t size ();
+
+private:
+  void load ();
+  void save ();
+
+  std::mutex m_mutex;
+  std::map<std::string, entry_s> m_entries;
+  std::string m_path;
+  size_t m_max_entries;
+};
+
+#endif // IMPORTLEDGER_H
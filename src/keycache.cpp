@@ -24,6 +24,11 @@
 #include "common.h"
 #include "cpphelp.h"
 #include "mail.h"
+#include "contextpool.h"
+#include "importledger.h"
+#include "externsearch.h"
+#include "metrics.h"
+#include "taskgraph.h"
 
 #include <gpg-error.h>
 #include <gpgme++/context.h>
@@ -38,6 +43,7 @@
 
 #include <set>
 #include <unordered_map>
+#include <unordered_set>
 #include <sstream>
 
 GPGRT_LOCK_DEFINE (keycache_lock);
@@ -45,6 +51,7 @@ GPGRT_LOCK_DEFINE (fpr_map_lock);
 GPGRT_LOCK_DEFINE (update_lock);
 GPGRT_LOCK_DEFINE (import_lock);
 GPGRT_LOCK_DEFINE (config_lock);
+GPGRT_LOCK_DEFINE (snapshot_lock);
 static KeyCache* singleton = nullptr;
 
 /** At some point we need to set a limit. There
@@ -60,6 +67,21 @@ static KeyCache* singleton = nullptr;
 #define MAX_LOCATOR_THREADS 50
 static int s_thread_cnt;
 
+static Metrics::Gauge *
+locators_gauge ()
+{
+  static auto s_gauge = Metrics::instance ()->gauge ("keycache.locators");
+  return s_gauge;
+}
+
+/* Account a new map entry in memdbg.  The key data itself is
+   reference counted by gpgme and not accounted.  */
+static void
+account_entry (const std::string &key, size_t value_size)
+{
+  memdbg_account (MEMDBG_KEYCACHE, (long long) (key.size () + value_size));
+}
+
 namespace
 {
   class LocateArgs
@@ -67,14 +89,16 @@ namespace
       public:
         LocateArgs (const std::string& mbox, Mail *mail = nullptr):
           m_mbox (mbox),
-          m_mail (mail)
+          m_mail (0)
         {
           TSTART;
           s_thread_cnt++;
+          locators_gauge ()->add (1);
           Mail::lockDelete ();
-          if (Mail::isValidPtr (m_mail))
+          if (Mail::isValidPtr (mail))
             {
-              m_mail->incrementLocateCount ();
+              m_mail = mail->handle ();
+              mail->incrementLocateCount ();
             }
           Mail::unlockDelete ();
           TRETURN;
@@ -84,17 +108,19 @@ namespace
         {
           TSTART;
           s_thread_cnt--;
+          locators_gauge ()->add (-1);
           Mail::lockDelete ();
-          if (Mail::isValidPtr (m_mail))
+          Mail *mail = Mail::getMailForHandle (m_mail);
+          if (mail)
             {
-              m_mail->decrementLocateCount ();
+              mail->decrementLocateCount ();
             }
           Mail::unlockDelete ();
           TRETURN;
         }
 
         std::string m_mbox;
-        Mail *m_mail;
+        Mail::handle_t m_mail;
     };
 } // namespace
 
@@ -102,41 +128,6 @@ typedef std::pair<std::string, GpgME::Protocol> update_arg_t;
 
 typedef std::pair<std::unique_ptr<LocateArgs>, std::string> import_arg_t;
 
-static std::vector<GpgME::Key>
-filter_chain (const std::vector<GpgME::Key> &input)
-{
-   std::vector<GpgME::Key> leaves;
-
-   std::remove_copy_if(input.begin(), input.end(),
-           std::back_inserter(leaves),
-           [input] (const auto &k)
-            {
-               /* Check if a key has this fingerprint in the
-                * chain ID. Meaning that there is any child of
-                * this certificate. In that case remove it. */
-               for (const auto &c: input)
-               {
-                 if (!c.chainID())
-                  {
-                    continue;
-                  }
-                 if (!k.primaryFingerprint() || !c.primaryFingerprint())
-                  {
-                     STRANGEPOINT;
-                     continue;
-                  }
-                 if (!strcmp (c.chainID(), k.primaryFingerprint()))
-                  {
-                     log_debug ("%s:%s: Filtering %s as non leaf cert",
-                                SRCNAME, __func__, k.primaryFingerprint ());
-                     return true;
-                  }
-               }
-               return false;
-            });
-    return leaves;
-}
-
 static DWORD WINAPI
 do_update (LPVOID arg)
 {
@@ -147,8 +138,7 @@ do_update (LPVOID arg)
              SRCNAME, __func__, anonstr (args->first.c_str ()),
              to_cstr (args->second));
 
-  auto ctx = std::unique_ptr<GpgME::Context> (GpgME::Context::createForProtocol
-                                              (args->second));
+  auto ctx = ContextPool::instance ()->get (args->second);
 
   if (!ctx)
     {
@@ -184,6 +174,34 @@ do_update (LPVOID arg)
   TRETURN 0;
 }
 
+/* Check if a previous import of the same data can be used again.
+   That is the case if it succeeded and all its keys are still
+   known.  */
+static bool
+ledger_has_import (const std::string &digest,
+                   std::vector<std::string> &r_fprs)
+{
+  TSTART;
+  ImportLedger::entry_s entry;
+  if (!ImportLedger::instance ()->lookup (digest, entry) ||
+      entry.fprs.empty ())
+    {
+      TRETURN false;
+    }
+  for (const auto &fpr: entry.fprs)
+    {
+      if (KeyCache::instance ()->getByFpr (fpr.c_str (), false).isNull ())
+        {
+          log_debug ("%s:%s Key %s of previous import is gone.",
+                     SRCNAME, __func__, anonstr (fpr.c_str ()));
+          ImportLedger::instance ()->forget (digest);
+          TRETURN false;
+        }
+    }
+  r_fprs = entry.fprs;
+  TRETURN true;
+}
+
 static DWORD WINAPI
 do_import (LPVOID arg)
 {
@@ -209,7 +227,7 @@ do_import (LPVOID arg)
     }
   data.rewind ();
 
-  auto ctx = GpgME::Context::create(proto);
+  auto ctx = ContextPool::instance ()->get (proto);
 
   if (!ctx)
     {
@@ -225,9 +243,20 @@ do_import (LPVOID arg)
     }
   data.rewind ();
 
+  std::vector<std::string> fingerprints;
+  const auto digest = ImportLedger::digest (proto, keyStr, strlen (keyStr));
+  if (ledger_has_import (digest, fingerprints))
+    {
+      log_debug ("%s:%s Data for: %s was already imported.",
+                 SRCNAME, __func__, anonstr (mbox.c_str ()));
+      KeyCache::instance ()->onAddrBookImportJobDone (mbox,
+                                                      fingerprints,
+                                                      proto);
+      TRETURN 0;
+    }
+
   const auto result = ctx->importKeys (data);
 
-  std::vector<std::string> fingerprints;
   for (const auto import: result.imports())
     {
       if (import.error())
@@ -259,6 +288,10 @@ do_import (LPVOID arg)
       log_debug ("%s:%s Imported: %s from addressbook.",
                  SRCNAME, __func__, anonstr (fpr));
     }
+  if (!result.error () && !fingerprints.empty ())
+    {
+      ImportLedger::instance ()->record (digest, fingerprints);
+    }
 
   KeyCache::instance ()->onAddrBookImportJobDone (mbox,
                                                   fingerprints,
@@ -274,7 +307,7 @@ do_populate_protocol (GpgME::Protocol proto, bool secret)
 {
   log_debug ("%s:%s: Starting keylisting for proto %s",
              SRCNAME, __func__, to_cstr (proto));
-  auto ctx = GpgME::Context::create (proto);
+  auto ctx = ContextPool::instance ()->get (proto);
   if (!ctx)
     {
       /* Maybe PGP broken and not S/MIME */
@@ -307,6 +340,11 @@ do_populate_protocol (GpgME::Protocol proto, bool secret)
                                              key);
 
     }
+  if (!err)
+    {
+      /* Stopped before the end of the keylisting.  */
+      ContextPool::discard (ctx);
+    }
   TRETURN;
 }
 
@@ -461,31 +499,110 @@ do_populate_smartcards (GpgME::Protocol proto)
   TRETURN;
 }
 
-static DWORD WINAPI
-do_populate (LPVOID)
+static void
+populate_config ()
 {
   TSTART;
-
   log_dbg ("Populating config");
+  /* Taken before loading so that a change meanwhile is noticed
+     the next time.  */
+  const auto sources =
+    ConfigSnapshot::stat_files (ConfigSnapshot::config_files ());
   gpgrt_lock_lock (&config_lock);
   GpgME::Error err;
-  KeyCache::instance ()->setConfig (GpgME::Configuration::Component::load (err));
+  const auto components = GpgME::Configuration::Component::load (err);
+  if (err)
+    {
+      log_error ("%s:%s: Failed to load the configuration: %s",
+                 SRCNAME, __func__, err.asString ());
+    }
+  KeyCache::instance ()->setConfig (components, sources);
   gpgrt_lock_unlock (&config_lock);
-  log_debug ("%s:%s: Populating keycache",
-             SRCNAME, __func__);
-  do_populate_protocol (GpgME::OpenPGP, false);
-  do_populate_smartcards (GpgME::OpenPGP);
-  do_populate_protocol (GpgME::OpenPGP, true);
-  if (opt.enable_smime)
+  TRETURN;
+}
+
+/* Take the current values of all options.  */
+static std::shared_ptr<ConfigSnapshot>
+snapshot_config (const std::vector<GpgME::Configuration::Component> &conf)
+{
+  auto snapshot = std::make_shared<ConfigSnapshot> ();
+  for (const auto &component: conf)
     {
-      do_populate_protocol (GpgME::CMS, false);
-      do_populate_smartcards (GpgME::CMS);
-      do_populate_protocol (GpgME::CMS, true);
+      if (!component.name ())
+        {
+          continue;
+        }
+      snapshot->set (component.name (), std::string (), std::string ());
+      for (const auto &option: component.options ())
+        {
+          const auto value = option.currentValue ();
+          if (!option.name () || value.isNull ())
+            {
+              continue;
+            }
+          std::string str;
+          switch (option.alternateType ())
+            {
+              case GpgME::Configuration::NoType:
+                str = value.boolValue () ? "1" : "0";
+                break;
+              case GpgME::Configuration::IntegerType:
+                str = std::to_string (value.intValue ());
+                break;
+              case GpgME::Configuration::UnsignedIntegerType:
+                str = std::to_string (value.uintValue ());
+                break;
+              default:
+                if (!value.stringValue ())
+                  {
+                    continue;
+                  }
+                str = value.stringValue ();
+            }
+          snapshot->set (component.name (), option.name (), str);
+        }
     }
-  log_debug ("%s:%s: Keycache populated",
-             SRCNAME, __func__);
+  return snapshot;
+}
 
-  TRETURN 0;
+static bool
+snapshot_uses_tofu (const ConfigSnapshot &snapshot)
+{
+  std::string model;
+  return snapshot.get ("gpg", "trust-model", &model) &&
+         (model == "tofu" || model == "tofu+pgp");
+}
+
+/* The keylistings of the protocols, the smartcard check and the
+   configuration are independent of each other.  Only the secret
+   keys are listed after the public keys and after the smartcards
+   were learned, so that the card keys are listed as secret.  */
+static void
+add_populate_tasks (TaskGraph &graph)
+{
+  graph.add ("gpgconf", populate_config);
+  const int smartcards = graph.add ("smartcards", [] () {
+      do_populate_smartcards (GpgME::OpenPGP);
+      if (opt.enable_smime)
+        {
+          do_populate_smartcards (GpgME::CMS);
+        }
+    });
+  const int pgp = graph.add ("openpgp", [] () {
+      do_populate_protocol (GpgME::OpenPGP, false);
+    });
+  graph.add ("openpgp secret", [] () {
+      do_populate_protocol (GpgME::OpenPGP, true);
+    }, { pgp, smartcards });
+  if (opt.enable_smime)
+    {
+      const int cms = graph.add ("cms", [] () {
+          do_populate_protocol (GpgME::CMS, false);
+        });
+      graph.add ("cms secret", [] () {
+          do_populate_protocol (GpgME::CMS, true);
+        }, { cms, smartcards });
+    }
 }
 
 
@@ -505,6 +622,7 @@ public:
     if (it == m_pgp_key_map.end ())
       {
         m_pgp_key_map.insert (std::pair<std::string, GpgME::Key> (mbox, key));
+        account_entry (mbox, sizeof (GpgME::Key));
       }
     else
       {
@@ -524,6 +642,7 @@ public:
     if (it == m_smime_key_map.end ())
       {
         m_smime_key_map.insert (std::pair<std::string, GpgME::Key> (mbox, key));
+        account_entry (mbox, sizeof (GpgME::Key));
       }
     else
       {
@@ -621,6 +740,7 @@ public:
     if (it == m_pgp_skey_map.end ())
       {
         m_pgp_skey_map.insert (std::pair<std::string, GpgME::Key> (mbox, key));
+        account_entry (mbox, sizeof (GpgME::Key));
       }
     else
       {
@@ -644,6 +764,7 @@ public:
     if (it == m_smime_skey_map.end ())
       {
         m_smime_skey_map.insert (std::pair<std::string, GpgME::Key> (mbox, key));
+        account_entry (mbox, sizeof (GpgME::Key));
       }
     else
       {
@@ -716,7 +837,7 @@ public:
       }
     if (proto == GpgME::CMS) {
         /* Remove root and intermediate ca's */
-        ret = filter_chain (ret);
+        ret = filterChain (ret);
     }
     gpgol_unlock (&keycache_lock);
     TRETURN ret;
@@ -850,7 +971,7 @@ public:
 
         if (!overrides.empty())
           {
-            const auto filtered = (proto == GpgME::CMS ? filter_chain(overrides)
+            const auto filtered = (proto == GpgME::CMS ? filterChain(overrides)
                                                        : overrides);
             ret.insert (ret.end (), filtered.begin (), filtered.end ());
             log_debug ("%s:%s: Using overrides for %s",
@@ -918,6 +1039,72 @@ public:
     TRETURN ret;
   }
 
+  /* Remove root and intermediate certificates.  A certificate that
+     is the issuer of any certificate in the cache is no leaf.  */
+  std::vector<GpgME::Key> filterChain (const std::vector<GpgME::Key> &input)
+    {
+      TSTART;
+      std::vector<GpgME::Key> leaves;
+      leaves.reserve (input.size ());
+
+      /* The input might contain keys not yet inserted.  */
+      std::unordered_set<std::string> issuers;
+      for (const auto &k: input)
+        {
+          if (k.chainID ())
+            {
+              issuers.insert (k.chainID ());
+            }
+        }
+
+      gpgol_lock (&fpr_map_lock);
+      for (const auto &k: input)
+        {
+          const char *fpr = k.primaryFingerprint ();
+          if (!fpr)
+            {
+              STRANGEPOINT;
+              leaves.push_back (k);
+              continue;
+            }
+          if (issuers.count (fpr) || m_issuer_fprs.count (fpr))
+            {
+              log_debug ("%s:%s: Filtering %s as non leaf cert",
+                         SRCNAME, __func__, anonstr (fpr));
+              continue;
+            }
+          leaves.push_back (k);
+        }
+      gpgol_unlock (&fpr_map_lock);
+      TRETURN leaves;
+    }
+
+  /* Move a certificate from the children of old_issuer to those of
+     new_issuer.  Either may be null.  Called with the fpr_map_lock
+     held.  */
+  void updateIssuer (const char *old_issuer, const char *new_issuer)
+    {
+      if (old_issuer && new_issuer && !strcmp (old_issuer, new_issuer))
+        {
+          return;
+        }
+      if (old_issuer)
+        {
+          auto it = m_issuer_fprs.find (old_issuer);
+          if (it != m_issuer_fprs.end () && !--it->second)
+            {
+              memdbg_account (MEMDBG_KEYCACHE,
+                              -(long long) (it->first.size () +
+                                            sizeof (size_t)));
+              m_issuer_fprs.erase (it);
+            }
+        }
+      if (new_issuer && !m_issuer_fprs[new_issuer]++)
+        {
+          account_entry (new_issuer, sizeof (size_t));
+        }
+    }
+
   void insertOrUpdateInFprMap (const GpgME::Key &key)
     {
       TSTART;
@@ -950,14 +1137,23 @@ public:
               m_sub_fpr_map.insert (std::make_pair(
                                      std::string (subFpr),
                                      std::string (primaryFpr)));
+              account_entry (subFpr, strlen (primaryFpr));
             }
         }
 
       auto it = m_fpr_map.find (primaryFpr);
 
+      /* Remember the issuer so that chains can be filtered without
+         comparing all certificates with each other.  */
+      updateIssuer (it != m_fpr_map.end () &&
+                    it->second.protocol () == GpgME::CMS ?
+                    it->second.chainID () : nullptr,
+                    key.protocol () == GpgME::CMS ? key.chainID () : nullptr);
+
       if (it == m_fpr_map.end ())
         {
           m_fpr_map.insert (std::make_pair (primaryFpr, key));
+          account_entry (primaryFpr, sizeof (GpgME::Key));
 
           gpgol_unlock (&fpr_map_lock);
           TRETURN;
@@ -1027,6 +1223,8 @@ public:
   GpgME::Key getFromMap (const char *fpr) const
   {
     TSTART;
+    static auto s_hits = Metrics::instance ()->counter ("keycache.map.hit");
+    static auto s_misses = Metrics::instance ()->counter ("keycache.map.miss");
     if (!fpr)
       {
         TRACEPOINT;
@@ -1053,15 +1251,22 @@ public:
       {
         const auto ret = keyIt->second;
         gpgol_unlock (&fpr_map_lock);
+        s_hits->add ();
         TRETURN ret;
       }
     gpgol_unlock (&fpr_map_lock);
+    s_misses->add ();
     TRETURN GpgME::Key();
   }
 
   GpgME::Key getByFpr (const char *fpr, bool block) const
     {
       TSTART;
+      static auto s_hits = Metrics::instance ()->counter ("keycache.fpr.hit");
+      static auto s_misses =
+        Metrics::instance ()->counter ("keycache.fpr.miss");
+      static auto s_wait_time =
+        Metrics::instance ()->histogram ("keycache.fpr.wait_usecs");
       if (!fpr)
         {
           TRACEPOINT;
@@ -1078,6 +1283,7 @@ public:
             {
               const std::string sFpr (fpr);
               int i = 0;
+              MetricsTimer timer (s_wait_time);
 
               gpgol_lock (&update_lock);
               while (m_update_jobs.find(sFpr) != m_update_jobs.end ())
@@ -1101,6 +1307,7 @@ public:
                     }
                 }
               gpgol_unlock (&update_lock);
+              timer.stop ();
 
               TRACEPOINT;
               const auto ret2 = getFromMap (fpr);
@@ -1113,16 +1320,19 @@ public:
                 {
                   log_debug ("%s:%s Cache hit after wait for %s.",
                              SRCNAME, __func__, anonstr (fpr));
+                  s_hits->add ();
                   TRETURN ret2;
                 }
             }
           log_debug ("%s:%s Cache miss for %s.",
                      SRCNAME, __func__, anonstr (fpr));
+          s_misses->add ();
           TRETURN GpgME::Key();
         }
 
       log_debug ("%s:%s Cache hit for %s.",
                  SRCNAME, __func__, anonstr (fpr));
+      s_hits->add ();
       TRETURN ret;
     }
 
@@ -1254,15 +1464,21 @@ public:
 
 
 
-  void populate ()
+  void populate (TaskGraph *graph)
     {
       TSTART;
+      loadSnapshot ();
       gpgrt_lock_lock (&keycache_lock);
       m_ultimate_keys.clear ();
       gpgrt_lock_unlock (&keycache_lock);
-      CloseHandle (CreateThread (nullptr, 0, do_populate,
-                                 nullptr, 0,
-                                 nullptr));
+      if (graph)
+        {
+          add_populate_tasks (*graph);
+          TRETURN;
+        }
+      auto own = std::make_shared<TaskGraph> ("keycache");
+      add_populate_tasks (*own);
+      TaskGraph::run_detached (own);
       TRETURN;
     }
 
@@ -1279,12 +1495,54 @@ public:
       m_cached_config = conf;
     }
 
+  /* Use the snapshot of the last run until gpgconf is done.  */
+  void loadSnapshot ()
+    {
+      TSTART;
+      auto snapshot = std::make_shared<ConfigSnapshot> ();
+      if (!snapshot->load (ConfigSnapshot::default_path ()))
+        {
+          TRETURN;
+        }
+      if (!snapshot->current ())
+        {
+          log_debug ("%s:%s: Configuration changed. Not using snapshot.",
+                     SRCNAME, __func__);
+          TRETURN;
+        }
+      setSnapshot (snapshot);
+      TRETURN;
+    }
+
+  void setSnapshot (const std::shared_ptr<const ConfigSnapshot> &snapshot)
+    {
+      gpgol_lock (&snapshot_lock);
+      m_snapshot = snapshot;
+      gpgol_unlock (&snapshot_lock);
+      m_use_tofu = snapshot_uses_tofu (*snapshot);
+      if (m_use_tofu)
+        {
+          log_dbg ("Keycache detected tofu mode.");
+        }
+    }
+
+  std::shared_ptr<const ConfigSnapshot> getSnapshot () const
+    {
+      gpgol_lock (&snapshot_lock);
+      auto ret = m_snapshot;
+      gpgol_unlock (&snapshot_lock);
+      return ret;
+    }
+
   std::unordered_map<std::string, GpgME::Key> m_pgp_key_map;
   std::unordered_map<std::string, GpgME::Key> m_smime_key_map;
   std::unordered_map<std::string, GpgME::Key> m_pgp_skey_map;
   std::unordered_map<std::string, GpgME::Key> m_smime_skey_map;
   std::unordered_map<std::string, GpgME::Key> m_fpr_map;
   std::unordered_map<std::string, std::string> m_sub_fpr_map;
+  /* Fingerprints of the issuers of the known S/MIME certificates
+     and the number of certificates they issued. */
+  std::unordered_map<std::string, size_t> m_issuer_fprs;
   std::unordered_map<std::string, std::vector<std::string> >
     m_pgp_overrides;
   std::unordered_map<std::string, std::vector<std::string> >
@@ -1294,6 +1552,7 @@ public:
   std::set<std::string> m_pgp_import_jobs;
   std::set<std::string> m_cms_import_jobs;
   std::vector<GpgME::Configuration::Component> m_cached_config;
+  std::shared_ptr<const ConfigSnapshot> m_snapshot;
   bool m_use_tofu;
 };
 
@@ -1362,8 +1621,7 @@ get_local_smime_keys (const std::string &addr)
 {
   TSTART;
   std::vector<GpgME::Key> keys;
-  auto ctx = std::unique_ptr<GpgME::Context> (
-                                              GpgME::Context::createForProtocol (GpgME::CMS));
+  auto ctx = ContextPool::instance ()->get (GpgME::CMS);
   if (!ctx)
     {
       TRACEPOINT;
@@ -1389,8 +1647,12 @@ get_local_smime_keys (const std::string &addr)
   TRETURN keys;
 }
 
+/* Search for the S/MIME keys of ADDR on the configured servers.
+   R_ERR is set if the search did not finish, e.g. because dirmngr
+   could not reach a server.  */
 static std::vector<GpgME::Key>
-get_extern_smime_keys (const std::string &addr, bool import)
+get_extern_smime_keys (const std::string &addr, bool import,
+                       GpgME::Error *r_err)
 {
   TSTART;
   std::vector<GpgME::Key> keys;
@@ -1399,6 +1661,7 @@ get_extern_smime_keys (const std::string &addr, bool import)
   if (!ctx)
     {
       TRACEPOINT;
+      *r_err = GpgME::Error::fromCode (GPG_ERR_GENERAL);
       TRETURN keys;
     }
   // We need to validate here to fetch CRL's
@@ -1407,6 +1670,7 @@ get_extern_smime_keys (const std::string &addr, bool import)
   if (e)
     {
       TRACEPOINT;
+      *r_err = e;
       TRETURN keys;
     }
 
@@ -1423,6 +1687,14 @@ get_extern_smime_keys (const std::string &addr, bool import)
         }
     } while (!err);
 
+  if (err.code () != GPG_ERR_EOF)
+    {
+      log_debug ("%s:%s: Extern search for %s failed: %s",
+                 SRCNAME, __func__, anonstr (addr.c_str()),
+                 err.asString ());
+      *r_err = err;
+    }
+
   if (import && keys.size ())
     {
       const GpgME::ImportResult res = ctx->importKeys(keys);
@@ -1451,7 +1723,11 @@ do_locate (LPVOID arg)
   log_debug ("%s:%s searching key for addr: \"%s\"",
              SRCNAME, __func__, anonstr (addr.c_str()));
 
+  static auto s_locate_time =
+    Metrics::instance ()->histogram ("keycache.locate_usecs");
+  MetricsTimer timer (s_locate_time);
   const auto k = GpgME::Key::locate (addr.c_str());
+  timer.stop ();
 
   if (!k.isNull ())
     {
@@ -1481,9 +1757,20 @@ do_locate (LPVOID arg)
                      "search is disabled.", SRCNAME, __func__);
           TRETURN 0;
         }
-      /* Search for extern keys and import them */
-      const auto externs = get_extern_smime_keys (addr, true);
-      if (externs.empty())
+      /* Search for extern keys and import them.  Addresses that
+         had none recently are not searched again for a while.  */
+      std::vector<GpgME::Key> externs;
+      auto search = [&addr, &externs] () -> ExternSearch::Result {
+        GpgME::Error err;
+        externs = get_extern_smime_keys (addr, true, &err);
+        if (!externs.empty ())
+          {
+            return ExternSearch::Found;
+          }
+        /* Only a search that finished may back off.  */
+        return err ? ExternSearch::Failed : ExternSearch::NotFound;
+      };
+      if (!ExternSearch::instance ()->run (addr, search))
         {
           TRETURN 0;
         }
@@ -1512,8 +1799,7 @@ static void
 locate_secret (const char *addr, GpgME::Protocol proto)
 {
   TSTART;
-  auto ctx = std::unique_ptr<GpgME::Context> (
-                      GpgME::Context::createForProtocol (proto));
+  auto ctx = ContextPool::instance ()->get (proto);
   if (!ctx)
     {
       TRACEPOINT;
@@ -1570,7 +1856,7 @@ locate_secret (const char *addr, GpgME::Protocol proto)
                      SRCNAME, __func__, anonstr (mbox.c_str()),
                      anonstr (key.primaryFingerprint()));
           KeyCache::instance()->setPgpKeySecret (mbox, key);
-          TRETURN;
+          break;
         }
       if (proto == GpgME::CMS)
         {
@@ -1578,9 +1864,15 @@ locate_secret (const char *addr, GpgME::Protocol proto)
                      SRCNAME, __func__, anonstr (mbox.c_str ()),
                      anonstr (key.primaryFingerprint()));
           KeyCache::instance()->setSmimeKeySecret (mbox, key);
-          TRETURN;
+          break;
         }
     } while (!err);
+  if (!err)
+    {
+      /* Stopped at the first key.  The keylisting is still running
+         so the context can't go back to the pool.  */
+      ContextPool::discard (ctx);
+    }
   TRETURN;
 }
 
@@ -1632,6 +1924,7 @@ KeyCache::startLocate (const char *addr, Mail *mail) const
       // It's enough to look at the PGP Key map. We marked
       // searched keys there.
       d->m_pgp_key_map.insert (std::pair<std::string, GpgME::Key> (recp, GpgME::Key()));
+      account_entry (recp, sizeof (GpgME::Key));
       log_debug ("%s:%s Creating a locator thread",
                  SRCNAME, __func__);
       const auto args = new LocateArgs(recp, mail);
@@ -1664,6 +1957,7 @@ KeyCache::startLocateSecret (const char *addr, Mail *mail) const
       // It's enough to look at the PGP Key map. We marked
       // searched keys there.
       d->m_pgp_skey_map.insert (std::pair<std::string, GpgME::Key> (recp, GpgME::Key()));
+      account_entry (recp, sizeof (GpgME::Key));
       log_debug ("%s:%s Creating a locator thread",
                  SRCNAME, __func__);
       const auto args = new LocateArgs(recp, mail);
@@ -1783,9 +2077,9 @@ KeyCache::getOverrides (const std::string &mbox, GpgME::Protocol proto)
 }
 
 void
-KeyCache::populate ()
+KeyCache::populate (TaskGraph *graph)
 {
-  return d->populate ();
+  return d->populate (graph);
 }
 
 std::vector<GpgME::Key>
@@ -1807,7 +2101,17 @@ KeyCache::import_pgp_key_data (const GpgME::Data &data)
       STRANGEPOINT;
       TRETURN false;
     }
-  auto ctx = GpgME::Context::create(GpgME::OpenPGP);
+
+  std::vector<std::string> fprs;
+  const auto digest = ImportLedger::digest (GpgME::OpenPGP, data);
+  if (ledger_has_import (digest, fprs))
+    {
+      log_debug ("%s:%s: Key data was already imported.",
+                 SRCNAME, __func__);
+      TRETURN true;
+    }
+
+  auto ctx = ContextPool::instance ()->get (GpgME::OpenPGP);
 
   if (!ctx)
     {
@@ -1870,6 +2174,24 @@ KeyCache::import_pgp_key_data (const GpgME::Data &data)
       log_debug ("%s:%s: Import result: %s",
                  SRCNAME, __func__, result.error ().asString ());
     }
+
+  for (const auto &import: result.imports ())
+    {
+      const char *fpr = import.fingerprint ();
+      if (import.error () || !fpr ||
+          std::find (fprs.begin (), fprs.end (), fpr) != fprs.end ())
+        {
+          continue;
+        }
+      fprs.push_back (fpr);
+      /* Make sure the key is in the cache so that the next
+         import of the same data can be skipped. */
+      KeyCache::instance ()->update (fpr, GpgME::OpenPGP);
+    }
+  if (!result.error () && !fprs.empty ())
+    {
+      ImportLedger::instance ()->record (digest, fprs);
+    }
   TRETURN !result.error();
 }
 
@@ -1880,33 +2202,27 @@ KeyCache::get_cached_config () const
 }
 
 void
-KeyCache::setConfig (const std::vector<GpgME::Configuration::Component>& conf)
+KeyCache::setConfig (const std::vector<GpgME::Configuration::Component>& conf,
+                     const ConfigSnapshot::sources_t &sources)
 {
+  TSTART;
   d->setConfig (conf);
-  for (const auto &component: conf)
-   {
-     if (component.name () && !strcmp (component.name (), "gpg"))
-       {
-         for (const auto &option: component.options ())
-           {
-             if (option.name () && !strcmp (option.name (), "trust-model"))
-               {
-                 const char *val = option.currentValue().stringValue();
-                 if (!val)
-                   {
-                     return;
-                   }
-                 if (!strcmp ("tofu", val) || !strcmp ("tofu+pgp", val))
-                   {
-                     log_dbg ("Keycache detected tofu mode.");
-                     d->m_use_tofu = true;
-                     return;
-                   }
-               }
-           }
-         return;
-       }
-   }
+  auto snapshot = snapshot_config (conf);
+  if (snapshot->empty ())
+    {
+      /* Keep the old snapshot if gpgconf failed.  */
+      TRETURN;
+    }
+  snapshot->set_sources (sources);
+  const auto old = d->getSnapshot ();
+  if (!old || !old->same (*snapshot))
+    {
+      log_debug ("%s:%s: Saving new configuration snapshot.",
+                 SRCNAME, __func__);
+      snapshot->save (ConfigSnapshot::default_path ());
+    }
+  d->setSnapshot (snapshot);
+  TRETURN;
 }
 
 bool
@@ -1923,52 +2239,51 @@ KeyCache::protocolIsOnline (GpgME::Protocol proto) const
     {
       TRETURN true;
     }
-  for (const auto &component: d->get_cached_config ())
+  auto snapshot = d->getSnapshot ();
+  if (!snapshot)
+    {
+      /* No snapshot from the last run.  Wait for gpgconf.  */
+      d->get_cached_config ();
+      snapshot = d->getSnapshot ();
+    }
+  if (!snapshot)
+    {
+      log_dbg ("No configuration. Assuming offline.");
+      TRETURN false;
+    }
+  if (proto == GpgME::OpenPGP && snapshot->has_component ("gpg"))
     {
-      if (proto == GpgME::OpenPGP && component.name () && !strcmp (component.name (), "gpg"))
+      if (snapshot->flag ("gpg", "auto-key-retrieve"))
         {
-          for (const auto &option: component.options ())
-            {
-              if (option.name () && !strcmp (option.name (), "auto-key-retrieve") &&
-                  option.currentValue().boolValue ())
-                {
-                  log_debug ("%s:%s: Detected auto-key-retrieve -> online",
-                             SRCNAME, __func__);
-                  TRETURN true;
-                }
-              if (option.name () && !strcmp (option.name (), "disable-dirmngr") &&
-                  option.currentValue().boolValue ())
-                {
-                  log_debug ("%s:%s: Detected disable-dirmngr -> offline",
-                             SRCNAME, __func__);
-                  TRETURN false;
-                }
-            }
+          log_debug ("%s:%s: Detected auto-key-retrieve -> online",
+                     SRCNAME, __func__);
+          TRETURN true;
         }
-      if (proto == GpgME::CMS && component.name () && !strcmp (component.name (), "gpgsm"))
+      if (snapshot->flag ("gpg", "disable-dirmngr"))
         {
-          for (const auto &option: component.options ())
-            {
-              if (option.name () && !strcmp (option.name (), "disable-crl-checks") &&
-                  option.currentValue().boolValue ())
-                {
-                  log_debug ("%s:%s: Detected disable-crl-checks -> offline",
-                             SRCNAME, __func__);
-                  TRETURN false;
-                }
-              if (option.name () && !strcmp (option.name (), "disable-dirmngr") &&
-                  option.currentValue().boolValue ())
-                {
-                  log_debug ("%s:%s: Detected disable-dirmngr -> offline",
-                             SRCNAME, __func__);
-                  TRETURN false;
-                }
-            }
-          /* By default S/MIME is online. */
-          log_dbg ("No options found. So assume CRL checks -> online");
-          TRETURN true;
+          log_debug ("%s:%s: Detected disable-dirmngr -> offline",
+                     SRCNAME, __func__);
+          TRETURN false;
         }
     }
+  if (proto == GpgME::CMS && snapshot->has_component ("gpgsm"))
+    {
+      if (snapshot->flag ("gpgsm", "disable-crl-checks"))
+        {
+          log_debug ("%s:%s: Detected disable-crl-checks -> offline",
+                     SRCNAME, __func__);
+          TRETURN false;
+        }
+      if (snapshot->flag ("gpgsm", "disable-dirmngr"))
+        {
+          log_debug ("%s:%s: Detected disable-dirmngr -> offline",
+                     SRCNAME, __func__);
+          TRETURN false;
+        }
+      /* By default S/MIME is online. */
+      log_dbg ("No options found. So assume CRL checks -> online");
+      TRETURN true;
+    }
 
   log_dbg ("Detected no online options.");
 
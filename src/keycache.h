@@ -30,6 +30,8 @@
 #include <gpgme++/global.h>
 #include <gpgme++/configuration.h>
 
+#include "confsnapshot.h"
+
 namespace GpgME
 {
   class Key;
@@ -37,6 +39,7 @@ namespace GpgME
 };
 
 class Mail;
+class TaskGraph;
 
 class KeyCache
 {
@@ -129,8 +132,10 @@ public:
     std::vector<GpgME::Key> getOverrides (const std::string &mbox,
                                           GpgME::Protocol proto);
 
-    /* Populate the fingerprint and secret key maps */
-    void populate ();
+    /* Populate the fingerprint and secret key maps.  The tasks
+       are added to graph which the caller runs.  Without a graph
+       they run in the background right away. */
+    void populate (TaskGraph *graph = nullptr);
 
     /* Get a vector of ultimately trusted keys. */
     std::vector<GpgME::Key> getUltimateKeys ();
@@ -144,7 +149,8 @@ public:
     const std::vector<GpgME::Configuration::Component> get_cached_config () const;
 
     /* Check the cached configuration if operations might
-       use online calls. */
+       use online calls.  Until the configuration is loaded the
+       snapshot from the last run is used if it is current. */
     bool protocolIsOnline (GpgME::Protocol proto) const;
 
     bool useTofu () const;
@@ -158,7 +164,10 @@ public:
     void onAddrBookImportJobDone (const std::string &fpr,
                                   const std::vector<std::string> &result_fprs,
                                   GpgME::Protocol proto);
-    void setConfig(const std::vector<GpgME::Configuration::Component> & comp);
+    /* Set the loaded configuration.  sources is the state of the
+       configuration files before it was loaded. */
+    void setConfig(const std::vector<GpgME::Configuration::Component> & comp,
+                   const ConfigSnapshot::sources_t &sources);
 
 private:
 
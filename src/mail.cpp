@@ -43,6 +43,9 @@
 #include "cpphelp.h"
 #include "addressbook.h"
 #include "recipient.h"
+#include "metrics.h"
+#include "mimetree.h"
+#include "handletable.h"
 
 #include <gpgme++/configuration.h>
 #include <gpgme++/tofuinfo.h>
@@ -66,6 +69,9 @@
 using namespace GpgME;
 
 static std::map<LPDISPATCH, Mail*> s_mail_map;
+/* The live mails.  Checks for a mail in s_mail_map would need a
+   scan of all values under the lock.  */
+static HandleTable<Mail> s_mail_handles;
 static std::map<std::string, Mail*> s_uid_map;
 static std::map<std::string, LPDISPATCH> s_folder_events_map;
 static std::set<std::string> uids_searched;
@@ -136,7 +142,8 @@ Mail::Mail (LPDISPATCH mailitem) :
     m_printing(false),
     m_recipients_set(false),
     m_is_split_copy(false),
-    m_attachs_added(false)
+    m_attachs_added(false),
+    m_handle(0)
 {
   TSTART;
   if (getMailForItem (mailitem))
@@ -159,6 +166,7 @@ Mail::Mail (LPDISPATCH mailitem) :
   gpgol_lock (&mail_map_lock);
   s_mail_map.insert (std::pair<LPDISPATCH, Mail *> (mailitem, this));
   gpgol_unlock (&mail_map_lock);
+  m_handle = s_mail_handles.add (this);
   s_last_mail = this;
   memdbg_ctor ("Mail");
   TRETURN;
@@ -212,6 +220,7 @@ Mail::~Mail()
       s_mail_map.erase (it);
     }
   gpgol_unlock (&mail_map_lock);
+  s_mail_handles.remove (m_handle);
 
   if (!m_uuid.empty())
     {
@@ -299,19 +308,15 @@ bool
 Mail::isValidPtr (const Mail *mail)
 {
   TSTART;
-  gpgol_lock (&mail_map_lock);
-  auto it = s_mail_map.begin();
-  while (it != s_mail_map.end())
-    {
-      if (it->second == mail)
-        {
-          gpgol_unlock (&mail_map_lock);
-          TRETURN true;
-        }
-      ++it;
-    }
-  gpgol_unlock (&mail_map_lock);
-  TRETURN false;
+  TRETURN s_mail_handles.contains (mail);
+}
+
+//static
+Mail *
+Mail::getMailForHandle (handle_t handle)
+{
+  TSTART;
+  TRETURN s_mail_handles.get (handle);
 }
 
 int
@@ -735,11 +740,47 @@ copy_attachment_to_file (std::shared_ptr<Attachment> att, HANDLE hFile)
   TRETURN 0;
 }
 
+/* True if s starts with "cid:" in any case.  */
+static bool
+is_cid_url (const char *s)
+{
+  return (s[0] | 0x20) == 'c' && (s[1] | 0x20) == 'i'
+         && (s[2] | 0x20) == 'd' && s[3] == ':';
+}
+
+/** Collect the indices of the attachments that the HTML body
+  refers to with cid: URLs.  The references are resolved with
+  the MIME structure so this is a single pass over the body. */
+static std::set<int>
+referenced_attachments (const char *html, const MimeTree &tree)
+{
+  std::set<int> ret;
+  for (const char *s = html; *s; )
+    {
+      if (!is_cid_url (s))
+        {
+          s++;
+          continue;
+        }
+      s += 4;
+      const size_t n = strcspn (s, "\"' \t\r\n<>()");
+      const int idx = tree.find_by_cid (std::string (s, n));
+      if (idx >= 0 && tree.part (idx).attachment >= 0)
+        {
+          ret.insert (tree.part (idx).attachment);
+        }
+      s += n;
+    }
+  return ret;
+}
+
 /** Sets some meta data on the last attachment added. The meta
-  data is taken from the attachment object. */
+  data is taken from the attachment object. referenced tells
+  if the HTML body refers to the attachment. */
 static int
 fixup_last_attachment_o (LPDISPATCH mail,
-                         std::shared_ptr<Attachment> attachment)
+                         std::shared_ptr<Attachment> attachment,
+                         bool referenced)
 {
   TSTART;
   /* Currently we only set content id */
@@ -757,14 +798,6 @@ fixup_last_attachment_o (LPDISPATCH mail,
    * in the HTML before we hide it. In doubt it is better to "break"
    * the content id reference but show the Attachment as a hidden
    * attachment can appear to be data loss. See T4526 T4203. */
-  char *body = get_oom_string (mail, "HTMLBody");
-  if (!body)
-    {
-      log_debug ("%s:%s: No HTML Body.",
-                 SRCNAME, __func__);
-      TRETURN 0;
-    }
-
   if (cid.front () == '<')
     {
       cid.erase (0, 1);
@@ -774,9 +807,7 @@ fixup_last_attachment_o (LPDISPATCH mail,
       cid.pop_back ();
     }
 
-  char *cid_pos = strstr (body, cid.c_str ());
-  xfree (body);
-  if (!cid_pos)
+  if (!referenced)
     {
       log_debug ("%s:%s: Failed to find cid: '%s' in body. Not setting cid.",
                  SRCNAME, __func__, anonstr (cid.c_str ()));
@@ -851,9 +882,30 @@ Mail::add_attachments_o (std::vector<std::shared_ptr<Attachment> > attachments)
   std::string addErrStr;
   int addErrCode = 0;
   std::vector<std::string> failedNames;
+
+  /* Look at the HTML body once for all attachments with a
+     content id instead of fetching it for each of them.  */
+  std::set<int> referenced;
+  for (const auto &att: attachments)
+    {
+      if (!att->get_content_id ().empty () && m_parser)
+        {
+          char *body = get_oom_string (m_mailitem, "HTMLBody");
+          if (body)
+            {
+              referenced = referenced_attachments (body,
+                                                   m_parser->get_mime_tree ());
+              xfree (body);
+            }
+          break;
+        }
+    }
+
+  int idx = -1;
   for (auto att: attachments)
     {
       int err = 0;
+      idx++;
       const auto dispName = att->get_display_name ();
       if (dispName.empty())
         {
@@ -909,7 +961,8 @@ Mail::add_attachments_o (std::vector<std::shared_ptr<Attachment> > attachments)
         {
           log_debug ("%s:%s: Added attachment '%s'",
                      SRCNAME, __func__, anonstr (dispName.c_str()));
-          err = fixup_last_attachment_o (m_mailitem, att);
+          err = fixup_last_attachment_o (m_mailitem, att,
+                                         referenced.count (idx) > 0);
         }
       if (err)
         {
@@ -970,7 +1023,19 @@ do_parsing (LPVOID arg)
   auto parser = mail->parser ();
   gpgol_unlock (&dtor_lock);
 
+  static auto s_parsings = Metrics::instance ()->counter ("parsing.count");
+  static auto s_waiting = Metrics::instance ()->gauge ("parsing.waiting");
+  static auto s_wait_time =
+    Metrics::instance ()->histogram ("parsing.wait_usecs");
+  static auto s_parse_time =
+    Metrics::instance ()->histogram ("parsing.parse_usecs");
+  s_parsings->add ();
+  s_waiting->add (1);
+  MetricsTimer wait_timer (s_wait_time);
   gpgol_lock (&parser_lock);
+  wait_timer.stop ();
+  s_waiting->add (-1);
+  MetricsTimer parse_timer (s_parse_time);
   /* We lock the parser here to avoid too many
      decryption attempts if there are
      multiple mailobjects which might have already
@@ -1006,6 +1071,16 @@ do_parsing (LPVOID arg)
       senderKey = KeyCache::instance ()->getEncryptionKeys (mail->getSender (),
                                                             GpgME::OpenPGP);
     }
+  if (!opt.sync_dec)
+    {
+      /* Show the text while large attachments are decrypted.  The
+         handler checks that the mail still exists.  */
+      parser->set_body_ready_cb ([arg] ()
+        {
+          do_in_ui_thread (SHOW_BODY, arg);
+        });
+    }
+
   bool has_already_preview = (mail->msgtype () == MSGTYPE_GPGOL_MULTIPART_SIGNED &&
                               !mail->getOriginalBody ().empty ());
   if (!has_already_preview && (senderKey.empty () || is_smime) &&
@@ -1801,6 +1876,52 @@ Mail::updateBody_o (bool is_preview)
   TRETURN;
 }
 
+void
+Mail::showEarlyBody_o ()
+{
+  TSTART;
+  if (!m_parser)
+    {
+      TRACEPOINT;
+      TRETURN;
+    }
+  const auto early = m_parser->get_early_body ();
+  if (early.body.empty ())
+    {
+      /* HTML is only shown after the whole content was decrypted
+         and its integrity checked, as it might load content.  */
+      log_dbg ("No text body to show early.");
+      TRETURN;
+    }
+  auto body = early.body;
+  find_and_replace (body, "\r\r\n", "\r\n");
+
+  int codepage = 0;
+  if (early.charset.empty ())
+    {
+      codepage = get_oom_int (m_mailitem, "InternetCodepage");
+    }
+  char *converted = ansi_charset_to_utf8 (early.charset.c_str (),
+                                          body.c_str (), body.size (),
+                                          codepage);
+  char *buf;
+  gpgrt_asprintf (&buf, TEXT_PREVIEW_PLACEHOLDER,
+                  isSMIME_m () ? "S/MIME" : "OpenPGP",
+                  _("message"),
+                  _("Please wait while the attachments are being decrypted..."),
+                  converted ? converted : "");
+  memdbg_alloc (buf);
+  xfree (converted);
+  put_oom_int (m_mailitem, "BodyFormat", 1);
+  if (put_oom_string (m_mailitem, "Body", buf))
+    {
+      log_error ("%s:%s: Failed to modify body of item.",
+                 SRCNAME, __func__);
+    }
+  xfree (buf);
+  TRETURN;
+}
+
 void
 Mail::updateHeaders_o ()
 {
@@ -2003,8 +2124,7 @@ Mail::parsingDone_o (bool is_preview)
     {
       log_debug ("%s:%s: Delayed invalidate to update sigstate.",
                  SRCNAME, __func__);
-      CloseHandle(CreateThread (NULL, 0, delayed_invalidate_ui, (LPVOID) 300, 0,
-                                NULL));
+      delayed_invalidate_ui (300);
     }
   TRACEPOINT;
   TRETURN;
@@ -2146,7 +2266,7 @@ Mail::wipe_o (bool force)
 }
 
 int
-Mail::updateOOMData_o (bool for_encryption)
+Mail::updateOOMData_o (bool for_encryption, bool refresh_recipients)
 {
   TSTART;
   char *buf = nullptr;
@@ -2172,7 +2292,7 @@ Mail::updateOOMData_o (bool for_encryption)
 
       if (!m_recipients_set)
         {
-          m_cached_recipients = getRecipients_o ();
+          m_cached_recipients = getRecipients_o (refresh_recipients);
         }
       else
         {
@@ -2562,7 +2682,7 @@ Mail::getBody_o () const
 }
 
 std::vector<Recipient>
-Mail::getRecipients_o () const
+Mail::getRecipients_o (bool refresh) const
 {
   TSTART;
   LPDISPATCH recipients = get_oom_object (m_mailitem, "Recipients");
@@ -2572,7 +2692,7 @@ Mail::getRecipients_o () const
       std::vector<std::string>();
     }
   bool err = false;
-  auto ret = get_oom_recipients (recipients, &err);
+  auto ret = get_oom_recipients (recipients, &err, refresh);
   gpgol_release (recipients);
 
   if (err)
@@ -4777,8 +4897,7 @@ Mail::decryptPermanently_o()
 
   log_debug ("%s:%s: Delayed invalidate to update sigstate after perm dec.",
              SRCNAME, __func__);
-  CloseHandle(CreateThread (NULL, 0, delayed_invalidate_ui, (LPVOID) 300, 0,
-                            NULL));
+  delayed_invalidate_ui (300);
   TRETURN;
 }
 
@@ -4834,8 +4953,10 @@ Mail::prepareCrypto_o ()
     }
 
   // First contact with a mail to encrypt update
-  // state and oom data.
-  updateOOMData_o (true);
+  // state and oom data.  The mail is encrypted to the recipients
+  // resolved now.  Resolve them from the address book and not from
+  // the cache so that e.g. a changed distribution list is seen.
+  updateOOMData_o (true, true);
 
   setCryptState (Mail::NeedsFirstAfterWrite);
 
@@ -4935,6 +5056,7 @@ Mail::splitCopyMailCallback (Mail *copied_mail)
   log_dbg ("Copy mail callback reached with mail %p", copied_mail);
   g_mail_copy_triggerer = nullptr;
   copied_mail->setSplitCopy (true);
+  copied_mail->setSplitBatch (m_split_batch);
 
   std::vector<Recipient> newRecipientsForCopy;
   std::vector<Recipient> newRecipientsForUs;
@@ -5082,6 +5204,18 @@ Mail::isSplitCopy () const
   return m_is_split_copy;
 }
 
+std::string
+Mail::splitBatch () const
+{
+  return m_split_batch;
+}
+
+void
+Mail::setSplitBatch (const std::string &batch)
+{
+  m_split_batch = batch;
+}
+
 int
 Mail::buildProtectedHeaders_o ()
 {
@@ -28,6 +28,7 @@
 #include "gpgme++/decryptionresult.h"
 #include "gpgme++/key.h"
 
+#include <cstdint>
 #include <string>
 
 class ParseController;
@@ -164,6 +165,19 @@ public:
   */
   static bool isValidPtr (const Mail *mail);
 
+  /** A handle that can be kept in other threads or delayed
+    callbacks instead of the pointer.  Unlike a pointer it can not
+    be confused with a new mail that was created at the address
+    of a deleted one. */
+  typedef uint64_t handle_t;
+  handle_t handle () const { return m_handle; }
+
+  /** @brief The mail for a handle.
+
+    @returns the mail or NULL if it was destroyed.  Take lockDelete
+    while using the mail from a different thread. */
+  static Mail *getMailForHandle (handle_t handle);
+
   /** @brief wipe the plaintext from all known Mail objects.
     *
     * This is intended as a "cleanup" call to be done on unload
@@ -292,8 +306,12 @@ public:
    *
    * It also updated the is_html_alternative value.
    *
+   * If refresh_recipients is true the recipients are resolved from
+   * the address book and not from the AddressCache.
+   *
    * @returns 0 on success */
-  int updateOOMData_o (bool for_encryption = false);
+  int updateOOMData_o (bool for_encryption = false,
+                       bool refresh_recipients = false);
 
   /** @brief get sender SMTP address (UTF-8 encoded).
    *
@@ -362,6 +380,11 @@ public:
   */
   void parsingDone_o (bool is_preview = false);
 
+  /** Show the text body of the decrypted content while the
+    attachments are still being decrypted.  Called from the
+    windowmessages handler like parsingDone_o. */
+  void showEarlyBody_o ();
+
   /** Returns true if the mail was verified and has at least one
     signature. Regardless of the validity of the mail */
   bool isSigned () const;
@@ -439,8 +462,9 @@ public:
    keys will not be resolved again. */
   void setRecipients (const std::vector<Recipient> &recps);
 
-  /** Get the recipients. */
-  std::vector<Recipient> getRecipients_o () const;
+  /** Get the recipients.  If refresh is true cached addresses of
+    address book entries are not used. */
+  std::vector<Recipient> getRecipients_o (bool refresh = false) const;
 
   /** Returns 1 if the mail was encrypted, 2 if signed, 3 if both.
       Only valid after decrypt_verify.
@@ -688,6 +712,11 @@ public:
   /* Setter for isSplitCopy */
   void setSplitCopy (bool val);
 
+  /* The batch of precomputed crypto results of a split.
+     Shared by the original mail and all its split copies. */
+  std::string splitBatch () const;
+  void setSplitBatch (const std::string &batch);
+
   /* Set protected headers data */
   void setProtectedHeaders (const std::string &hdrs);
   std::string protectedHeaders () const;
@@ -769,10 +798,12 @@ private:
   std::vector<GpgME::Key> m_resolved_signing_keys; /* Prepared / resolved keys for signing. */
   bool m_recipients_set; /* Recipients were explictly set. */
   bool m_is_split_copy; /* Is the a copy mail that was part of a split. */
+  std::string m_split_batch; /* Batch id in the SplitCryptCache. */
   std::string m_protected_headers;
   header_info_s m_header_info; /* Information about the original headers */
   bool m_attachs_added; /* State variable to track if we have added attachments to this mail. */
   std::string m_dec_content_type; /* Top level content type of the decrypted mail. */
+  handle_t m_handle; /* Our handle in the table of live mails. */
 };
 
 /* A state variable to capture which mail triggered a copy to
@@ -255,8 +255,7 @@ EVENT_SINK_INVOKE(MailItemEvents)
               log_debug ("%s:%s: Non crypto mail %p opened. Updating sigstatus.",
                          SRCNAME, __func__, m_mail);
               /* Ensure that no wrong sigstatus is shown */
-              CloseHandle(CreateThread (NULL, 0, delayed_invalidate_ui, (LPVOID) 300, 0,
-                                        NULL));
+              delayed_invalidate_ui (300);
               TBREAK;
             }
           if (m_mail->setUUID_o ())
@@ -171,6 +171,17 @@ get_conf_bool (const char *name, int defaultVal)
   return ret;
 }
 
+static int
+get_conf_int (const char *name, int defaultVal)
+{
+  char *val = NULL;
+  int ret;
+  load_extension_value (name, &val);
+  ret = val == NULL ? defaultVal : atoi (val);
+  xfree (val);
+  return ret;
+}
+
 static int
 dbg_compat (int oldval)
 {
@@ -265,6 +276,10 @@ read_options (void)
             opt.enable_debug |= DBG_OOM;
           else if (!strcmp (p, "oom-extra"))
             opt.enable_debug |= DBG_OOM;
+          else if (!strcmp (p, "spans"))
+            opt.enable_debug |= DBG_SPANS;
+          else if (!strcmp (p, "metrics"))
+            opt.enable_debug |= DBG_METRICS;
           else
             log_debug ("invalid debug flag `%s' ignored", p);
         }
@@ -280,11 +295,13 @@ read_options (void)
      as the option for debuging was not read before. */
   free (val); val = NULL;
   if (opt.enable_debug)
-    log_debug ("enabled debug flags:%s%s%s%s\n",
+    log_debug ("enabled debug flags:%s%s%s%s%s%s\n",
                (opt.enable_debug & DBG_MEMORY)? " memory":"",
                (opt.enable_debug & DBG_DATA)? " data":"",
                (opt.enable_debug & DBG_OOM)? " oom":"",
-               (opt.enable_debug & DBG_TRACE)? " trace":""
+               (opt.enable_debug & DBG_TRACE)? " trace":"",
+               (opt.enable_debug & DBG_SPANS)? " spans":"",
+               (opt.enable_debug & DBG_METRICS)? " metrics":""
                );
 
   opt.enable_smime = get_conf_bool ("enableSmime", 0);
@@ -306,6 +323,8 @@ read_options (void)
   opt.splitBCCMails = get_conf_bool ("splitBCCMails", 0);
   opt.combinedOpsEnabled = get_conf_bool ("combinedOpsEnabled", 0);
   opt.encryptSubject = get_conf_bool ("encryptSubject", 0);
+  /* Off until a resolver with --server is shipped.  */
+  opt.resolver_service = get_conf_bool ("resolverService", 0);
 
   if (!opt.automation)
     {
@@ -343,6 +362,11 @@ read_options (void)
      unencrypted mails in the recently deleted folder on the
      server we block it. */
   opt.sync_dec = get_conf_bool ("syncDec", 0);
+
+  opt.max_mime_depth = get_conf_int ("maxMimeDepth", 0);
+  opt.max_mime_parts = get_conf_int ("maxMimeParts", 0);
+  opt.max_mime_attachments = get_conf_int ("maxMimeAttachments", 0);
+  opt.max_mime_header_lines = get_conf_int ("maxMimeHeaderLines", 0);
 }
 
 
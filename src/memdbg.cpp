@@ -27,13 +27,19 @@
 
 #include <gpg-error.h>
 
-#include <unordered_map>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <mutex>
 #include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
-std::unordered_map <std::string, int> cppObjs;
+/* Outlook objects are only tracked with DBG_MEMORY.  */
 std::unordered_map <void *, int> olObjs;
 std::unordered_map <void *, std::string> olNames;
-std::unordered_map <void *, std::string> allocs;
 
 GPGRT_LOCK_DEFINE (memdbg_log);
 
@@ -43,6 +49,77 @@ GPGRT_LOCK_DEFINE (memdbg_log);
 # include "oomhelp.h"
 #endif
 
+/* Raise peak to value if it is higher.  */
+static void
+update_peak (std::atomic<long long> &peak, long long value)
+{
+  long long cur = peak.load (std::memory_order_relaxed);
+  while (value > cur &&
+         !peak.compare_exchange_weak (cur, value, std::memory_order_relaxed))
+    ;
+}
+
+struct memdbg_type_s
+{
+  memdbg_type_s (const char *n) : name (n), live (0), peak (0), total (0) {}
+  std::string name;
+  std::atomic<long long> live;
+  std::atomic<long long> peak;
+  std::atomic<long long> total;
+};
+
+struct memdbg_site_s
+{
+  memdbg_site_s (const char *s, const char *f, int l) :
+    srcname (s), func (f), line (l), live (0), total (0) {}
+  std::string srcname;
+  std::string func;
+  int line;
+  std::atomic<long long> live;
+  std::atomic<long long> total;
+};
+
+/* The registries only grow.  Records are never freed so the
+   cached pointers stay valid.  */
+static std::mutex registry_mutex;
+static std::vector<memdbg_type_s *> types;
+/* Keyed by the addresses of the file and function names which
+   are constant for a call site.  */
+typedef std::tuple<const void *, const void *, int> site_key_t;
+static std::map<site_key_t, memdbg_site_s *> sites;
+
+/* The live allocations spread over some locks so that threads
+   allocating at the same time rarely wait for each other.  */
+#define ALLOC_SHARDS 16
+struct alloc_shard_s
+{
+  std::mutex mutex;
+  std::unordered_map<void *, memdbg_site_s *> ptrs;
+};
+static alloc_shard_s alloc_shards[ALLOC_SHARDS];
+
+static alloc_shard_s &
+shard_for (void *ptr)
+{
+  /* Heap pointers are aligned so the low bits carry no
+     information.  */
+  return alloc_shards[((uintptr_t) ptr >> 4) % ALLOC_SHARDS];
+}
+
+struct subsys_s
+{
+  subsys_s () : live (0), peak (0) {}
+  std::atomic<long long> live;
+  std::atomic<long long> peak;
+};
+static subsys_s subsystems[MEMDBG_NSUBSYS];
+static const char *subsys_names[MEMDBG_NSUBSYS] =
+  {
+    "parser",
+    "keycache",
+    "mimemaker"
+  };
+
 /* Returns true on a name change */
 static bool
 register_name (void *obj, const char *nameSuggestion)
@@ -159,67 +236,63 @@ memdbg_released (void *obj)
   gpgrt_lock_unlock (&memdbg_log);
 }
 
-void
-memdbg_ctor (const char *objName)
+memdbg_type_s *
+_memdbg_type (const char *objName)
 {
-  DBGGUARD;
-
   if (!objName)
     {
-      TRACEPOINT;
-      return;
+      objName = "unknown";
     }
-
-  gpgrt_lock_lock (&memdbg_log);
-
-  const std::string nameStr (objName);
-
-  auto it = cppObjs.find (nameStr);
-
-  if (it == cppObjs.end())
+  std::lock_guard<std::mutex> lock (registry_mutex);
+  for (const auto type: types)
     {
-      it = cppObjs.insert (std::make_pair (nameStr, 0)).first;
+      if (type->name == objName)
+        {
+          return type;
+        }
     }
-  it->second++;
-
-  gpgrt_lock_unlock (&memdbg_log);
+  types.push_back (new memdbg_type_s (objName));
+  return types.back ();
 }
 
 void
-memdbg_dtor (const char *objName)
+_memdbg_ctor (memdbg_type_s *type)
 {
-  DBGGUARD;
+  const long long live = type->live.fetch_add (1,
+                                               std::memory_order_relaxed) + 1;
+  type->total.fetch_add (1, std::memory_order_relaxed);
+  update_peak (type->peak, live);
+}
 
-  if (!objName)
+void
+_memdbg_dtor (memdbg_type_s *type)
+{
+  if (type->live.fetch_sub (1, std::memory_order_relaxed) <= 0)
     {
-      TRACEPOINT;
-      return;
+      log_error ("%s:%s Dtor of %s more often then ctor",
+                 SRCNAME, __func__, type->name.c_str ());
     }
+}
 
-  const std::string nameStr (objName);
-  auto it = cppObjs.find (nameStr);
-
-  if (it == cppObjs.end())
+memdbg_site_s *
+_memdbg_site (const char *srcname, const char *func, int line)
+{
+  if (!srcname || !func)
     {
-      log_error ("%s:%s Dtor of %s before ctor",
-                 SRCNAME, __func__, nameStr.c_str());
-      gpgrt_lock_unlock (&memdbg_log);
-      return;
+      srcname = func = "unknown";
     }
-
-  it->second--;
-
-  if (it->second < 0)
+  const site_key_t key (srcname, func, line);
+  std::lock_guard<std::mutex> lock (registry_mutex);
+  auto &site = sites[key];
+  if (!site)
     {
-      log_error ("%s:%s Dtor of %s more often then ctor",
-                 SRCNAME, __func__, nameStr.c_str());
+      site = new memdbg_site_s (srcname, func, line);
     }
-  gpgrt_lock_unlock (&memdbg_log);
+  return site;
 }
 
-
 void
-_memdbg_alloc (void *ptr, const char *srcname, const char *func, int line)
+_memdbg_alloc (void *ptr, memdbg_site_s *site)
 {
   DBGGUARD;
 
@@ -229,23 +302,17 @@ _memdbg_alloc (void *ptr, const char *srcname, const char *func, int line)
       return;
     }
 
-  gpgrt_lock_lock (&memdbg_log);
-
-  const std::string identifier = std::string (srcname) + std::string (":") +
-                                  std::string (func) + std::string (":") +
-                                  std::to_string (line);
-
-  auto it = allocs.find (ptr);
-
-  if (it != allocs.end())
-    {
-      TRACEPOINT;
-      gpgrt_lock_unlock (&memdbg_log);
-      return;
-    }
-  allocs.insert (std::make_pair (ptr, identifier));
-
-  gpgrt_lock_unlock (&memdbg_log);
+  auto &shard = shard_for (ptr);
+  {
+    std::lock_guard<std::mutex> lock (shard.mutex);
+    if (!shard.ptrs.insert (std::make_pair (ptr, site)).second)
+      {
+        TRACEPOINT;
+        return;
+      }
+  }
+  site->live.fetch_add (1, std::memory_order_relaxed);
+  site->total.fetch_add (1, std::memory_order_relaxed);
 }
 
 
@@ -260,38 +327,97 @@ memdbg_free (void *ptr)
       return false;
     }
 
-  gpgrt_lock_lock (&memdbg_log);
-
-  auto it = allocs.find (ptr);
+  memdbg_site_s *site;
+  auto &shard = shard_for (ptr);
+  {
+    std::lock_guard<std::mutex> lock (shard.mutex);
+    auto it = shard.ptrs.find (ptr);
+    if (it == shard.ptrs.end ())
+      {
+        log_error ("%s:%s Free unregistered: %p",
+                   SRCNAME, __func__, ptr);
+        return false;
+      }
+    site = it->second;
+    shard.ptrs.erase (it);
+  }
+  site->live.fetch_sub (1, std::memory_order_relaxed);
+  return true;
+}
 
-  if (it == allocs.end())
+void
+memdbg_account (int subsys, long long delta)
+{
+  if (subsys < 0 || subsys >= MEMDBG_NSUBSYS)
     {
-      log_error ("%s:%s Free unregistered: %p",
-                 SRCNAME, __func__, ptr);
-      gpgrt_lock_unlock (&memdbg_log);
-      return false;
+      TRACEPOINT;
+      return;
     }
+  auto &sub = subsystems[subsys];
+  const long long live = sub.live.fetch_add (delta,
+                                             std::memory_order_relaxed) + delta;
+  update_peak (sub.peak, live);
+}
 
-  allocs.erase (it);
-
-  gpgrt_lock_unlock (&memdbg_log);
-  return true;
+long long
+memdbg_live_bytes (int subsys, long long *r_peak)
+{
+  if (subsys < 0 || subsys >= MEMDBG_NSUBSYS)
+    {
+      TRACEPOINT;
+      return 0;
+    }
+  if (r_peak)
+    {
+      *r_peak = subsystems[subsys].peak.load (std::memory_order_relaxed);
+    }
+  return subsystems[subsys].live.load (std::memory_order_relaxed);
 }
 
+/* We use std::to_string as msvcrt does not know %lld.  */
 void
 memdbg_dump ()
 {
   DBGGUARD;
-  gpgrt_lock_lock (&memdbg_log);
   log_memory (""
 "------------------------------MEMORY DUMP----------------------------------");
 
-  log_memory("-- C++ Objects --");
-  for (const auto &pair: cppObjs)
+  std::vector<memdbg_type_s *> dump_types;
+  std::vector<std::pair<long long, memdbg_site_s *> > dump_sites;
+  {
+    std::lock_guard<std::mutex> lock (registry_mutex);
+    dump_types = types;
+    for (const auto &pair: sites)
+      {
+        const long long live = pair.second->live.load ();
+        if (live > 0)
+          {
+            dump_sites.push_back (std::make_pair (live, pair.second));
+          }
+      }
+  }
+
+  log_memory("-- C++ Objects (live / peak / total) --");
+  for (const auto type: dump_types)
     {
-      log_memory("%s\t: %i", pair.first.c_str(), pair.second);
+      log_memory("%s\t: %s / %s / %s", type->name.c_str (),
+                 std::to_string (type->live.load ()).c_str (),
+                 std::to_string (type->peak.load ()).c_str (),
+                 std::to_string (type->total.load ()).c_str ());
     }
   log_memory("-- C++ End --");
+  log_memory("-- Subsystem bytes (live / peak) --");
+  for (int i = 0; i < MEMDBG_NSUBSYS; i++)
+    {
+      long long peak;
+      const long long live = memdbg_live_bytes (i, &peak);
+      log_memory("%s\t: %s / %s", subsys_names[i],
+                 std::to_string (live).c_str (),
+                 std::to_string (peak).c_str ());
+    }
+  log_memory("-- Subsystem End --");
+
+  gpgrt_lock_lock (&memdbg_log);
   log_memory("-- OL Objects --");
   for (const auto &pair: olObjs)
     {
@@ -311,14 +437,26 @@ memdbg_dump ()
         }
     }
   log_memory("-- OL End --");
-  log_memory("-- Allocated Addresses --");
-  for (const auto &pair: allocs)
+  gpgrt_lock_unlock (&memdbg_log);
+
+  /* Sites that still hold memory, the biggest first.  */
+  log_memory("-- Allocation sites (live / total) --");
+  std::sort (dump_sites.begin (), dump_sites.end (),
+             [] (const std::pair<long long, memdbg_site_s *> &a,
+                 const std::pair<long long, memdbg_site_s *> &b)
     {
-      log_memory ("%s: %p", pair.second.c_str(), pair.first);
+      return a.first > b.first;
+    });
+  for (const auto &pair: dump_sites)
+    {
+      const auto site = pair.second;
+      log_memory ("%s:%s:%i: %s / %s", site->srcname.c_str (),
+                  site->func.c_str (), site->line,
+                  std::to_string (pair.first).c_str (),
+                  std::to_string (site->total.load ()).c_str ());
     }
-  log_memory("-- Allocated Addresses End --");
+  log_memory("-- Allocation sites End --");
 
   log_memory(""
 "------------------------------MEMORY END ----------------------------------");
-  gpgrt_lock_unlock (&memdbg_log);
 }
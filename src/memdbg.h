@@ -42,14 +42,81 @@ extern "C" {
 void _memdbg_addRef (void *obj, const char *nameSuggestion);
 void memdbg_released (void *obj);
 
-void memdbg_ctor (const char *objName);
-void memdbg_dtor (const char *objName);
+/* Object and allocation counters are kept per type and per call
+   site.  The records are looked up once per call site and cached
+   in a static so that counting is a single atomic operation.  C
+   has no dynamic initialization of statics so there the static
+   is set on first use.  The lookup returns the same record for
+   the same arguments, so a race there is harmless.  */
+struct memdbg_type_s;
+struct memdbg_site_s;
 
-void _memdbg_alloc (void *ptr, const char *srcname, const char *func, int line);
+struct memdbg_type_s *_memdbg_type (const char *objName);
+void _memdbg_ctor (struct memdbg_type_s *type);
+void _memdbg_dtor (struct memdbg_type_s *type);
+
+struct memdbg_site_s *_memdbg_site (const char *srcname, const char *func,
+                                    int line);
+void _memdbg_alloc (void *ptr, struct memdbg_site_s *site);
+
+#ifdef __cplusplus
+#define memdbg_ctor(X) \
+{ \
+  static struct memdbg_type_s *memdbg_type_ = _memdbg_type (X); \
+  _memdbg_ctor (memdbg_type_); \
+}
+#define memdbg_dtor(X) \
+{ \
+  static struct memdbg_type_s *memdbg_type_ = _memdbg_type (X); \
+  _memdbg_dtor (memdbg_type_); \
+}
 #define memdbg_alloc(X) \
-    _memdbg_alloc ((void *)X, log_srcname (__FILE__), __func__, __LINE__);
+{ \
+  static struct memdbg_site_s *memdbg_site_ = \
+    _memdbg_site (log_srcname (__FILE__), __func__, __LINE__); \
+  _memdbg_alloc ((void *)X, memdbg_site_); \
+}
+#else
+#define memdbg_ctor(X) \
+{ \
+  static struct memdbg_type_s *memdbg_type_ = NULL; \
+  if (!memdbg_type_) \
+    memdbg_type_ = _memdbg_type (X); \
+  _memdbg_ctor (memdbg_type_); \
+}
+#define memdbg_dtor(X) \
+{ \
+  static struct memdbg_type_s *memdbg_type_ = NULL; \
+  if (!memdbg_type_) \
+    memdbg_type_ = _memdbg_type (X); \
+  _memdbg_dtor (memdbg_type_); \
+}
+#define memdbg_alloc(X) \
+{ \
+  static struct memdbg_site_s *memdbg_site_ = NULL; \
+  if (!memdbg_site_) \
+    memdbg_site_ = _memdbg_site (log_srcname (__FILE__), __func__, \
+                                 __LINE__); \
+  _memdbg_alloc ((void *)X, memdbg_site_); \
+}
+#endif
 int memdbg_free (void *ptr);
 
+/* Subsystems for which the live and peak bytes are accounted.  */
+enum memdbg_subsys_e
+  {
+    MEMDBG_PARSER = 0,  /* Parsed mails and their attachments.  */
+    MEMDBG_KEYCACHE,    /* The maps of the key cache.  */
+    MEMDBG_MIMEMAKER,   /* MIME structures built for encryption.  */
+    MEMDBG_NSUBSYS
+  };
+
+/* Add delta bytes to subsys.  This is always enabled.  */
+void memdbg_account (int subsys, long long delta);
+/* The bytes held by subsys.  If r_peak is not NULL it is set
+   to the highest value seen.  */
+long long memdbg_live_bytes (int subsys, long long *r_peak);
+
 void memdbg_dump(void);
 
 #ifdef __cplusplus
@@ -0,0 +1,279 @@
+/* metrics.cpp - Runtime counters, gauges and latency histograms
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+
+#include "metrics.h"
+#include "cpphelp.h"
+
+#include <stdio.h>
+
+void
+Metrics::Gauge::update_peak (int64_t value)
+{
+  int64_t peak = m_peak.load (std::memory_order_relaxed);
+  while (value > peak &&
+         !m_peak.compare_exchange_weak (peak, value,
+                                        std::memory_order_relaxed))
+    ;
+}
+
+void
+Metrics::Gauge::set (int64_t value)
+{
+  m_value.store (value, std::memory_order_relaxed);
+  update_peak (value);
+}
+
+void
+Metrics::Gauge::add (int64_t delta)
+{
+  update_peak (m_value.fetch_add (delta, std::memory_order_relaxed) + delta);
+}
+
+Metrics::Histogram::Histogram ()
+{
+  reset ();
+}
+
+void
+Metrics::Histogram::reset ()
+{
+  for (int i = 0; i < NBUCKETS; i++)
+    {
+      m_buckets[i].store (0, std::memory_order_relaxed);
+    }
+  m_count.store (0, std::memory_order_relaxed);
+  m_sum.store (0, std::memory_order_relaxed);
+  m_min.store (UINT64_MAX, std::memory_order_relaxed);
+  m_max.store (0, std::memory_order_relaxed);
+}
+
+void
+Metrics::Histogram::record (uint64_t value)
+{
+  int bucket = 0;
+  for (uint64_t v = value; v && bucket < NBUCKETS - 1; v >>= 1)
+    {
+      bucket++;
+    }
+  m_buckets[bucket].fetch_add (1, std::memory_order_relaxed);
+  m_count.fetch_add (1, std::memory_order_relaxed);
+  m_sum.fetch_add (value, std::memory_order_relaxed);
+
+  uint64_t cur = m_min.load (std::memory_order_relaxed);
+  while (value < cur &&
+         !m_min.compare_exchange_weak (cur, value, std::memory_order_relaxed))
+    ;
+  cur = m_max.load (std::memory_order_relaxed);
+  while (value > cur &&
+         !m_max.compare_exchange_weak (cur, value, std::memory_order_relaxed))
+    ;
+}
+
+uint64_t
+Metrics::Histogram::count () const
+{
+  return m_count.load (std::memory_order_relaxed);
+}
+
+uint64_t
+Metrics::Histogram::sum () const
+{
+  return m_sum.load (std::memory_order_relaxed);
+}
+
+uint64_t
+Metrics::Histogram::min () const
+{
+  const uint64_t ret = m_min.load (std::memory_order_relaxed);
+  return ret == UINT64_MAX ? 0 : ret;
+}
+
+uint64_t
+Metrics::Histogram::max () const
+{
+  return m_max.load (std::memory_order_relaxed);
+}
+
+uint64_t
+Metrics::Histogram::percentile (double p) const
+{
+  uint64_t counts[NBUCKETS];
+  uint64_t total = 0;
+  for (int i = 0; i < NBUCKETS; i++)
+    {
+      counts[i] = m_buckets[i].load (std::memory_order_relaxed);
+      total += counts[i];
+    }
+  if (!total)
+    {
+      return 0;
+    }
+  /* The rank of the wanted value, at least the first one.  */
+  uint64_t rank = (uint64_t) (p / 100.0 * total + 0.5);
+  if (!rank)
+    {
+      rank = 1;
+    }
+  uint64_t seen = 0;
+  for (int i = 0; i < NBUCKETS; i++)
+    {
+      seen += counts[i];
+      if (seen >= rank)
+        {
+          const uint64_t upper = i ? ((uint64_t) 1 << i) - 1 : 0;
+          /* The bucket bound might be above anything recorded.  */
+          return upper < max () ? upper : max ();
+        }
+    }
+  return max ();
+}
+
+Metrics *
+Metrics::instance ()
+{
+  static Metrics *s_metrics = new Metrics;
+  return s_metrics;
+}
+
+Metrics::Counter *
+Metrics::counter (const std::string &name)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  auto &ret = m_counters[name];
+  if (!ret)
+    {
+      ret.reset (new Counter);
+    }
+  return ret.get ();
+}
+
+Metrics::Gauge *
+Metrics::gauge (const std::string &name)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  auto &ret = m_gauges[name];
+  if (!ret)
+    {
+      ret.reset (new Gauge);
+    }
+  return ret.get ();
+}
+
+Metrics::Histogram *
+Metrics::histogram (const std::string &name)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  auto &ret = m_histograms[name];
+  if (!ret)
+    {
+      ret.reset (new Histogram);
+    }
+  return ret.get ();
+}
+
+/* We use std::to_string as msvcrt does not know %llu.  */
+std::string
+Metrics::dump ()
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  std::string ret;
+  for (const auto &pair: m_counters)
+    {
+      ret += "counter " + pair.first + " " +
+             std::to_string (pair.second->value ()) + "\n";
+    }
+  for (const auto &pair: m_gauges)
+    {
+      ret += "gauge " + pair.first + " " +
+             std::to_string (pair.second->value ()) + " peak=" +
+             std::to_string (pair.second->peak ()) + "\n";
+    }
+  for (const auto &pair: m_histograms)
+    {
+      const auto &hist = *pair.second;
+      ret += "histogram " + pair.first +
+             " count=" + std::to_string (hist.count ()) +
+             " sum=" + std::to_string (hist.sum ()) +
+             " min=" + std::to_string (hist.min ()) +
+             " max=" + std::to_string (hist.max ()) +
+             " p50=" + std::to_string (hist.percentile (50)) +
+             " p90=" + std::to_string (hist.percentile (90)) +
+             " p99=" + std::to_string (hist.percentile (99)) + "\n";
+    }
+  return ret;
+}
+
+void
+Metrics::dump_to_log ()
+{
+  const auto lines = gpgol_split (dump (), '\n');
+  log_debug ("%s:%s: " SIZE_T_FORMAT " metrics:",
+             SRCNAME, __func__, lines.size ());
+  for (const auto &line: lines)
+    {
+      if (!line.empty ())
+        {
+          log_debug ("%s:%s: %s", SRCNAME, __func__, line.c_str ());
+        }
+    }
+}
+
+bool
+Metrics::dump_to_file (const char *filename)
+{
+  FILE *fp = fopen (filename, "wb");
+  if (!fp)
+    {
+      log_error ("%s:%s: Failed to open '%s'", SRCNAME, __func__, filename);
+      return false;
+    }
+  const auto content = dump ();
+  bool ret = fwrite (content.c_str (), 1, content.size (), fp) ==
+             content.size ();
+  if (fclose (fp))
+    {
+      ret = false;
+    }
+  if (!ret)
+    {
+      log_error ("%s:%s: Failed to write '%s'", SRCNAME, __func__, filename);
+    }
+  return ret;
+}
+
+void
+Metrics::reset ()
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  for (const auto &pair: m_counters)
+    {
+      pair.second->m_value.store (0, std::memory_order_relaxed);
+    }
+  for (const auto &pair: m_gauges)
+    {
+      pair.second->m_peak.store (pair.second->value (),
+                                 std::memory_order_relaxed);
+    }
+  for (const auto &pair: m_histograms)
+    {
+      pair.second->reset ();
+    }
+}
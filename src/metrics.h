@@ -0,0 +1,171 @@
+/* metrics.h - Runtime counters, gauges and latency histograms
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "config.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/** A registry of named metrics.
+
+  Metrics are always collected as updating them only costs an
+  atomic operation.  Looking a metric up by name takes a lock so
+  callers should keep the returned pointer, usually in a function
+  local static:
+
+    static auto s_parses = Metrics::instance ()->counter ("parse.count");
+    s_parses->add ();
+
+  The returned pointers stay valid for the lifetime of the
+  registry.  Latencies are recorded in microseconds. */
+class Metrics
+{
+public:
+  /** A monotonic count of events. */
+  class Counter
+  {
+  public:
+    Counter () : m_value (0) {}
+    void add (uint64_t n = 1)
+    {
+      m_value.fetch_add (n, std::memory_order_relaxed);
+    }
+    uint64_t value () const
+    {
+      return m_value.load (std::memory_order_relaxed);
+    }
+  private:
+    friend class Metrics;
+    std::atomic<uint64_t> m_value;
+  };
+
+  /** A value that goes up and down.  The highest value
+    seen is kept as the peak. */
+  class Gauge
+  {
+  public:
+    Gauge () : m_value (0), m_peak (0) {}
+    void set (int64_t value);
+    void add (int64_t delta);
+    int64_t value () const
+    {
+      return m_value.load (std::memory_order_relaxed);
+    }
+    int64_t peak () const
+    {
+      return m_peak.load (std::memory_order_relaxed);
+    }
+  private:
+    friend class Metrics;
+    void update_peak (int64_t value);
+    std::atomic<int64_t> m_value;
+    std::atomic<int64_t> m_peak;
+  };
+
+  /** A distribution of values in power of two buckets.  Bucket
+    n counts the values with a bit length of n so percentiles are
+    only accurate up to a factor of two. */
+  class Histogram
+  {
+  public:
+    enum { NBUCKETS = 32 };
+    Histogram ();
+    void record (uint64_t value);
+    uint64_t count () const;
+    uint64_t sum () const;
+    uint64_t min () const;
+    uint64_t max () const;
+    /** Upper bound of the bucket that contains the
+      percentile p (0 to 100). */
+    uint64_t percentile (double p) const;
+  private:
+    friend class Metrics;
+    void reset ();
+    std::atomic<uint64_t> m_buckets[NBUCKETS];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_min;
+    std::atomic<uint64_t> m_max;
+  };
+
+  static Metrics *instance ();
+
+  /** Get or create the metric with name. */
+  Counter *counter (const std::string &name);
+  Gauge *gauge (const std::string &name);
+  Histogram *histogram (const std::string &name);
+
+  /** All metrics as text, one line per metric sorted by name. */
+  std::string dump ();
+  /** Write the dump to the log. */
+  void dump_to_log ();
+  /** Write the dump to filename.  Returns false on error. */
+  bool dump_to_file (const char *filename);
+  /** Set counters and histograms back to zero.  Gauges describe
+    the current state so they keep their value and only the peak
+    is reset to it. The metrics stay registered. */
+  void reset ();
+
+private:
+  std::mutex m_mutex;
+  std::map<std::string, std::unique_ptr<Counter> > m_counters;
+  std::map<std::string, std::unique_ptr<Gauge> > m_gauges;
+  std::map<std::string, std::unique_ptr<Histogram> > m_histograms;
+};
+
+/** Records the time from construction to destruction
+  in microseconds to a histogram.  hist may be null. */
+class MetricsTimer
+{
+public:
+  explicit MetricsTimer (Metrics::Histogram *hist) :
+    m_hist (hist),
+    m_start (std::chrono::steady_clock::now ())
+  {
+  }
+  ~MetricsTimer ()
+  {
+    stop ();
+  }
+  /** Record now instead of on destruction. */
+  void stop ()
+  {
+    if (!m_hist)
+      return;
+    const auto elapsed = std::chrono::steady_clock::now () - m_start;
+    m_hist->record ((uint64_t)
+      std::chrono::duration_cast<std::chrono::microseconds> (elapsed).count ());
+    m_hist = nullptr;
+  }
+private:
+  MetricsTimer (const MetricsTimer &);
+  MetricsTimer &operator= (const MetricsTimer &);
+
+  Metrics::Histogram *m_hist;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+#endif // METRICS_H
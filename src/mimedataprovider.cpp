@@ -23,12 +23,15 @@
 #include <string.h>
 #include <vector>
 #include <sstream>
+#include <algorithm>
 
 #include "mimedataprovider.h"
 #include "rfc822parse.h"
 #include "rfc2047parse.h"
 #include "attachment.h"
 #include "cpphelp.h"
+#include "sha256.h"
+#include "metrics.h"
 
 #ifndef HAVE_W32_SYSTEM
 #define stricmp strcasecmp
@@ -44,23 +47,17 @@
    our read. -1 */
 #define LINEBUFSIZE (BUFSIZE - 1)
 
+/* Default resource limits.  They are generous for real mails.  */
+#define MAX_MIME_DEPTH 32
+#define MAX_MIME_PARTS 2000
+#define MAX_MIME_ATTACHMENTS 1000
+#define MAX_MIME_HEADER_LINES 50000
+#define MAX_MIME_HEADER_BYTES (8 * 1024 * 1024)
+
 #include <gpgme++/error.h>
 
 /* To keep track of the MIME message structures we use a linked list
    with each item corresponding to one part. */
-struct mimestruct_item_s;
-typedef struct mimestruct_item_s *mimestruct_item_t;
-struct mimestruct_item_s
-{
-  mimestruct_item_t next;
-  unsigned int level;   /* Level in the hierarchy of that part.  0
-                           indicates the outer body.  */
-  char *filename;       /* Malloced filename or NULL.  */
-  char *cid;            /* Malloced content id or NULL. */
-  char *charset;        /* Malloced charset or NULL.  */
-  char content_type[1]; /* String with the content type. */
-};
-
 /* The context object we use to track information. */
 struct mime_context
 {
@@ -96,11 +93,16 @@ struct mime_context
   int in_protected_headers; /* Indicates if we are in a mime part that was
                                marked by a protected headers header. */
 
-  /* A linked list describing the structure of the mime message.  This
-     list gets build up while parsing the message.  */
-  mimestruct_item_t mimestruct;
-  mimestruct_item_t *mimestruct_tail;
-  mimestruct_item_t mimestruct_cur;
+  int in_header;          /* The last line went into a header. */
+  int nparts;             /* Number of parts for the limits. */
+  int header_lines;       /* Number of header lines of all parts. */
+  size_t header_bytes;    /* Size of the headers of all parts. */
+
+  int part_cur;           /* Index of the current part in the
+                             MimeTree or -1.  */
+  size_t next_line_offset; /* Input offset after the current line. */
+  size_t prev_line_end;   /* Input offset of the end of the previous
+                             line without its line break.  */
 
   int any_attachments_created;  /* True if we created a new atatchment.  */
 
@@ -111,6 +113,13 @@ struct mime_context
 };
 typedef struct mime_context *mime_context_t;
 
+/* Helper for the optional strings of a MimeTree part.  */
+static const char *
+nonnull (const char *s)
+{
+  return s ? s : "";
+}
+
 /* Print the message event EVENT. */
 static void
 debug_message_event (rfc822parse_event_t event)
@@ -171,6 +180,21 @@ is_cms_signed_data (const char *buffer, size_t length)
 }
 #endif
 
+/* Decode the filename parameter S.  RFC 2231 values are already
+   UTF-8 and 8 bit text is no RFC 2047 encoded word.  */
+static char *
+decode_filename (const char *s)
+{
+  for (const char *p = s; *p; p++)
+    {
+      if (*p & 0x80)
+        {
+          return xstrdup (s);
+        }
+    }
+  return rfc2047_parse (s);
+}
+
 /* Process the transition to body event.
 
    This means we have received the empty line indicating the body and
@@ -219,7 +243,7 @@ t2body (MimeDataProvider *provider, rfc822parse_t msg)
     {
       s = rfc822parse_query_parameter (field, "filename", 0);
       if (s)
-        filename = rfc2047_parse (s);
+        filename = decode_filename (s);
       s = rfc822parse_query_parameter (field, NULL, 1);
 
       if (s && strstr (s, "attachment"))
@@ -284,7 +308,7 @@ t2body (MimeDataProvider *provider, rfc822parse_t msg)
          was not found */
       s = rfc822parse_query_parameter (field, "name", 0);
       if (s)
-        filename = rfc2047_parse (s);
+        filename = decode_filename (s);
     }
 
   /* Parse a Content Id header */
@@ -299,19 +323,16 @@ t2body (MimeDataProvider *provider, rfc822parse_t msg)
     }
   /* Update our idea of the entire MIME structure.  */
   {
-    mimestruct_item_t ms;
-
-    ms = (mimestruct_item_t) xmalloc (sizeof *ms + strlen (ctmain) + 1 + strlen (ctsub));
-    ctx->mimestruct_cur = ms;
-    *ctx->mimestruct_tail = ms;
-    ctx->mimestruct_tail = &ms->next;
-    ms->next = NULL;
-    strcpy (stpcpy (stpcpy (ms->content_type, ctmain), "/"), ctsub);
-    ms->level = ctx->nesting_level;
-    ms->filename = filename;
-    ms->cid = cid;
+    const std::string type = std::string (ctmain) + "/" + ctsub;
+    ctx->part_cur = provider->mime_tree ().add_part (ctx->nesting_level,
+                                                     type.c_str (),
+                                                     filename, cid, charset,
+                                                     ctx->next_line_offset);
+    xfree (filename);
     filename = NULL;
-    ms->charset = charset;
+    xfree (cid);
+    cid = NULL;
+    xfree (charset);
     charset = NULL;
   }
 
@@ -419,7 +440,7 @@ t2body (MimeDataProvider *provider, rfc822parse_t msg)
                    " is_protected_headers=%d",
                    SRCNAME, __func__,
                    ctx->nesting_level, ctx->part_counter, is_text,
-                   ctx->mimestruct_cur->charset?ctx->mimestruct_cur->charset:"",
+                   nonnull (provider->mime_tree ().charset (ctx->part_cur)),
                    ctx->body_seen, is_text_attachment, is_protected_headers);
 
   /* If this is a text part, decide whether we treat it as one
@@ -531,6 +552,10 @@ message_cb (void *opaque, rfc822parse_event_t event,
       ctx->any_boundary = 1;
       ctx->in_data = 0;
       ctx->collect_body = 0;
+      /* The boundary ends the parts on the level below the
+         multipart.  */
+      provider->mime_tree ().close_parts (ctx->nesting_level,
+                                          ctx->prev_line_end);
 
       if (ctx->start_hashing == 2 && ctx->hashing_level == ctx->nesting_level)
         {
@@ -553,14 +578,20 @@ message_cb (void *opaque, rfc822parse_event_t event,
 MimeDataProvider::MimeDataProvider(bool no_headers) :
   m_protected_headers_version(0),
   m_signature(nullptr),
+  m_crypto_size(0),
+  m_accounted(0),
   m_has_html_body(false),
-  m_collect_everything(no_headers)
+  m_collect_everything(no_headers),
+  m_limits(default_limits ()),
+  m_consumed(0),
+  m_body_done(false),
+  m_bulk(true)
 {
   TSTART;
   memdbg_ctor ("MimeDataProvider");
   m_mime_ctx = (mime_context_t) xcalloc (1, sizeof *m_mime_ctx);
   m_mime_ctx->msg = rfc822parse_open (message_cb, this);
-  m_mime_ctx->mimestruct_tail = &m_mime_ctx->mimestruct;
+  m_mime_ctx->part_cur = -1;
   TRETURN;
 }
 
@@ -583,6 +614,7 @@ MimeDataProvider::MimeDataProvider(LPSTREAM stream, bool no_headers):
   collect_data (stream);
   log_data ("%s:%s Data collected.", SRCNAME, __func__);
   gpgol_release (stream);
+  account_memory ();
   TRETURN;
 }
 #endif
@@ -594,6 +626,7 @@ MimeDataProvider::MimeDataProvider(FILE *stream, bool no_headers):
   log_data ("%s:%s Collecting data from file.", SRCNAME, __func__);
   collect_data (stream);
   log_data ("%s:%s Data collected.", SRCNAME, __func__);
+  account_memory ();
   TRETURN;
 }
 
@@ -601,16 +634,8 @@ MimeDataProvider::~MimeDataProvider()
 {
   TSTART;
   memdbg_dtor ("MimeDataProvider");
+  memdbg_account (MEMDBG_PARSER, -(long long) m_accounted);
   log_debug ("%s:%s", SRCNAME, __func__);
-  while (m_mime_ctx->mimestruct)
-    {
-      mimestruct_item_t tmp = m_mime_ctx->mimestruct->next;
-      xfree (m_mime_ctx->mimestruct->filename);
-      xfree (m_mime_ctx->mimestruct->charset);
-      xfree (m_mime_ctx->mimestruct->cid);
-      xfree (m_mime_ctx->mimestruct);
-      m_mime_ctx->mimestruct = tmp;
-    }
   rfc822parse_close (m_mime_ctx->msg);
   m_mime_ctx->current_attachment = NULL;
   xfree (m_mime_ctx);
@@ -668,23 +693,44 @@ MimeDataProvider::collect_input_lines(const char *input, size_t insize)
   size_t nleft = insize;
   size_t not_taken = nleft;
   size_t len = 0;
+  const char *line_start = s;
 
   /* Split the raw data into lines */
   for (; nleft; nleft--, s++)
     {
-      if (pos >= LINEBUFSIZE)
+      if (!pos)
         {
-          log_error ("%s:%s: rfc822 parser failed: line too long\n",
-                     SRCNAME, __func__);
-          GpgME::Error::setSystemError (GPG_ERR_EIO);
-          TRETURN not_taken;
+          if (m_unparsed)
+            {
+              /* A limit was reached.  Just keep the rest.  */
+              m_unparsed->write (s, nleft);
+              not_taken -= nleft;
+              break;
+            }
+          line_start = s;
+          /* At the start of a line try to skip to the next boundary. */
+          size_t taken = collect_bulk (s, nleft, m_consumed + (s - input),
+                                       linebuf);
+          if (taken)
+            {
+              not_taken -= taken;
+              nleft -= taken - 1;
+              s += taken - 1;
+              continue;
+            }
+        }
+      if (pos >= m_limits.max_line_length)
+        {
+          stop_parsing ("line length");
+          m_unparsed->write (line_start, nleft + pos);
+          not_taken = 0;
+          break;
         }
       if (*s != '\n')
         linebuf[pos++] = *s;
       else
         {
           /* Got a complete line.  Remove the last CR.  */
-          not_taken -= pos + 1; /* Pos starts at 0 so + 1 for it */
           if (pos && linebuf[pos-1] == '\r')
             {
               pos--;
@@ -692,6 +738,15 @@ MimeDataProvider::collect_input_lines(const char *input, size_t insize)
 
           log_data ("%s:%s: Parsing line=`%.*s'\n",
                          SRCNAME, __func__, (int)pos, linebuf);
+          if (check_limits (pos))
+            {
+              /* Keep this line and the rest.  */
+              m_unparsed->write (line_start, nleft + (s - line_start));
+              not_taken = 0;
+              break;
+            }
+          not_taken = nleft - 1;
+          m_mime_ctx->next_line_offset = m_consumed + (s - input) + 1;
           /* Check the next state */
           if (rfc822parse_insert (m_mime_ctx->msg,
                                   (unsigned char*) linebuf,
@@ -699,8 +754,10 @@ MimeDataProvider::collect_input_lines(const char *input, size_t insize)
             {
               log_error ("%s:%s: rfc822 parser failed: %s\n",
                          SRCNAME, __func__, strerror (errno));
+              m_consumed += insize - not_taken;
               TRETURN not_taken;
             }
+          m_mime_ctx->prev_line_end = m_consumed + (line_start - input) + pos;
 
           /* Check if the first line of the body is actually
              a PGP Inline message. If so treat it as crypto data. */
@@ -769,8 +826,8 @@ MimeDataProvider::collect_input_lines(const char *input, size_t insize)
                     }
                   if (m_body_charset.empty())
                     {
-                      m_body_charset = m_mime_ctx->mimestruct_cur->charset ?
-                                       m_mime_ctx->mimestruct_cur->charset : "";
+                      m_body_charset =
+                        nonnull (m_tree.charset (m_mime_ctx->part_cur));
                     }
                   m_mime_ctx->collect_body = 2;
                 }
@@ -786,17 +843,17 @@ MimeDataProvider::collect_input_lines(const char *input, size_t insize)
                     }
                   if (m_html_charset.empty())
                     {
-                      m_html_charset = m_mime_ctx->mimestruct_cur->charset ?
-                                       m_mime_ctx->mimestruct_cur->charset : "";
+                      m_html_charset =
+                        nonnull (m_tree.charset (m_mime_ctx->part_cur));
                     }
                   m_mime_ctx->collect_html_body = 2;
                 }
               else if (m_mime_ctx->current_attachment && len)
                 {
-                  m_mime_ctx->current_attachment->get_data().write(linebuf, len);
+                  m_mime_ctx->current_attachment->write(linebuf, len);
                   if (!m_mime_ctx->is_base64_encoded && !slbrk)
                     {
-                      m_mime_ctx->current_attachment->get_data().write("\r\n", 2);
+                      m_mime_ctx->current_attachment->write("\r\n", 2);
                     }
                 }
               else
@@ -853,9 +910,228 @@ MimeDataProvider::collect_input_lines(const char *input, size_t insize)
           pos = 0;
         }
     }
+  m_consumed += insize - not_taken;
   TRETURN not_taken;
 }
 
+mime_limits_s
+MimeDataProvider::default_limits ()
+{
+  mime_limits_s ret;
+
+  ret.max_depth = opt.max_mime_depth > 0 ? opt.max_mime_depth : MAX_MIME_DEPTH;
+  ret.max_parts = opt.max_mime_parts > 0 ? opt.max_mime_parts : MAX_MIME_PARTS;
+  ret.max_attachments = opt.max_mime_attachments > 0 ?
+                        opt.max_mime_attachments : MAX_MIME_ATTACHMENTS;
+  ret.max_header_lines = opt.max_mime_header_lines > 0 ?
+                         opt.max_mime_header_lines : MAX_MIME_HEADER_LINES;
+  ret.max_header_bytes = MAX_MIME_HEADER_BYTES;
+  ret.max_line_length = LINEBUFSIZE;
+  return ret;
+}
+
+void
+MimeDataProvider::set_limits (const mime_limits_s &limits)
+{
+  m_limits = limits;
+  /* Lines are collected in a fixed size buffer.  */
+  if (!m_limits.max_line_length || m_limits.max_line_length > LINEBUFSIZE)
+    {
+      m_limits.max_line_length = LINEBUFSIZE;
+    }
+}
+
+bool
+MimeDataProvider::check_limits (size_t linelen)
+{
+  const mime_context_t ctx = m_mime_ctx;
+
+  if (!rfc822parse_in_header (ctx->msg))
+    {
+      ctx->in_header = 0;
+      return false;
+    }
+
+  const char *reason = nullptr;
+  if (!ctx->in_header)
+    {
+      /* This is the first line of a new part. */
+      ctx->in_header = 1;
+      ctx->nparts++;
+      if (ctx->nparts > m_limits.max_parts)
+        reason = "parts";
+      else if (ctx->nesting_level > m_limits.max_depth)
+        reason = "nesting depth";
+      else if (m_attachments.size () >= (size_t) m_limits.max_attachments)
+        reason = "attachments";
+    }
+  ctx->header_lines++;
+  ctx->header_bytes += linelen;
+  if (!reason && ctx->header_lines > m_limits.max_header_lines)
+    reason = "header lines";
+  if (!reason && ctx->header_bytes > m_limits.max_header_bytes)
+    reason = "header size";
+  if (!reason)
+    return false;
+
+  stop_parsing (reason);
+  return true;
+}
+
+/* The structure of the rest is lost but the user can still look
+   at it.  The header lines that the parser already took for the
+   current part are put in front of it.  */
+void
+MimeDataProvider::stop_parsing (const char *reason)
+{
+  TSTART;
+  static auto s_limits = Metrics::instance ()->counter ("mime.limit_reached");
+  s_limits->add ();
+  log_error ("%s:%s: Limit of %s reached at part %i level %i. "
+             "Not parsing the rest of the mail.",
+             SRCNAME, __func__, reason, m_mime_ctx->nparts,
+             m_mime_ctx->nesting_level);
+
+  announce_progress ();
+  m_unparsed = std::shared_ptr<Attachment> (new Attachment ());
+  m_unparsed->set_attach_type (ATTACHTYPE_FROMMOSS);
+  m_unparsed->set_display_name ("unparsed-mime.txt");
+  m_unparsed->set_content_type ("text/plain");
+  m_attachments.push_back (m_unparsed);
+  m_mime_ctx->any_attachments_created = 1;
+  m_mime_ctx->current_attachment = nullptr;
+  m_mime_ctx->in_data = 0;
+  m_tree.close_parts (0, m_mime_ctx->prev_line_end);
+
+  if (rfc822parse_in_header (m_mime_ctx->msg))
+    {
+      void *ectx = nullptr;
+      const char *line;
+      while ((line = rfc822parse_enum_header_lines (m_mime_ctx->msg, &ectx)))
+        {
+          m_unparsed->write (line, strlen (line));
+          m_unparsed->write ("\r\n", 2);
+        }
+      rfc822parse_enum_header_lines (nullptr, &ectx);
+    }
+  TRETURN;
+}
+
+/* Most of the data in a large mail is the base64 encoded body of
+   an attachment or of the crypto data.  For these parts the rfc822
+   parser only looks for the next boundary and the collectors ignore
+   the line breaks.  So instead of splitting them into lines we search
+   for the next line that might start with "--<boundary>" and decode
+   everything up to it in large slices.  Returns 0 if the lines need
+   to be handled one by one.  OFFSET is the position of INPUT in
+   the whole input.  */
+size_t
+MimeDataProvider::collect_bulk (const char *input, size_t insize,
+                                size_t offset, char *linebuf)
+{
+  static auto s_bulk_bytes = Metrics::instance ()->counter ("mime.bulk_bytes");
+  const mime_context_t ctx = m_mime_ctx;
+  const char *boundary;
+  size_t blen;
+
+  if (!m_bulk || !ctx->in_data || !ctx->is_base64_encoded
+      || ctx->collect_body
+      || ctx->collect_html_body
+      || (ctx->collect_crypto_data && ctx->start_hashing))
+    {
+      return 0;
+    }
+
+  GpgME::Data *target;
+  if (ctx->collect_signature)
+    {
+      if (ctx->collect_signature != 2)
+        return 0;
+      if (!m_signature)
+        {
+          m_signature = new GpgME::Data();
+        }
+      target = m_signature;
+    }
+  else if (ctx->collect_crypto_data)
+    {
+      target = &m_crypto_data;
+    }
+  else if (ctx->in_data == 2)
+    {
+      /* An attachment.  Without one the data is dropped.  */
+      target = nullptr;
+    }
+  else
+    {
+      return 0;
+    }
+
+  if (!rfc822parse_in_plain_body (ctx->msg, &boundary, &blen))
+    {
+      return 0;
+    }
+
+  /* True if a line starting at P might be the boundary.  A partial
+     line counts as a match so it is left for the next call.  */
+  const char *end = input + insize;
+  auto maybe_boundary = [&] (const char *p) -> bool {
+    const size_t avail = end - p;
+    if (!boundary || !avail || *p != '-')
+      return false;
+    if (avail < 2)
+      return true;
+    if (p[1] != '-')
+      return false;
+    return !memcmp (p + 2, boundary, std::min (avail - 2, blen));
+  };
+
+  if (maybe_boundary (input))
+    {
+      return 0;
+    }
+  /* Find the end of the last complete line before the boundary.
+     Stop before a line that is too long so that the line by line
+     parsing handles it like any other overlong line.  */
+  const char *stop = nullptr;
+  for (const char *p = input;
+       (p = (const char *) memchr (p, '\n', end - p)); )
+    {
+      if ((size_t) (p - (stop ? stop : input)) >= m_limits.max_line_length)
+        break;
+      stop = ++p;
+      if (maybe_boundary (p))
+        break;
+    }
+  if (!stop)
+    {
+      return 0;
+    }
+
+  const size_t taken = stop - input;
+  const char *line_end = stop - 1;
+  if (line_end > input && line_end[-1] == '\r')
+    line_end--;
+  ctx->prev_line_end = offset + (line_end - input);
+  for (const char *p = input; p < stop; )
+    {
+      size_t n = std::min ((size_t) (stop - p), (size_t) LINEBUFSIZE);
+      memcpy (linebuf, p, n);
+      p += n;
+      n = b64_decode (&ctx->base64, linebuf, n);
+      if (!n)
+        continue;
+      if (target)
+        target->write (linebuf, n);
+      else if (ctx->current_attachment)
+        ctx->current_attachment->write (linebuf, n);
+    }
+  log_data ("%s:%s: Took " SIZE_T_FORMAT " bytes up to the next boundary.",
+            SRCNAME, __func__, taken);
+  s_bulk_bytes->add (taken);
+  return taken;
+}
+
 #ifdef HAVE_W32_SYSTEM
 void
 MimeDataProvider::collect_data(LPSTREAM stream)
@@ -1045,6 +1321,8 @@ MimeDataProvider::collect_data(FILE *stream)
 ssize_t MimeDataProvider::write(const void *buffer, size_t bufSize)
 {
   TSTART;
+  static auto s_bytes = Metrics::instance ()->counter ("mime.bytes");
+  s_bytes->add (bufSize);
   if (m_collect_everything)
     {
       /* Writing with collect everything one means that we are outputprovider.
@@ -1052,6 +1330,7 @@ ssize_t MimeDataProvider::write(const void *buffer, size_t bufSize)
       log_data ("%s:%s: Using complete input as body " SIZE_T_FORMAT " bytes.",
                        SRCNAME, __func__, bufSize);
       m_body += std::string ((const char *) buffer, bufSize);
+      account_memory ();
       TRETURN bufSize;
     }
   m_rawbuf += std::string ((const char*)buffer, bufSize);
@@ -1068,6 +1347,7 @@ ssize_t MimeDataProvider::write(const void *buffer, size_t bufSize)
   log_data ("%s:%s: Write Consumed: " SIZE_T_FORMAT " bytes",
                    SRCNAME, __func__, m_rawbuf.size() - not_taken);
   m_rawbuf.erase (0, m_rawbuf.size() - not_taken);
+  account_memory ();
   TRETURN bufSize;
 }
 
@@ -1084,6 +1364,53 @@ MimeDataProvider::signature() const
   TRETURN m_signature;
 }
 
+static bool
+hash_data (sha256_context_t *ctx, GpgME::Data &data)
+{
+  char buf[4096];
+  ssize_t nread;
+  bool any = false;
+
+  if (data.seek (0, SEEK_SET))
+    {
+      return false;
+    }
+  while ((nread = data.read (buf, sizeof buf)) > 0)
+    {
+      sha256_write (ctx, buf, (size_t) nread);
+      any = true;
+    }
+  data.seek (0, SEEK_SET);
+  return any;
+}
+
+std::string
+MimeDataProvider::crypto_digest()
+{
+  TSTART;
+  sha256_context_t ctx;
+  unsigned char digest[SHA256_DIGEST_LEN];
+  std::string ret;
+
+  sha256_init (&ctx);
+  if (!hash_data (&ctx, m_crypto_data))
+    {
+      TRETURN std::string ();
+    }
+  if (m_signature)
+    {
+      sha256_write (&ctx, "\0sig", 4);
+      hash_data (&ctx, *m_signature);
+    }
+  sha256_final (&ctx, digest);
+  for (size_t i = 0; i < sizeof digest; i++)
+    {
+      ret += tohex_lower (digest[i] >> 4);
+      ret += tohex_lower (digest[i] & 15);
+    }
+  TRETURN ret;
+}
+
 std::shared_ptr<Attachment>
 MimeDataProvider::create_attachment()
 {
@@ -1091,6 +1418,9 @@ MimeDataProvider::create_attachment()
   log_data ("%s:%s: Creating attachment.",
                    SRCNAME, __func__);
 
+  /* A new part means that the body is complete.  */
+  announce_progress ();
+
   auto attach = std::shared_ptr<Attachment> (new Attachment());
   attach->set_attach_type (ATTACHTYPE_FROMMOSS);
   m_mime_ctx->any_attachments_created = 1;
@@ -1098,30 +1428,34 @@ MimeDataProvider::create_attachment()
   /* And now for the real name.  We avoid storing the name "smime.p7m"
      because that one is used at several places in the mapi conversion
      functions.  */
-  if (m_mime_ctx->mimestruct_cur && m_mime_ctx->mimestruct_cur->filename)
+  const int cur = m_mime_ctx->part_cur;
+  const char *filename = cur >= 0 ? m_tree.filename (cur) : nullptr;
+  const char *cid = cur >= 0 ? m_tree.cid (cur) : nullptr;
+  if (filename)
     {
-      if (!strcmp (m_mime_ctx->mimestruct_cur->filename, "smime.p7m"))
+      if (!strcmp (filename, "smime.p7m"))
         {
           attach->set_display_name ("x-smime.p7m");
         }
       else
         {
           log_data ("%s:%s: Attachment filename: %s",
-                           SRCNAME, __func__, m_mime_ctx->mimestruct_cur->filename);
-          attach->set_display_name (m_mime_ctx->mimestruct_cur->filename);
+                           SRCNAME, __func__, filename);
+          attach->set_display_name (filename);
         }
     }
-  if (m_mime_ctx->mimestruct_cur && m_mime_ctx->mimestruct_cur->cid)
+  if (cid)
     {
-      attach->set_content_id (m_mime_ctx->mimestruct_cur->cid);
+      attach->set_content_id (cid);
       log_data ("%s:%s: content-id: %s",
-                SRCNAME, __func__, m_mime_ctx->mimestruct_cur->cid);
+                SRCNAME, __func__, cid);
     }
-  if (m_mime_ctx->mimestruct_cur && m_mime_ctx->mimestruct_cur->content_type)
+  if (cur >= 0)
     {
-      attach->set_content_type (m_mime_ctx->mimestruct_cur->content_type);
+      attach->set_content_type (m_tree.content_type (cur));
       log_data ("%s:%s: content-type: %s",
-                SRCNAME, __func__, m_mime_ctx->mimestruct_cur->content_type);
+                SRCNAME, __func__, m_tree.content_type (cur));
+      m_tree.set_attachment (cur, (int) m_attachments.size ());
     }
   m_attachments.push_back (attach);
 
@@ -1180,11 +1514,10 @@ void MimeDataProvider::finalize ()
      that we hide the first text part as we parsed the headers above
      from that part. */
   if (m_protected_headers_version == 1 && m_ph_helpbuf.size () &&
-      m_mime_ctx->mimestruct && m_mime_ctx->mimestruct->content_type &&
-      !strcmp (m_mime_ctx->mimestruct->content_type, "multipart/mixed") &&
-      m_mime_ctx->mimestruct->next && m_mime_ctx->mimestruct->next->content_type && (
-      !strcmp (m_mime_ctx->mimestruct->next->content_type, "text/plain") ||
-      !strcmp (m_mime_ctx->mimestruct->next->content_type, "text/rfc822-headers")))
+      m_tree.size () > 1 &&
+      !strcmp (m_tree.content_type (0), "multipart/mixed") && (
+      !strcmp (m_tree.content_type (1), "text/plain") ||
+      !strcmp (m_tree.content_type (1), "text/rfc822-headers")))
     {
       log_debug ("%s:%s: Detected protected headers legacy part. It will be hidden.",
                  SRCNAME, __func__);
@@ -1209,9 +1542,44 @@ void MimeDataProvider::finalize ()
                      SRCNAME, __func__);
         }
     }
+  m_tree.close_parts (0, m_unparsed ? m_consumed
+                                    : m_mime_ctx->prev_line_end);
+  account_memory ();
   TRETURN;
 }
 
+void
+MimeDataProvider::announce_progress ()
+{
+  TSTART;
+  /* Text in signed data is not collected as body.  */
+  if (m_body_done_cb && !m_body_done && m_mime_ctx->body_seen &&
+      (!m_body.empty () || !m_html_body.empty ()))
+    {
+      log_debug ("%s:%s: Body complete.", SRCNAME, __func__);
+      m_body_done = true;
+      m_body_done_cb ();
+    }
+  TRETURN;
+}
+
+void
+MimeDataProvider::account_memory ()
+{
+  if (!m_crypto_size)
+    {
+      /* The crypto data is only written while collecting.  */
+      const off_t pos = m_crypto_data.seek (0, SEEK_CUR);
+      const off_t end = m_crypto_data.seek (0, SEEK_END);
+      m_crypto_data.seek (pos, SEEK_SET);
+      m_crypto_size = end > 0 ? (size_t) end : 0;
+    }
+  const size_t used = m_crypto_size + m_body.capacity () +
+                      m_html_body.capacity () + m_rawbuf.capacity ();
+  memdbg_account (MEMDBG_PARSER, (long long) used - (long long) m_accounted);
+  m_accounted = used;
+}
+
 const std::string &MimeDataProvider::get_body ()
 {
   TSTART;
@@ -25,17 +25,33 @@
 #include <gpgme++/interfaces/dataprovider.h>
 #include <gpgme++/data.h>
 #include "rfc822parse.h"
+#include "mimetree.h"
 
 #ifdef HAVE_W32_SYSTEM
 #include "mapihelp.h"
 #endif
 
+#include <functional>
 #include <string>
 #include <map>
+#include <vector>
 struct mime_context;
 typedef struct mime_context *mime_context_t;
 class Attachment;
 
+/* Limits on the resources used to parse one mail.  When one of them
+   is reached we stop splitting the mail into parts and the rest of
+   the input becomes a single opaque attachment.  */
+struct mime_limits_s
+{
+  int max_depth;            /* Nesting level of a part. */
+  int max_parts;            /* Number of parts. */
+  int max_attachments;      /* Number of attachments created. */
+  int max_header_lines;     /* Header lines of all parts. */
+  size_t max_header_bytes;  /* Size of the headers of all parts. */
+  size_t max_line_length;   /* Length of a single line. */
+};
+
 /** This class does simple one level mime parsing to find crypto
   data.
 
@@ -103,6 +119,11 @@ public:
   */
   GpgME::Data *signature() const;
 
+  /* A hex encoded SHA-256 digest over the crypto data and the
+     detached signature. Identifies the input of the crypto
+     operation. Empty if there is no crypto data. */
+  std::string crypto_digest();
+
   /* Add an attachment to the list */
   std::shared_ptr<Attachment> create_attachment();
 
@@ -128,6 +149,29 @@ public:
 
   std::string get_content_type () const;
   void set_content_type (const char *ctmain, const char *ctsub);
+
+  /* The limits from the options or the built-in defaults. */
+  static mime_limits_s default_limits ();
+  /* Change the limits before writing to the provider. */
+  void set_limits (const mime_limits_s &limits);
+  /* True if a limit was reached and the rest of the input
+     was not parsed. */
+  bool limit_reached () const {return !!m_unparsed;}
+  /* Test instrumentation.  Handle all input line by line
+     instead of skipping to the next boundary in bulk. */
+  void disable_bulk () {m_bulk = false;}
+
+  /* The structure of the parsed input.  Complete after
+     finalize. */
+  const MimeTree &mime_tree () const {return m_tree;}
+  MimeTree &mime_tree () {return m_tree;}
+
+  /* Progressive delivery while the input is written.  The callback
+     is called in the writing thread once when an attachment starts
+     after the body so that no more body data follows.  It is not
+     called if the body only ends with the input. */
+  void set_body_done_cb (const std::function<void ()> &cb)
+    {m_body_done_cb = cb;}
 private:
 #ifdef HAVE_W32_SYSTEM
   /* Collect the data from mapi. */
@@ -137,6 +181,24 @@ private:
   void collect_data(FILE *stream);
   /* Collect a single line. */
   size_t collect_input_lines(const char *input, size_t size);
+  /* Pass the lines up to the next boundary to the collector in
+     one go if possible.  Returns the number of bytes taken. */
+  size_t collect_bulk (const char *input, size_t size, size_t offset,
+                       char *linebuf);
+  /* Check the limits before LINELEN bytes are inserted into the
+     parser.  Returns true if one was reached.  */
+  bool check_limits (size_t linelen);
+  /* Stop parsing and start the attachment for the rest of the
+     input.  */
+  void stop_parsing (const char *reason);
+  /* Call the progress callback if the body is done. */
+  void announce_progress ();
+  /* Update the bytes accounted for the parser in memdbg. */
+  void account_memory ();
+  /* Size of the crypto data once it is collected. */
+  size_t m_crypto_size;
+  /* Bytes accounted in memdbg. */
+  size_t m_accounted;
   /* A detached signature found in the input */
   std::string m_sig_data;
   /* The data to be passed to the crypto operation */
@@ -167,5 +229,18 @@ private:
   std::string m_ph_helpbuf;
   /* Main content type */
   std::string m_content_type;
+  /* Resource limits for parsing. */
+  mime_limits_s m_limits;
+  /* The rest of the input once a limit was reached. */
+  std::shared_ptr<Attachment> m_unparsed;
+  /* The MIME structure. */
+  MimeTree m_tree;
+  /* Bytes of the input taken by the parser. */
+  size_t m_consumed;
+  /* Progress callback and whether it was called. */
+  std::function<void ()> m_body_done_cb;
+  bool m_body_done;
+  /* Whether collect_bulk may be used. */
+  bool m_bulk;
 };
 #endif // MIMEDATAPROVIDER_H
@@ -0,0 +1,233 @@
+/* mimetree.cpp - The structure of a parsed MIME message
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+
+#include "mimetree.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Strip angle brackets from a content id.  */
+static std::string
+bare_cid (const std::string &cid)
+{
+  size_t start = 0;
+  size_t len = cid.size ();
+  if (len && cid[0] == '<')
+    {
+      start++;
+      len--;
+    }
+  if (len && cid[start + len - 1] == '>')
+    {
+      len--;
+    }
+  return cid.substr (start, len);
+}
+
+MimeTree::MimeTree ()
+{
+  /* Offset 0 is the empty string which marks unset values.  */
+  m_pool.push_back ('\0');
+}
+
+uint32_t
+MimeTree::add_string (const char *str)
+{
+  if (!str || !*str)
+    {
+      return 0;
+    }
+  const uint32_t ret = (uint32_t) m_pool.size ();
+  m_pool.append (str, strlen (str) + 1);
+  return ret;
+}
+
+uint32_t
+MimeTree::intern_type (const char *type)
+{
+  const auto it = m_types.find (type);
+  if (it != m_types.end ())
+    {
+      return it->second;
+    }
+  const uint32_t ret = add_string (type);
+  m_types.insert (std::make_pair (std::string (type), ret));
+  return ret;
+}
+
+const char *
+MimeTree::content_type (int idx) const
+{
+  return m_pool.c_str () + m_parts[idx].type;
+}
+
+const char *
+MimeTree::filename (int idx) const
+{
+  const uint32_t off = m_parts[idx].filename;
+  return off ? m_pool.c_str () + off : nullptr;
+}
+
+const char *
+MimeTree::cid (int idx) const
+{
+  const uint32_t off = m_parts[idx].cid;
+  return off ? m_pool.c_str () + off : nullptr;
+}
+
+const char *
+MimeTree::charset (int idx) const
+{
+  const uint32_t off = m_parts[idx].charset;
+  return off ? m_pool.c_str () + off : nullptr;
+}
+
+int
+MimeTree::find_by_cid (const std::string &cid) const
+{
+  const auto it = m_cids.find (bare_cid (cid));
+  return it == m_cids.end () ? -1 : it->second;
+}
+
+std::vector<int>
+MimeTree::find_by_type (const std::string &type) const
+{
+  const auto it = m_types.find (type);
+  if (it == m_types.end ())
+    {
+      return std::vector<int> ();
+    }
+  return m_type_parts.at (it->second);
+}
+
+int
+MimeTree::find_by_path (const std::string &path) const
+{
+  if (m_parts.empty ())
+    {
+      return -1;
+    }
+  int idx = 0;
+  const char *s = path.c_str ();
+  while (*s)
+    {
+      char *end;
+      long n = strtol (s, &end, 10);
+      if (end == s || n < 1 || (*end && *end != '.'))
+        {
+          return -1;
+        }
+      idx = m_parts[idx].first_child;
+      while (idx >= 0 && --n)
+        {
+          idx = m_parts[idx].next_sibling;
+        }
+      if (idx < 0)
+        {
+          return -1;
+        }
+      s = *end ? end + 1 : end;
+    }
+  return idx;
+}
+
+std::string
+MimeTree::path (int idx) const
+{
+  std::string ret;
+  for (; idx >= 0 && m_parts[idx].parent >= 0; idx = m_parts[idx].parent)
+    {
+      int n = 1;
+      for (int i = m_parts[m_parts[idx].parent].first_child; i != idx;
+           i = m_parts[i].next_sibling)
+        {
+          n++;
+        }
+      ret = std::to_string (n) + (ret.empty () ? "" : ".") + ret;
+    }
+  return ret;
+}
+
+int
+MimeTree::add_part (int level, const char *type, const char *filename,
+                    const char *cid, const char *charset, size_t offset)
+{
+  /* Parts on the same or a deeper level are done.  */
+  close_parts (level, offset);
+
+  const int idx = (int) m_parts.size ();
+  part_s part;
+  part.parent = m_open.empty () ? -1 : m_open.back ();
+  part.first_child = -1;
+  part.next_sibling = -1;
+  part.level = level;
+  part.attachment = -1;
+  part.offset = offset;
+  part.size = 0;
+  part.type = intern_type (type ? type : "");
+  part.filename = add_string (filename);
+  part.cid = add_string (cid);
+  part.charset = add_string (charset);
+  m_parts.push_back (part);
+  m_last_child.push_back (-1);
+
+  if (part.parent >= 0)
+    {
+      int &last = m_last_child[part.parent];
+      if (last < 0)
+        {
+          m_parts[part.parent].first_child = idx;
+        }
+      else
+        {
+          m_parts[last].next_sibling = idx;
+        }
+      last = idx;
+    }
+  m_type_parts[part.type].push_back (idx);
+  if (cid && *cid)
+    {
+      /* The first part with an id wins like in other MUAs.  */
+      m_cids.insert (std::make_pair (bare_cid (cid), idx));
+    }
+  m_open.push_back (idx);
+  return idx;
+}
+
+void
+MimeTree::set_attachment (int idx, int attachment)
+{
+  if (idx >= 0 && idx < (int) m_parts.size ())
+    {
+      m_parts[idx].attachment = attachment;
+    }
+}
+
+void
+MimeTree::close_parts (int level, size_t end)
+{
+  while (!m_open.empty () && m_parts[m_open.back ()].level >= level)
+    {
+      part_s &part = m_parts[m_open.back ()];
+      part.size = end > part.offset ? end - part.offset : 0;
+      m_open.pop_back ();
+    }
+}
@@ -0,0 +1,111 @@
+/* mimetree.h - The structure of a parsed MIME message
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MIMETREE_H
+#define MIMETREE_H
+
+#include "config.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/** The structure of a MIME message.
+
+  The parts are stored in document order in one vector and refer
+  to each other by index.  All strings live in one pool and the
+  content types are interned, so a part is a small fixed size
+  record.  The tree is built by the MimeDataProvider while it
+  parses and is read only afterwards.
+
+  A path names a part like an IMAP section: the root has the
+  empty path, its children are "1", "2", ... and their children
+  "2.1" and so on. */
+class MimeTree
+{
+public:
+  struct part_s
+  {
+    int parent;          /* Index of the parent or -1 for the root. */
+    int first_child;     /* Index of the first child or -1. */
+    int next_sibling;    /* Index of the next sibling or -1. */
+    int level;           /* Nesting level, 0 for the root. */
+    int attachment;      /* Index of the attachment created for
+                            the part or -1. */
+    size_t offset;       /* Offset of the body in the parsed input. */
+    size_t size;         /* Size of the body without the line break
+                            before the next boundary. */
+    uint32_t type;       /* Offsets into the string pool, 0 if */
+    uint32_t filename;   /* the value is not set. */
+    uint32_t cid;
+    uint32_t charset;
+  };
+
+  MimeTree ();
+
+  /** Number of parts. */
+  size_t size () const { return m_parts.size (); }
+  bool empty () const { return m_parts.empty (); }
+  const part_s &part (int idx) const { return m_parts[idx]; }
+
+  /** The strings of a part.  The content type is never null,
+    the others are null if not set. */
+  const char *content_type (int idx) const;
+  const char *filename (int idx) const;
+  const char *cid (int idx) const;
+  const char *charset (int idx) const;
+
+  /** The part with the content id or -1.  Angle brackets
+    around cid are ignored. */
+  int find_by_cid (const std::string &cid) const;
+  /** All parts with the content type in document order. */
+  std::vector<int> find_by_type (const std::string &type) const;
+  /** The part with the path or -1. */
+  int find_by_path (const std::string &path) const;
+  /** The path of a part. */
+  std::string path (int idx) const;
+
+  /* For the parser.  */
+
+  /** Add a part at level whose body starts at offset.  Returns
+    its index. */
+  int add_part (int level, const char *type, const char *filename,
+                const char *cid, const char *charset, size_t offset);
+  void set_attachment (int idx, int attachment);
+  /** The bodies of the open parts at level or deeper end at end. */
+  void close_parts (int level, size_t end);
+
+private:
+  uint32_t add_string (const char *str);
+  uint32_t intern_type (const char *type);
+
+  std::vector<part_s> m_parts;
+  std::string m_pool;
+  /* Maps content types to their pool offset and back to
+     the parts with that type. */
+  std::unordered_map<std::string, uint32_t> m_types;
+  std::unordered_map<uint32_t, std::vector<int> > m_type_parts;
+  std::unordered_map<std::string, int> m_cids;
+  /* Parts whose body has not ended yet and the last child of
+     each part while building.  */
+  std::vector<int> m_open;
+  std::vector<int> m_last_child;
+};
+
+#endif // MIMETREE_H
@@ -0,0 +1,137 @@
+/* mpscring.h - Bounded lock-free multi producer queue
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MPSCRING_H
+#define MPSCRING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/** A fixed size ring buffer that many threads can push to
+  without taking a lock.  Only one thread at a time may pop.
+
+  Each slot carries a sequence number that tells producers and
+  the consumer whose turn it is, so a producer only has to claim
+  a position with a compare and swap and then fills its slot
+  without blocking anyone else.  push fails instead of waiting
+  when the ring is full.
+
+  The capacity is rounded up to a power of two. */
+template <typename T>
+class MpscRing
+{
+public:
+  explicit MpscRing (size_t capacity) :
+    m_mask (round_up (capacity) - 1),
+    m_slots (m_mask + 1),
+    m_head (0),
+    m_tail (0)
+  {
+    for (size_t i = 0; i <= m_mask; i++)
+      {
+        m_slots[i].seq.store (i, std::memory_order_relaxed);
+      }
+  }
+
+  /** Add value.  Returns false if the ring is full. */
+  bool push (const T &value)
+  {
+    size_t pos = m_head.load (std::memory_order_relaxed);
+    for (;;)
+      {
+        Slot &slot = m_slots[pos & m_mask];
+        const size_t seq = slot.seq.load (std::memory_order_acquire);
+        const ptrdiff_t diff = (ptrdiff_t) seq - (ptrdiff_t) pos;
+        if (!diff)
+          {
+            if (m_head.compare_exchange_weak (pos, pos + 1,
+                                              std::memory_order_relaxed))
+              {
+                slot.value = value;
+                slot.seq.store (pos + 1, std::memory_order_release);
+                return true;
+              }
+          }
+        else if (diff < 0)
+          {
+            return false;
+          }
+        else
+          {
+            pos = m_head.load (std::memory_order_relaxed);
+          }
+      }
+  }
+
+  /** Take the oldest value.  Returns false if the ring is empty
+    or the oldest slot is still being filled.  Must not be
+    called concurrently. */
+  bool pop (T &value)
+  {
+    const size_t pos = m_tail.load (std::memory_order_relaxed);
+    Slot &slot = m_slots[pos & m_mask];
+    const size_t seq = slot.seq.load (std::memory_order_acquire);
+    if (seq != pos + 1)
+      {
+        return false;
+      }
+    value = slot.value;
+    slot.seq.store (pos + m_mask + 1, std::memory_order_release);
+    m_tail.store (pos + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /** Approximate number of queued values. */
+  size_t size () const
+  {
+    const size_t head = m_head.load (std::memory_order_relaxed);
+    const size_t tail = m_tail.load (std::memory_order_relaxed);
+    return head > tail ? head - tail : 0;
+  }
+
+  size_t capacity () const
+  {
+    return m_mask + 1;
+  }
+
+private:
+  struct Slot
+  {
+    Slot () : seq (0), value () {}
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  static size_t round_up (size_t n)
+  {
+    size_t ret = 2;
+    while (ret < n)
+      {
+        ret <<= 1;
+      }
+    return ret;
+  }
+
+  const size_t m_mask;
+  std::vector<Slot> m_slots;
+  std::atomic<size_t> m_head;
+  std::atomic<size_t> m_tail;
+};
+
+#endif // MPSCRING_H
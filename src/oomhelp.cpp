@@ -29,6 +29,8 @@
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <map>
+#include <set>
 #include <rpc.h>
 
 #include "common.h"
@@ -38,6 +40,8 @@
 #include "gpgoladdin.h"
 #include "categorymanager.h"
 #include "recipient.h"
+#include "addrcache.h"
+#include "dispidcache.h"
 
 HRESULT
 gpgol_queryInterface (LPUNKNOWN pObj, REFIID riid, LPVOID FAR *ppvObj)
@@ -143,24 +147,18 @@ get_object_name_s (shared_disp_t obj)
   return get_object_name_s (obj.get ());
 }
 
-/* Lookup the dispid of object PDISP for member NAME.  Returns
-   DISPID_UNKNOWN on error.  */
-DISPID
-lookup_oom_dispid (LPDISPATCH pDisp, const char *name)
+/* Ask PDISP for the dispid of NAME.  */
+static bool
+resolve_oom_dispid (LPDISPATCH pDisp, const char *name, long *r_dispid)
 {
   HRESULT hr;
   DISPID dispid;
   wchar_t *wname;
 
-  if (!pDisp || !name)
-    {
-      TRETURN DISPID_UNKNOWN; /* Error: Invalid arg.  */
-    }
-
   wname = utf8_to_wchar (name);
   if (!wname)
     {
-      TRETURN DISPID_UNKNOWN;/* Error:  Out of memory.  */
+      return false; /* Error:  Out of memory.  */
     }
 
   hr = pDisp->GetIDsOfNames (IID_NULL, &wname, 1,
@@ -169,10 +167,78 @@ lookup_oom_dispid (LPDISPATCH pDisp, const char *name)
   if (hr != S_OK || dispid == DISPID_UNKNOWN)
     log_debug ("%s:%s: error looking up dispid(%s)=%d: hr=0x%x\n",
                SRCNAME, __func__, name, (int)dispid, (unsigned int)hr);
-  if (hr != S_OK)
-    dispid = DISPID_UNKNOWN;
+  if (hr != S_OK || dispid == DISPID_UNKNOWN)
+    {
+      return false;
+    }
+  *r_dispid = dispid;
+  return true;
+}
+
+/* Return the type info of PDISP as key for the dispid cache or
+   NULL if it has none.  The returned reference must be passed to
+   release_dispid_cache_type.  */
+static ITypeInfo *
+dispid_cache_type (LPDISPATCH pDisp)
+{
+  ITypeInfo *info = nullptr;
 
-  return dispid;
+  if (pDisp->GetTypeInfo (0, LOCALE_SYSTEM_DEFAULT, &info) != S_OK)
+    {
+      return nullptr;
+    }
+  return info;
+}
+
+/* Release INFO unless the dispid cache saw it for the first time.
+   The cache needs that reference so that the pointer stays
+   unique.  */
+static void
+release_dispid_cache_type (ITypeInfo *info, bool new_type)
+{
+  if (info && !new_type)
+    {
+      info->Release ();
+    }
+}
+
+/* Lookup the dispid of object PDISP for member NAME.  Returns
+   DISPID_UNKNOWN on error.  The dispids are cached per type info
+   of PDISP so usually no call into Outlook is needed.  */
+DISPID
+lookup_oom_dispid (LPDISPATCH pDisp, const char *name)
+{
+  long dispid;
+  bool new_type;
+
+  if (!pDisp || !name)
+    {
+      return DISPID_UNKNOWN; /* Error: Invalid arg.  */
+    }
+
+  ITypeInfo *info = dispid_cache_type (pDisp);
+  const bool ok = DispidCache::instance ()->lookup (
+    info, name,
+    [pDisp] (const char *n, long *r_id)
+      {
+        return resolve_oom_dispid (pDisp, n, r_id);
+      }, &dispid, &new_type);
+  release_dispid_cache_type (info, new_type);
+  return ok ? dispid : DISPID_UNKNOWN;
+}
+
+/* Drop the cached dispid of NAME for the type of PDISP.  To be
+   called if an invoke says that the member is unknown.  */
+void
+invalidate_oom_dispid (LPDISPATCH pDisp, const char *name)
+{
+  if (!pDisp || !name)
+    {
+      return;
+    }
+  ITypeInfo *info = dispid_cache_type (pDisp);
+  DispidCache::instance ()->invalidate (info, name);
+  release_dispid_cache_type (info, false);
 }
 
 static void
@@ -397,6 +463,10 @@ get_oom_object (LPDISPATCH pStart, const char *fullname)
                      name, vtResult.pdispVal, vtResult.vt, (unsigned int)hr,
                      (unsigned int)argErr, (unsigned int)dispid);
           dump_excepinfo (execpinfo);
+          if (hr == DISP_E_MEMBERNOTFOUND)
+            {
+              invalidate_oom_dispid (pDisp, name);
+            }
           VariantClear (&vtResult);
           gpgol_release (pDisp);
           TRETURN NULL;  /* Invoke failed.  */
@@ -1399,7 +1469,8 @@ get_recipient_addr_entry_fallbacks_ex (LPDISPATCH addr_entry)
       char *smtpbegin = strstr(ret, "SMTP:");
       if (smtpbegin == ret)
         {
-          ret += 5;
+          /* Move instead of skipping so that ret can be freed.  */
+          memmove (ret, ret + 5, strlen (ret + 5) + 1);
         }
       TRETURN ret;
     }
@@ -1428,162 +1499,188 @@ get_recipient_addr_entry_fallbacks_ex (LPDISPATCH addr_entry)
   TRETURN nullptr;
 }
 
-/* Helper for additional fallbacks in recipient lookup */
-static char *
-get_recipient_addr_fallbacks (LPDISPATCH recipient)
+/* The address book as seen through the OOM.  The cache knows
+   address entries by their ID, so the entries seen while resolving
+   the recipients are kept here to look them up by ID.  Entries
+   without ID get a temporary one which is not cached.  */
+class OomAddressDirectory: public AddressDirectory
 {
-  TSTART;
-  if (!recipient)
-    {
-      TRETURN nullptr;
-    }
-  LPDISPATCH addr_entry = get_oom_object (recipient, "AddressEntry");
-
-  if (!addr_entry)
-    {
-      log_debug ("%s:%s: Failed to find AddressEntry",
-                 SRCNAME, __func__);
-      TRETURN nullptr;
-    }
-
-  char *ret = get_recipient_addr_entry_fallbacks_ex (addr_entry);
+public:
+  /* Keep ENTRY and return its id.  */
+  std::string add (const shared_disp_t &entry)
+  {
+    std::string ret;
+    char *id = get_oom_string (entry.get (), "ID");
+    if (id && *id)
+      {
+        ret = id;
+      }
+    else
+      {
+        ret = std::string ("tmp:") + std::to_string (m_temp.size ());
+        m_temp.insert (ret);
+      }
+    xfree (id);
+    m_entries[ret] = entry;
+    return ret;
+  }
 
-  gpgol_release (addr_entry);
+  /* The entry for ID or null if it was not seen.  */
+  shared_disp_t get (const std::string &id) const
+  {
+    const auto it = m_entries.find (id);
+    return it == m_entries.end () ? nullptr : it->second;
+  }
 
-  TRETURN ret;
-}
+  bool cacheable (const std::string &id) const override
+  {
+    return !id.empty () && !m_temp.count (id);
+  }
 
-/* Try to resolve a recipient group and add it to the recipients vector.
+  bool resolve_smtp (const std::string &id, std::string *r_addr) override
+  {
+    TSTART;
+    const auto entry = get (id);
+    if (!entry)
+      {
+        TRETURN false;
+      }
+    char *addr = get_recipient_addr_entry_fallbacks_ex (entry.get ());
+    if (!addr)
+      {
+        TRETURN false;
+      }
+    *r_addr = addr;
+    xfree (addr);
+    TRETURN true;
+  }
 
-   Returns true on success.
-*/
-static bool
-try_resolve_group (LPDISPATCH addrEntry,
-                   std::vector<std::pair<Recipient, shared_disp_t> >&ret,
-                   int recipient_type)
-{
-  TSTART;
-  /* Get the name for debugging */
-  std::string name;
-  char *cname = get_oom_string (addrEntry, "Name");
-  if (cname)
-    {
-      name = cname;
-    }
-  xfree (cname);
+  bool group_members (const std::string &id,
+                      std::vector<entry_s> *r_members) override
+  {
+    TSTART;
+    const auto entry = get (id);
+    if (!entry)
+      {
+        TRETURN false;
+      }
+    int user_type = get_oom_int (entry.get (), "AddressEntryUserType");
+    if (user_type != DISTRIBUTION_LIST_ADDRESS_ENTRY_TYPE)
+      {
+        log_data ("%s:%s: type of entry is %i",
+                  SRCNAME, __func__, user_type);
+        TRETURN false;
+      }
 
-  int user_type = get_oom_int (addrEntry, "AddressEntryUserType");
+    auto members = MAKE_SHARED (get_oom_object (entry.get (), "Members"));
+    if (!members)
+      {
+        TRACEPOINT;
+        TRETURN true;
+      }
 
-  if (user_type != DISTRIBUTION_LIST_ADDRESS_ENTRY_TYPE)
-    {
-      log_data ("%s:%s: type of %s is %i",
-                       SRCNAME, __func__, anonstr (name.c_str()), user_type);
-      TRETURN false;
-    }
+    int count = get_oom_int (members.get (), "Count");
+    for (int i = 1; i <= count; i++)
+      {
+        auto item_str = std::string("Item(") + std::to_string (i) + ")";
+        auto member = MAKE_SHARED (get_oom_object (members.get (),
+                                                   item_str.c_str()));
+        if (!member)
+          {
+            TRACEPOINT;
+            continue;
+          }
+        entry_s element;
+        char *entry_name = get_oom_string (member.get(), "Name");
+        if (entry_name)
+          {
+            element.name = entry_name;
+            xfree (entry_name);
+          }
+        element.is_group = get_oom_int (member.get(), "AddressEntryUserType")
+                           == DISTRIBUTION_LIST_ADDRESS_ENTRY_TYPE;
+        element.id = add (member);
+        if (!element.is_group)
+          {
+            /* Resolve directly ? */
+            char *addrtype = get_pa_string (member.get(), PR_ADDRTYPE_DASL);
+            if (addrtype && !strcmp (addrtype, "SMTP"))
+              {
+                char *resolved = get_pa_string (member.get(),
+                                                PR_EMAIL_ADDRESS_DASL);
+                if (resolved)
+                  {
+                    element.addr = resolved;
+                  }
+                xfree (resolved);
+              }
+            xfree (addrtype);
+          }
+        r_members->push_back (element);
+      }
+    TRETURN true;
+  }
 
-  LPDISPATCH members = get_oom_object (addrEntry, "Members");
-  addrEntry = nullptr;
+private:
+  std::map<std::string, shared_disp_t> m_entries;
+  std::set<std::string> m_temp;
+};
 
-  if (!members)
+/* Get the address entry with ID from the session.  The ID is passed
+   as a string argument as Exchange IDs are too long for a path.  */
+static shared_disp_t
+get_address_entry_by_id (const std::string &id)
+{
+  TSTART;
+  LPDISPATCH application = GpgolAddin::get_instance ()->get_application ();
+  if (!application || id.empty ())
     {
-      TRACEPOINT;
-      TRETURN false;
+      TRETURN nullptr;
     }
-
-  int count = get_oom_int (members, "Count");
-
-  if (!count)
+  auto session = MAKE_SHARED (get_oom_object (application, "Session"));
+  if (!session)
     {
       TRACEPOINT;
-      gpgol_release (members);
-      TRETURN false;
+      TRETURN nullptr;
     }
-
-  bool foundOne = false;
-  for (int i = 1; i <= count; i++)
+  VARIANT result;
+  VariantInit (&result);
+  if (invoke_oom_method_with_string (session.get (), "GetAddressEntryFromID",
+                                     id.c_str (), &result))
     {
-      auto item_str = std::string("Item(") + std::to_string (i) + ")";
-      auto entry = MAKE_SHARED (get_oom_object (members, item_str.c_str()));
-      if (!entry)
-        {
-          TRACEPOINT;
-          continue;
-        }
-      std::string entryName;
-      char *entry_name = get_oom_string (entry.get(), "Name");
-      if (entry_name)
-        {
-          entryName = entry_name;
-          xfree (entry_name);
-        }
-
-      int subType = get_oom_int (entry.get(), "AddressEntryUserType");
-      /* Resolve recursively, yeah fun. */
-      if (subType == DISTRIBUTION_LIST_ADDRESS_ENTRY_TYPE)
-        {
-          log_debug ("%s:%s: recursive address entry %s",
-                     SRCNAME, __func__,
-                     anonstr (entryName.c_str()));
-          if (try_resolve_group (entry.get(), ret, recipient_type))
-            {
-              foundOne = true;
-              continue;
-            }
-        }
-
-      std::pair<Recipient, shared_disp_t> element;
-      element.second = entry;
-
-      /* Resolve directly ? */
-      char *addrtype = get_pa_string (entry.get(), PR_ADDRTYPE_DASL);
-      if (addrtype && !strcmp (addrtype, "SMTP"))
-        {
-          xfree (addrtype);
-          char *resolved = get_pa_string (entry.get(), PR_EMAIL_ADDRESS_DASL);
-          if (resolved)
-            {
-              element.first = Recipient (resolved, entryName.c_str (),
-                                         recipient_type);
-              ret.push_back (element);
-              foundOne = true;
-              continue;
-            }
-        }
-      xfree (addrtype);
-
-      /* Resolve through Exchange API */
-      char *ex_resolved = get_recipient_addr_entry_fallbacks_ex (entry.get());
-      if (ex_resolved)
-        {
-          element.first = Recipient (ex_resolved, entryName.c_str (),
-                                     recipient_type);
-          ret.push_back (element);
-          foundOne = true;
-          continue;
-        }
-
-      log_debug ("%s:%s: failed to resolve name %s",
-                 SRCNAME, __func__,
-                 anonstr (entryName.c_str()));
+      log_debug ("%s:%s: Failed to get address entry.",
+                 SRCNAME, __func__);
+      TRETURN nullptr;
     }
-  gpgol_release (members);
-  if (!foundOne)
+  if (result.vt != VT_DISPATCH || !result.pdispVal)
     {
-      log_debug ("%s:%s: failed to resolve group %s",
-                 SRCNAME, __func__,
-                 anonstr (name.c_str()));
+      log_debug ("%s:%s: No address entry for the ID.",
+                 SRCNAME, __func__);
+      VariantClear (&result);
+      TRETURN nullptr;
     }
-  TRETURN foundOne;
+  /* The reference of the result is passed on.  */
+  memdbg_addRef (result.pdispVal);
+  TRETURN MAKE_SHARED (result.pdispVal);
 }
 
 /* Get the recipient mbox addresses with the addrEntry
-   object corresponding to the resolved address. */
-std::vector<std::pair<Recipient, shared_disp_t> >
-get_oom_recipients_with_addrEntry (LPDISPATCH recipients, bool *r_err)
+   object corresponding to the resolved address.
+
+   The SMTP addresses of address entries and the members of
+   distribution lists are taken from the AddressCache as looking
+   them up takes several calls into Exchange.  If WITH_ENTRIES is
+   false the entries of group members are not looked up.  If REFRESH
+   is true they are looked up again and the cache is updated.  */
+static std::vector<std::pair<Recipient, shared_disp_t> >
+resolve_oom_recipients (LPDISPATCH recipients, bool *r_err,
+                        bool with_entries, bool refresh)
 {
   TSTART;
   int recipientsCnt = get_oom_int (recipients, "Count");
   std::vector<std::pair<Recipient, shared_disp_t> > ret;
+  OomAddressDirectory dir;
+  AddressCache *cache = AddressCache::instance ();
   int i;
 
   if (!recipientsCnt)
@@ -1621,11 +1718,29 @@ get_oom_recipients_with_addrEntry (LPDISPATCH recipients, bool *r_err)
 
 
       auto addrEntry = MAKE_SHARED (get_oom_object (recipient, "AddressEntry"));
-      if (addrEntry && try_resolve_group (addrEntry.get (), ret,
-                                          recipient_type))
+      std::string entry_id;
+      std::vector<AddressCache::member_s> members;
+      if (addrEntry)
+        {
+          entry_id = dir.add (addrEntry);
+        }
+      if (addrEntry && cache->expand_group (dir, entry_id, &members, refresh))
         {
           log_debug ("%s:%s: Resolved recipient group",
                      SRCNAME, __func__);
+          for (const auto &member: members)
+            {
+              std::pair<Recipient, shared_disp_t> element;
+              element.first = Recipient (member.addr.c_str (),
+                                         member.name.c_str (),
+                                         recipient_type);
+              element.second = dir.get (member.id);
+              if (!element.second && with_entries)
+                {
+                  element.second = get_address_entry_by_id (member.id);
+                }
+              ret.push_back (element);
+            }
           gpgol_release (recipient);
           continue;
         }
@@ -1645,13 +1760,12 @@ get_oom_recipients_with_addrEntry (LPDISPATCH recipients, bool *r_err)
           continue;
         }
       /* No PR_SMTP_ADDRESS first fallback */
-      resolved = get_recipient_addr_fallbacks (recipient);
-      if (resolved)
+      std::string smtp;
+      if (addrEntry && cache->smtp_address (dir, entry_id, &smtp, refresh))
         {
-          entry.first = Recipient (resolved, entryName.c_str (),
+          entry.first = Recipient (smtp.c_str (), entryName.c_str (),
                                    recipient_type);
           entry.first.setIndex (i);
-          xfree (resolved);
           gpgol_release (recipient);
           ret.push_back (entry);
           continue;
@@ -1674,16 +1788,28 @@ get_oom_recipients_with_addrEntry (LPDISPATCH recipients, bool *r_err)
           *r_err = true;
         }
     }
+  log_debug ("%s:%s: Address cache hits %lu misses %lu",
+             SRCNAME, __func__, (unsigned long) cache->hits (),
+             (unsigned long) cache->misses ());
   TRETURN ret;
 }
 
+/* Get the recipient mbox addresses with the addrEntry
+   object corresponding to the resolved address. */
+std::vector<std::pair<Recipient, shared_disp_t> >
+get_oom_recipients_with_addrEntry (LPDISPATCH recipients, bool *r_err)
+{
+  return resolve_oom_recipients (recipients, r_err, true, false);
+}
+
 /* Gets the resolved smtp addresses of the recpients. */
 std::vector<Recipient>
-get_oom_recipients (LPDISPATCH recipients, bool *r_err)
+get_oom_recipients (LPDISPATCH recipients, bool *r_err, bool refresh)
 {
   TSTART;
   std::vector<Recipient> ret;
-  for (const auto pair: get_oom_recipients_with_addrEntry (recipients, r_err))
+  for (const auto pair: resolve_oom_recipients (recipients, r_err, false,
+                                                refresh))
     {
       ret.push_back (pair.first);
     }
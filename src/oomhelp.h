@@ -174,6 +174,9 @@ std::string get_object_name_s (shared_disp_t obj);
 /* Helper to lookup a dispid.  */
 DISPID lookup_oom_dispid (LPDISPATCH pDisp, const char *name);
 
+/* Drop the cached dispid of NAME for the type of PDISP.  */
+void invalidate_oom_dispid (LPDISPATCH pDisp, const char *name);
+
 /* Return the OOM object's IDispatch interface described by FULLNAME.  */
 LPDISPATCH get_oom_object (LPDISPATCH pStart, const char *fullname);
 /* Do the same but with a shared disp return value */
@@ -230,9 +233,11 @@ HWND get_oom_context_window (LPDISPATCH context);
 /* Get the address of the recipients as string list.
    The second part of the pair returned is the recipient type
    which corresponds in value to Mail::recipientType.
-   If r_err is not null it is set to true in case of an error. */
+   If r_err is not null it is set to true in case of an error.
+   If refresh is true cached addresses are not used. */
 std::vector<Recipient> get_oom_recipients (LPDISPATCH recipients,
-                                           bool *r_err = nullptr);
+                                           bool *r_err = nullptr,
+                                           bool refresh = false);
 
 /* Same as above but include the AddrEntry object in the result.
    Caller needs to release the AddrEntry. */
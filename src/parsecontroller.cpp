@@ -24,14 +24,21 @@
 #include "parsecontroller.h"
 #include "attachment.h"
 #include "mimedataprovider.h"
+#include "pipedataprovider.h"
 
 #include "keycache.h"
+#include "contextpool.h"
+#include "singleflight.h"
+#include "metrics.h"
 
 #include <gpgme++/context.h>
 #include <gpgme++/decryptionresult.h>
 #include <gpgme++/key.h>
 
 #include <sstream>
+#ifndef HAVE_W32_SYSTEM
+#include <thread>
+#endif
 
 #include "cpphelp.h"
 
@@ -115,7 +122,7 @@ get_and_print_key_test (const char *fingerprint, GpgME::Protocol proto)
 ParseController::ParseController(LPSTREAM instream, msgtype_t type):
     m_inputprovider  (new MimeDataProvider(instream,
                           expect_no_headers(type))),
-    m_outputprovider (new MimeDataProvider(expect_no_mime(type))),
+    m_outputprovider (std::make_shared<MimeDataProvider> (expect_no_mime (type))),
     m_type (type),
     m_block_html (false),
     m_second_pass (false)
@@ -133,7 +140,7 @@ ParseController::ParseController(LPSTREAM instream, msgtype_t type):
 ParseController::ParseController(FILE *instream, msgtype_t type):
     m_inputprovider  (new MimeDataProvider(instream,
                           expect_no_headers(type))),
-    m_outputprovider (new MimeDataProvider(expect_no_mime(type))),
+    m_outputprovider (std::make_shared<MimeDataProvider> (expect_no_mime (type))),
     m_type (type),
     m_block_html (false),
     m_second_pass (false)
@@ -150,8 +157,6 @@ ParseController::~ParseController()
   TSTART;
   log_debug ("%s:%s", SRCNAME, __func__);
   memdbg_dtor ("ParseController");
-  delete m_inputprovider;
-  delete m_outputprovider;
   TRETURN;
 }
 
@@ -200,7 +205,7 @@ format_recipients(GpgME::DecryptionResult result, Protocol protocol)
   std::string msg;
   for (const auto recipient: result.recipients())
     {
-      auto ctx = Context::createForProtocol(protocol);
+      auto ctx = ContextPool::instance ()->get (protocol);
       Error e;
       if (!ctx) {
           /* Can't happen */
@@ -208,7 +213,6 @@ format_recipients(GpgME::DecryptionResult result, Protocol protocol)
           continue;
       }
       const auto key = ctx->key(recipient.keyID(), e, false);
-      delete ctx;
       if (!key.isNull() && key.numUserIDs() && !e) {
         msg += std::string("<br/>") + key.userIDs()[0].id() + " (0x" + recipient.keyID() + ")";
         continue;
@@ -336,6 +340,171 @@ is_valid_chksum(const GpgME::Signature &sig)
   TRETURN valid;
 }
 
+struct ParseController::parse_result_s
+{
+  GpgME::DecryptionResult decrypt_result;
+  GpgME::VerificationResult verify_result;
+  std::string error;
+  bool block_html;
+  std::shared_ptr<MimeDataProvider> output;
+};
+
+/* Parses that run or ran recently keyed by flight_key. */
+static SingleFlight<const ParseController::parse_result_s> s_parse_flights;
+
+std::string
+ParseController::flight_key (bool offline)
+{
+  TSTART;
+  const auto digest = m_inputprovider->crypto_digest ();
+  if (digest.empty ())
+    {
+      TRETURN std::string ();
+    }
+  TRETURN digest + "/" + std::to_string ((int) m_type) +
+          (offline ? "/o" : "/-") + (m_second_pass ? "/2/" : "/1/") +
+          m_sender;
+}
+
+void
+ParseController::parse (bool offline)
+{
+  TSTART;
+  static auto s_parses = Metrics::instance ()->counter ("parse.count");
+  static auto s_shared = Metrics::instance ()->counter ("parse.shared");
+  s_parses->add ();
+  const auto key = flight_key (offline);
+  if (key.empty ())
+    {
+      parse_internal (offline);
+      TRETURN;
+    }
+
+  bool shared = false;
+  auto result = s_parse_flights.run (key,
+                                     [this, offline] (bool &retain)
+    {
+      parse_internal (offline);
+      auto ret = std::make_shared<parse_result_s> ();
+      ret->decrypt_result = m_decrypt_result;
+      ret->verify_result = m_verify_result;
+      ret->error = m_error;
+      ret->block_html = m_block_html;
+      ret->output = m_outputprovider;
+      /* Errors might be transient (e.g. a canceled pinentry)
+         so only good results are shared.  */
+      retain = m_error.empty () && !m_decrypt_result.error ();
+      return std::shared_ptr<const parse_result_s> (ret);
+    }, &shared);
+
+  m_result = result;
+  if (!shared)
+    {
+      TRETURN;
+    }
+  s_shared->add ();
+  log_debug ("%s:%s:%p: Sharing result of identical parse.",
+             SRCNAME, __func__, this);
+  m_decrypt_result = result->decrypt_result;
+  m_verify_result = result->verify_result;
+  m_error = result->error;
+  m_block_html = result->block_html;
+  m_outputprovider = result->output;
+  m_second_pass = true;
+  TRETURN;
+}
+
+/* Arguments for the thread that passes the signed data to the
+   verification and to the MIME parser.  */
+struct tee_producer_s
+{
+  PipeDataProvider *pipe;
+  Data *input;
+  Data *output;
+};
+
+static void
+tee_signed_data (tee_producer_s *args)
+{
+  TSTART;
+  char buf[4096];
+  ssize_t nread;
+  bool verifying = true;
+
+  while ((nread = args->input->read (buf, sizeof buf)) > 0)
+    {
+      /* If the verification stopped reading the rest is only
+         parsed.  */
+      verifying = verifying && args->pipe->write (buf, nread) >= 0;
+      args->output->write (buf, nread);
+    }
+  /* Tell the verification that we are done.  A read error fails
+     it.  */
+  args->pipe->close_write (nread < 0);
+  TRETURN;
+}
+
+#ifdef HAVE_W32_SYSTEM
+static DWORD WINAPI
+do_tee_signed_data (LPVOID arg)
+{
+  tee_signed_data (static_cast<tee_producer_s *>(arg));
+  return 0;
+}
+#endif
+
+/* Verify the detached signature sig over input while input is
+   parsed into output.  A second thread reads the input once and
+   passes it through a bounded pipe to the verification and to the
+   MIME parser.  */
+static VerificationResult
+verify_detached_and_parse (Context *ctx, Data &sig, Data &input,
+                           Data &output)
+{
+  TSTART;
+  PipeDataProvider pipe;
+  Data signed_data (&pipe);
+  tee_producer_s producer_args;
+  producer_args.pipe = &pipe;
+  producer_args.input = &input;
+  producer_args.output = &output;
+
+#ifdef HAVE_W32_SYSTEM
+  HANDLE producer = CreateThread (nullptr, 0, do_tee_signed_data,
+                                  (LPVOID) &producer_args, 0, nullptr);
+  if (!producer)
+    {
+      log_error_w32 (-1, "%s:%s: Failed to create producer thread.",
+                     SRCNAME, __func__);
+      /* Verify first and parse afterwards.  */
+      const auto result = ctx->verifyDetachedSignature (sig, input);
+      input.seek (0, SEEK_SET);
+      char buf[4096];
+      ssize_t nread;
+      while ((nread = input.read (buf, sizeof buf)) > 0)
+        {
+          output.write (buf, nread);
+        }
+      TRETURN result;
+    }
+#else
+  std::thread producer (tee_signed_data, &producer_args);
+#endif
+
+  const auto result = ctx->verifyDetachedSignature (sig, signed_data);
+  /* Release the producer if the verification did not read it all. */
+  pipe.abort ();
+#ifdef HAVE_W32_SYSTEM
+  WaitForSingleObject (producer, INFINITE);
+  CloseHandle (producer);
+#else
+  producer.join ();
+#endif
+  log_debug ("%s:%s: Streamed " SIZE_T_FORMAT " bytes to verification.",
+             SRCNAME, __func__, pipe.total ());
+  TRETURN result;
+}
+
 /* Note on stability:
 
    Experiments have shown that we can have a crash if parse
@@ -349,14 +518,18 @@ is_valid_chksum(const GpgME::Signature &sig)
    (slower e.g. when pinentry is requrired).
 */
 void
-ParseController::parse(bool offline)
+ParseController::parse_internal (bool offline)
 {
   TSTART;
+  /* The MIME parsing happens while gpg writes the output so it
+     can't be timed on its own.  */
+  static auto s_parse_time = Metrics::instance ()->histogram ("parse.usecs");
+  MetricsTimer parse_timer (s_parse_time);
   // Wrap the input stream in an attachment / GpgME Data
   Protocol protocol;
   bool decrypt, verify;
 
-  Data input (m_inputprovider);
+  Data input (m_inputprovider.get ());
 
   auto inputType = input.type ();
 
@@ -400,7 +573,7 @@ ParseController::parse(bool offline)
     {
       protocol = Protocol::OpenPGP;
     }
-  auto ctx = std::unique_ptr<Context> (Context::createForProtocol (protocol));
+  auto ctx = ContextPool::instance ()->get (protocol);
   if (!ctx)
     {
       log_error ("%s:%s:Failed to create context. Installation broken.",
@@ -445,11 +618,29 @@ ParseController::parse(bool offline)
   if (m_second_pass)
     {
       // Always use a fresh output on second pass
-      delete m_outputprovider;
-      m_outputprovider = new MimeDataProvider (expect_no_mime (m_type));
+      m_outputprovider = std::make_shared<MimeDataProvider> (
+                                                  expect_no_mime (m_type));
     }
 
-  Data output (m_outputprovider);
+  Data output (m_outputprovider.get ());
+  auto early_provider = m_outputprovider;
+  if (decrypt && m_body_ready_cb)
+    {
+      /* Publish the body while the attachments are still being
+         decrypted.  The provider calls this in our thread. */
+      auto provider = early_provider.get ();
+      provider->set_body_done_cb ([this, provider] ()
+        {
+          {
+            std::lock_guard<std::mutex> lock (m_early_mutex);
+            m_early.body = provider->get_body ();
+            m_early.charset = provider->get_body_charset ();
+          }
+          log_debug ("%s:%s:%p: Body ready before decryption is done.",
+                     SRCNAME, __func__, this);
+          m_body_ready_cb ();
+        });
+    }
   log_debug ("%s:%s:%p decrypt: %i verify: %i with protocol: %s sender: %s type: %i",
              SRCNAME, __func__, this,
              decrypt, verify,
@@ -460,7 +651,13 @@ ParseController::parse(bool offline)
     {
       input.seek (0, SEEK_SET);
       TRACEPOINT;
+      static auto s_decrypt_time =
+        Metrics::instance ()->histogram ("parse.decrypt_usecs");
+      MetricsTimer timer (s_decrypt_time);
       auto combined_result = ctx->decryptAndVerify(input, output);
+      timer.stop ();
+      /* The provider might be shared with other controllers.  */
+      early_provider->set_body_done_cb (std::function<void ()> ());
       log_debug ("%s:%s:%p decrypt / verify done.",
                  SRCNAME, __func__, this);
       m_decrypt_result = combined_result.first;
@@ -476,11 +673,10 @@ ParseController::parse(bool offline)
           log_dbg ("Did not have combined result parsing output.");
           /* There is a signature in the output. So we have
              to verify it now as an extra step. */
-          input = Data (m_outputprovider);
-          delete m_inputprovider;
+          input = Data (m_outputprovider.get ());
           m_inputprovider = m_outputprovider;
-          m_outputprovider = new MimeDataProvider();
-          output = Data(m_outputprovider);
+          m_outputprovider = std::make_shared<MimeDataProvider> ();
+          output = Data (m_outputprovider.get ());
           verify = true;
           TRACEPOINT;
         }
@@ -511,32 +707,28 @@ ParseController::parse(bool offline)
   if (verify)
     {
       TRACEPOINT;
+      static auto s_verify_time =
+        Metrics::instance ()->histogram ("parse.verify_usecs");
+      MetricsTimer timer (s_verify_time);
       GpgME::Data *sig = m_inputprovider->signature();
       input.seek (0, SEEK_SET);
       if (sig)
         {
           sig->seek (0, SEEK_SET);
           TRACEPOINT;
-          m_verify_result = ctx->verifyDetachedSignature(*sig, input);
-          log_debug ("%s:%s:%p verify done.",
-                     SRCNAME, __func__, this);
-          /* Copy the input to output to do a mime parsing. */
-          char buf[4096];
-          input.seek (0, SEEK_SET);
           // Use a fresh output
-          auto provider = new MimeDataProvider ();
+          auto provider = std::make_shared<MimeDataProvider> ();
 
           // Warning: The dtor of the Data object touches
-          // the provider. So we have to delete it after
+          // the provider. So we have to release it after
           // the assignment.
-          output = Data (provider);
-          delete m_outputprovider;
+          output = Data (provider.get ());
           m_outputprovider = provider;
-          size_t nread;
-          while ((nread = input.read (buf, 4096)) > 0)
-            {
-              output.write (buf, nread);
-            }
+          /* Verify and do the mime parsing in one pass.  */
+          m_verify_result = verify_detached_and_parse (ctx.get (), *sig,
+                                                       input, output);
+          log_debug ("%s:%s:%p verify done.",
+                     SRCNAME, __func__, this);
         }
       else
         {
@@ -577,7 +769,7 @@ ParseController::parse(bool offline)
               if (utf8)
                 {
                   // Try again after conversion.
-                  ctx = std::unique_ptr<Context> (Context::createForProtocol (protocol));
+                  ctx = ContextPool::instance ()->get (protocol);
                   ctx->setArmor (true);
                   if (!m_sender.empty())
                     {
@@ -588,13 +780,12 @@ ParseController::parse(bool offline)
                   xfree (utf8);
 
                   // Use a fresh output
-                  auto provider = new MimeDataProvider (true);
+                  auto provider = std::make_shared<MimeDataProvider> (true);
 
                   // Warning: The dtor of the Data object touches
-                  // the provider. So we have to delete it after
+                  // the provider. So we have to release it after
                   // the assignment.
-                  output = Data (provider);
-                  delete m_outputprovider;
+                  output = Data (provider.get ());
                   m_outputprovider = provider;
 
                   // Try again
@@ -762,6 +953,17 @@ ParseController::get_attachments() const
     }
 }
 
+const MimeTree &
+ParseController::get_mime_tree () const
+{
+  static const MimeTree s_empty;
+  if (m_outputprovider)
+    {
+      return m_outputprovider->mime_tree ();
+    }
+  return s_empty;
+}
+
 std::string
 ParseController::get_protected_header (const std::string &which) const
 {
@@ -773,6 +975,13 @@ ParseController::get_protected_header (const std::string &which) const
   TRETURN std::string ();
 }
 
+ParseController::early_body_s
+ParseController::get_early_body () const
+{
+  std::lock_guard<std::mutex> lock (m_early_mutex);
+  return m_early;
+}
+
 std::string
 ParseController::get_content_type () const
 {
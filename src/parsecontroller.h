@@ -37,8 +37,12 @@
 #include <gpgme++/verificationresult.h>
 #include <gpgme++/data.h>
 
+#include <functional>
+#include <mutex>
+
 class Attachment;
 class MimeDataProvider;
+class MimeTree;
 
 #ifdef HAVE_W32_SYSTEM
 #include "oomhelp.h"
@@ -63,7 +67,14 @@ public:
   ~ParseController();
 
   /** Main entry point. After execution getters will become
-  valid. */
+  valid.
+
+  If the same input is already being parsed by a different
+  controller, or was parsed successfully a short while ago,
+  its result is shared instead of running the crypto operation
+  again. Outlook often loads the same message into several
+  mail objects at once and each decrypt might need a passphrase
+  or smartcard interaction. */
   void parse (bool offline);
 
   /** Get the Body. Call parse first. */
@@ -85,6 +96,11 @@ public:
   */
   std::vector<std::shared_ptr<Attachment> > get_attachments() const;
 
+  /** The MIME structure of the decrypted / verified content.
+    The attachment index of a part refers to get_attachments.
+    Call parse first. */
+  const MimeTree &get_mime_tree () const;
+
   const GpgME::DecryptionResult decrypt_result() const
   { return m_decrypt_result; }
   const GpgME::VerificationResult verify_result() const
@@ -105,10 +121,40 @@ public:
 
   std::string get_content_type () const;
 
+  /* The text body of the decrypted content before the parse is
+     done.  HTML is only shown once the integrity of the content
+     was checked as it might load content. */
+  struct early_body_s
+  {
+    std::string body;
+    std::string charset;
+  };
+
+  /** Set a function that is called in the parsing thread as soon
+    as the body of the decrypted content is complete while the
+    attachments are still being decrypted.  get_early_body returns
+    the body then.  It is not called if the body is only complete
+    at the end of the content. */
+  void set_body_ready_cb (const std::function<void ()> &cb)
+  { m_body_ready_cb = cb; }
+
+  /** The body as it was when the body ready function was called.
+    Empty before. */
+  early_body_s get_early_body () const;
+
+  /* The result of a parse that can be shared between controllers. */
+  struct parse_result_s;
+
 private:
+  /* Does the actual work for parse. */
+  void parse_internal (bool offline);
+  /* Key to identify parses of the same input. Empty if the
+     result should not be shared. */
+  std::string flight_key (bool offline);
+
   /* State variables */
-  MimeDataProvider *m_inputprovider;
-  MimeDataProvider *m_outputprovider;
+  std::shared_ptr<MimeDataProvider> m_inputprovider;
+  std::shared_ptr<MimeDataProvider> m_outputprovider;
   msgtype_t m_type;
   std::string m_error;
   GpgME::DecryptionResult m_decrypt_result;
@@ -117,6 +163,12 @@ private:
   bool m_block_html;
   autocrypt_s m_autocrypt_info; /* Autocrypt info about the mail */
   bool m_second_pass; /* Second pass parsing with the same controller. */
+  /* Keeps a shared result alive for other controllers. */
+  std::shared_ptr<const parse_result_s> m_result;
+  /* Progressive delivery of the body. */
+  std::function<void ()> m_body_ready_cb;
+  mutable std::mutex m_early_mutex;
+  early_body_s m_early;
 };
 
 #endif /* PARSECONTROLLER_H */
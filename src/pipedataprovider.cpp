@@ -0,0 +1,170 @@
+/* pipedataprovider.cpp - Bounded in memory pipe as GpgME dataprovider
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+
+#include "pipedataprovider.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+#ifndef ESPIPE
+# define ESPIPE 29
+#endif
+
+PipeDataProvider::PipeDataProvider (size_t capacity) :
+  m_buf (capacity ? capacity : 1),
+  m_head (0),
+  m_fill (0),
+  m_total (0),
+  m_closed (false),
+  m_failed (false),
+  m_aborted (false)
+{
+  memdbg_ctor ("PipeDataProvider");
+}
+
+PipeDataProvider::~PipeDataProvider ()
+{
+  memdbg_dtor ("PipeDataProvider");
+}
+
+bool
+PipeDataProvider::isSupported (GpgME::DataProvider::Operation op) const
+{
+  return op == GpgME::DataProvider::Read ||
+         op == GpgME::DataProvider::Write ||
+         op == GpgME::DataProvider::Release;
+}
+
+ssize_t
+PipeDataProvider::read (void *buffer, size_t bufSize)
+{
+  if (!bufSize)
+    {
+      return 0;
+    }
+  std::unique_lock<std::mutex> lock (m_mutex);
+  m_readable.wait (lock, [this] {
+    return m_fill || m_closed || m_aborted;
+  });
+
+  if (!m_fill)
+    {
+      if (m_failed || m_aborted)
+        {
+          errno = EPIPE;
+          return -1;
+        }
+      /* EOF */
+      return 0;
+    }
+
+  const size_t cap = m_buf.size ();
+  size_t nread = 0;
+  char *dst = static_cast<char *> (buffer);
+  while (nread < bufSize && m_fill)
+    {
+      size_t chunk = std::min (bufSize - nread, m_fill);
+      chunk = std::min (chunk, cap - m_head);
+      memcpy (dst + nread, m_buf.data () + m_head, chunk);
+      m_head = (m_head + chunk) % cap;
+      m_fill -= chunk;
+      nread += chunk;
+    }
+  lock.unlock ();
+  m_writable.notify_one ();
+
+  return static_cast<ssize_t> (nread);
+}
+
+ssize_t
+PipeDataProvider::write (const void *buffer, size_t bufSize)
+{
+  const char *src = static_cast<const char *> (buffer);
+  const size_t cap = m_buf.size ();
+  size_t nwritten = 0;
+
+  while (nwritten < bufSize)
+    {
+      std::unique_lock<std::mutex> lock (m_mutex);
+      m_writable.wait (lock, [this, cap] {
+        return m_fill < cap || m_closed || m_aborted;
+      });
+      if (m_closed || m_aborted)
+        {
+          log_debug ("%s:%s: Write to %s pipe.",
+                     SRCNAME, __func__, m_aborted ? "aborted" : "closed");
+          errno = EPIPE;
+          return -1;
+        }
+      while (nwritten < bufSize && m_fill < cap)
+        {
+          const size_t tail = (m_head + m_fill) % cap;
+          size_t chunk = std::min (bufSize - nwritten, cap - m_fill);
+          chunk = std::min (chunk, cap - tail);
+          memcpy (m_buf.data () + tail, src + nwritten, chunk);
+          m_fill += chunk;
+          m_total += chunk;
+          nwritten += chunk;
+        }
+      lock.unlock ();
+      m_readable.notify_one ();
+    }
+
+  return static_cast<ssize_t> (nwritten);
+}
+
+off_t
+PipeDataProvider::seek (off_t, int)
+{
+  errno = ESPIPE;
+  return -1;
+}
+
+void
+PipeDataProvider::close_write (bool failed)
+{
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_closed = true;
+    m_failed = failed;
+  }
+  m_readable.notify_all ();
+  m_writable.notify_all ();
+}
+
+void
+PipeDataProvider::abort ()
+{
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_aborted = true;
+  }
+  m_readable.notify_all ();
+  m_writable.notify_all ();
+}
+
+size_t
+PipeDataProvider::total () const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_total;
+}
@@ -0,0 +1,94 @@
+/* pipedataprovider.h - Bounded in memory pipe as GpgME dataprovider
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PIPEDATAPROVIDER_H
+#define PIPEDATAPROVIDER_H
+
+#include "config.h"
+
+#include <gpgme++/interfaces/dataprovider.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+/** A bounded FIFO between exactly one producer and one consumer
+  thread.
+
+  The producer writes into it (e.g. through a sink or as the output
+  of a crypto operation) while the consumer reads from it (e.g. as
+  the input of a crypto operation).  Writes block while the buffer
+  is full and reads block while it is empty so that at most
+  capacity bytes are held in memory at any time.
+
+  The producer has to call close_write once it is done, otherwise
+  the consumer never sees EOF.  If the consumer stops reading
+  before EOF it has to call abort so that a blocked producer
+  returns an error instead of waiting forever.
+
+  Seeking is not supported.  */
+class PipeDataProvider : public GpgME::DataProvider
+{
+public:
+  explicit PipeDataProvider (size_t capacity = 64 * 1024);
+  ~PipeDataProvider ();
+
+  /* Dataprovider interface */
+  bool isSupported (Operation op) const;
+
+  /** Read up to bufSize bytes.  Blocks until at least one byte is
+    available.  Returns 0 on EOF and -1 with errno set to EPIPE if
+    the producer closed the pipe with an error.  */
+  ssize_t read (void *buffer, size_t bufSize);
+
+  /** Write all of buffer.  Blocks while the pipe is full.  Returns
+    bufSize or -1 with errno set to EPIPE if the pipe was aborted
+    or already closed.  */
+  ssize_t write (const void *buffer, size_t bufSize);
+
+  /* Not supported. Sets errno to ESPIPE. */
+  off_t seek (off_t offset, int whence);
+
+  /* Noop */
+  void release () {}
+
+  /** Signal the end of the data.  If failed is true the reader
+    gets an error instead of EOF after the buffered data.  */
+  void close_write (bool failed = false);
+
+  /** Called by the reader to release a blocked writer.  All
+    further writes fail.  */
+  void abort ();
+
+  /** The number of bytes that went through the pipe. */
+  size_t total () const;
+
+private:
+  mutable std::mutex m_mutex;
+  std::condition_variable m_readable;
+  std::condition_variable m_writable;
+  std::vector<char> m_buf;
+  size_t m_head;
+  size_t m_fill;
+  size_t m_total;
+  bool m_closed;
+  bool m_failed;
+  bool m_aborted;
+};
+
+#endif // PIPEDATAPROVIDER_H
@@ -0,0 +1,642 @@
+/* resolverservice.cpp - Long running key resolver helper
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+#include "cpphelp.h"
+
+#include "resolverservice.h"
+
+#ifdef HAVE_W32_SYSTEM
+# include "common.h"
+# include "w32-gettext.h"
+# include <windows.h>
+#else
+# include <errno.h>
+# include <poll.h>
+# include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+/* Start attempts in a row after which the service is disabled.  */
+#define MAX_START_FAILURES 2
+
+/* Longest line accepted from the helper.  */
+#define MAX_LINE_LEN (64 * 1024)
+
+int
+parse_resolver_output (const std::string &output, resolver_output_s *r_result)
+{
+  TSTART;
+  std::istringstream ss (output);
+  std::string line;
+
+  r_result->sig_fprs.clear ();
+  r_result->recp_fprs.clear ();
+  r_result->proto.clear ();
+  while (std::getline (ss, line))
+    {
+      rtrim (line);
+      if (line == "cancel")
+        {
+          log_debug ("%s:%s: resolver canceled",
+                     SRCNAME, __func__);
+          TRETURN -2;
+        }
+      if (line == "unencrypted")
+        {
+          log_debug ("%s:%s: FIXME resolver wants unencrypted",
+                     SRCNAME, __func__);
+          TRETURN -1;
+        }
+      std::istringstream lss (line);
+
+      // First is sig or enc
+      std::string what;
+      std::string how;
+      std::string fingerprint;
+      std::string mbox;
+
+      std::getline (lss, what, ':');
+      std::getline (lss, how, ':');
+      std::getline (lss, fingerprint, ':');
+      std::getline (lss, mbox, ':');
+
+      if (r_result->proto.empty ())
+        {
+          /* TODO: Allow mixed */
+          r_result->proto = (how == "smime") ? "smime" : "pgp";
+        }
+
+      if (what == "sig")
+        {
+          r_result->sig_fprs.push_back (fingerprint);
+          continue;
+        }
+      if (what == "enc")
+        {
+          r_result->recp_fprs.push_back (std::make_pair (mbox, fingerprint));
+        }
+    }
+  TRETURN 0;
+}
+
+namespace
+{
+  /* Splits the raw data into lines.  */
+  class BufferedConnection: public ResolverService::Connection
+  {
+  public:
+    bool write_line (const std::string &line) override
+      {
+        const std::string data = line + "\n";
+        size_t off = 0;
+        while (off < data.size ())
+          {
+            const long nwritten = write_some (data.data () + off,
+                                              data.size () - off);
+            if (nwritten <= 0)
+              {
+                return false;
+              }
+            off += nwritten;
+          }
+        return true;
+      }
+
+    bool read_line (std::string *r_line, int timeout_ms) override
+      {
+        const auto deadline = std::chrono::steady_clock::now () +
+                              std::chrono::milliseconds (timeout_ms);
+        for (;;)
+          {
+            const size_t pos = m_buf.find ('\n');
+            if (pos != std::string::npos)
+              {
+                r_line->assign (m_buf, 0, pos);
+                m_buf.erase (0, pos + 1);
+                if (!r_line->empty () && r_line->back () == '\r')
+                  {
+                    r_line->pop_back ();
+                  }
+                return true;
+              }
+            if (m_buf.size () > MAX_LINE_LEN)
+              {
+                log_error ("%s:%s: Line too long.", SRCNAME, __func__);
+                return false;
+              }
+            if (timeout_ms >= 0)
+              {
+                const auto left =
+                  std::chrono::duration_cast<std::chrono::milliseconds>
+                    (deadline - std::chrono::steady_clock::now ()).count ();
+                if (left <= 0 || !wait_some ((int) left))
+                  {
+                    log_debug ("%s:%s: Timeout.", SRCNAME, __func__);
+                    return false;
+                  }
+              }
+            char buf[4096];
+            const long nread = read_some (buf, sizeof buf);
+            if (nread <= 0)
+              {
+                return false;
+              }
+            m_buf.append (buf, nread);
+          }
+      }
+
+  protected:
+    virtual long read_some (char *buf, size_t len) = 0;
+    virtual long write_some (const char *buf, size_t len) = 0;
+    /* Wait up to timeout_ms until read_some does not block.  */
+    virtual bool wait_some (int timeout_ms) = 0;
+
+  private:
+    std::string m_buf;
+  };
+
+#ifdef HAVE_W32_SYSTEM
+  class PipeConnection: public BufferedConnection
+  {
+  public:
+    PipeConnection (const PROCESS_INFORMATION &pi, HANDLE to_child,
+                    HANDLE from_child) :
+      m_process (pi.hProcess),
+      m_pid (pi.dwProcessId),
+      m_to_child (to_child),
+      m_from_child (from_child)
+      {
+      }
+
+    ~PipeConnection ()
+      {
+        /* The helper exits on EOF.  */
+        CloseHandle (m_to_child);
+        if (WaitForSingleObject (m_process, 2000) != WAIT_OBJECT_0)
+          {
+            log_debug ("%s:%s: Helper did not exit. Terminating it.",
+                       SRCNAME, __func__);
+            TerminateProcess (m_process, 1);
+          }
+        CloseHandle (m_from_child);
+        CloseHandle (m_process);
+      }
+
+    void prepare_request () override
+      {
+        /* Like SpawnAllowSetFg for the spawned resolver.  */
+        AllowSetForegroundWindow (m_pid);
+      }
+
+  protected:
+    long read_some (char *buf, size_t len) override
+      {
+        DWORD nread = 0;
+        if (!ReadFile (m_from_child, buf, (DWORD) len, &nread, nullptr))
+          {
+            return -1;
+          }
+        return nread;
+      }
+
+    long write_some (const char *buf, size_t len) override
+      {
+        DWORD nwritten = 0;
+        if (!WriteFile (m_to_child, buf, (DWORD) len, &nwritten, nullptr))
+          {
+            return -1;
+          }
+        return nwritten;
+      }
+
+    bool wait_some (int timeout_ms) override
+      {
+        /* Anonymous pipes can't be waited for, so peek until the
+           helper writes something or exits.  */
+        const DWORD start = GetTickCount ();
+        for (;;)
+          {
+            DWORD avail = 0;
+            if (!PeekNamedPipe (m_from_child, nullptr, 0, nullptr, &avail,
+                                nullptr) || avail)
+              {
+                /* On error the read fails right away.  */
+                return true;
+              }
+            const DWORD waited = GetTickCount () - start;
+            if (waited >= (DWORD) timeout_ms)
+              {
+                return false;
+              }
+            if (WaitForSingleObject (m_process,
+                                     std::min<DWORD> (50, timeout_ms - waited))
+                == WAIT_OBJECT_0)
+              {
+                /* Exited.  Whatever it wrote is in the pipe now.  */
+                return true;
+              }
+          }
+      }
+
+  private:
+    HANDLE m_process;
+    DWORD m_pid;
+    HANDLE m_to_child;
+    HANDLE m_from_child;
+  };
+#else
+  class FdConnection: public BufferedConnection
+  {
+  public:
+    FdConnection (int read_fd, int write_fd) :
+      m_read_fd (read_fd),
+      m_write_fd (write_fd)
+      {
+      }
+
+    ~FdConnection ()
+      {
+        close (m_write_fd);
+        close (m_read_fd);
+      }
+
+  protected:
+    long read_some (char *buf, size_t len) override
+      {
+        ssize_t nread;
+        do
+          {
+            nread = read (m_read_fd, buf, len);
+          }
+        while (nread < 0 && errno == EINTR);
+        return nread;
+      }
+
+    long write_some (const char *buf, size_t len) override
+      {
+        ssize_t nwritten;
+        do
+          {
+            nwritten = write (m_write_fd, buf, len);
+          }
+        while (nwritten < 0 && errno == EINTR);
+        return nwritten;
+      }
+
+    bool wait_some (int timeout_ms) override
+      {
+        struct pollfd pfd;
+        pfd.fd = m_read_fd;
+        pfd.events = POLLIN;
+        int ret;
+        do
+          {
+            ret = poll (&pfd, 1, timeout_ms);
+          }
+        while (ret < 0 && errno == EINTR);
+        /* On error the read fails right away.  */
+        return ret != 0;
+      }
+
+  private:
+    int m_read_fd;
+    int m_write_fd;
+  };
+#endif
+} // namespace
+
+#ifdef HAVE_W32_SYSTEM
+/* Start resolver.exe in server mode with pipes as stdin and
+   stdout.  */
+static std::unique_ptr<ResolverService::Connection>
+launch_resolver ()
+{
+  TSTART;
+  char *gpg4win_dir = get_gpg4win_dir ();
+  if (!gpg4win_dir)
+    {
+      TRACEPOINT;
+      TRETURN nullptr;
+    }
+  const auto resolver = std::string (gpg4win_dir) + "\\bin\\resolver.exe";
+  xfree (gpg4win_dir);
+
+  log_debug ("%s:%s: Starting '%s' as server",
+             SRCNAME, __func__, resolver.c_str ());
+
+  SECURITY_ATTRIBUTES sa;
+  memset (&sa, 0, sizeof sa);
+  sa.nLength = sizeof sa;
+  sa.bInheritHandle = TRUE;
+
+  HANDLE in_read = nullptr, in_write = nullptr;
+  HANDLE out_read = nullptr, out_write = nullptr;
+  if (!CreatePipe (&in_read, &in_write, &sa, 0))
+    {
+      log_error ("%s:%s: Failed to create pipe.", SRCNAME, __func__);
+      TRETURN nullptr;
+    }
+  if (!CreatePipe (&out_read, &out_write, &sa, 0))
+    {
+      log_error ("%s:%s: Failed to create pipe.", SRCNAME, __func__);
+      CloseHandle (in_read);
+      CloseHandle (in_write);
+      TRETURN nullptr;
+    }
+  /* Our ends must not be inherited or the helper never sees EOF.  */
+  SetHandleInformation (in_write, HANDLE_FLAG_INHERIT, 0);
+  SetHandleInformation (out_read, HANDLE_FLAG_INHERIT, 0);
+  HANDLE null_handle = CreateFileW (L"NUL", GENERIC_WRITE, FILE_SHARE_WRITE,
+                                    &sa, OPEN_EXISTING, 0, nullptr);
+
+  /* Only the handles of the helper are inherited and not every
+     inheritable handle that Outlook has open.  */
+  HANDLE inherit[3] = { in_read, out_write, null_handle };
+  const DWORD n_inherit = null_handle != INVALID_HANDLE_VALUE ? 3 : 2;
+  SIZE_T attr_size = 0;
+  InitializeProcThreadAttributeList (nullptr, 1, 0, &attr_size);
+  auto attrs = (LPPROC_THREAD_ATTRIBUTE_LIST) xmalloc (attr_size);
+  const bool have_attrs =
+    InitializeProcThreadAttributeList (attrs, 1, 0, &attr_size);
+  const bool have_list = have_attrs &&
+    UpdateProcThreadAttribute (attrs, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+                               inherit, n_inherit * sizeof (HANDLE),
+                               nullptr, nullptr);
+  if (!have_list)
+    {
+      log_error ("%s:%s: Failed to set up the handle list: %lu",
+                 SRCNAME, __func__, GetLastError ());
+    }
+
+  STARTUPINFOEXW si;
+  memset (&si, 0, sizeof si);
+  si.StartupInfo.cb = sizeof si;
+  si.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+  si.StartupInfo.hStdInput = in_read;
+  si.StartupInfo.hStdOutput = out_write;
+  si.StartupInfo.hStdError = n_inherit == 3 ? null_handle : nullptr;
+  si.lpAttributeList = attrs;
+
+  PROCESS_INFORMATION pi;
+  memset (&pi, 0, sizeof pi);
+  const std::string cmdline = "\"" + resolver + "\" --server --debug";
+  wchar_t *wcmdline = utf8_to_wchar (cmdline.c_str ());
+  const bool started = have_list && wcmdline &&
+                       CreateProcessW (nullptr, wcmdline, nullptr, nullptr,
+                                       TRUE, EXTENDED_STARTUPINFO_PRESENT,
+                                       nullptr, nullptr,
+                                       &si.StartupInfo, &pi);
+  xfree (wcmdline);
+  if (have_attrs)
+    {
+      DeleteProcThreadAttributeList (attrs);
+    }
+  xfree (attrs);
+
+  CloseHandle (in_read);
+  CloseHandle (out_write);
+  if (null_handle != INVALID_HANDLE_VALUE)
+    {
+      CloseHandle (null_handle);
+    }
+  if (!started)
+    {
+      log_error ("%s:%s: Failed to start resolver: %lu",
+                 SRCNAME, __func__, GetLastError ());
+      CloseHandle (in_write);
+      CloseHandle (out_read);
+      TRETURN nullptr;
+    }
+  CloseHandle (pi.hThread);
+  TRETURN std::unique_ptr<ResolverService::Connection> (
+    new PipeConnection (pi, in_write, out_read));
+}
+#else
+std::unique_ptr<ResolverService::Connection>
+ResolverService::fd_connection (int read_fd, int write_fd)
+{
+  return std::unique_ptr<Connection> (new FdConnection (read_fd, write_fd));
+}
+#endif
+
+ResolverService::ResolverService (const Launcher &launcher,
+                                  int greeting_timeout_ms) :
+  m_launcher (launcher),
+  m_start_failures (0),
+  m_greeting_timeout_ms (greeting_timeout_ms)
+{
+}
+
+ResolverService::~ResolverService ()
+{
+  stop ();
+}
+
+ResolverService *
+ResolverService::instance ()
+{
+  /* Intentionally leaked like the other singletons.  */
+#ifdef HAVE_W32_SYSTEM
+  static ResolverService *s_service = new ResolverService (launch_resolver);
+#else
+  static ResolverService *s_service = new ResolverService (
+    [] () { return std::unique_ptr<Connection> (); });
+#endif
+  return s_service;
+}
+
+std::string
+ResolverService::escape (const std::string &str)
+{
+  std::string ret;
+  ret.reserve (str.size ());
+  for (const char c: str)
+    {
+      if (c == '%' || c == '\r' || c == '\n')
+        {
+          ret += '%';
+          ret += tohex ((c >> 4) & 15);
+          ret += tohex (c & 15);
+          continue;
+        }
+      ret += c;
+    }
+  return ret;
+}
+
+std::string
+ResolverService::unescape (const std::string &str)
+{
+  std::string ret;
+  ret.reserve (str.size ());
+  for (size_t i = 0; i < str.size (); i++)
+    {
+      if (str[i] == '%' && i + 2 < str.size ()
+          && hexdigitp (str.c_str () + i + 1)
+          && hexdigitp (str.c_str () + i + 2))
+        {
+          ret += (char) xtoi_2 (str.c_str () + i + 1);
+          i += 2;
+          continue;
+        }
+      ret += str[i];
+    }
+  return ret;
+}
+
+/* Called with the mutex held.  */
+bool
+ResolverService::start_locked ()
+{
+  if (m_conn)
+    {
+      return true;
+    }
+  if (m_start_failures >= MAX_START_FAILURES)
+    {
+      return false;
+    }
+
+  auto conn = m_launcher ? m_launcher () : std::unique_ptr<Connection> ();
+  if (!conn)
+    {
+      m_start_failures++;
+      log_debug ("%s:%s: Resolver service not available.%s",
+                 SRCNAME, __func__,
+                 m_start_failures >= MAX_START_FAILURES ?
+                 " Disabling it." : "");
+      return false;
+    }
+  /* A resolver without server mode exits or keeps running without
+     ever greeting, so don't wait forever and don't try again.
+     Dropping the connection stops the helper.  */
+  std::string greeting;
+  if (!conn->read_line (&greeting, m_greeting_timeout_ms) ||
+      !starts_with (greeting, "OK"))
+    {
+      m_start_failures = MAX_START_FAILURES;
+      log_debug ("%s:%s: Resolver does not speak the protocol. "
+                 "Disabling the service.", SRCNAME, __func__);
+      return false;
+    }
+  log_debug ("%s:%s: Resolver service started: '%s'",
+             SRCNAME, __func__, greeting.c_str ());
+  m_start_failures = 0;
+  m_conn = std::move (conn);
+  return true;
+}
+
+bool
+ResolverService::start ()
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return start_locked ();
+}
+
+ResolverService::Result
+ResolverService::resolve (const std::vector<std::string> &args,
+                          std::string *r_output)
+{
+  TSTART;
+  std::lock_guard<std::mutex> lock (m_mutex);
+  if (!start_locked ())
+    {
+      TRETURN NotAvailable;
+    }
+
+  m_conn->prepare_request ();
+  bool ok = true;
+  for (const auto &arg: args)
+    {
+      ok = ok && m_conn->write_line ("ARG " + escape (arg));
+    }
+  if (!ok || !m_conn->write_line ("RESOLVE"))
+    {
+      /* Without RESOLVE the helper does nothing, so spawning the
+         resolver can not show a second dialog.  */
+      log_error ("%s:%s: Failed to send the request.", SRCNAME, __func__);
+      stop_locked ();
+      TRETURN NotAvailable;
+    }
+
+  std::string output;
+  std::string line;
+  for (;;)
+    {
+      if (!m_conn->read_line (&line))
+        {
+          log_error ("%s:%s: Lost the resolver service.",
+                     SRCNAME, __func__);
+          break;
+        }
+      if (starts_with (line, "D "))
+        {
+          output += unescape (line.substr (2)) + "\n";
+          continue;
+        }
+      if (line == "OK" || starts_with (line, "OK "))
+        {
+          *r_output = output;
+          TRETURN Resolved;
+        }
+      if (starts_with (line, "ERR"))
+        {
+          /* The helper is still fine, only this request failed.  */
+          log_error ("%s:%s: Resolver service failed: '%s'",
+                     SRCNAME, __func__, line.c_str ());
+          TRETURN Failed;
+        }
+      log_error ("%s:%s: Unexpected line from resolver service.",
+                 SRCNAME, __func__);
+      break;
+    }
+
+  stop_locked ();
+  TRETURN Failed;
+}
+
+/* Called with the mutex held.  */
+void
+ResolverService::stop_locked ()
+{
+  if (!m_conn)
+    {
+      return;
+    }
+  m_conn->write_line ("BYE");
+  m_conn.reset ();
+}
+
+void
+ResolverService::stop ()
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  stop_locked ();
+}
+
+bool
+ResolverService::disabled () const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_start_failures >= MAX_START_FAILURES;
+}
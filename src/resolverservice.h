@@ -0,0 +1,156 @@
+/* resolverservice.h - Long running key resolver helper
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RESOLVERSERVICE_H
+#define RESOLVERSERVICE_H
+
+#include "config.h"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/** The result of a resolver run. */
+struct resolver_output_s
+{
+  /* Fingerprints of the signing keys.  */
+  std::vector<std::string> sig_fprs;
+  /* Pairs of mailbox and fingerprint of the encryption keys.  */
+  std::vector<std::pair<std::string, std::string> > recp_fprs;
+  /* The protocol of the first line, "pgp" or "smime".  Empty if
+     there was no line.  */
+  std::string proto;
+};
+
+/** Parse what the resolver writes to stdout.  Each line has the
+  form "sig|enc:pgp|smime:<fingerprint>[:<mailbox>]".  Returns 0 on
+  success, -1 if the user wants to send unencrypted and -2 if the
+  user canceled. */
+int parse_resolver_output (const std::string &output,
+                           resolver_output_s *r_result);
+
+/** Talks to a resolver that keeps running between requests.
+
+  Spawning resolver.exe for each mail means a process start and a
+  full key listing before the dialog shows up.  The helper is
+  started once with --server and keeps its key state while it
+  runs.  The protocol is line based over its stdin and stdout:
+
+    helper: OK <greeting>               once after the start
+    client: ARG <arg>                   for each argument
+    client: RESOLVE
+    helper: D <line>                    for each line of output
+    helper: OK | ERR <description>
+    client: BYE                         before the helper is stopped
+
+  Arguments and data are the same as for a spawned resolver, with
+  "%", CR and LF percent escaped.  Requests are serialized.
+
+  If the helper can not be started or the request could not be
+  handed to it, the caller spawns the resolver as before.  Once
+  RESOLVE was sent the helper may already show its dialog, so an
+  error or a lost helper after that fails the resolution.  After
+  repeated start failures the service is disabled for the session.
+  A helper that does not greet in time, e.g. a resolver that has
+  no server mode, disables it right away.
+
+  Released resolvers have no server mode yet, so the service is
+  only used with the "resolverService" option.  */
+class ResolverService
+{
+public:
+  /** A line based connection to the helper.  Destroying it stops
+    the helper. */
+  class Connection
+  {
+  public:
+    virtual ~Connection () {}
+    /** Write line followed by a LF. */
+    virtual bool write_line (const std::string &line) = 0;
+    /** Read a line without the LF.  False on EOF or error or if
+      no line came within timeout_ms.  A negative timeout waits
+      forever. */
+    virtual bool read_line (std::string *r_line, int timeout_ms = -1) = 0;
+    /** Called before each request, e.g. to allow the helper to
+      bring its dialog to the front. */
+    virtual void prepare_request () {}
+  };
+
+  /** Starts the helper.  Returns nullptr on failure. */
+  typedef std::function<std::unique_ptr<Connection> ()> Launcher;
+
+  /** Create the service.  The helper has to greet within
+    greeting_timeout_ms after it was started. */
+  explicit ResolverService (const Launcher &launcher,
+                            int greeting_timeout_ms = 10000);
+  ~ResolverService ();
+
+  /** The service for the resolver of the Gpg4win installation. */
+  static ResolverService *instance ();
+
+  /** Start the helper if it is not running so that the first
+    request does not have to wait.  Returns false if it is not
+    available. */
+  bool start ();
+
+  enum Result
+    {
+      /* The request did not reach the helper.  Spawn the resolver
+         instead.  */
+      NotAvailable = 0,
+      Resolved,
+      /* The helper got the request but failed.  */
+      Failed
+    };
+
+  /** Run the resolver with args, which do not include the program
+    name.  If Resolved is returned r_output is what a spawned
+    resolver would have written to stdout. */
+  Result resolve (const std::vector<std::string> &args,
+                  std::string *r_output);
+
+  /** Stop the helper.  The next request starts a new one. */
+  void stop ();
+
+  bool disabled () const;
+
+  static std::string escape (const std::string &str);
+  static std::string unescape (const std::string &str);
+
+#ifndef HAVE_W32_SYSTEM
+  /** A connection over file descriptors.  Both are closed with
+    the connection.  */
+  static std::unique_ptr<Connection> fd_connection (int read_fd,
+                                                    int write_fd);
+#endif
+
+private:
+  bool start_locked ();
+  void stop_locked ();
+
+  mutable std::mutex m_mutex;
+  Launcher m_launcher;
+  std::unique_ptr<Connection> m_conn;
+  int m_start_failures;
+  const int m_greeting_timeout_ms;
+};
+
+#endif // RESOLVERSERVICE_H
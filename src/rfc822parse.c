@@ -42,6 +42,10 @@
 #include "common_indep.h"
 #include "rfc822parse.h"
 
+#if defined(HAVE_W32_SYSTEM) && !defined(BUILD_TESTS)
+# include "mlang-charset.h"
+#endif
+
 enum token_type
   {
     tSPACE,
@@ -51,9 +55,8 @@ enum token_type
     tSPECIAL
   };
 
-/* For now we directly use our TOKEN as the parse context */
-typedef struct rfc822parse_field_context *TOKEN;
-struct rfc822parse_field_context
+typedef struct token_s *TOKEN;
+struct token_s
 {
   TOKEN next;
   enum token_type type;
@@ -65,6 +68,27 @@ struct rfc822parse_field_context
   char data[1];
 };
 
+/* A parameter of a parsed field.  RFC 2231 continuations are merged
+   into one parameter and extended values are decoded to UTF-8.  */
+struct field_param
+{
+  const char *name;     /* Lowercase name; points into a token.  */
+  char *value;          /* Points into a token or to BUFFER.  */
+  char *buffer;         /* Allocated value or NULL.  */
+  unsigned int extended:1; /* Value taken from an RFC 2231 parameter. */
+  unsigned int lowered:1;
+};
+
+/* The parse context of a field.  The parameters are collected once
+   when the field is parsed so that queries need not walk the
+   tokens.  */
+struct rfc822parse_field_context
+{
+  TOKEN tokens;
+  struct field_param *params;
+  int nparams;
+};
+
 struct hdr_line
 {
   struct hdr_line *next;
@@ -95,12 +119,23 @@ struct rfc822parse_context
   part_t parts;         /* The tree of parts. */
   part_t current_part;  /* Whom we are processing (points into parts). */
   const char *boundary; /* Current boundary. */
+  size_t boundary_len;  /* Length of BOUNDARY. */
 };
 
 static HDR_LINE find_header (rfc822parse_t msg, const char *name,
 			     int which, HDR_LINE * rprev);
 
 
+/* Set the current boundary.  The length is cached as we need it
+   for every body line. */
+static void
+set_boundary (rfc822parse_t msg, const char *boundary)
+{
+  msg->boundary = boundary;
+  msg->boundary_len = boundary? strlen (boundary) : 0;
+}
+
+
 static size_t
 length_sans_trailing_ws (const unsigned char *line, size_t len)
 {
@@ -222,7 +257,7 @@ release_handle_data (rfc822parse_t msg)
   release_part (msg->parts);
   msg->parts = NULL;
   msg->current_part = NULL;
-  msg->boundary = NULL;
+  set_boundary (msg, NULL);
 }
 
 
@@ -322,7 +357,7 @@ set_current_part_to_parent (rfc822parse_t msg)
   msg->current_part = parent;
 
   parent = find_parent (msg->parts, parent);
-  msg->boundary = parent? parent->boundary: NULL;
+  set_boundary (msg, parent? parent->boundary: NULL);
 }
 
 
@@ -361,7 +396,7 @@ transition_to_body (rfc822parse_t msg)
                       part_t part;
 
                       strcpy (msg->current_part->boundary, s);
-                      msg->boundary = msg->current_part->boundary;
+                      set_boundary (msg, msg->current_part->boundary);
                       part = new_part ();
                       if (!part)
                         {
@@ -454,7 +489,7 @@ insert_body (rfc822parse_t msg, const unsigned char *line, size_t length)
 
   if (length > 2 && *line == '-' && line[1] == '-' && msg->boundary)
     {
-      size_t blen = strlen (msg->boundary);
+      size_t blen = msg->boundary_len;
 
       if (length == blen + 2
           && !memcmp (line+2, msg->boundary, blen))
@@ -470,7 +505,7 @@ insert_body (rfc822parse_t msg, const unsigned char *line, size_t length)
           && !memcmp (line+2, msg->boundary, blen))
         {
           rc = do_callback (msg, RFC822PARSE_LAST_BOUNDARY);
-          msg->boundary = NULL; /* No current boundary anymore. */
+          set_boundary (msg, NULL); /* No current boundary anymore. */
           set_current_part_to_parent (msg);
 
           /* Fixme: The next should actually be send right before the
@@ -496,6 +531,33 @@ rfc822parse_insert (rfc822parse_t msg, const unsigned char *line, size_t length)
 }
 
 
+/* Return true if the next line is inserted into the header of a
+   part.  */
+int
+rfc822parse_in_header (rfc822parse_t msg)
+{
+  return !msg->in_body;
+}
+
+
+/* Return true if the parser is in the body of a part and not in a
+   preamble.  In that state a line is only of interest to the parser
+   if it is a boundary line so a caller may skip over all other lines
+   without inserting them.  The current boundary is stored at
+   R_BOUNDARY and its length at R_BOUNDARY_LEN; the boundary is NULL
+   if the body extends to the end of the message.  */
+int
+rfc822parse_in_plain_body (rfc822parse_t msg, const char **r_boundary,
+                           size_t *r_boundary_len)
+{
+  if (!msg->in_body || msg->in_preamble)
+    return 0;
+  *r_boundary = msg->boundary;
+  *r_boundary_len = msg->boundary_len;
+  return 1;
+}
+
+
 /* Tell the parser that we have finished the message. */
 int
 rfc822parse_finish (rfc822parse_t msg)
@@ -949,6 +1011,289 @@ parse_field (HDR_LINE hdr)
 
 
 
+/****************
+ * Check whether T points to a parameter.
+ * A parameter starts with a semicolon and it is assumed that t
+ * points to exactly this one.
+ */
+static int
+is_parameter (TOKEN t)
+{
+  t = t->next;
+  if (!t || t->type != tATOM)
+    return 0;
+  t = t->next;
+  if (!t || !(t->type == tSPECIAL && t->data[0] == '='))
+    return 0;
+  t = t->next;
+  if (!t)
+    return 1; /* We assume that an non existing value is an empty one. */
+  return t->type == tQUOTED || t->type == tATOM;
+}
+
+
+/* A section of an RFC 2231 parameter.  */
+struct param_piece
+{
+  const char *name;     /* The name without the section suffix.  */
+  long section;
+  int encoded;          /* The value is percent encoded.  */
+  int order;            /* Position in the field.  */
+  const char *value;
+};
+
+static int
+compare_pieces (const void *a_arg, const void *b_arg)
+{
+  const struct param_piece *a = a_arg;
+  const struct param_piece *b = b_arg;
+  int cmp = strcmp (a->name, b->name);
+
+  if (cmp)
+    return cmp;
+  if (a->section != b->section)
+    return a->section < b->section ? -1 : 1;
+  return a->order - b->order;
+}
+
+static int
+hexval (int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* Append S to BUFFER at *R_LENGTH and decode %xx escapes if
+   ENCODED is set.  The output is never longer than S.  */
+static void
+append_section (char *buffer, size_t *r_length, const char *s, int encoded)
+{
+  size_t n = *r_length;
+
+  for (; *s; s++)
+    {
+      if (encoded && *s == '%' && hexval (s[1]) >= 0 && hexval (s[2]) >= 0)
+        {
+          buffer[n++] = hexval (s[1]) * 16 + hexval (s[2]);
+          s += 2;
+        }
+      else
+        buffer[n++] = *s;
+    }
+  *r_length = n;
+}
+
+/* Return a malloced UTF-8 version of the LENGTH bytes at RAW which
+   are in CHARSET.  Unknown charsets are returned unchanged.  */
+static char *
+param_to_utf8 (const char *charset, const char *raw, size_t length)
+{
+  const unsigned char *s;
+  char *result, *d;
+
+  if (!strcasecmp (charset, "iso-8859-1") || !strcasecmp (charset, "latin1"))
+    {
+      result = xmalloc (2 * length + 1);
+      if (!result)
+        return NULL;
+      for (s = (const unsigned char *)raw, d = result; length; s++, length--)
+        {
+          if (*s < 0x80)
+            *d++ = *s;
+          else
+            {
+              *d++ = 0xc0 | (*s >> 6);
+              *d++ = 0x80 | (*s & 0x3f);
+            }
+        }
+      *d = 0;
+      return result;
+    }
+#if defined(HAVE_W32_SYSTEM) && !defined(BUILD_TESTS)
+  if (*charset && strcasecmp (charset, "utf-8")
+      && strcasecmp (charset, "us-ascii"))
+    {
+      result = ansi_charset_to_utf8 (charset, raw, length, 0);
+      if (result)
+        return result;
+    }
+#endif
+  result = xmalloc (length + 1);
+  if (!result)
+    return NULL;
+  memcpy (result, raw, length);
+  result[length] = 0;
+  return result;
+}
+
+static struct field_param *
+find_param (rfc822parse_field_t field, const char *name)
+{
+  int i;
+
+  for (i = 0; i < field->nparams; i++)
+    if (!strcmp (field->params[i].name, name))
+      return field->params + i;
+  return NULL;
+}
+
+/* Merge the sorted sections PIECES of one RFC 2231 parameter and
+   store it in FIELD.  Returns 0 on success.  */
+static int
+merge_pieces (rfc822parse_field_t field, struct param_piece *pieces, int n)
+{
+  struct field_param *p;
+  const char *charset = "";
+  const char *value, *q;
+  char *raw, *result;
+  size_t length = 0;
+  size_t start = 0;
+  long section = 0;
+  int i, count;
+
+  /* Only the sections from 0 on without a gap count.  The first of
+     duplicate sections wins.  */
+  for (i = count = 0; i < n; i++)
+    {
+      if (pieces[i].section == section)
+        {
+          pieces[count++] = pieces[i];
+          length += strlen (pieces[i].value);
+          section++;
+        }
+      else if (pieces[i].section > section)
+        break;
+    }
+  if (!count)
+    return 0;
+
+  raw = xmalloc (length + 1);
+  if (!raw)
+    return -1;
+  length = 0;
+  for (i = 0; i < count; i++)
+    {
+      value = pieces[i].value;
+      if (!i && pieces[i].encoded
+          && (q = strchr (value, '\'')) && strchr (q + 1, '\''))
+        {
+          /* charset'language'value; we ignore the language.  */
+          append_section (raw, &length, value, 0);
+          raw[q - value] = 0;
+          charset = raw;
+          length = start = q - value + 1;
+          value = strchr (q + 1, '\'') + 1;
+        }
+      append_section (raw, &length, value, pieces[i].encoded);
+    }
+  raw[length] = 0;
+  result = param_to_utf8 (charset, raw + start, length - start);
+  xfree (raw);
+  if (!result)
+    return -1;
+
+  /* The extended value takes precedence over a plain one which
+     clients add for old readers.  */
+  p = find_param (field, pieces[0].name);
+  if (!p)
+    {
+      p = field->params + field->nparams++;
+      p->name = pieces[0].name;
+    }
+  xfree (p->buffer);
+  p->value = p->buffer = result;
+  p->extended = 1;
+  p->lowered = 0;
+  return 0;
+}
+
+/* Collect the parameters of FIELD.  Returns 0 on success.  */
+static int
+collect_params (rfc822parse_field_t field)
+{
+  struct param_piece *pieces;
+  struct field_param *p;
+  TOKEN t, a, v;
+  char *star, *end;
+  int n = 0, npieces = 0, i, j;
+  int rc = 0;
+
+  for (t = field->tokens; t; t = t->next)
+    if (t->type == tSPECIAL && t->data[0] == ';' && is_parameter (t))
+      n++;
+  if (!n)
+    return 0;
+  field->params = xcalloc (n, sizeof *field->params);
+  pieces = xcalloc (n, sizeof *pieces);
+  if (!field->params || !pieces)
+    {
+      xfree (pieces);
+      return -1;
+    }
+
+  for (t = field->tokens; t; t = t->next)
+    {
+      if (!(t->type == tSPECIAL && t->data[0] == ';' && is_parameter (t)))
+        continue;
+      a = t->next;
+      v = a->next->next;
+      if (!a->flags.lowered)
+        {
+          lowercase_string (a->data);
+          a->flags.lowered = 1;
+        }
+
+      star = strchr (a->data, '*');
+      if (!star)
+        {
+          /* A plain parameter; the first one of a name wins.  */
+          if (find_param (field, a->data))
+            continue;
+          p = field->params + field->nparams++;
+          p->name = a->data;
+          /* A missing value is the empty string at the end of the
+             name.  */
+          p->value = v ? v->data : a->data + strlen (a->data);
+          continue;
+        }
+
+      /* An RFC 2231 parameter "name*", "name*N" or "name*N*".  */
+      pieces[npieces].encoded = 1;
+      pieces[npieces].section = 0;
+      if (star[1])
+        {
+          pieces[npieces].section = strtol (star + 1, &end, 10);
+          if (!(star[1] >= '0' && star[1] <= '9'))
+            continue;
+          pieces[npieces].encoded = *end == '*';
+          if (*end && !(*end == '*' && !end[1]))
+            continue;
+        }
+      *star = 0;
+      pieces[npieces].name = a->data;
+      pieces[npieces].order = npieces;
+      pieces[npieces].value = v ? v->data : "";
+      npieces++;
+    }
+
+  qsort (pieces, npieces, sizeof *pieces, compare_pieces);
+  for (i = 0; i < npieces && !rc; i = j)
+    {
+      for (j = i + 1; j < npieces && !strcmp (pieces[i].name, pieces[j].name);
+           j++)
+        ;
+      rc = merge_pieces (field, pieces + i, j - i);
+    }
+  xfree (pieces);
+  return rc;
+}
+
+
 /****************
  * Find and parse a header field.
  * WHICH indicates what to do if there are multiple instance of the same
@@ -963,6 +1308,8 @@ rfc822parse_field_t
 rfc822parse_parse_field (rfc822parse_t msg, const char *name, int which)
 {
   HDR_LINE hdr;
+  TOKEN tokens;
+  rfc822parse_field_t field;
 
   if (!which)
     return NULL;
@@ -970,38 +1317,40 @@ rfc822parse_parse_field (rfc822parse_t msg, const char *name, int which)
   hdr = find_header (msg, name, which, NULL);
   if (!hdr)
     return NULL;
-  return parse_field (hdr);
+  tokens = parse_field (hdr);
+  if (!tokens)
+    return NULL;
+  field = xcalloc (1, sizeof *field);
+  if (!field)
+    {
+      release_token_list (tokens);
+      return NULL;
+    }
+  field->tokens = tokens;
+  if (collect_params (field))
+    {
+      rfc822parse_release_field (field);
+      return NULL;
+    }
+  return field;
 }
 
 void
 rfc822parse_release_field (rfc822parse_field_t ctx)
 {
-  if (ctx)
-    release_token_list (ctx);
+  int i;
+
+  if (!ctx)
+    return;
+  release_token_list (ctx->tokens);
+  for (i = 0; i < ctx->nparams; i++)
+    xfree (ctx->params[i].buffer);
+  xfree (ctx->params);
+  xfree (ctx);
 }
 
 
 
-/****************
- * Check whether T points to a parameter.
- * A parameter starts with a semicolon and it is assumed that t
- * points to exactly this one.
- */
-static int
-is_parameter (TOKEN t)
-{
-  t = t->next;
-  if (!t || t->type != tATOM)
-    return 0;
-  t = t->next;
-  if (!t || !(t->type == tSPECIAL && t->data[0] == '='))
-    return 0;
-  t = t->next;
-  if (!t)
-    return 1; /* We assume that an non existing value is an empty one. */
-  return t->type == tQUOTED || t->type == tATOM;
-}
-
 /*
    Some header (Content-type) have a special syntax where attribute=value
    pairs are used after a leading semicolon.  The parse_field code
@@ -1011,6 +1360,10 @@ is_parameter (TOKEN t)
    parse context is valid; NULL is returned in case that attr is not
    defined in the header, a missing value is represented by an empty string.
 
+   Continuations and charset encoded values as defined in RFC2231
+   are merged and returned as UTF-8; such a value is preferred over a
+   plain one of the same name.
+
    With LOWER_VALUE set to true, a matching field value will be
    lowercased.
 
@@ -1022,11 +1375,15 @@ const char *
 rfc822parse_query_parameter (rfc822parse_field_t ctx, const char *attr,
                              int lower_value)
 {
-  TOKEN t, a;
+  struct field_param *p;
+  TOKEN t;
+
+  if (!ctx)
+    return NULL;
 
   if (!attr)
     {
-      t = ctx;
+      t = ctx->tokens;
       if (t
           && (t->type == tATOM || t->type == tQUOTED || t->type == tDOMAINLIT))
         {
@@ -1040,37 +1397,15 @@ rfc822parse_query_parameter (rfc822parse_field_t ctx, const char *attr,
       return NULL;
     }
 
-  for (t = ctx; t; t = t->next)
+  p = find_param (ctx, attr);
+  if (!p)
+    return NULL;
+  if (lower_value && !p->lowered)
     {
-      /* skip to the next semicolon */
-      for (; t && !(t->type == tSPECIAL && t->data[0] == ';'); t = t->next)
-	;
-      if (!t)
-	return NULL;
-      if (is_parameter (t))
-	{ /* Look closer. */
-	  a = t->next; /* We know that this is an atom */
-          if ( !a->flags.lowered )
-            {
-              lowercase_string (a->data);
-              a->flags.lowered = 1;
-            }
-	  if (!strcmp (a->data, attr))
-	    { /* found */
-	      t = a->next->next;
-	      /* Either T is now an atom, a quoted string or NULL in
-	       * which case we return an empty string. */
-
-              if ( lower_value && t && !t->flags.lowered )
-                {
-                  lowercase_string (t->data);
-                  t->flags.lowered = 1;
-                }
-	      return t ? t->data : "";
-	    }
-	}
+      lowercase_string (p->value);
+      p->lowered = 1;
     }
-  return NULL;
+  return p->value;
 }
 
 /****************
@@ -1084,7 +1419,7 @@ rfc822parse_query_parameter (rfc822parse_field_t ctx, const char *attr,
 const char *
 rfc822parse_query_media_type (rfc822parse_field_t ctx, const char **subtype)
 {
-  TOKEN t = ctx;
+  TOKEN t = ctx->tokens;
   const char *type;
 
   if (t->type != tATOM)
@@ -66,6 +66,11 @@ int rfc822parse_finish (rfc822parse_t msg);
 int rfc822parse_insert (rfc822parse_t msg,
                         const unsigned char *line, size_t length);
 
+int rfc822parse_in_header (rfc822parse_t msg);
+
+int rfc822parse_in_plain_body (rfc822parse_t msg, const char **r_boundary,
+                               size_t *r_boundary_len);
+
 char *rfc822parse_get_field (rfc822parse_t msg, const char *name, int which,
                              size_t *valueoff);
 
@@ -0,0 +1,161 @@
+/* scheduler.cpp - A single thread for delayed jobs
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+
+#include "scheduler.h"
+
+Scheduler::Scheduler () :
+  m_blocked (0),
+  m_shutdown (false)
+{
+  m_thread = std::thread (&Scheduler::run, this);
+}
+
+Scheduler::~Scheduler ()
+{
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_shutdown = true;
+  }
+  m_cond.notify_all ();
+  m_thread.join ();
+}
+
+Scheduler *
+Scheduler::instance ()
+{
+  /* Intentionally leaked.  Joining threads while the DLL is
+     unloaded would deadlock on the loader lock.  */
+  static Scheduler *s_scheduler = new Scheduler ();
+  return s_scheduler;
+}
+
+bool
+Scheduler::schedule (std::chrono::milliseconds delay, const Job &job,
+                     int key, bool blockable)
+{
+  std::unique_lock<std::mutex> lock (m_mutex);
+  if (key && !m_keys.insert (key).second)
+    {
+      log_debug ("%s:%s: Job %i is already pending.",
+                 SRCNAME, __func__, key);
+      return false;
+    }
+  entry_s entry;
+  entry.job = job;
+  entry.key = key;
+  entry.blockable = blockable;
+  const auto due = std::chrono::steady_clock::now () + delay;
+  /* Jobs due at the same time are inserted after the existing
+     ones.  */
+  const bool first = m_timers.empty () || due < m_timers.begin ()->first;
+  m_timers.insert (std::make_pair (due, entry));
+  lock.unlock ();
+  if (first)
+    {
+      m_cond.notify_one ();
+    }
+  return true;
+}
+
+void
+Scheduler::block ()
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  m_blocked++;
+}
+
+bool
+Scheduler::unblock ()
+{
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    if (!m_blocked)
+      {
+        return false;
+      }
+    if (--m_blocked || m_held.empty ())
+      {
+        return true;
+      }
+  }
+  m_cond.notify_one ();
+  return true;
+}
+
+bool
+Scheduler::blocked () const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_blocked > 0;
+}
+
+size_t
+Scheduler::pending () const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_timers.size () + m_held.size ();
+}
+
+void
+Scheduler::run ()
+{
+  std::unique_lock<std::mutex> lock (m_mutex);
+  while (!m_shutdown)
+    {
+      entry_s entry;
+      if (!m_blocked && !m_held.empty ())
+        {
+          entry = std::move (m_held.front ());
+          m_held.pop_front ();
+        }
+      else if (m_timers.empty ())
+        {
+          m_cond.wait (lock);
+          continue;
+        }
+      else
+        {
+          const auto it = m_timers.begin ();
+          if (it->first > std::chrono::steady_clock::now ())
+            {
+              m_cond.wait_until (lock, it->first);
+              continue;
+            }
+          entry = std::move (it->second);
+          m_timers.erase (it);
+          if (entry.blockable && m_blocked)
+            {
+              m_held.push_back (std::move (entry));
+              continue;
+            }
+        }
+      /* A request that arrives while the job runs is not dropped
+         as the job might already be past the point it cares
+         about.  */
+      if (entry.key)
+        {
+          m_keys.erase (entry.key);
+        }
+      lock.unlock ();
+      entry.job ();
+      lock.lock ();
+    }
+}
@@ -0,0 +1,97 @@
+/* scheduler.h - A single thread for delayed jobs
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "config.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+/** Runs delayed jobs in a single thread.
+
+  The pending jobs are kept ordered by their due time so the thread
+  only wakes up when the next job is due or a new one arrives.
+  Jobs with the same due time run in the order they were added.
+
+  A job may have a key.  While a job with that key is pending
+  further requests with the key are dropped so that bursts of the
+  same request only run once.
+
+  A blockable job that becomes due while the scheduler is blocked
+  is held back and runs as soon as the last block is released.
+
+  Jobs must not touch MAPI or the Outlook Object Model as they
+  are not executed in the UI thread.  A long job delays all later
+  ones.  */
+class Scheduler
+{
+public:
+  typedef std::function<void ()> Job;
+
+  Scheduler ();
+
+  /** Stops the thread.  Jobs that are not due yet are dropped. */
+  ~Scheduler ();
+
+  /** The shared scheduler. */
+  static Scheduler *instance ();
+
+  /** Run job after delay.  A key of 0 means no key.  Returns false
+    if the request was dropped because a job with key is pending. */
+  bool schedule (std::chrono::milliseconds delay, const Job &job,
+                 int key = 0, bool blockable = false);
+
+  /** Hold back blockable jobs until unblock is called as often as
+    block. */
+  void block ();
+  /** Returns false if the scheduler was not blocked. */
+  bool unblock ();
+  bool blocked () const;
+
+  /** Number of jobs not yet run. */
+  size_t pending () const;
+
+private:
+  struct entry_s
+  {
+    Job job;
+    int key;
+    bool blockable;
+  };
+
+  void run ();
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::multimap<std::chrono::steady_clock::time_point, entry_s> m_timers;
+  std::deque<entry_s> m_held;
+  std::set<int> m_keys;
+  int m_blocked;
+  bool m_shutdown;
+  std::thread m_thread;
+};
+
+#endif // SCHEDULER_H
@@ -0,0 +1,63 @@
+/* sha256.h - SHA-256 message digest
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#if 0
+}
+#endif
+#endif
+
+#define SHA256_DIGEST_LEN 32
+
+/* We do not link libgcrypt so this small implementation is used
+   where we need a digest to identify data, e.g. to recognize the
+   same ciphertext or the same key data again.  */
+struct sha256_context_s
+{
+  uint32_t state[8];
+  uint64_t nbytes;        /* Number of bytes hashed so far.  */
+  unsigned char buf[64];  /* Pending partial block.  */
+  size_t buflen;
+};
+typedef struct sha256_context_s sha256_context_t;
+
+/*-- sha256.c --*/
+void sha256_init (sha256_context_t *ctx);
+void sha256_write (sha256_context_t *ctx, const void *data, size_t len);
+void sha256_final (sha256_context_t *ctx,
+                   unsigned char digest[SHA256_DIGEST_LEN]);
+
+/* Convenience function to hash a single buffer.  */
+void sha256_buffer (const void *data, size_t len,
+                    unsigned char digest[SHA256_DIGEST_LEN]);
+
+/* HMAC-SHA256 (RFC 2104) of DATA with KEY.  */
+void hmac_sha256 (const void *key, size_t keylen,
+                  const void *data, size_t len,
+                  unsigned char digest[SHA256_DIGEST_LEN]);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /*SHA256_H*/
@@ -0,0 +1,192 @@
+/* singleflight.h - Share the result of identical operations
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/** Runs an operation only once for concurrent callers with the
+  same key.
+
+  The first caller for a key (the leader) runs the operation.
+  Callers that arrive while it is running wait for it and get
+  the same result.  If the leader sets retain the result is also
+  handed out to callers that arrive within the retention time
+  after it finished.  A retained result is only referenced weakly
+  so it is gone as soon as the last user dropped it.
+
+  The result must not be modified by the users. */
+template <typename T>
+class SingleFlight
+{
+public:
+  typedef std::function<std::shared_ptr<T> (bool &retain)> Operation;
+
+  explicit SingleFlight (std::chrono::seconds retention =
+                           std::chrono::seconds (30)) :
+    m_retention (retention)
+  {
+  }
+
+  /** Run fn for key unless it is already running or recently
+    finished.  If r_shared is not null it is set to true if the
+    result came from a different caller.  */
+  std::shared_ptr<T> run (const std::string &key, const Operation &fn,
+                          bool *r_shared = nullptr)
+  {
+    if (r_shared)
+      {
+        *r_shared = false;
+      }
+    std::unique_lock<std::mutex> lock (m_mutex);
+    for (;;)
+      {
+        prune ();
+        const auto done_it = m_done.find (key);
+        if (done_it != m_done.end ())
+          {
+            auto result = done_it->second.result.lock ();
+            if (result)
+              {
+                if (r_shared)
+                  {
+                    *r_shared = true;
+                  }
+                return result;
+              }
+            m_done.erase (done_it);
+          }
+        const auto it = m_running.find (key);
+        if (it == m_running.end ())
+          {
+            return run_leader (key, fn, lock);
+          }
+        auto flight = it->second;
+        flight->cond.wait (lock, [&flight] { return flight->done; });
+        if (flight->result)
+          {
+            if (r_shared)
+              {
+                *r_shared = true;
+              }
+            return flight->result;
+          }
+        /* The leader failed or its result may not be shared.
+           Check again, one of the waiters becomes the new leader.  */
+      }
+  }
+
+  /** Forget all retained results. */
+  void clear ()
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_done.clear ();
+  }
+
+private:
+  struct Flight
+  {
+    Flight () : done (false) {}
+    std::condition_variable cond;
+    bool done;
+    std::shared_ptr<T> result;
+  };
+
+  struct Done
+  {
+    std::weak_ptr<T> result;
+    std::chrono::steady_clock::time_point finished;
+  };
+
+  std::shared_ptr<T> run_leader (const std::string &key, const Operation &fn,
+                                 std::unique_lock<std::mutex> &lock)
+  {
+    auto flight = std::make_shared<Flight> ();
+    m_running[key] = flight;
+    lock.unlock ();
+
+    bool retain = false;
+    std::shared_ptr<T> result;
+    try
+      {
+        result = fn (retain);
+      }
+    catch (...)
+      {
+        finish (key, flight, nullptr, false, lock);
+        throw;
+      }
+    finish (key, flight, result, retain, lock);
+    return result;
+  }
+
+  void finish (const std::string &key, const std::shared_ptr<Flight> &flight,
+               const std::shared_ptr<T> &result, bool retain,
+               std::unique_lock<std::mutex> &lock)
+  {
+    lock.lock ();
+    const auto it = m_running.find (key);
+    if (it != m_running.end () && it->second == flight)
+      {
+        m_running.erase (it);
+      }
+    /* Waiters only get a result if it may be shared, otherwise
+       they have to do the operation themself.  */
+    flight->result = retain ? result : nullptr;
+    flight->done = true;
+    if (retain && result)
+      {
+        Done done;
+        done.result = result;
+        done.finished = std::chrono::steady_clock::now ();
+        m_done[key] = done;
+      }
+    flight->cond.notify_all ();
+  }
+
+  void prune ()
+  {
+    const auto now = std::chrono::steady_clock::now ();
+    for (auto it = m_done.begin (); it != m_done.end ();)
+      {
+        if (now - it->second.finished > m_retention ||
+            it->second.result.expired ())
+          {
+            it = m_done.erase (it);
+          }
+        else
+          {
+            ++it;
+          }
+      }
+  }
+
+  std::mutex m_mutex;
+  std::map<std::string, std::shared_ptr<Flight> > m_running;
+  std::map<std::string, Done> m_done;
+  std::chrono::steady_clock::duration m_retention;
+};
+
+#endif // SINGLEFLIGHT_H
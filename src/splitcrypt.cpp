@@ -0,0 +1,186 @@
+/* splitcrypt.cpp - Encrypt one plaintext to multiple recipient sets
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+#include "cpphelp.h"
+
+#include "splitcrypt.h"
+#include "workerpool.h"
+
+#include <gpgme++/context.h>
+#include <gpgme++/data.h>
+#include <gpgme++/encryptionresult.h>
+
+#include <algorithm>
+#include <functional>
+#include <time.h>
+
+/* Unclaimed results are dropped after this many seconds. */
+#define SPLIT_CACHE_TTL (30 * 60)
+
+static std::string
+cache_key (const std::string &batch, GpgME::Protocol proto, bool sign,
+           const std::vector<GpgME::Key> &keys)
+{
+  std::vector<std::string> fprs;
+  for (const auto &key: keys)
+    {
+      const char *fpr = key.primaryFingerprint ();
+      fprs.push_back (fpr ? fpr : "");
+    }
+  std::sort (fprs.begin (), fprs.end ());
+  fprs.erase (std::unique (fprs.begin (), fprs.end ()), fprs.end ());
+
+  std::string ret;
+  join (fprs, ",", ret);
+  return batch + "/" + to_cstr (proto) + (sign ? "/s/" : "/e/") + ret;
+}
+
+static void
+encrypt_one (GpgME::Protocol proto,
+             const std::shared_ptr<const std::string> &plaintext,
+             split_crypt_result_s *result)
+{
+  TSTART;
+  auto ctx = GpgME::Context::create (proto);
+  if (!ctx)
+    {
+      log_error ("%s:%s: Failure to create context.",
+                 SRCNAME, __func__);
+      result->err = GpgME::Error (gpg_error (GPG_ERR_GENERAL));
+      TRETURN;
+    }
+  ctx->setTextMode (proto == GpgME::OpenPGP);
+  ctx->setArmor (proto == GpgME::OpenPGP);
+
+  /* No copy. The plaintext outlives the data object and is
+     only read.  */
+  GpgME::Data input (plaintext->c_str (), plaintext->size (), false);
+  GpgME::Data output;
+
+  const auto encResult = ctx->encrypt (result->keys, input, output,
+                                       GpgME::Context::AlwaysTrust);
+  result->err = encResult.error ();
+  if (result->err)
+    {
+      log_error ("%s:%s: Encryption error %s.",
+                 SRCNAME, __func__, result->err.asString ());
+      GpgME::Data log;
+      if (!ctx->getAuditLog (log, GpgME::Context::DiagnosticAuditLog))
+        {
+          result->diag = log.toString ();
+        }
+      TRETURN;
+    }
+  result->ciphertext = std::make_shared<const std::string> (output.toString ());
+  TRETURN;
+}
+
+std::vector<split_crypt_result_s>
+split_encrypt (GpgME::Protocol proto,
+               const std::shared_ptr<const std::string> &plaintext,
+               const std::vector<std::vector<GpgME::Key> > &recipient_sets,
+               WorkerPool *pool)
+{
+  TSTART;
+  std::vector<split_crypt_result_s> results (recipient_sets.size ());
+  std::vector<std::function<void ()> > jobs;
+
+  for (size_t i = 0; i < recipient_sets.size (); i++)
+    {
+      auto result = &results[i];
+      result->keys = recipient_sets[i];
+      jobs.push_back ([proto, plaintext, result] () {
+        encrypt_one (proto, plaintext, result);
+      });
+    }
+
+  log_debug ("%s:%s: Encrypting " SIZE_T_FORMAT " bytes to " SIZE_T_FORMAT
+             " recipient sets on %u threads.",
+             SRCNAME, __func__, plaintext->size (), recipient_sets.size (),
+             pool->size ());
+  pool->run_all (jobs);
+  TRETURN results;
+}
+
+SplitCryptCache::SplitCryptCache () : m_batch_counter (0)
+{
+}
+
+SplitCryptCache *
+SplitCryptCache::instance ()
+{
+  static SplitCryptCache *s_cache = new SplitCryptCache ();
+  return s_cache;
+}
+
+std::string
+SplitCryptCache::new_batch ()
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return asprintf_s ("%lx-%u", (unsigned long) time (nullptr),
+                     ++m_batch_counter);
+}
+
+void
+SplitCryptCache::put (const std::string &batch, GpgME::Protocol proto,
+                      bool sign, const std::vector<GpgME::Key> &keys,
+                      const std::shared_ptr<const std::string> &ciphertext)
+{
+  const auto now = time (nullptr);
+  std::lock_guard<std::mutex> lock (m_mutex);
+  for (auto it = m_entries.begin (); it != m_entries.end ();)
+    {
+      if (now - it->second.created > SPLIT_CACHE_TTL)
+        {
+          log_debug ("%s:%s: Dropping expired entry of batch %s",
+                     SRCNAME, __func__, it->second.batch.c_str ());
+          it = m_entries.erase (it);
+          continue;
+        }
+      ++it;
+    }
+  entry_s entry;
+  entry.batch = batch;
+  entry.ciphertext = ciphertext;
+  entry.created = now;
+  m_entries[cache_key (batch, proto, sign, keys)] = entry;
+}
+
+std::shared_ptr<const std::string>
+SplitCryptCache::take (const std::string &batch, GpgME::Protocol proto,
+                       bool sign, const std::vector<GpgME::Key> &keys)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  const auto it = m_entries.find (cache_key (batch, proto, sign, keys));
+  if (it == m_entries.end ())
+    {
+      return nullptr;
+    }
+  auto ret = it->second.ciphertext;
+  m_entries.erase (it);
+  return ret;
+}
+
+size_t
+SplitCryptCache::size ()
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_entries.size ();
+}
@@ -0,0 +1,102 @@
+/* splitcrypt.h - Encrypt one plaintext to multiple recipient sets
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SPLITCRYPT_H
+#define SPLITCRYPT_H
+
+#include "config.h"
+
+#include <gpgme++/global.h>
+#include <gpgme++/error.h>
+#include <gpgme++/key.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class WorkerPool;
+
+/* The outcome of encrypting the shared plaintext to one
+   recipient set. */
+struct split_crypt_result_s
+{
+  std::vector<GpgME::Key> keys;
+  /* The encrypted data. Null on error. */
+  std::shared_ptr<const std::string> ciphertext;
+  GpgME::Error err;
+  /* Audit log on error. */
+  std::string diag;
+};
+
+/* Encrypt plaintext to each of the recipient_sets in parallel on
+   pool.  The plaintext is only read and shared between all jobs.
+   The results are in the same order as recipient_sets.  */
+std::vector<split_crypt_result_s>
+split_encrypt (GpgME::Protocol proto,
+               const std::shared_ptr<const std::string> &plaintext,
+               const std::vector<std::vector<GpgME::Key> > &recipient_sets,
+               WorkerPool *pool);
+
+/** Holds the ciphertexts that were created while splitting a mail
+  for BCC recipients until the mail for the recipient set asks for
+  it.
+
+  Entries belong to a batch which is carried by all mails of one
+  split so that a result can never be used for a different mail
+  that happens to have the same recipients.  */
+class SplitCryptCache
+{
+public:
+  static SplitCryptCache *instance ();
+
+  /* Create a new unique batch id. */
+  std::string new_batch ();
+
+  /* Store the ciphertext for the key set.  Entries that are
+     not taken within 30 minutes are dropped. */
+  void put (const std::string &batch, GpgME::Protocol proto, bool sign,
+            const std::vector<GpgME::Key> &keys,
+            const std::shared_ptr<const std::string> &ciphertext);
+
+  /* Remove and return the ciphertext for the key set or null. */
+  std::shared_ptr<const std::string> take (const std::string &batch,
+                                           GpgME::Protocol proto,
+                                           bool sign,
+                                           const std::vector<GpgME::Key> &keys);
+
+  /* Number of unclaimed entries. */
+  size_t size ();
+
+private:
+  SplitCryptCache ();
+
+  struct entry_s
+  {
+    std::string batch;
+    std::shared_ptr<const std::string> ciphertext;
+    time_t created;
+  };
+
+  std::mutex m_mutex;
+  std::map<std::string, entry_s> m_entries;
+  unsigned int m_batch_counter;
+};
+
+#endif // SPLITCRYPT_H
@@ -0,0 +1,209 @@
+/* taskgraph.cpp - Run tasks with dependencies in parallel
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+
+#include "taskgraph.h"
+
+static long long
+ms_between (const std::chrono::steady_clock::time_point &from,
+            const std::chrono::steady_clock::time_point &to)
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>
+    (to - from).count ();
+}
+
+TaskGraph::TaskGraph (const std::string &name) :
+  m_name (name),
+  m_done (0),
+  m_elapsed (0),
+  m_started (false)
+{
+}
+
+int
+TaskGraph::add (const std::string &name, const Task &task,
+                const std::vector<int> &deps)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  if (m_started)
+    {
+      log_error ("%s:%s: %s: Can't add '%s' while running.",
+                 SRCNAME, __func__, m_name.c_str (), name.c_str ());
+      return -1;
+    }
+  const int id = (int) m_nodes.size ();
+  for (const int dep: deps)
+    {
+      if (dep < 0 || dep >= id)
+        {
+          log_error ("%s:%s: %s: Unknown dependency of '%s'.",
+                     SRCNAME, __func__, m_name.c_str (), name.c_str ());
+          return -1;
+        }
+    }
+  for (const int dep: deps)
+    {
+      m_nodes[dep].dependents.push_back (id);
+    }
+  node_s node;
+  node.name = name;
+  node.task = task;
+  node.ndeps = deps.size ();
+  node.waiting = 0;
+  node.started = 0;
+  node.took = 0;
+  m_nodes.push_back (node);
+  return id;
+}
+
+void
+TaskGraph::run ()
+{
+  std::unique_lock<std::mutex> lock (m_mutex);
+  if (m_started)
+    {
+      log_error ("%s:%s: %s: Already run.",
+                 SRCNAME, __func__, m_name.c_str ());
+      return;
+    }
+  m_started = true;
+  log_debug ("%s:%s: %s: Running " SIZE_T_FORMAT " tasks.",
+             SRCNAME, __func__, m_name.c_str (), m_nodes.size ());
+  m_start = std::chrono::steady_clock::now ();
+  for (auto &node: m_nodes)
+    {
+      node.waiting = node.ndeps;
+    }
+  for (size_t id = 0; id < m_nodes.size (); id++)
+    {
+      if (!m_nodes[id].ndeps)
+        {
+          launch_locked ((int) id);
+        }
+    }
+  m_cond.wait (lock, [this] () { return m_done == m_nodes.size (); });
+  m_elapsed = ms_between (m_start, std::chrono::steady_clock::now ());
+
+  /* All threads are started before the last task is done.  */
+  std::vector<std::thread> threads;
+  threads.swap (m_threads);
+  lock.unlock ();
+  for (auto &thread: threads)
+    {
+      thread.join ();
+    }
+  log_timings ();
+}
+
+void
+TaskGraph::run_detached (const std::shared_ptr<TaskGraph> &graph)
+{
+  std::thread ([graph] () { graph->run (); }).detach ();
+}
+
+/* Called with the mutex held.  */
+void
+TaskGraph::launch_locked (int id)
+{
+  m_threads.push_back (std::thread (&TaskGraph::execute, this, id));
+}
+
+void
+TaskGraph::execute (int id)
+{
+  /* The nodes are not changed while running so the task can be
+     used without the lock.  */
+  node_s &node = m_nodes[id];
+  const auto start = std::chrono::steady_clock::now ();
+  try
+    {
+      if (node.task)
+        {
+          node.task ();
+        }
+    }
+  catch (...)
+    {
+      log_error ("%s:%s: %s: Task '%s' failed.",
+                 SRCNAME, __func__, m_name.c_str (), node.name.c_str ());
+    }
+  const auto end = std::chrono::steady_clock::now ();
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+  node.started = ms_between (m_start, start);
+  node.took = ms_between (start, end);
+  for (const int dependent: node.dependents)
+    {
+      if (!--m_nodes[dependent].waiting)
+        {
+          launch_locked (dependent);
+        }
+    }
+  if (++m_done == m_nodes.size ())
+    {
+      m_cond.notify_all ();
+    }
+}
+
+void
+TaskGraph::log_timings () const
+{
+  long long sum = 0;
+  for (const auto &timing: timings ())
+    {
+      log_debug ("%s:%s: %s: '%s' started after %lld ms and took %lld ms",
+                 SRCNAME, __func__, m_name.c_str (), timing.name.c_str (),
+                 timing.started, timing.took);
+      sum += timing.took;
+    }
+  log_debug ("%s:%s: %s: Done after %lld ms. The tasks took %lld ms "
+             "in total.", SRCNAME, __func__, m_name.c_str (), elapsed (),
+             sum);
+}
+
+std::vector<TaskGraph::timing_s>
+TaskGraph::timings () const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  std::vector<timing_s> ret;
+  for (const auto &node: m_nodes)
+    {
+      timing_s timing;
+      timing.name = node.name;
+      timing.started = node.started;
+      timing.took = node.took;
+      ret.push_back (timing);
+    }
+  return ret;
+}
+
+long long
+TaskGraph::elapsed () const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_elapsed;
+}
+
+size_t
+TaskGraph::size () const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_nodes.size ();
+}
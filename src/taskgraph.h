@@ -0,0 +1,110 @@
+/* taskgraph.h - Run tasks with dependencies in parallel
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include "config.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** A set of tasks where a task may depend on others.
+
+  Each task runs in its own thread as soon as all tasks it depends
+  on are done, so independent tasks run in parallel and the whole
+  graph takes as long as its slowest chain of tasks.  This is meant
+  for a few long running tasks like the key listings at startup
+  that mostly wait for other processes.
+
+  A task can only depend on tasks added before it, so there are no
+  cycles.  A task that throws counts as done.  After the run the
+  start and duration of each task are logged.
+
+  Tasks must not touch MAPI or the Outlook Object Model as they
+  are not executed in the UI thread.  */
+class TaskGraph
+{
+public:
+  typedef std::function<void ()> Task;
+
+  struct timing_s
+  {
+    std::string name;
+    long long started;  /* Milliseconds after the start of the run.  */
+    long long took;     /* Milliseconds the task ran.  */
+  };
+
+  /** The name is used for the log. */
+  explicit TaskGraph (const std::string &name);
+
+  /** Add task which runs after the tasks with the ids in deps.
+    Returns the id of the task or -1 if a dependency is unknown or
+    the graph already runs. */
+  int add (const std::string &name, const Task &task,
+           const std::vector<int> &deps = std::vector<int> ());
+
+  /** Run all tasks and wait for them.  A graph runs only once. */
+  void run ();
+
+  /** Run graph in a background thread. */
+  static void run_detached (const std::shared_ptr<TaskGraph> &graph);
+
+  /** The timings of the tasks after the run in the order they
+    were added. */
+  std::vector<timing_s> timings () const;
+
+  /** Milliseconds the run took. */
+  long long elapsed () const;
+
+  size_t size () const;
+
+private:
+  struct node_s
+  {
+    std::string name;
+    Task task;
+    std::vector<int> dependents;
+    size_t ndeps;
+    size_t waiting;
+    long long started;
+    long long took;
+  };
+
+  void launch_locked (int id);
+  void execute (int id);
+  void log_timings () const;
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_cond;
+  const std::string m_name;
+  std::vector<node_s> m_nodes;
+  std::vector<std::thread> m_threads;
+  std::chrono::steady_clock::time_point m_start;
+  size_t m_done;
+  long long m_elapsed;
+  bool m_started;
+};
+
+#endif // TASKGRAPH_H
@@ -27,6 +27,7 @@
 #include "gpgoladdin.h"
 #include "wks-helper.h"
 #include "addressbook.h"
+#include "scheduler.h"
 
 #include <stdio.h>
 
@@ -34,7 +35,10 @@
 
 /* Singleton window */
 static HWND g_responder_window = NULL;
-static int invalidation_blocked = 0;
+
+/* wParam of a user msg that was posted.  The ctx belongs to the
+   window procedure then.  */
+#define WM_CTX_POSTED 1
 
 LONG_PTR WINAPI
 gpgol_window_proc (HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
@@ -109,7 +113,7 @@ gpgol_window_proc (HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             }
           case (INVALIDATE_UI):
             {
-              if (!invalidation_blocked)
+              if (!Scheduler::instance ()->blocked ())
                 {
                   log_debug ("%s:%s: Invalidating UI",
                              SRCNAME, __func__);
@@ -403,11 +407,28 @@ gpgol_window_proc (HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
               mail->parsingDone_o (true);
               TBREAK;
             }
+          case SHOW_BODY:
+            {
+              auto mail = (Mail*) ctx->data;
+              if (!Mail::isValidPtr (mail))
+                {
+                  log_dbg ("SHOW_BODY for mail %p which is gone.",
+                           mail);
+                  TBREAK;
+                }
+              log_dbg ("SHOW_BODY for %p", mail);
+              mail->showEarlyBody_o ();
+              TBREAK;
+            }
 
           default:
             log_debug ("%s:%s: Unknown msg %x",
                        SRCNAME, __func__, ctx->wmsg_type);
         }
+        if (wParam == WM_CTX_POSTED)
+          {
+            xfree (ctx);
+          }
         TRETURN 0;
     }
   else if (message == WM_USER)
@@ -516,8 +537,8 @@ create_responder_window ()
   TRETURN g_responder_window;
 }
 
-static int
-send_msg_to_ui_thread (wm_ctx_t *ctx)
+static HWND
+find_responder_window ()
 {
   TSTART;
   size_t cls_name_len = strlen(RESPONDER_CLASS_NAME) + 1;
@@ -529,12 +550,43 @@ send_msg_to_ui_thread (wm_ctx_t *ctx)
   {
     log_error ("%s:%s: Failed to find responder window.",
                SRCNAME, __func__);
+  }
+  TRETURN responder;
+}
+
+static int
+send_msg_to_ui_thread (wm_ctx_t *ctx)
+{
+  TSTART;
+  HWND responder = find_responder_window ();
+  if (!responder)
+  {
     TRETURN -1;
   }
   SendMessage (responder, WM_USER + 42, 0, (LPARAM) ctx);
   TRETURN 0;
 }
 
+/* Like send_msg_to_ui_thread but does not wait for the handler.
+   The scheduler thread must never block in the UI thread as a
+   handler that takes long would hold back all other jobs.  The
+   window procedure frees ctx.  */
+static int
+post_msg_to_ui_thread (wm_ctx_t *ctx)
+{
+  TSTART;
+  HWND responder = find_responder_window ();
+  if (!responder ||
+      !PostMessage (responder, WM_USER + 42, WM_CTX_POSTED, (LPARAM) ctx))
+    {
+      log_error ("%s:%s: Failed to post message of type %i",
+                 SRCNAME, __func__, ctx->wmsg_type);
+      xfree (ctx);
+      TRETURN -1;
+    }
+  TRETURN 0;
+}
+
 int
 do_in_ui_thread (gpgol_wmsg_type type, void *data)
 {
@@ -553,23 +605,6 @@ do_in_ui_thread (gpgol_wmsg_type type, void *data)
   TRETURN ctx.err;
 }
 
-static DWORD WINAPI
-do_async (LPVOID arg)
-{
-  TSTART;
-  wm_ctx_t *ctx = (wm_ctx_t*) arg;
-  log_debug ("%s:%s: Do async with type %i after %i ms",
-             SRCNAME, __func__, ctx ? ctx->wmsg_type : -1,
-             ctx->delay);
-  if (ctx->delay)
-    {
-      Sleep (ctx->delay);
-    }
-  send_msg_to_ui_thread (ctx);
-  xfree (ctx);
-  TRETURN 0;
-}
-
 void
 do_in_ui_thread_async (gpgol_wmsg_type type, void *data, int delay)
 {
@@ -579,7 +614,13 @@ do_in_ui_thread_async (gpgol_wmsg_type type, void *data, int delay)
   ctx->data = data;
   ctx->delay = delay;
 
-  CloseHandle (CreateThread (NULL, 0, do_async, (LPVOID) ctx, 0, NULL));
+  log_debug ("%s:%s: Do async with type %i after %i ms",
+             SRCNAME, __func__, type, delay);
+  Scheduler::instance ()->schedule (std::chrono::milliseconds (delay),
+                                    [ctx] ()
+    {
+      post_msg_to_ui_thread (ctx);
+    });
   TRETURN;
 }
 
@@ -693,44 +734,20 @@ create_message_hook()
                            GetCurrentThreadId());
 }
 
-GPGRT_LOCK_DEFINE (invalidate_lock);
-
-static bool invalidation_in_progress;
-
-DWORD WINAPI
-delayed_invalidate_ui (LPVOID minsleep)
+void
+delayed_invalidate_ui (int minsleep_ms)
 {
   TSTART;
-  if (invalidation_in_progress)
+  /* Pending invalidations are coalesced and held back while the
+     invalidation is blocked.  */
+  Scheduler::instance ()->schedule (std::chrono::milliseconds (minsleep_ms),
+                                    [] ()
     {
-      log_debug ("%s:%s: Invalidation canceled as it is in progress.",
-                 SRCNAME, __func__);
-      TRETURN 0;
-    }
-  TRACEPOINT;
-  invalidation_in_progress = true;
-  gpgol_lock(&invalidate_lock);
-
-  int sleep_ms = (intptr_t)minsleep;
-  Sleep (sleep_ms);
-  int i = 0;
-  while (invalidation_blocked)
-    {
-      i++;
-      if (i % 10 == 0)
-        {
-          log_debug ("%s:%s: Waiting for invalidation.",
-                     SRCNAME, __func__);
-        }
-
-      Sleep (100);
-      /* Do we need an abort statement here? */
-    }
-  do_in_ui_thread (INVALIDATE_UI, nullptr);
-  TRACEPOINT;
-  invalidation_in_progress = false;
-  gpgol_unlock(&invalidate_lock);
-  TRETURN 0;
+      wm_ctx_t *ctx = (wm_ctx_t *) xcalloc (1, sizeof (wm_ctx_t));
+      ctx->wmsg_type = INVALIDATE_UI;
+      post_msg_to_ui_thread (ctx);
+    }, INVALIDATE_UI, true);
+  TRETURN;
 }
 
 DWORD WINAPI
@@ -745,9 +762,9 @@ void
 blockInv()
 {
   TSTART;
-  invalidation_blocked++;
-  log_oom ("%s:%s: Invalidation block count %i",
-                 SRCNAME, __func__, invalidation_blocked);
+  Scheduler::instance ()->block ();
+  log_oom ("%s:%s: Invalidation blocked",
+                 SRCNAME, __func__);
   TRETURN;
 }
 
@@ -755,15 +772,13 @@ void
 unblockInv()
 {
   TSTART;
-  invalidation_blocked--;
-  log_oom ("%s:%s: Invalidation block count %i",
-                 SRCNAME, __func__, invalidation_blocked);
+  log_oom ("%s:%s: Invalidation unblocked",
+                 SRCNAME, __func__);
 
-  if (invalidation_blocked < 0)
+  if (!Scheduler::instance ()->unblock ())
     {
       log_error ("%s:%s: Invalidation block mismatch",
                  SRCNAME, __func__);
-      invalidation_blocked = 0;
     }
   TRETURN;
 }
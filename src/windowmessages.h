@@ -62,6 +62,7 @@ typedef enum _gpgol_wmsg_type
   SEND_MULTIPLE_MAILS,
   SEND,
   SHOW_PREVIEW, /* Show mail contents before a verify is done */
+  SHOW_BODY, /* Show the body before the attachments are decrypted */
   /* External API, keep it stable! */
   EXT_API_CLOSE = 1301,
   EXT_API_CLOSE_ALL = 1302,
@@ -97,8 +98,8 @@ do_in_ui_thread (gpgol_wmsg_type type, void *data);
 /** Send a message to the UI thread but returns
     immediately without waiting for the execution.
 
-    The delay is used in the detached thread to delay
-    the sending of the actual message. */
+    The message is posted from the scheduler thread once
+    the delay has passed. */
 void
 do_in_ui_thread_async (gpgol_wmsg_type type, void *data, int delay = 0);
 
@@ -115,8 +116,10 @@ void blockInv ();
 /** Unblock ui invalidation */
 void unblockInv ();
 
-DWORD WINAPI
-delayed_invalidate_ui (LPVOID minsleep_ms = 0);
+/** Invalidate the UI after minsleep_ms once it is no longer
+    blocked.  Requests while one is pending are dropped. */
+void
+delayed_invalidate_ui (int minsleep_ms = 0);
 
 DWORD WINAPI
 close_mail (LPVOID);
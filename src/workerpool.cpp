@@ -0,0 +1,145 @@
+/* workerpool.cpp - Bounded pool of worker threads
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "common_indep.h"
+
+#include "workerpool.h"
+
+/* More threads do not help as each job spawns an engine
+   process anyway.  */
+#define MAX_WORKERS 8
+
+WorkerPool::WorkerPool (unsigned int nthreads, size_t max_queued) :
+  m_max_queued (max_queued ? max_queued : 1),
+  m_shutdown (false)
+{
+  if (!nthreads)
+    {
+      nthreads = std::thread::hardware_concurrency ();
+      if (!nthreads)
+        {
+          nthreads = 2;
+        }
+      if (nthreads > MAX_WORKERS)
+        {
+          nthreads = MAX_WORKERS;
+        }
+    }
+  log_debug ("%s:%s: Starting pool with %u threads.",
+             SRCNAME, __func__, nthreads);
+  for (unsigned int i = 0; i < nthreads; i++)
+    {
+      m_threads.emplace_back (&WorkerPool::work, this);
+    }
+}
+
+WorkerPool::~WorkerPool ()
+{
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_shutdown = true;
+  }
+  m_has_job.notify_all ();
+  m_has_room.notify_all ();
+  for (auto &thread: m_threads)
+    {
+      thread.join ();
+    }
+}
+
+WorkerPool *
+WorkerPool::instance ()
+{
+  /* Intentionally leaked.  Joining threads while the DLL is
+     unloaded would deadlock on the loader lock.  */
+  static WorkerPool *s_pool = new WorkerPool ();
+  return s_pool;
+}
+
+bool
+WorkerPool::submit (const std::function<void ()> &job)
+{
+  std::unique_lock<std::mutex> lock (m_mutex);
+  m_has_room.wait (lock, [this] {
+    return m_queue.size () < m_max_queued || m_shutdown;
+  });
+  if (m_shutdown)
+    {
+      log_error ("%s:%s: Pool is shutting down.",
+                 SRCNAME, __func__);
+      return false;
+    }
+  m_queue.push_back (job);
+  lock.unlock ();
+  m_has_job.notify_one ();
+  return true;
+}
+
+void
+WorkerPool::run_all (const std::vector<std::function<void ()> > &jobs)
+{
+  std::mutex done_mutex;
+  std::condition_variable done_cond;
+  size_t pending = jobs.size ();
+
+  for (const auto &job: jobs)
+    {
+      auto wrapped = [&, job] () {
+        job ();
+        std::lock_guard<std::mutex> lock (done_mutex);
+        if (!--pending)
+          {
+            done_cond.notify_all ();
+          }
+      };
+      if (!submit (wrapped))
+        {
+          /* Run it ourself so that the caller is not left
+             waiting.  */
+          wrapped ();
+        }
+    }
+
+  std::unique_lock<std::mutex> lock (done_mutex);
+  done_cond.wait (lock, [&pending] { return !pending; });
+}
+
+void
+WorkerPool::work ()
+{
+  for (;;)
+    {
+      std::function<void ()> job;
+      {
+        std::unique_lock<std::mutex> lock (m_mutex);
+        m_has_job.wait (lock, [this] {
+          return !m_queue.empty () || m_shutdown;
+        });
+        if (m_queue.empty ())
+          {
+            /* Shutdown and nothing left to do. */
+            return;
+          }
+        job = std::move (m_queue.front ());
+        m_queue.pop_front ();
+      }
+      m_has_room.notify_one ();
+      job ();
+    }
+}
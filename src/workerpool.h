@@ -0,0 +1,76 @@
+/* workerpool.h - Bounded pool of worker threads
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include "config.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** A fixed number of threads working on a bounded job queue.
+
+  Jobs must not touch MAPI or the Outlook Object Model as they
+  are not executed in the UI thread.
+
+  submit blocks while the queue is full so that a producer can
+  not pile up an unbounded amount of work.  */
+class WorkerPool
+{
+public:
+  /** Create a pool with nthreads threads (0 means the number of
+    cores capped to a sane maximum) and a queue that can hold
+    max_queued jobs. */
+  explicit WorkerPool (unsigned int nthreads = 0,
+                       size_t max_queued = 64);
+
+  /** Waits for all queued jobs before returning. */
+  ~WorkerPool ();
+
+  /** The shared pool for crypto jobs. */
+  static WorkerPool *instance ();
+
+  /** Queue a job.  Blocks while the queue is full.  Returns false
+    if the pool is shutting down and the job was not queued. */
+  bool submit (const std::function<void ()> &job);
+
+  /** Run all jobs on the pool and wait until all of them are
+    done.  Must not be called from a job of the same pool. */
+  void run_all (const std::vector<std::function<void ()> > &jobs);
+
+  /** Number of worker threads. */
+  unsigned int size () const { return (unsigned int) m_threads.size (); }
+
+private:
+  void work ();
+
+  std::mutex m_mutex;
+  std::condition_variable m_has_job;
+  std::condition_variable m_has_room;
+  std::deque<std::function<void ()> > m_queue;
+  std::vector<std::thread> m_threads;
+  size_t m_max_queued;
+  bool m_shutdown;
+};
+
+#endif // WORKERPOOL_H
@@ -0,0 +1,147 @@
+/* run-contextpool.cpp - Benchmark for the GpgME context pool.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common_indep.h"
+#include "contextpool.h"
+#include <gpgme.h>
+#include <gpgme++/context.h>
+#include <gpgme++/key.h>
+
+#include <chrono>
+#include <iostream>
+
+static int
+show_usage (int ex)
+{
+  fputs ("usage: run-contextpool [options] [FINGERPRINT]\n\n"
+         "Runs a keylisting for FINGERPRINT with fresh contexts and\n"
+         "with pooled contexts and prints the throughput of both.\n\n"
+         "Options:\n"
+         "  --verbose             run in verbose mode\n"
+         "  --cms                 use S/MIME instead of OpenPGP\n"
+         "  --repeat N            repeat N times (default 100)\n"
+         , stderr);
+  exit (ex);
+}
+
+/* Do a cheap operation that still needs the engine. */
+static bool
+do_keylisting (GpgME::Context *ctx, const char *fpr)
+{
+  ctx->setKeyListMode (GpgME::KeyListMode::Local);
+  ctx->setOffline (true);
+  GpgME::Error err;
+  const auto key = ctx->key (fpr, err, false);
+  return !err && !key.isNull ();
+}
+
+static void
+print_result (const char *what, int repeats, double secs)
+{
+  std::cout << what << ": " << repeats << " operations in "
+            << secs << "s (" << (secs > 0 ? repeats / secs : 0)
+            << " ops/s)" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  int last_argc = -1;
+  int repeats = 100;
+  GpgME::Protocol proto = GpgME::OpenPGP;
+  const char *fpr = "1BA323932B3FAA826132C79E8D9860C58F246DE6";
+
+  if (!getenv ("GNUPGHOME"))
+    {
+      putenv ((char*) "GNUPGHOME=" GPGHOMEDIR);
+    }
+  gpgme_check_version (NULL);
+
+  if (argc)
+    { argc--; argv++; }
+
+  while (argc && last_argc != argc )
+    {
+      last_argc = argc;
+      if (!strcmp (*argv, "--"))
+        {
+          argc--; argv++;
+          break;
+        }
+      else if (!strcmp (*argv, "--help"))
+        show_usage (0);
+      else if (!strcmp (*argv, "--verbose"))
+        {
+          opt.enable_debug |= 1;
+          set_log_file ("stderr");
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--cms"))
+        {
+          proto = GpgME::CMS;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--repeat"))
+        {
+            argc--; argv++;
+            if (!argc)
+                show_usage (1);
+            repeats = atoi (*argv);
+            argc--; argv++;
+        }
+    }
+  if (argc > 1)
+    show_usage (1);
+  if (argc)
+    fpr = argv[0];
+
+  auto start = std::chrono::steady_clock::now ();
+  for (int i = 0; i < repeats; i++)
+    {
+      auto ctx = GpgME::Context::create (proto);
+      if (!ctx || !do_keylisting (ctx.get (), fpr))
+        {
+          std::cerr << "Keylisting with fresh context failed" << std::endl;
+          exit (1);
+        }
+    }
+  std::chrono::duration<double> fresh = std::chrono::steady_clock::now () -
+                                        start;
+
+  ContextPool pool;
+  start = std::chrono::steady_clock::now ();
+  for (int i = 0; i < repeats; i++)
+    {
+      auto ctx = pool.get (proto);
+      if (!ctx || !do_keylisting (ctx.get (), fpr))
+        {
+          std::cerr << "Keylisting with pooled context failed" << std::endl;
+          exit (1);
+        }
+    }
+  std::chrono::duration<double> pooled = std::chrono::steady_clock::now () -
+                                         start;
+
+  print_result ("Fresh contexts ", repeats, fresh.count ());
+  print_result ("Pooled contexts", repeats, pooled.count ());
+  std::cout << "Idle contexts in pool: " << pool.idle (proto) << std::endl;
+  return 0;
+}
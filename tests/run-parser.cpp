@@ -37,6 +37,7 @@ show_usage (int ex)
          "  --clear-signed        clearsigned\n"
          "  --pgp-message         inline pgp message\n"
          "  --repeat N            repeat N times\n"
+         "  --trace FILE          write a Chrome trace of the spans to FILE\n"
          , stderr);
   exit (ex);
 }
@@ -47,6 +48,7 @@ int main(int argc, char **argv)
   msgtype_t msgtype = MSGTYPE_UNKNOWN;
   FILE *fp_in = NULL;
   int repeats = 1;
+  const char *trace_file = NULL;
 
   gpgme_check_version (NULL);
 
@@ -108,6 +110,15 @@ int main(int argc, char **argv)
             repeats = atoi (*argv);
             argc--; argv++;
         }
+      else if (!strcmp (*argv, "--trace"))
+        {
+            argc--; argv++;
+            if (!argc)
+                show_usage (1);
+            trace_file = *argv;
+            opt.enable_debug |= DBG_SPANS;
+            argc--; argv++;
+        }
     }
   if (argc < 1 || argc > 2)
     show_usage (1);
@@ -139,4 +150,10 @@ int main(int argc, char **argv)
         }
 
     }
+  if (trace_file && !span_dump (trace_file))
+    {
+      std::cerr << "failed to write trace: " << trace_file << std::endl;
+      return 1;
+    }
+  return 0;
 }
@@ -0,0 +1,235 @@
+/* t-addrcache.cpp - Test for the address book entry cache.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "common_indep.h"
+#include "addrcache.h"
+#include "t-common.h"
+
+#include <map>
+#include <string>
+
+/* A local directory with Exchange users and lists.  */
+class FakeDirectory: public AddressDirectory
+{
+public:
+  FakeDirectory () : calls (0) {}
+
+  bool resolve_smtp (const std::string &id, std::string *r_addr) override
+  {
+    calls++;
+    const auto it = smtp.find (id);
+    if (it == smtp.end ())
+      {
+        return false;
+      }
+    *r_addr = it->second;
+    return true;
+  }
+
+  bool group_members (const std::string &id,
+                      std::vector<entry_s> *r_members) override
+  {
+    calls++;
+    const auto it = groups.find (id);
+    if (it == groups.end ())
+      {
+        return false;
+      }
+    *r_members = it->second;
+    return true;
+  }
+
+  bool cacheable (const std::string &id) const override
+  {
+    return id.compare (0, 4, "tmp:");
+  }
+
+  void add_member (const std::string &group, const std::string &id,
+                   const std::string &addr = std::string (),
+                   bool is_group = false)
+  {
+    entry_s entry;
+    entry.id = id;
+    entry.name = id + " name";
+    entry.addr = addr;
+    entry.is_group = is_group;
+    groups[group].push_back (entry);
+  }
+
+  std::map<std::string, std::string> smtp;
+  std::map<std::string, std::vector<entry_s> > groups;
+  int calls;
+};
+
+static std::string
+addrs (const std::vector<AddressCache::member_s> &members)
+{
+  std::string ret;
+  for (const auto &member: members)
+    {
+      ret += (ret.empty () ? "" : ",") + member.addr;
+    }
+  return ret;
+}
+
+int main()
+{
+  FakeDirectory dir;
+  dir.smtp["ex-alice"] = "alice@example.org";
+  dir.smtp["ex-bob"] = "bob@example.org";
+  /* team contains an SMTP member, an Exchange user, a sub list
+     and itself through the sub list.  */
+  dir.add_member ("team", "carol", "carol@example.org");
+  dir.add_member ("team", "ex-alice");
+  dir.add_member ("team", "sub", "", true);
+  dir.add_member ("sub", "ex-bob");
+  dir.add_member ("sub", "team", "", true);
+  dir.add_member ("sub", "ex-gone");
+
+  AddressCache cache;
+  std::string addr;
+  std::vector<AddressCache::member_s> members;
+
+  if (!cache.smtp_address (dir, "ex-alice", &addr) ||
+      addr != "alice@example.org" ||
+      cache.smtp_address (dir, "ex-gone", &addr) || dir.calls != 2)
+    {
+      fail ("Wrong address");
+    }
+  /* Positive and negative results are cached.  */
+  if (!cache.smtp_address (dir, "ex-alice", &addr) ||
+      cache.smtp_address (dir, "ex-gone", &addr) || dir.calls != 2 ||
+      cache.hits () != 2)
+    {
+      fail ("Address not cached");
+    }
+
+  if (!cache.expand_group (dir, "team", &members) ||
+      addrs (members) != "carol@example.org,alice@example.org,bob@example.org"
+      || members[0].name != "carol name" || members[2].id != "ex-bob")
+    {
+      fail ("Wrong group members");
+    }
+  const int calls = dir.calls;
+  members.clear ();
+  /* The sub list was cached while expanding team.  */
+  if (!cache.expand_group (dir, "team", &members) || members.size () != 3 ||
+      !cache.expand_group (dir, "sub", &members) ||
+      addrs (members) != "bob@example.org" || dir.calls != calls)
+    {
+      fail ("Group not cached");
+    }
+
+  /* A changed list is seen after invalidation.  */
+  dir.add_member ("team", "dave", "dave@example.org");
+  cache.expand_group (dir, "team", &members);
+  if (members.size () != 3)
+    {
+      fail ("Cache not used");
+    }
+  cache.invalidate ("team");
+  cache.expand_group (dir, "team", &members);
+  if (members.size () != 4 || members[3].addr != "dave@example.org")
+    {
+      fail ("Invalidate failed");
+    }
+
+  /* A refresh asks the directory for the list and its members even
+     if they are cached and updates the cache.  */
+  dir.smtp["ex-bob"] = "robert@example.org";
+  const size_t hits = cache.hits ();
+  if (!cache.expand_group (dir, "team", &members, true) ||
+      members.size () != 4 || members[2].addr != "robert@example.org" ||
+      cache.hits () != hits)
+    {
+      fail ("Refresh used the cache");
+    }
+  dir.calls = 0;
+  if (!cache.smtp_address (dir, "ex-bob", &addr) ||
+      addr != "robert@example.org" ||
+      !cache.expand_group (dir, "sub", &members) ||
+      members[0].addr != "robert@example.org" || dir.calls)
+    {
+      fail ("Refresh did not update the cache");
+    }
+  dir.smtp["ex-bob"] = "bob@example.org";
+  if (!cache.smtp_address (dir, "ex-bob", &addr, true) ||
+      addr != "bob@example.org" || dir.calls != 1)
+    {
+      fail ("Address not refreshed");
+    }
+
+  /* Temporary ids are never cached.  */
+  dir.smtp["tmp:1"] = "tmp@example.org";
+  dir.calls = 0;
+  cache.smtp_address (dir, "tmp:1", &addr);
+  cache.smtp_address (dir, "tmp:1", &addr);
+  if (dir.calls != 2 || addr != "tmp@example.org")
+    {
+      fail ("Temporary id cached");
+    }
+
+  /* Entries expire.  */
+  AddressCache expiring (std::chrono::seconds (0));
+  dir.calls = 0;
+  expiring.smtp_address (dir, "ex-bob", &addr);
+  expiring.smtp_address (dir, "ex-bob", &addr);
+  if (dir.calls != 2 || expiring.hits ())
+    {
+      fail ("Stale entry used");
+    }
+
+  /* Failures are only kept for the negative time to live as
+     Exchange might just not be reachable.  */
+  AddressCache failing (std::chrono::seconds (600), std::chrono::seconds (0));
+  dir.calls = 0;
+  failing.smtp_address (dir, "ex-alice", &addr);
+  failing.smtp_address (dir, "ex-alice", &addr);
+  if (dir.calls != 1 || failing.smtp_address (dir, "ex-gone", &addr) ||
+      failing.smtp_address (dir, "ex-gone", &addr) || dir.calls != 3)
+    {
+      fail ("Failure cached");
+    }
+  /* The same for a list with a member that could not be resolved.  */
+  failing.expand_group (dir, "sub", &members);
+  dir.calls = 0;
+  failing.expand_group (dir, "sub", &members);
+  if (members.empty () || dir.calls < 2)
+    {
+      fail ("Incomplete group cached");
+    }
+  dir.calls = 0;
+  failing.expand_group (dir, "ex-alice", &members);
+  failing.expand_group (dir, "ex-alice", &members);
+  if (dir.calls != 1)
+    {
+      fail ("Entry that is no group not cached");
+    }
+
+  cache.clear ();
+  dir.calls = 0;
+  cache.smtp_address (dir, "ex-alice", &addr);
+  if (dir.calls != 1)
+    {
+      fail ("Clear failed");
+    }
+  return 0;
+}
@@ -0,0 +1,33 @@
+/* t-common.h - Helpers shared by the tests.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef T_COMMON_H
+#define T_COMMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Report a failed check and end the test.  */
+static inline void
+fail (const char *msg)
+{
+  fprintf (stderr, "FAIL: %s\n", msg);
+  exit (1);
+}
+
+#endif // T_COMMON_H
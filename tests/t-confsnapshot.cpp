@@ -0,0 +1,129 @@
+/* t-confsnapshot.cpp - Test for the gpgconf snapshot.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "common_indep.h"
+#include "confsnapshot.h"
+#include "t-common.h"
+
+#include <string>
+#include <vector>
+
+static void
+write_file (const std::string &path, const char *content)
+{
+  FILE *fp = fopen (path.c_str (), "wb");
+  if (!fp)
+    {
+      fail ("Failed to write file");
+    }
+  fputs (content, fp);
+  fclose (fp);
+}
+
+int main()
+{
+  char tmpl[] = "/tmp/t-confsnapshot-XXXXXX";
+  if (!mkdtemp (tmpl))
+    {
+      fail ("Failed to create directory");
+    }
+  const std::string dir = tmpl;
+  const std::string gpg_conf = dir + "/gpg.conf";
+  const std::string gpgsm_conf = dir + "/gpgsm.conf";
+  const std::string path = dir + "/snapshot.txt";
+  write_file (gpg_conf, "trust-model tofu+pgp\n");
+
+  ConfigSnapshot snapshot;
+  snapshot.set ("gpg", "trust-model", "tofu+pgp");
+  snapshot.set ("gpg", "auto-key-retrieve", "0");
+  snapshot.set ("gpg", "comment", "two words");
+  snapshot.set ("gpg", "multi", "a\nb");
+  snapshot.set ("gpgsm", "disable-crl-checks", "1");
+  snapshot.set ("dirmngr", "", "");
+  snapshot.set_sources (ConfigSnapshot::stat_files ({ gpg_conf,
+                                                      gpgsm_conf }));
+
+  std::string value;
+  if (!snapshot.flag ("gpgsm", "disable-crl-checks") ||
+      snapshot.flag ("gpg", "auto-key-retrieve") ||
+      snapshot.flag ("gpg", "unknown") ||
+      snapshot.get ("gpg", "multi", &value) ||
+      !snapshot.has_component ("dirmngr") ||
+      snapshot.has_component ("scdaemon") ||
+      !snapshot.sources ()[0].exists || snapshot.sources ()[1].exists)
+    {
+      fail ("Wrong values");
+    }
+  if (!snapshot.current ())
+    {
+      fail ("Snapshot not current");
+    }
+
+  /* Save and load keeps everything.  */
+  ConfigSnapshot loaded;
+  if (!snapshot.save (path) || !loaded.load (path) ||
+      !loaded.same (snapshot) || !loaded.current () ||
+      !loaded.get ("gpg", "comment", &value) || value != "two words")
+    {
+      fail ("Snapshot not restored");
+    }
+
+  /* A changed, new or removed file makes the snapshot stale.  */
+  write_file (gpg_conf, "trust-model tofu+pgp\nauto-key-retrieve\n");
+  if (loaded.current ())
+    {
+      fail ("Changed file not detected");
+    }
+  loaded.set_sources (ConfigSnapshot::stat_files ({ gpg_conf,
+                                                    gpgsm_conf }));
+  write_file (gpgsm_conf, "");
+  if (loaded.current ())
+    {
+      fail ("New file not detected");
+    }
+  loaded.set_sources (ConfigSnapshot::stat_files ({ gpg_conf,
+                                                    gpgsm_conf }));
+  unlink (gpgsm_conf.c_str ());
+  if (loaded.current ())
+    {
+      fail ("Removed file not detected");
+    }
+
+  /* Broken snapshots are not used.  */
+  ConfigSnapshot broken;
+  write_file (path, "# Something else\nopt gpg a 1\n");
+  if (broken.load (path) || broken.load (dir + "/missing") ||
+      !broken.empty ())
+    {
+      fail ("Broken snapshot used");
+    }
+  write_file (path, "# GpgOL gpgconf snapshot v1\nopt gpg a 1\n");
+  if (broken.load (path))
+    {
+      fail ("Snapshot without files used");
+    }
+
+  unlink (path.c_str ());
+  unlink (gpg_conf.c_str ());
+  rmdir (tmpl);
+  return 0;
+}
@@ -0,0 +1,161 @@
+/* t-dispidcache.cpp - Test for the cache of OOM dispids.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "common_indep.h"
+#include "dispidcache.h"
+#include "t-common.h"
+
+#include <map>
+#include <string>
+
+/* Stands in for the ITypeInfo of an OOM type.  */
+struct FakeTypeInfo
+{
+  std::map<std::string, long> members;
+  int refs;
+  int calls;
+};
+
+/* Stands in for an IDispatch.  Objects of the same type share their
+   type info like COM objects of the same type library do.  */
+struct FakeDispatch
+{
+  FakeTypeInfo *info;
+
+  FakeTypeInfo *GetTypeInfo ()
+  {
+    if (info)
+      {
+        info->refs++;
+      }
+    return info;
+  }
+
+  bool GetIDsOfNames (const char *name, long *r_dispid)
+  {
+    info->calls++;
+    const auto it = info->members.find (name);
+    if (it == info->members.end ())
+      {
+        return false;
+      }
+    *r_dispid = it->second;
+    return true;
+  }
+};
+
+/* Like lookup_oom_dispid.  Returns -1 for unknown names.  */
+static long
+lookup (DispidCache &cache, FakeDispatch &disp, const char *name)
+{
+  long dispid;
+  bool new_type;
+  FakeTypeInfo *info = disp.GetTypeInfo ();
+  const bool ok = cache.lookup (info, name,
+                                [&disp] (const char *n, long *r_id)
+                                  {
+                                    return disp.GetIDsOfNames (n, r_id);
+                                  }, &dispid, &new_type);
+  if (info && !new_type)
+    {
+      info->refs--;
+    }
+  return ok ? dispid : -1;
+}
+
+static void
+check_dispids ()
+{
+  DispidCache cache;
+  FakeTypeInfo mail_info = { { {"Subject", 55}, {"Body", 156} }, 1, 0 };
+  FakeTypeInfo other_info = { { {"Subject", 7} }, 1, 0 };
+  FakeDispatch mail1 = { &mail_info };
+  FakeDispatch mail2 = { &mail_info };
+  FakeDispatch other = { &other_info };
+
+  for (int i = 0; i < 100; i++)
+    {
+      if (lookup (cache, i % 2 ? mail1 : mail2, "Subject") != 55 ||
+          lookup (cache, mail1, "Body") != 156 ||
+          lookup (cache, other, "Subject") != 7)
+        {
+          fail ("Wrong dispid");
+        }
+    }
+  /* One call per type and name.  */
+  if (mail_info.calls != 2 || other_info.calls != 1 ||
+      cache.misses () != 3 || cache.hits () != 297)
+    {
+      fail ("Wrong hit rate");
+    }
+  /* The cache keeps one reference per type.  */
+  if (mail_info.refs != 2 || other_info.refs != 2)
+    {
+      fail ("Wrong type references");
+    }
+
+  /* Unknown names are asked every time.  */
+  if (lookup (cache, mail1, "Nope") != -1 ||
+      lookup (cache, mail1, "Nope") != -1 || mail_info.calls != 4)
+    {
+      fail ("Unknown name cached");
+    }
+
+  /* Objects without type are not cached.  */
+  FakeTypeInfo untyped_info = { { {"Subject", 55} }, 1, 0 };
+  FakeDispatch untyped = { nullptr };
+  long dispid;
+  auto resolve = [&untyped_info] (const char *n, long *r_id)
+    {
+      FakeDispatch disp = { &untyped_info };
+      return disp.GetIDsOfNames (n, r_id);
+    };
+  cache.lookup (untyped.GetTypeInfo (), "Subject", resolve, &dispid);
+  cache.lookup (untyped.GetTypeInfo (), "Subject", resolve, &dispid);
+  if (untyped_info.calls != 2 || dispid != 55)
+    {
+      fail ("Untyped object cached");
+    }
+
+  /* A changed member is picked up after invalidation.  */
+  mail_info.members["Subject"] = 56;
+  if (lookup (cache, mail1, "Subject") != 55)
+    {
+      fail ("Cache not used");
+    }
+  cache.invalidate (&mail_info, "Subject");
+  if (lookup (cache, mail2, "Subject") != 56 ||
+      lookup (cache, other, "Subject") != 7 ||
+      lookup (cache, mail1, "Body") != 156 || mail_info.calls != 5)
+    {
+      fail ("Invalidated too much or too little");
+    }
+  if (mail_info.refs != 2 || other_info.refs != 2)
+    {
+      fail ("Type references changed");
+    }
+}
+
+int main()
+{
+  check_dispids ();
+  return 0;
+}
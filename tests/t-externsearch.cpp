@@ -0,0 +1,269 @@
+/* t-externsearch.cpp - Test for the external key search back-off.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "common_indep.h"
+#include "externsearch.h"
+#include "t-common.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Stands in for the directory servers of dirmngr.  It knows
+   certificates for some addresses and counts the queries.  */
+class StubKeyserver
+{
+public:
+  StubKeyserver () : queries (0), active (0), max_active (0) {}
+
+  ExternSearch::Result search (const std::string &addr)
+  {
+    const int now_active = ++active;
+    int seen = max_active;
+    while (now_active > seen &&
+           !max_active.compare_exchange_weak (seen, now_active))
+      ;
+    queries++;
+    std::this_thread::sleep_for (std::chrono::milliseconds (delay_ms));
+    active--;
+    std::lock_guard<std::mutex> lock (mutex);
+    if (offline)
+      {
+        return ExternSearch::Failed;
+      }
+    return certs.count (addr) ? ExternSearch::Found : ExternSearch::NotFound;
+  }
+
+  ExternSearch::Search searcher (const std::string &addr)
+  {
+    return [this, addr] () { return search (addr); };
+  }
+
+  std::mutex mutex;
+  std::set<std::string> certs;
+  std::atomic<int> queries;
+  std::atomic<int> active;
+  std::atomic<int> max_active;
+  int delay_ms = 0;
+  bool offline = false;
+};
+
+/* The fake time.  It starts at the real time as loading the state
+   drops entries that expired long ago.  */
+static long long s_now;
+
+static void
+check_backoff (const std::string &path)
+{
+  StubKeyserver server;
+  server.certs.insert ("known@example.org");
+  ExternSearch search (path, 2, 100, 1000);
+  search.set_clock ([] () { return s_now; });
+
+  if (!search.run ("known@example.org", server.searcher ("known@example.org"))
+      || !search.run ("known@example.org",
+                      server.searcher ("known@example.org"))
+      || server.queries != 2 || search.size ())
+    {
+      fail ("Found certificates are held back");
+    }
+
+  /* An unknown address is not searched again within the back-off
+     time, which doubles each time up to the maximum.  */
+  const std::string unknown = "nobody@other.example";
+  long long expected[] = { 100, 200, 400, 800, 1000, 1000 };
+  for (long long wait: expected)
+    {
+      const int queries = server.queries;
+      if (search.run (unknown, server.searcher (unknown)) ||
+          server.queries != queries + 1)
+        {
+          fail ("Unknown address not searched");
+        }
+      s_now += wait - 1;
+      if (search.wanted (unknown) ||
+          search.run ("NOBODY@other.example", server.searcher (unknown)) ||
+          server.queries != queries + 1)
+        {
+          fail ("Unknown address searched too early");
+        }
+      s_now += 1;
+      if (!search.wanted (unknown))
+        {
+          fail ("Back-off too long");
+        }
+    }
+  search.forget (unknown);
+}
+
+static void
+check_domain (const std::string &path)
+{
+  StubKeyserver server;
+  ExternSearch search (path, 2, 100, 1000);
+  search.set_clock ([] () { return s_now; });
+
+  /* After three unknown addresses the domain backs off.  */
+  search.run ("a@nodir.example", server.searcher ("a@nodir.example"));
+  search.run ("b@nodir.example", server.searcher ("b@nodir.example"));
+  if (!search.wanted ("c@nodir.example"))
+    {
+      fail ("Domain backs off too early");
+    }
+  search.run ("c@nodir.example", server.searcher ("c@nodir.example"));
+  if (search.wanted ("d@nodir.example") || !search.wanted ("d@dir.example"))
+    {
+      fail ("Domain does not back off");
+    }
+  s_now += 100;
+  if (!search.wanted ("d@nodir.example"))
+    {
+      fail ("Domain back-off too long");
+    }
+  /* A hit clears the domain.  */
+  server.certs.insert ("d@nodir.example");
+  search.run ("d@nodir.example", server.searcher ("d@nodir.example"));
+  search.run ("e@nodir.example", server.searcher ("e@nodir.example"));
+  if (!search.wanted ("f@nodir.example"))
+    {
+      fail ("Domain not cleared");
+    }
+}
+
+static void
+check_persistence (const std::string &path)
+{
+  StubKeyserver server;
+  {
+    ExternSearch search (path, 2, 100, 1000);
+    search.set_clock ([] () { return s_now; });
+    search.run ("gone@example.net", server.searcher ("gone@example.net"));
+  }
+  ExternSearch search (path, 2, 100, 1000);
+  search.set_clock ([] () { return s_now; });
+  if (search.wanted ("gone@example.net") || !search.wanted ("new@example.net"))
+    {
+      fail ("State not restored");
+    }
+
+  FILE *fp = fopen (path.c_str (), "rb");
+  char buf[4096];
+  const size_t nread = fp ? fread (buf, 1, sizeof buf - 1, fp) : 0;
+  if (fp)
+    {
+      fclose (fp);
+    }
+  buf[nread] = 0;
+  if (!nread || strstr (buf, "gone") || strstr (buf, "example"))
+    {
+      fail ("Addresses stored in the clear");
+    }
+}
+
+static void
+check_failures (const std::string &path)
+{
+  /* Searches that did not finish, e.g. while offline, do not back
+     off the address or the domain and are not saved.  */
+  StubKeyserver server;
+  server.offline = true;
+  ExternSearch search (path, 2, 100, 1000);
+  search.set_clock ([] () { return s_now; });
+  for (int i = 0; i < 5; i++)
+    {
+      const std::string addr = "user" + std::to_string (i) +
+                               "@offline.example";
+      if (search.run (addr, server.searcher (addr)))
+        {
+          fail ("Failed search reported as found");
+        }
+    }
+  if (search.size () || !search.wanted ("user0@offline.example") ||
+      !search.wanted ("new@offline.example") ||
+      !access (path.c_str (), F_OK))
+    {
+      fail ("Failed search backs off");
+    }
+
+  server.offline = false;
+  search.run ("user0@offline.example",
+              server.searcher ("user0@offline.example"));
+  if (server.queries != 6 || search.wanted ("user0@offline.example"))
+    {
+      fail ("Search after failures not counted");
+    }
+}
+
+static void
+check_concurrency ()
+{
+  StubKeyserver server;
+  server.delay_ms = 20;
+  ExternSearch search (std::string (), 2, 100, 1000);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++)
+    {
+      const std::string addr = "user" + std::to_string (i) + "@d" +
+                               std::to_string (i) + ".example";
+      threads.push_back (std::thread ([&search, &server, addr] () {
+        search.run (addr, server.searcher (addr));
+      }));
+    }
+  for (auto &thread: threads)
+    {
+      thread.join ();
+    }
+  if (server.queries != 8 || server.max_active > 2)
+    {
+      fail ("Concurrency limit not kept");
+    }
+}
+
+int main()
+{
+  char tmpl[] = "/tmp/t-externsearch-XXXXXX";
+  if (!mkdtemp (tmpl))
+    {
+      fail ("Failed to create directory");
+    }
+  const std::string path = std::string (tmpl) + "/state.txt";
+  s_now = (long long) time (nullptr);
+
+  check_backoff (path);
+  check_domain (path);
+  unlink (path.c_str ());
+  check_persistence (path);
+  unlink (path.c_str ());
+  check_failures (path);
+  check_concurrency ();
+
+  unlink (path.c_str ());
+  rmdir (tmpl);
+  return 0;
+}
@@ -0,0 +1,178 @@
+/* t-handletable.cpp - Test for the generation counted handle table.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "handletable.h"
+#include "t-common.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define THREADS 8
+#define OBJS 16
+#define ROUNDS 200000
+
+struct Obj
+{
+  /* Set while the object is in the table.  A stale handle that
+     still resolves would see it unset.  */
+  std::atomic<int> live;
+  int owner;
+};
+
+static HandleTable<Obj> s_table;
+/* The objects outlive the threads so that a resolved handle can
+   be dereferenced after its object was removed.  */
+static Obj s_objs[THREADS][OBJS];
+static std::atomic<bool> s_failed (false);
+
+static void
+check_basics ()
+{
+  HandleTable<Obj> table;
+  Obj a, b;
+
+  if (table.get (0) || table.contains (&a))
+    {
+      fail ("Empty table has objects");
+    }
+  const auto ha = table.add (&a);
+  if (!ha || table.get (ha) != &a || table.find (&a) != ha ||
+      table.add (&a) != ha || table.size () != 1)
+    {
+      fail ("Add failed");
+    }
+  if (!table.remove (ha) || table.remove (ha) || table.get (ha) ||
+      table.contains (&a))
+    {
+      fail ("Remove failed");
+    }
+  /* The slot is reused with a new generation.  */
+  const auto hb = table.add (&b);
+  if ((hb & 0xffffffff) != (ha & 0xffffffff) || hb == ha ||
+      table.get (ha) || table.get (hb) != &b)
+    {
+      fail ("Stale handle resolves");
+    }
+  /* The same address again gets a new handle.  */
+  table.remove (&b);
+  const auto hb2 = table.add (&b);
+  if (hb2 == hb || table.get (hb) || table.get (hb2) != &b)
+    {
+      fail ("Reused address keeps handle");
+    }
+  if (table.get (hb2 + 1) || table.get (~(uint64_t) 0))
+    {
+      fail ("Bogus handle resolves");
+    }
+}
+
+/* Each thread adds and removes its own objects and checks the
+   handles of all threads while the others change the table.  */
+static void
+stress (int id, std::vector<std::atomic<uint64_t> > *shared)
+{
+  Obj *objs = s_objs[id];
+  uint64_t handles[OBJS] = {0};
+  unsigned int seed = id;
+
+  for (int i = 0; i < OBJS; i++)
+    {
+      objs[i].live = 0;
+      objs[i].owner = id;
+    }
+  for (int round = 0; round < ROUNDS && !s_failed; round++)
+    {
+      const int i = rand_r (&seed) % OBJS;
+      if (handles[i])
+        {
+          objs[i].live = 0;
+          if (!s_table.remove (handles[i]))
+            {
+              s_failed = true;
+            }
+          handles[i] = 0;
+        }
+      else
+        {
+          objs[i].live = 1;
+          handles[i] = s_table.add (&objs[i]);
+          if (s_table.get (handles[i]) != &objs[i])
+            {
+              s_failed = true;
+            }
+        }
+      (*shared)[id] = handles[i];
+
+      /* A handle published by a thread resolves to an object of
+         that thread or to nothing.  Our own ones must be live.  */
+      const int other = rand_r (&seed) % THREADS;
+      Obj *obj = s_table.get ((*shared)[other]);
+      if (obj && (obj->owner != other || (other == id && !obj->live)))
+        {
+          s_failed = true;
+        }
+    }
+  for (int i = 0; i < OBJS; i++)
+    {
+      if (handles[i])
+        {
+          objs[i].live = 0;
+          s_table.remove (handles[i]);
+        }
+    }
+}
+
+int main()
+{
+  check_basics ();
+
+  std::vector<std::atomic<uint64_t> > shared (THREADS);
+  for (auto &h: shared)
+    {
+      h = 0;
+    }
+  std::vector<std::thread> threads;
+  for (int i = 0; i < THREADS; i++)
+    {
+      threads.push_back (std::thread (stress, i, &shared));
+    }
+  for (auto &thread: threads)
+    {
+      thread.join ();
+    }
+  if (s_failed)
+    {
+      fail ("Inconsistent table under concurrency");
+    }
+  if (s_table.size ())
+    {
+      fail ("Objects left");
+    }
+  for (const auto &h: shared)
+    {
+      if (s_table.get (h))
+        {
+          fail ("Stale handle after stress");
+        }
+    }
+  return 0;
+}
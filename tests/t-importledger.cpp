@@ -0,0 +1,142 @@
+/* t-importledger.cpp - Test for the ledger of key imports.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "common_indep.h"
+#include "importledger.h"
+#include "t-common.h"
+
+#include <string>
+#include <vector>
+
+static void
+write_file (const std::string &path, const std::string &content)
+{
+  FILE *fp = fopen (path.c_str (), "wb");
+  if (!fp)
+    {
+      fail ("Failed to write file");
+    }
+  fputs (content.c_str (), fp);
+  fclose (fp);
+}
+
+static void
+check_memory ()
+{
+  const auto pgp = ImportLedger::digest (GpgME::OpenPGP, "key", 3);
+  const auto cms = ImportLedger::digest (GpgME::CMS, "key", 3);
+  const auto other = ImportLedger::digest (GpgME::OpenPGP, "other", 5);
+  if (pgp == cms || pgp == other || pgp.size () != 64 ||
+      ImportLedger::digest (GpgME::OpenPGP, "key", 3) != pgp)
+    {
+      fail ("Wrong digests");
+    }
+
+  ImportLedger ledger;
+  ImportLedger::entry_s entry;
+  if (ledger.lookup (pgp, entry) || ledger.size ())
+    {
+      fail ("Empty ledger has entries");
+    }
+  ledger.record (pgp, { "AAAA", "BBBB" });
+  ledger.record (cms, { "CCCC" });
+  if (!ledger.lookup (pgp, entry) || entry.fprs.size () != 2 ||
+      entry.fprs[1] != "BBBB" || !entry.when ||
+      !ledger.lookup (cms, entry) || entry.fprs.size () != 1 ||
+      ledger.lookup (other, entry) || ledger.size () != 2)
+    {
+      fail ("Wrong lookup");
+    }
+
+  ledger.forget (pgp);
+  ledger.forget (other);
+  if (ledger.lookup (pgp, entry) || !ledger.lookup (cms, entry) ||
+      ledger.size () != 1)
+    {
+      fail ("Wrong forget");
+    }
+}
+
+int main()
+{
+  check_memory ();
+
+  char tmpl[] = "/tmp/t-importledger-XXXXXX";
+  if (!mkdtemp (tmpl))
+    {
+      fail ("Failed to create directory");
+    }
+  const std::string dir = tmpl;
+  const std::string path = dir + "/ledger.txt";
+  const std::string d1 (64, '1');
+  const std::string d2 (64, '2');
+  const std::string d3 (64, '3');
+  const std::string d4 (64, '4');
+
+  /* Failed imports from older versions and broken lines are
+     dropped on load.  */
+  write_file (path, "# GpgOL import ledger v1\n" +
+                    d1 + " 1 100 AAAA,BBBB\n" +
+                    d2 + " 0 200 \n" +
+                    d3 + " 1 300 CCCC\n" +
+                    "1234 1 400 DDDD\n" +
+                    d4 + "\n");
+  ImportLedger::entry_s entry;
+  {
+    ImportLedger ledger (path, 3);
+    if (ledger.size () != 2 || !ledger.lookup (d1, entry) ||
+        entry.when != 100 || entry.fprs.size () != 2 ||
+        entry.fprs[0] != "AAAA" || ledger.lookup (d2, entry))
+      {
+        fail ("Wrong entries loaded");
+      }
+
+    /* The oldest entries are dropped first.  */
+    ledger.record (d2, { "EEEE" });
+    ledger.record (d4, { "FFFF" });
+    if (ledger.size () != 3 || ledger.lookup (d1, entry) ||
+        !ledger.lookup (d3, entry) || !ledger.lookup (d4, entry))
+      {
+        fail ("Wrong eviction");
+      }
+    ledger.forget (d3);
+  }
+
+  /* Changes are saved right away.  */
+  {
+    ImportLedger ledger (path, 3);
+    if (ledger.size () != 2 || !ledger.lookup (d2, entry) ||
+        entry.fprs.size () != 1 || entry.fprs[0] != "EEEE" ||
+        !ledger.lookup (d4, entry) || ledger.lookup (d3, entry))
+      {
+        fail ("Ledger not restored");
+      }
+  }
+
+  unlink (path.c_str ());
+  if (ImportLedger (path).size ())
+    {
+      fail ("Entries without ledger");
+    }
+  rmdir (tmpl);
+  return 0;
+}
@@ -0,0 +1,212 @@
+/* t-log.cpp - Test for the asynchronous logging.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common_indep.h"
+#include "t-common.h"
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define NTHREADS 4
+#define NLINES 20000
+#define LOGNAME "t-log.log"
+#define SPANNAME "t-log-spans.json"
+
+static void
+log_lines (int thread)
+{
+  for (int i = 0; i < NLINES; i++)
+    {
+      log_debug ("%s:%s: thread %i line %i", SRCNAME, __func__, thread, i);
+    }
+}
+
+/* Returns the nanoseconds per log call. */
+static double
+measure ()
+{
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now ();
+  for (int i = 0; i < NTHREADS; i++)
+    {
+      threads.push_back (std::thread (log_lines, i));
+    }
+  for (auto &t: threads)
+    {
+      t.join ();
+    }
+  std::chrono::duration<double, std::nano> elapsed =
+    std::chrono::steady_clock::now () - start;
+  return elapsed.count () / (NTHREADS * NLINES);
+}
+
+/* Check that all lines are there and in order per thread. */
+static void
+check_log ()
+{
+  std::ifstream in (LOGNAME);
+  std::string line;
+  int next[NTHREADS] = { 0 };
+  int total = 0;
+  while (std::getline (in, line))
+    {
+      const auto pos = line.find ("thread ");
+      int thread, num;
+      if (pos == std::string::npos ||
+          sscanf (line.c_str () + pos, "thread %i line %i", &thread,
+                  &num) != 2 || thread < 0 || thread >= NTHREADS)
+        {
+          continue;
+        }
+      if (num != next[thread])
+        {
+          fail ("Log lines missing or out of order");
+        }
+      next[thread]++;
+      total++;
+    }
+  if (total != NTHREADS * NLINES)
+    {
+      fail ("Wrong number of log lines");
+    }
+}
+
+/* Check that an error is written without an explicit flush. */
+static void
+check_error_flush ()
+{
+  log_error ("%s:%s: the error marker", SRCNAME, __func__);
+  for (int i = 0; i < 200; i++)
+    {
+      std::ifstream in (LOGNAME);
+      std::string content ((std::istreambuf_iterator<char> (in)),
+                           std::istreambuf_iterator<char> ());
+      if (content.find ("ERROR/t-log.cpp:check_error_flush: the error marker")
+          != std::string::npos)
+        {
+          return;
+        }
+      std::this_thread::sleep_for (std::chrono::milliseconds (10));
+    }
+  fail ("Error was not flushed");
+}
+
+/* Check that anonstr is stable and keeps values apart. */
+static void
+check_anonstr ()
+{
+  const std::string a = anonstr ("alice@example.org");
+  const std::string b = anonstr ("bob@example.org");
+  if (a == b || a.find ("gpgol_str_") || a.find ("example") !=
+      std::string::npos)
+    {
+      fail ("Bad anonymized string");
+    }
+  for (int i = 0; i < 100; i++)
+    {
+      anonstr (std::to_string (i).c_str ());
+    }
+  if (a != anonstr ("alice@example.org"))
+    {
+      fail ("Anonymized string not stable");
+    }
+  std::string other;
+  std::thread t ([&other] () { other = anonstr ("alice@example.org"); });
+  t.join ();
+  if (a != other)
+    {
+      fail ("Anonymized string differs between threads");
+    }
+}
+
+static std::string
+read_file (const char *name)
+{
+  std::ifstream in (name);
+  return std::string ((std::istreambuf_iterator<char> (in)),
+                      std::istreambuf_iterator<char> ());
+}
+
+/* A full span buffer is usable again after span_clear.  */
+static void
+check_spans ()
+{
+  /* More than a thread keeps.  */
+  for (int i = 0; i < 300000; i++)
+    {
+      span_record (__FILE__, "filler", span_now ());
+    }
+  if (!span_dump (SPANNAME) ||
+      read_file (SPANNAME).find ("\"dropped\":0}") != std::string::npos)
+    {
+      fail ("Full span buffer not detected");
+    }
+  span_clear ();
+  span_record (__FILE__, "after_clear", span_now ());
+  const std::string content = (span_dump (SPANNAME) ?
+                               read_file (SPANNAME) : std::string ());
+  if (content.find ("after_clear") == std::string::npos ||
+      content.find ("filler") != std::string::npos ||
+      content.find ("\"dropped\":0}") == std::string::npos)
+    {
+      fail ("Spans dropped after clear");
+    }
+  remove (SPANNAME);
+}
+
+int main()
+{
+  opt.enable_debug = 1;
+
+  /* Baseline without a log file. */
+  set_log_file (NULL);
+  const double off = measure ();
+
+  remove (LOGNAME);
+  set_log_file (LOGNAME);
+  const double on = measure ();
+  log_flush ();
+
+  printf ("Per call overhead: %.0f ns with logging, %.0f ns without\n",
+          on, off);
+
+  check_log ();
+  check_error_flush ();
+  check_anonstr ();
+  check_spans ();
+
+  /* After shutdown logging is synchronous. */
+  log_shutdown ();
+  log_debug ("%s:%s: after shutdown", SRCNAME, __func__);
+  const std::string content = read_file (LOGNAME);
+  if (content.find ("after shutdown") == std::string::npos)
+    {
+      fail ("Synchronous logging after shutdown failed");
+    }
+
+  set_log_file (NULL);
+  remove (LOGNAME);
+  return 0;
+}
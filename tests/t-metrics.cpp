@@ -0,0 +1,190 @@
+/* t-metrics.cpp - Test for the metrics registry.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common_indep.h"
+#include "metrics.h"
+#include "t-common.h"
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define NTHREADS 8
+#define NUPDATES 100000
+#define DUMPNAME "t-metrics.txt"
+
+static void
+update (int thread)
+{
+  auto metrics = Metrics::instance ();
+  /* Looking up by name must give the same metric in all threads. */
+  auto counter = metrics->counter ("test.counter");
+  auto gauge = metrics->gauge ("test.gauge");
+  auto hist = metrics->histogram ("test.hist");
+  for (int i = 0; i < NUPDATES; i++)
+    {
+      counter->add ();
+      gauge->add (1);
+      hist->record (thread);
+      gauge->add (-1);
+    }
+}
+
+static void
+check_threads ()
+{
+  std::vector<std::thread> threads;
+  for (int i = 0; i < NTHREADS; i++)
+    {
+      threads.push_back (std::thread (update, i));
+    }
+  for (auto &t: threads)
+    {
+      t.join ();
+    }
+  auto metrics = Metrics::instance ();
+  if (metrics->counter ("test.counter")->value () !=
+      (uint64_t) NTHREADS * NUPDATES)
+    {
+      fail ("Counter lost updates");
+    }
+  const auto gauge = metrics->gauge ("test.gauge");
+  if (gauge->value () || gauge->peak () < 1 || gauge->peak () > NTHREADS)
+    {
+      fail ("Gauge value or peak wrong");
+    }
+  const auto hist = metrics->histogram ("test.hist");
+  uint64_t sum = 0;
+  for (int i = 0; i < NTHREADS; i++)
+    {
+      sum += (uint64_t) i * NUPDATES;
+    }
+  if (hist->count () != (uint64_t) NTHREADS * NUPDATES ||
+      hist->sum () != sum || hist->min () != 0 ||
+      hist->max () != NTHREADS - 1)
+    {
+      fail ("Histogram lost updates");
+    }
+}
+
+static void
+check_histogram ()
+{
+  Metrics::Histogram *hist = Metrics::instance ()->histogram ("test.dist");
+  if (hist->count () || hist->percentile (50) || hist->min () || hist->max ())
+    {
+      fail ("New histogram not empty");
+    }
+  /* 90 fast values and 10 slow ones. */
+  for (int i = 0; i < 90; i++)
+    {
+      hist->record (100);
+    }
+  for (int i = 0; i < 10; i++)
+    {
+      hist->record (5000);
+    }
+  /* 100 falls into the bucket 64 to 127. */
+  if (hist->percentile (50) != 127 || hist->percentile (90) != 127)
+    {
+      fail ("Wrong low percentile");
+    }
+  /* 5000 falls into the bucket 4096 to 8191 which is capped
+     by the maximum. */
+  if (hist->percentile (99) != 5000 || hist->max () != 5000 ||
+      hist->min () != 100)
+    {
+      fail ("Wrong high percentile");
+    }
+
+  Metrics::Histogram *timed = Metrics::instance ()->histogram ("test.timer");
+  {
+    MetricsTimer timer (timed);
+    std::this_thread::sleep_for (std::chrono::milliseconds (20));
+  }
+  if (timed->count () != 1 || timed->min () < 20000)
+    {
+      fail ("Timer did not record");
+    }
+  MetricsTimer stopped (timed);
+  stopped.stop ();
+  stopped.stop ();
+  if (timed->count () != 2)
+    {
+      fail ("Stopped timer recorded twice");
+    }
+}
+
+static void
+check_dump ()
+{
+  auto metrics = Metrics::instance ();
+  const auto dump = metrics->dump ();
+  const auto expected = "counter test.counter " +
+                        std::to_string (NTHREADS * NUPDATES) + "\n";
+  if (dump.find (expected) == std::string::npos ||
+      dump.find ("gauge test.gauge 0 peak=") == std::string::npos ||
+      dump.find ("histogram test.dist count=100 sum=59000 min=100 max=5000 "
+                 "p50=127 p90=127 p99=5000\n") == std::string::npos)
+    {
+      fprintf (stderr, "%s", dump.c_str ());
+      fail ("Unexpected dump");
+    }
+
+  remove (DUMPNAME);
+  if (!metrics->dump_to_file (DUMPNAME))
+    {
+      fail ("Failed to write dump");
+    }
+  std::ifstream in (DUMPNAME);
+  std::string content ((std::istreambuf_iterator<char> (in)),
+                       std::istreambuf_iterator<char> ());
+  if (content.find (expected) == std::string::npos)
+    {
+      fail ("Dump file incomplete");
+    }
+  remove (DUMPNAME);
+
+  auto gauge = metrics->gauge ("test.gauge");
+  gauge->set (3);
+  auto counter = metrics->counter ("test.counter");
+  metrics->reset ();
+  if (counter->value () || metrics->histogram ("test.dist")->count () ||
+      gauge->value () != 3 || gauge->peak () != 3)
+    {
+      fail ("Reset failed");
+    }
+  if (metrics->counter ("test.counter") != counter)
+    {
+      fail ("Metric changed after reset");
+    }
+}
+
+int main()
+{
+  check_threads ();
+  check_histogram ();
+  check_dump ();
+  return 0;
+}
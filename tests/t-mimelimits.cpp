@@ -0,0 +1,256 @@
+/* t-mimelimits.cpp - Test the resource limits of the MIME parser.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "common_indep.h"
+#include "mimedataprovider.h"
+#include "attachment.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+/* Generous bounds.  Without limits the inputs below take minutes
+   or crash.  */
+#define MAX_SECONDS 10
+#define MAX_RSS_GROWTH_KB (256 * 1024)
+
+static void
+fail (const char *name, const char *msg)
+{
+  fprintf (stderr, "FAIL: %s: %s\n", name, msg);
+  exit (1);
+}
+
+static long
+max_rss_kb ()
+{
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/* Parse INPUT in small pieces like the real input and check the
+   time and memory bounds.  */
+static void
+parse (const char *name, MimeDataProvider &provider, const std::string &input)
+{
+  const long rss = max_rss_kb ();
+  const auto start = std::chrono::steady_clock::now ();
+  for (size_t pos = 0; pos < input.size (); pos += 4096)
+    {
+      provider.write (input.c_str () + pos,
+                      std::min ((size_t) 4096, input.size () - pos));
+    }
+  provider.finalize ();
+  const auto secs = std::chrono::duration_cast<std::chrono::seconds>
+    (std::chrono::steady_clock::now () - start).count ();
+  if (secs > MAX_SECONDS)
+    {
+      fail (name, "Too slow");
+    }
+  if (max_rss_kb () - rss > MAX_RSS_GROWTH_KB)
+    {
+      fail (name, "Too much memory");
+    }
+}
+
+static std::string
+unparsed (const char *name, MimeDataProvider &provider)
+{
+  if (!provider.limit_reached ())
+    {
+      fail (name, "No limit reached");
+    }
+  const auto atts = provider.get_attachments ();
+  if (atts.empty () || atts.back ()->get_display_name () != "unparsed-mime.txt")
+    {
+      fail (name, "No attachment for the rest");
+    }
+  return atts.back ()->get_data ().toString ();
+}
+
+static void
+check_nesting ()
+{
+  std::string input;
+  for (int i = 0; i < 100000; i++)
+    {
+      input += "Content-Type: multipart/mixed; boundary=\"b" +
+               std::to_string (i) + "\"\r\n\r\n--b" + std::to_string (i) +
+               "\r\n";
+    }
+  input += "Content-Type: text/plain\r\n\r\nDeep\r\n";
+
+  MimeDataProvider provider;
+  parse ("nesting", provider, input);
+  const auto rest = unparsed ("nesting", provider);
+  if (rest.find ("Deep") == std::string::npos)
+    {
+      fail ("nesting", "Rest incomplete");
+    }
+}
+
+static void
+check_parts ()
+{
+  std::string input = "Content-Type: multipart/mixed; boundary=\"b\"\r\n\r\n";
+  for (int i = 0; i < 200000; i++)
+    {
+      input += "--b\r\nContent-Type: application/octet-stream\r\n"
+               "Content-Transfer-Encoding: base64\r\n\r\nAAAA\r\n";
+    }
+  input += "--b--\r\n";
+
+  MimeDataProvider provider;
+  parse ("parts", provider, input);
+  unparsed ("parts", provider);
+  if (provider.get_attachments ().size () >
+      (size_t) MimeDataProvider::default_limits ().max_parts + 1)
+    {
+      fail ("parts", "Too many attachments");
+    }
+}
+
+static void
+check_headers ()
+{
+  std::string input = "Subject: Many headers\r\n";
+  for (int i = 0; i < 1000000; i++)
+    {
+      input += "X-Header: " + std::to_string (i) + "\r\n";
+    }
+  input += "\r\nBody\r\n";
+
+  MimeDataProvider provider;
+  parse ("headers", provider, input);
+  const auto rest = unparsed ("headers", provider);
+  /* The headers the parser already took are kept.  */
+  if (rest.compare (0, 23, "Subject: Many headers\r\n") ||
+      rest.find ("\r\nBody\r\n") == std::string::npos)
+    {
+      fail ("headers", "Rest incomplete");
+    }
+}
+
+static void
+check_line_length ()
+{
+  const std::string line (10 * 1024 * 1024, 'x');
+  const std::string input = "Content-Type: text/plain\r\n\r\nStart\r\n" +
+                            line + "\r\n";
+
+  MimeDataProvider provider;
+  parse ("line", provider, input);
+  const auto rest = unparsed ("line", provider);
+  if (rest.size () != line.size () + 2 ||
+      provider.get_body ().find ("Start") == std::string::npos)
+    {
+      fail ("line", "Wrong split");
+    }
+}
+
+/* Base64 lines are usually skipped in bulk.  An overlong one still
+   stops the parser.  The input is written in pieces of 4096 bytes,
+   the long line is in the first one.  */
+static void
+check_bulk_line_length ()
+{
+  const std::string good (76, 'Q');
+  const std::string bad (1000, 'Q');
+  std::string input =
+    "Content-Type: multipart/mixed; boundary=\"b\"\r\n\r\n"
+    "--b\r\n"
+    "Content-Type: application/octet-stream; name=\"a.bin\"\r\n"
+    "Content-Transfer-Encoding: base64\r\n\r\n";
+  for (int i = 0; i < 20; i++)
+    {
+      input += good + "\r\n";
+    }
+  const std::string tail = bad + "\r\n" + good + "\r\n--b--\r\n";
+  input += tail;
+
+  MimeDataProvider provider;
+  auto limits = MimeDataProvider::default_limits ();
+  limits.max_line_length = 200;
+  provider.set_limits (limits);
+  parse ("bulk line", provider, input);
+  if (unparsed ("bulk line", provider) != tail)
+    {
+      fail ("bulk line", "Wrong rest");
+    }
+  const auto atts = provider.get_attachments ();
+  if (atts.size () != 2 ||
+      atts[0]->get_data ().toString ().size () != 20 * 57)
+    {
+      fail ("bulk line", "Data before the long line lost");
+    }
+}
+
+static void
+check_custom ()
+{
+  const std::string input =
+    "Content-Type: multipart/mixed; boundary=\"outer\"\r\n\r\n"
+    "--outer\r\n"
+    "Content-Type: text/plain\r\n\r\nBody\r\n"
+    "--outer\r\n"
+    "Content-Type: multipart/mixed; boundary=\"inner\"\r\n\r\n"
+    "--inner\r\n"
+    "Content-Type: text/plain\r\n\r\nToo deep\r\n"
+    "--inner--\r\n"
+    "--outer--\r\n";
+
+  MimeDataProvider unlimited;
+  parse ("custom", unlimited, input);
+  if (unlimited.limit_reached ())
+    {
+      fail ("custom", "Default limits reached");
+    }
+
+  MimeDataProvider provider;
+  auto limits = MimeDataProvider::default_limits ();
+  limits.max_depth = 1;
+  provider.set_limits (limits);
+  parse ("custom", provider, input);
+  const auto rest = unparsed ("custom", provider);
+  if (rest != "Content-Type: text/plain\r\n\r\nToo deep\r\n"
+              "--inner--\r\n--outer--\r\n")
+    {
+      fail ("custom", "Wrong rest");
+    }
+  if (provider.get_body ().find ("Body") == std::string::npos)
+    {
+      fail ("custom", "Body lost");
+    }
+}
+
+int main()
+{
+  check_custom ();
+  check_line_length ();
+  check_bulk_line_length ();
+  check_headers ();
+  check_parts ();
+  check_nesting ();
+  return 0;
+}
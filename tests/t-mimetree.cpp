@@ -0,0 +1,515 @@
+/* t-mimetree.cpp - Test for the MIME structure of a parsed mail.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common_indep.h"
+#include "mimedataprovider.h"
+#include "mimetree.h"
+#include "attachment.h"
+#include "metrics.h"
+#include "t-common.h"
+
+#include <string>
+#include <vector>
+
+static const char mail[] =
+  "Content-Type: multipart/mixed; boundary=\"outer\"\r\n"
+  "\r\n"
+  "--outer\r\n"
+  "Content-Type: multipart/related; boundary=\"inner\"\r\n"
+  "\r\n"
+  "--inner\r\n"
+  "Content-Type: text/html; charset=utf-8\r\n"
+  "\r\n"
+  "<img src=\"cid:logo@example\">\r\n"
+  "--inner\r\n"
+  "Content-Type: image/png\r\n"
+  "Content-Transfer-Encoding: base64\r\n"
+  "Content-ID: <logo@example>\r\n"
+  "\r\n"
+  "iVBORw0KGgo=\r\n"
+  "--inner--\r\n"
+  "--outer\r\n"
+  "Content-Type: image/png; name=\"other.png\"\r\n"
+  "Content-Transfer-Encoding: base64\r\n"
+  "\r\n"
+  "iVBORw0KGgo=\r\n"
+  "--outer--\r\n";
+
+/* RFC 2231 continuations and charset encoded parameters.  The
+   extended filename wins over the plain one.  */
+static const char param_mail[] =
+  "Content-Type: multipart/mixed; boundary=\"b\"\r\n"
+  "\r\n"
+  "--b\r\n"
+  "Content-Type: text/plain; charset*=us-ascii'en'utf-8\r\n"
+  "Content-Disposition: attachment; filename=\"plain.txt\";\r\n"
+  " filename*0*=utf-8''%E2%82%AC%20sign;\r\n"
+  " filename*2=\".txt\"; filename*1*=%20%C3%A4\r\n"
+  "\r\n"
+  "x\r\n"
+  "--b\r\n"
+  "Content-Type: application/octet-stream;\r\n"
+  " name*=iso-8859-1''%E4%2Ebin\r\n"
+  "\r\n"
+  "y\r\n"
+  "--b--\r\n";
+
+/* The encoded body of part idx.  */
+static std::string
+body (const MimeTree &tree, int idx)
+{
+  return std::string (mail + tree.part (idx).offset, tree.part (idx).size);
+}
+
+static void
+check_params ()
+{
+  MimeDataProvider provider;
+  provider.write (param_mail, sizeof param_mail - 1);
+  provider.finalize ();
+
+  const MimeTree &tree = provider.mime_tree ();
+  if (tree.size () != 3 || !tree.filename (1) || !tree.filename (2) ||
+      strcmp (tree.filename (1), "\xe2\x82\xac sign \xc3\xa4.txt") ||
+      strcmp (tree.filename (2), "\xc3\xa4.bin") ||
+      strcmp (tree.charset (1), "utf-8"))
+    {
+      fail ("Wrong RFC 2231 parameters");
+    }
+}
+
+static const char body_mail[] =
+  "Content-Type: multipart/mixed; boundary=\"b\"\r\n"
+  "\r\n"
+  "--b\r\n"
+  "Content-Type: text/plain; charset=utf-8\r\n"
+  "\r\n"
+  "Hello\r\n"
+  "World\r\n"
+  "--b\r\n"
+  "Content-Type: application/octet-stream; name=\"a.bin\"\r\n"
+  "Content-Transfer-Encoding: base64\r\n"
+  "\r\n"
+  "QUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFB\r\n"
+  "QUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFBQUFB\r\n"
+  "--b\r\n"
+  "Content-Type: application/octet-stream; name=\"b.bin\"\r\n"
+  "\r\n"
+  "B\r\n"
+  "--b--\r\n";
+
+/* The body is announced once, when the text part is complete and
+   before the data of the first attachment was written.  */
+static void
+check_body_done ()
+{
+  MimeDataProvider provider;
+  int calls = 0;
+  size_t written = 0;
+  size_t written_at_cb = 0;
+  std::string body_at_cb;
+  provider.set_body_done_cb ([&] ()
+    {
+      calls++;
+      written_at_cb = written;
+      body_at_cb = provider.get_body ();
+    });
+  for (size_t pos = 0; pos < sizeof body_mail - 1; pos += 5)
+    {
+      const size_t len = std::min ((size_t) 5, sizeof body_mail - 1 - pos);
+      written = pos + len;
+      provider.write (body_mail + pos, len);
+    }
+  provider.finalize ();
+
+  const char *attachment_end = strstr (strstr (body_mail, "QUFB"), "--b");
+  if (calls != 1 || body_at_cb != provider.get_body () ||
+      body_at_cb.find ("World") == std::string::npos ||
+      written_at_cb >= (size_t) (attachment_end - body_mail) ||
+      provider.get_attachments ().size () != 2)
+    {
+      fail ("Body not announced before the attachments");
+    }
+
+  /* A body that only ends with the input is not announced.  */
+  MimeDataProvider text;
+  calls = 0;
+  text.set_body_done_cb ([&calls] () { calls++; });
+  const char plain[] = "Content-Type: text/plain\r\n\r\nJust text\r\n";
+  text.write (plain, sizeof plain - 1);
+  text.finalize ();
+  if (calls)
+    {
+      fail ("Body announced at the end");
+    }
+}
+
+/* Base64 encoded PGP or S/MIME data of larger mails is skipped in
+   bulk up to the next boundary.  This must give the same result as
+   handling the lines one by one.  */
+
+static std::string
+base64_lines (const std::string &data, const char *eol)
+{
+  static const char digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string ret;
+  std::string line;
+  for (size_t i = 0; i < data.size (); i += 3)
+    {
+      unsigned int v = (unsigned char) data[i] << 16;
+      if (i + 1 < data.size ())
+        v |= (unsigned char) data[i + 1] << 8;
+      if (i + 2 < data.size ())
+        v |= (unsigned char) data[i + 2];
+      line += digits[(v >> 18) & 63];
+      line += digits[(v >> 12) & 63];
+      line += i + 1 < data.size () ? digits[(v >> 6) & 63] : '=';
+      line += i + 2 < data.size () ? digits[v & 63] : '=';
+      if (line.size () == 76)
+        {
+          ret += line + eol;
+          line.clear ();
+        }
+    }
+  if (!line.empty ())
+    {
+      ret += line + eol;
+    }
+  return ret;
+}
+
+/* Some binary data that does not look like a boundary.  */
+static std::string
+binary_data (size_t len)
+{
+  std::string ret;
+  unsigned int state = 42;
+  for (size_t i = 0; i < len; i++)
+    {
+      state = state * 1103515245 + 12345;
+      ret += (char) (state >> 16);
+    }
+  return ret;
+}
+
+/* Replace the CR LF line endings of S by EOL.  */
+static std::string
+with_eol (const std::string &s, const char *eol)
+{
+  std::string ret;
+  for (size_t i = 0; i < s.size (); i++)
+    {
+      if (s[i] == '\r' && i + 1 < s.size () && s[i + 1] == '\n')
+        {
+          ret += eol;
+          i++;
+        }
+      else
+        {
+          ret += s[i];
+        }
+    }
+  return ret;
+}
+
+static std::string
+data_string (GpgME::Data &data)
+{
+  std::string ret;
+  char buf[4096];
+  ssize_t nread;
+  data.seek (0, SEEK_SET);
+  while ((nread = data.read (buf, sizeof buf)) > 0)
+    {
+      ret.append (buf, nread);
+    }
+  data.seek (0, SEEK_SET);
+  return ret;
+}
+
+/* Everything the provider collected from a mail.  */
+struct collected_s
+{
+  std::string crypto_data;
+  std::string signature;
+  std::string body;
+  std::vector<std::string> attachments;
+  std::vector<std::pair<size_t, size_t> > parts;
+  size_t bulk_bytes;
+
+  bool operator== (const collected_s &other) const
+  {
+    return crypto_data == other.crypto_data &&
+           signature == other.signature && body == other.body &&
+           attachments == other.attachments && parts == other.parts;
+  }
+};
+
+/* Parse INPUT written in the pieces that start at SPLITS.  */
+static collected_s
+collect (const std::string &input, const std::vector<size_t> &splits,
+         bool bulk)
+{
+  static auto s_bulk_bytes = Metrics::instance ()->counter ("mime.bulk_bytes");
+  const uint64_t bulk_start = s_bulk_bytes->value ();
+  MimeDataProvider provider;
+  if (!bulk)
+    {
+      provider.disable_bulk ();
+    }
+  size_t pos = 0;
+  for (size_t split: splits)
+    {
+      provider.write (input.c_str () + pos, split - pos);
+      pos = split;
+    }
+  provider.write (input.c_str () + pos, input.size () - pos);
+  provider.finalize ();
+
+  collected_s ret;
+  provider.crypto_digest ();
+  char buf[4096];
+  ssize_t nread;
+  while ((nread = provider.read (buf, sizeof buf)) > 0)
+    {
+      ret.crypto_data.append (buf, nread);
+    }
+  if (provider.signature ())
+    {
+      ret.signature = data_string (*provider.signature ());
+    }
+  ret.body = provider.get_body ();
+  for (const auto &attachment: provider.get_attachments ())
+    {
+      ret.attachments.push_back (data_string (attachment->get_data ()));
+    }
+  const MimeTree &tree = provider.mime_tree ();
+  for (int i = 0; i < (int) tree.size (); i++)
+    {
+      ret.parts.push_back (std::make_pair (tree.part (i).offset,
+                                           tree.part (i).size));
+    }
+  ret.bulk_bytes = s_bulk_bytes->value () - bulk_start;
+  return ret;
+}
+
+/* Parse INPUT with and without the bulk path and in different
+   pieces.  Returns the result of the line path.  */
+static collected_s
+check_same (const char *name, const std::string &input)
+{
+  const collected_s expected = collect (input, {}, false);
+  if (expected.bulk_bytes)
+    {
+      fail ("Bulk path not disabled");
+    }
+  const collected_s whole = collect (input, {}, true);
+  if (!whole.bulk_bytes)
+    {
+      fprintf (stderr, "%s: ", name);
+      fail ("Bulk path not used");
+    }
+  std::vector<std::vector<size_t> > all_splits = { {} };
+  /* Small and large pieces.  */
+  for (size_t step: { (size_t) 1, (size_t) 7, (size_t) 4096 })
+    {
+      std::vector<size_t> splits;
+      for (size_t pos = step; pos < input.size (); pos += step)
+        {
+          splits.push_back (pos);
+        }
+      all_splits.push_back (splits);
+    }
+  /* Pieces that end within each boundary line or right before
+     it, e.g. with a lone "-" or "--".  */
+  for (size_t at = input.find ("\n--"); at != std::string::npos;
+       at = input.find ("\n--", at + 1))
+    {
+      for (size_t len = 0; len < 12 && at + len < input.size (); len++)
+        {
+          all_splits.push_back ({ at + len });
+        }
+    }
+  for (const auto &splits: all_splits)
+    {
+      if (!(collect (input, splits, true) == expected))
+        {
+          fprintf (stderr, "%s: ", name);
+          fail ("Bulk path differs from the line path");
+        }
+    }
+  return expected;
+}
+
+static void
+check_bulk ()
+{
+  const std::string data = binary_data (20000);
+  const std::string sig = binary_data (3000);
+
+  for (const char *eol: { "\r\n", "\n" })
+    {
+      /* An attachment.  The base64 lines end with a partial "-". */
+      const std::string attach_mail = with_eol (
+        "Content-Type: multipart/mixed; boundary=\"b\"\r\n"
+        "\r\n"
+        "--b\r\n"
+        "Content-Type: text/plain\r\n"
+        "\r\n"
+        "Hello\r\n"
+        "--b\r\n"
+        "Content-Type: application/octet-stream; name=\"a.bin\"\r\n"
+        "Content-Transfer-Encoding: base64\r\n"
+        "\r\n", eol) + base64_lines (data, eol) + "-" + eol + "--" + eol +
+        "--bb" + eol + with_eol (
+        "--b\r\n"
+        "Content-Type: application/octet-stream; name=\"b.bin\"\r\n"
+        "Content-Transfer-Encoding: base64\r\n"
+        "\r\n"
+        "Qg==\r\n"
+        "--b--\r\n", eol);
+      const auto attach = check_same ("attachment", attach_mail);
+      if (attach.attachments.size () != 2 ||
+          attach.attachments[0].size () < data.size () ||
+          attach.attachments[0].compare (0, data.size (), data) ||
+          attach.attachments[1] != "B" || attach.body != "Hello\r\n")
+        {
+          fail ("Wrong attachment data");
+        }
+
+      /* Opaque S/MIME data.  */
+      const std::string smime_mail = with_eol (
+        "Content-Type: multipart/mixed; boundary=\"b\"\r\n"
+        "\r\n"
+        "--b\r\n"
+        "Content-Type: application/pkcs7-mime; smime-type=enveloped-data\r\n"
+        "Content-Transfer-Encoding: base64\r\n"
+        "\r\n", eol) + base64_lines (data, eol) + with_eol (
+        "--b--\r\n", eol);
+      if (check_same ("crypto data", smime_mail).crypto_data != data)
+        {
+          fail ("Wrong crypto data");
+        }
+
+      /* A detached S/MIME signature.  */
+      const std::string signed_mail = with_eol (
+        "Content-Type: multipart/signed; micalg=sha-256;\r\n"
+        " protocol=\"application/pkcs7-signature\"; boundary=\"s\"\r\n"
+        "\r\n"
+        "--s\r\n"
+        "Content-Type: text/plain\r\n"
+        "\r\n"
+        "Signed\r\n"
+        "--s\r\n"
+        "Content-Type: application/pkcs7-signature; name=\"smime.p7s\"\r\n"
+        "Content-Transfer-Encoding: base64\r\n"
+        "\r\n", eol) + base64_lines (sig, eol) + with_eol (
+        "--s--\r\n", eol);
+      if (check_same ("signature", signed_mail).signature != sig)
+        {
+          fail ("Wrong signature");
+        }
+    }
+}
+
+int main()
+{
+  check_params ();
+  check_body_done ();
+  check_bulk ();
+
+  MimeDataProvider provider;
+  /* Write in small pieces so that lines are split.  */
+  for (size_t pos = 0; pos < sizeof mail - 1; pos += 7)
+    {
+      provider.write (mail + pos, std::min ((size_t) 7, sizeof mail - 1 - pos));
+    }
+  provider.finalize ();
+
+  const MimeTree &tree = provider.mime_tree ();
+  if (tree.size () != 5)
+    {
+      fail ("Wrong number of parts");
+    }
+  if (strcmp (tree.content_type (0), "multipart/mixed") ||
+      strcmp (tree.content_type (1), "multipart/related") ||
+      strcmp (tree.content_type (2), "text/html") ||
+      strcmp (tree.content_type (3), "image/png") ||
+      strcmp (tree.content_type (4), "image/png"))
+    {
+      fail ("Wrong content types");
+    }
+  /* Interned types share their string.  */
+  if (tree.part (3).type != tree.part (4).type)
+    {
+      fail ("Type not interned");
+    }
+  if (tree.part (0).parent != -1 || tree.part (1).parent != 0 ||
+      tree.part (2).parent != 1 || tree.part (3).parent != 1 ||
+      tree.part (4).parent != 0 || tree.part (0).first_child != 1 ||
+      tree.part (1).next_sibling != 4 || tree.part (2).next_sibling != 3)
+    {
+      fail ("Wrong tree");
+    }
+  if (tree.path (3) != "1.2" || tree.find_by_path ("1.2") != 3 ||
+      tree.find_by_path ("") != 0 || tree.find_by_path ("2") != 4 ||
+      tree.find_by_path ("3") != -1 || tree.find_by_path ("1.x") != -1)
+    {
+      fail ("Wrong paths");
+    }
+
+  const int img = tree.find_by_cid ("logo@example");
+  if (img != 3 || tree.find_by_cid ("<logo@example>") != 3 ||
+      tree.find_by_cid ("missing") != -1)
+    {
+      fail ("Wrong cid lookup");
+    }
+  const auto pngs = tree.find_by_type ("image/png");
+  if (pngs.size () != 2 || pngs[0] != 3 || pngs[1] != 4 ||
+      !tree.find_by_type ("text/plain").empty ())
+    {
+      fail ("Wrong type lookup");
+    }
+  if (strcmp (tree.charset (2), "utf-8") || tree.charset (3) ||
+      strcmp (tree.filename (4), "other.png") || tree.filename (3))
+    {
+      fail ("Wrong parameters");
+    }
+
+  if (body (tree, 2) != "<img src=\"cid:logo@example\">" ||
+      body (tree, 3) != "iVBORw0KGgo=" || body (tree, 4) != "iVBORw0KGgo=")
+    {
+      fail ("Wrong offsets");
+    }
+
+  /* The cid resolves to the attachment of the part.  */
+  const auto atts = provider.get_attachments ();
+  const int att = tree.part (img).attachment;
+  if (att < 0 || att >= (int) atts.size () ||
+      atts[att]->get_content_id () != "<logo@example>" ||
+      tree.part (2).attachment != -1)
+    {
+      fail ("Wrong attachment");
+    }
+  return 0;
+}
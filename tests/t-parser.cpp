@@ -63,6 +63,14 @@ struct
     NULL,
     2,
     "us-ascii"},
+  /* The signed part is larger than the pipe between the
+     verification and the MIME parser.  */
+  { DATADIR "/openpgp-signed-large.mbox",
+    MSGTYPE_GPGOL_MULTIPART_SIGNED,
+    DATADIR "/openpgp-signed-large.plain",
+    NULL,
+    1,
+    "us-ascii"},
   { DATADIR "/openpgp-encrypted+signed.mbox",
     MSGTYPE_GPGOL_MULTIPART_ENCRYPTED,
     DATADIR "/openpgp-encrypted+signed.plain",
@@ -0,0 +1,185 @@
+/* t-pipedataprovider.cpp - Test for the bounded pipe.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "common_indep.h"
+#include "pipedataprovider.h"
+#include "t-common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+/* Read until EOF or error.  Returns the result of the last read.  */
+static ssize_t
+read_all (PipeDataProvider &pipe, std::string *r_data, size_t chunk)
+{
+  char buf[64];
+  ssize_t nread;
+
+  while ((nread = pipe.read (buf, std::min (chunk, sizeof buf))) > 0)
+    {
+      r_data->append (buf, nread);
+    }
+  return nread;
+}
+
+/* A reader waits for the writer.  */
+static void
+check_blocking_read ()
+{
+  PipeDataProvider pipe;
+  std::atomic<bool> done (false);
+  std::string data;
+
+  std::thread reader ([&] () {
+      char buf[16];
+      const ssize_t nread = pipe.read (buf, sizeof buf);
+      if (nread > 0)
+        {
+          data.assign (buf, nread);
+        }
+      done = true;
+    });
+  std::this_thread::sleep_for (std::chrono::milliseconds (50));
+  if (done)
+    {
+      fail ("Read did not block");
+    }
+  pipe.write ("hello", 5);
+  reader.join ();
+  if (data != "hello")
+    {
+      fail ("Wrong data after blocking read");
+    }
+}
+
+/* Data that wraps around the end of the buffer stays in order.  */
+static void
+check_wraparound ()
+{
+  PipeDataProvider pipe (8);
+  char buf[8];
+
+  if (pipe.write ("abcde", 5) != 5 || pipe.read (buf, 5) != 5 ||
+      pipe.write ("fghijk", 6) != 6 || pipe.read (buf, sizeof buf) != 6 ||
+      std::string (buf, 6) != "fghijk")
+    {
+      fail ("Wrong data after wraparound");
+    }
+
+  /* More than the capacity in odd sized chunks.  */
+  std::string input;
+  for (int i = 0; i < 10000; i++)
+    {
+      input += (char) ('a' + i % 23);
+    }
+  PipeDataProvider small (7);
+  std::thread writer ([&] () {
+      for (size_t pos = 0; pos < input.size (); pos += 5)
+        {
+          const size_t len = std::min ((size_t) 5, input.size () - pos);
+          if (small.write (input.data () + pos, len) != (ssize_t) len)
+            {
+              fail ("Write failed");
+            }
+        }
+      small.close_write ();
+    });
+  std::string output;
+  const ssize_t last = read_all (small, &output, 3);
+  writer.join ();
+  if (last || output != input || small.total () != input.size ())
+    {
+      fail ("Wrong data through a small pipe");
+    }
+}
+
+/* The reader gets the buffered data and then EOF or an error.  */
+static void
+check_close ()
+{
+  std::string data;
+  PipeDataProvider pipe;
+  pipe.write ("data", 4);
+  pipe.close_write ();
+  if (read_all (pipe, &data, 2) != 0 || data != "data" ||
+      pipe.read (&data[0], 1) != 0)
+    {
+      fail ("No EOF after close");
+    }
+  if (pipe.write ("more", 4) != -1 || errno != EPIPE)
+    {
+      fail ("Write after close succeeded");
+    }
+
+  data.clear ();
+  PipeDataProvider failed;
+  failed.write ("data", 4);
+  failed.close_write (true);
+  if (read_all (failed, &data, 2) != -1 || errno != EPIPE ||
+      data != "data")
+    {
+      fail ("No error after failed close");
+    }
+}
+
+/* Abort releases a writer that waits for room.  */
+static void
+check_abort ()
+{
+  PipeDataProvider pipe (4);
+  std::atomic<bool> done (false);
+  ssize_t written = 0;
+  int err = 0;
+
+  std::thread writer ([&] () {
+      written = pipe.write ("0123456789", 10);
+      err = errno;
+      done = true;
+    });
+  std::this_thread::sleep_for (std::chrono::milliseconds (50));
+  if (done)
+    {
+      fail ("Write did not block");
+    }
+  pipe.abort ();
+  writer.join ();
+  if (written != -1 || err != EPIPE)
+    {
+      fail ("Blocked writer not released");
+    }
+  if (pipe.write ("x", 1) != -1 || errno != EPIPE)
+    {
+      fail ("Write after abort succeeded");
+    }
+}
+
+int main()
+{
+  check_blocking_read ();
+  check_wraparound ();
+  check_close ();
+  check_abort ();
+  return 0;
+}
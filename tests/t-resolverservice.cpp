@@ -0,0 +1,305 @@
+/* t-resolverservice.cpp - Test for the resolver service protocol.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "common_indep.h"
+#include "resolverservice.h"
+#include "t-common.h"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Stands in for resolver.exe --server.  It knows a key for some
+   mailboxes and answers like the real resolver without a dialog.
+   A mailbox "cancel@example.org" cancels, the argument --fail
+   makes the request fail and --crash makes the helper exit.  */
+static std::map<std::string, std::string> s_keys;
+static std::atomic<int> s_launches;
+static std::atomic<int> s_requests;
+static std::vector<std::thread> s_threads;
+
+static void
+stand_in (std::unique_ptr<ResolverService::Connection> conn)
+{
+  conn->write_line ("OK stand-in resolver");
+  std::vector<std::string> args;
+  std::string line;
+  while (conn->read_line (&line))
+    {
+      if (line.compare (0, 4, "ARG ") == 0)
+        {
+          args.push_back (ResolverService::unescape (line.substr (4)));
+          continue;
+        }
+      if (line == "BYE")
+        {
+          return;
+        }
+      if (line != "RESOLVE")
+        {
+          conn->write_line ("ERR 1 unknown command");
+          continue;
+        }
+      s_requests++;
+      std::vector<std::string> output;
+      bool encrypt = false;
+      bool failed = false;
+      for (size_t i = 0; i < args.size (); i++)
+        {
+          const auto &arg = args[i];
+          if (arg == "--crash")
+            {
+              return;
+            }
+          if (arg == "--fail")
+            {
+              failed = true;
+            }
+          else if (arg == "--sender" && i + 1 < args.size ())
+            {
+              output.push_back ("sig:smime:" + s_keys[args[++i]]);
+            }
+          else if (arg == "--encrypt")
+            {
+              encrypt = true;
+            }
+          else if (arg == "cancel@example.org")
+            {
+              output.assign (1, "cancel");
+              break;
+            }
+          else if (encrypt && arg.compare (0, 2, "--"))
+            {
+              output.push_back ("enc:smime:" + s_keys[arg] + ":" + arg);
+            }
+        }
+      args.clear ();
+      if (failed)
+        {
+          conn->write_line ("ERR 2 failed");
+          continue;
+        }
+      for (const auto &out: output)
+        {
+          conn->write_line ("D " + ResolverService::escape (out));
+        }
+      conn->write_line ("OK");
+    }
+}
+
+static std::unique_ptr<ResolverService::Connection>
+launch_stand_in ()
+{
+  int to_helper[2];
+  int from_helper[2];
+  if (pipe (to_helper) || pipe (from_helper))
+    {
+      return nullptr;
+    }
+  s_launches++;
+  s_threads.push_back (std::thread (stand_in,
+    ResolverService::fd_connection (to_helper[0], from_helper[1])));
+  return ResolverService::fd_connection (from_helper[0], to_helper[1]);
+}
+
+static void
+check_escape ()
+{
+  const std::string str = "a%b\r\nc:d";
+  if (ResolverService::escape (str) != "a%25b%0D%0Ac:d" ||
+      ResolverService::unescape (ResolverService::escape (str)) != str ||
+      ResolverService::unescape ("%zz%4") != "%zz%4")
+    {
+      fail ("Escaping broken");
+    }
+}
+
+static void
+check_parse ()
+{
+  resolver_output_s result;
+  if (parse_resolver_output ("sig:smime:AAAA\r\n"
+                             "enc:smime:BBBB:bob@example.org\n"
+                             "enc:pgp:CCCC:carol@example.org\n", &result)
+      || result.proto != "smime" || result.sig_fprs.size () != 1
+      || result.sig_fprs[0] != "AAAA" || result.recp_fprs.size () != 2
+      || result.recp_fprs[1].first != "carol@example.org"
+      || result.recp_fprs[1].second != "CCCC")
+    {
+      fail ("Output not parsed");
+    }
+  if (parse_resolver_output ("sig:pgp:AAAA\ncancel\n", &result) != -2 ||
+      parse_resolver_output ("unencrypted\n", &result) != -1 ||
+      parse_resolver_output ("", &result) || !result.proto.empty ())
+    {
+      fail ("Wrong result");
+    }
+}
+
+static void
+check_service ()
+{
+  s_keys["alice@example.org"] = "A11CE";
+  s_keys["bob@example.org"] = "B0B";
+  ResolverService service (launch_stand_in);
+
+  const std::vector<std::string> args = {
+    "--debug", "--overlayText", "Resolving\nrecipients...", "--sign",
+    "--sender", "alice@example.org", "--encrypt", "bob@example.org" };
+  std::string output;
+  resolver_output_s result;
+  if (service.resolve (args, &output) != ResolverService::Resolved ||
+      parse_resolver_output (output, &result) ||
+      result.sig_fprs.size () != 1 || result.sig_fprs[0] != "A11CE" ||
+      result.recp_fprs.size () != 1 || result.recp_fprs[0].second != "B0B")
+    {
+      fail ("Request failed");
+    }
+
+  /* The helper keeps running between requests.  */
+  if (service.resolve ({ "--encrypt", "cancel@example.org" }, &output) !=
+      ResolverService::Resolved ||
+      parse_resolver_output (output, &result) != -2 ||
+      service.resolve (args, &output) != ResolverService::Resolved ||
+      s_launches != 1 || s_requests != 3)
+    {
+      fail ("Helper not reused");
+    }
+
+  /* A failed request keeps the helper, a lost one is restarted.
+     Both fail the resolution because the helper got the request.  */
+  if (service.resolve ({ "--fail" }, &output) != ResolverService::Failed ||
+      service.resolve (args, &output) != ResolverService::Resolved ||
+      s_launches != 1)
+    {
+      fail ("Failed request not handled");
+    }
+  if (service.resolve ({ "--crash" }, &output) != ResolverService::Failed ||
+      service.resolve (args, &output) != ResolverService::Resolved ||
+      s_launches != 2)
+    {
+      fail ("Lost helper not restarted");
+    }
+  service.stop ();
+}
+
+static void
+check_unavailable ()
+{
+  int launches = 0;
+  ResolverService service ([&launches] () {
+    launches++;
+    return std::unique_ptr<ResolverService::Connection> ();
+  });
+  std::string output;
+  if (service.resolve ({ "--encrypt" }, &output) !=
+      ResolverService::NotAvailable || service.disabled ()
+      || service.start () || !service.disabled ()
+      || service.resolve ({ "--encrypt" }, &output) !=
+      ResolverService::NotAvailable || launches != 2)
+    {
+      fail ("Missing helper not handled");
+    }
+}
+
+static void
+check_silent ()
+{
+  /* Like a resolver without server mode that keeps running.  */
+  std::vector<int> fds;
+  int launches = 0;
+  ResolverService service ([&fds, &launches] () {
+    int to_helper[2];
+    int from_helper[2];
+    if (pipe (to_helper) || pipe (from_helper))
+      {
+        return std::unique_ptr<ResolverService::Connection> ();
+      }
+    launches++;
+    fds.push_back (to_helper[0]);
+    fds.push_back (from_helper[1]);
+    return ResolverService::fd_connection (from_helper[0], to_helper[1]);
+  }, 100);
+  std::string output;
+  const auto start = std::chrono::steady_clock::now ();
+  if (service.resolve ({ "--encrypt" }, &output) !=
+      ResolverService::NotAvailable || !service.disabled ()
+      || service.resolve ({ "--encrypt" }, &output) !=
+      ResolverService::NotAvailable || launches != 1
+      || std::chrono::steady_clock::now () - start > std::chrono::seconds (5))
+    {
+      fail ("Silent helper not handled");
+    }
+  for (const int fd: fds)
+    {
+      close (fd);
+    }
+}
+
+static void
+check_unsent ()
+{
+  /* A helper that goes away before it got the request.  */
+  int launches = 0;
+  ResolverService service ([&launches] () {
+    int to_helper[2];
+    int from_helper[2];
+    if (pipe (to_helper) || pipe (from_helper))
+      {
+        return std::unique_ptr<ResolverService::Connection> ();
+      }
+    launches++;
+    close (to_helper[0]);
+    auto helper = ResolverService::fd_connection (-1, from_helper[1]);
+    helper->write_line ("OK greeting");
+    return ResolverService::fd_connection (from_helper[0], to_helper[1]);
+  });
+  std::string output;
+  if (service.resolve ({ "--encrypt" }, &output) !=
+      ResolverService::NotAvailable || service.disabled () || launches != 1)
+    {
+      fail ("Unsent request not handled");
+    }
+}
+
+int main()
+{
+  /* Writing to a helper that exited must not kill us.  */
+  signal (SIGPIPE, SIG_IGN);
+
+  check_escape ();
+  check_parse ();
+  check_service ();
+  check_unavailable ();
+  check_silent ();
+  check_unsent ();
+
+  for (auto &thread: s_threads)
+    {
+      thread.join ();
+    }
+  return 0;
+}
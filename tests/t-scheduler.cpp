@@ -0,0 +1,179 @@
+/* t-scheduler.cpp - Test for the delayed job scheduler.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "common_indep.h"
+#include "scheduler.h"
+#include "t-common.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using std::chrono::milliseconds;
+
+/* Wait until pending jobs are done or the timeout passed.  */
+static void
+wait_idle (Scheduler &sched)
+{
+  for (int i = 0; i < 500 && sched.pending (); i++)
+    {
+      std::this_thread::sleep_for (milliseconds (10));
+    }
+  /* The last job might still run.  */
+  std::this_thread::sleep_for (milliseconds (20));
+}
+
+static void
+check_order ()
+{
+  Scheduler sched;
+  std::mutex mutex;
+  std::string order;
+  std::thread::id first_thread;
+  std::atomic<bool> one_thread (true);
+
+  const int delays[] = {60, 0, 30, 30, 10};
+  const char names[] = "edbca";
+  for (int i = 0; i < 5; i++)
+    {
+      const char name = names[i];
+      sched.schedule (milliseconds (delays[i]), [&, name] ()
+        {
+          std::lock_guard<std::mutex> lock (mutex);
+          if (order.empty ())
+            {
+              first_thread = std::this_thread::get_id ();
+            }
+          else if (first_thread != std::this_thread::get_id ())
+            {
+              one_thread = false;
+            }
+          order += name;
+        });
+    }
+  wait_idle (sched);
+  if (order != "dabce")
+    {
+      fail ("Wrong order");
+    }
+  if (!one_thread || first_thread == std::this_thread::get_id ())
+    {
+      fail ("Not run in one scheduler thread");
+    }
+}
+
+static void
+check_coalesce ()
+{
+  Scheduler sched;
+  std::atomic<int> runs (0);
+  int dropped = 0;
+
+  for (int i = 0; i < 50; i++)
+    {
+      if (!sched.schedule (milliseconds (30), [&runs] () { runs++; }, 1))
+        {
+          dropped++;
+        }
+    }
+  wait_idle (sched);
+  if (runs != 1 || dropped != 49)
+    {
+      fail ("Requests not coalesced");
+    }
+  /* Once it ran the key can be scheduled again.  */
+  sched.schedule (milliseconds (0), [&runs] () { runs++; }, 1);
+  wait_idle (sched);
+  if (runs != 2)
+    {
+      fail ("Key not released");
+    }
+}
+
+static void
+check_block ()
+{
+  Scheduler sched;
+  std::atomic<int> blockable (0);
+  std::atomic<int> other (0);
+
+  sched.block ();
+  sched.block ();
+  sched.schedule (milliseconds (0), [&blockable] () { blockable++; }, 2, true);
+  sched.schedule (milliseconds (0), [&other] () { other++; });
+  std::this_thread::sleep_for (milliseconds (100));
+  if (other != 1)
+    {
+      fail ("Normal job blocked");
+    }
+  if (blockable || sched.pending () != 1)
+    {
+      fail ("Blockable job not held");
+    }
+  sched.unblock ();
+  std::this_thread::sleep_for (milliseconds (50));
+  if (blockable)
+    {
+      fail ("Job ran while still blocked");
+    }
+  /* It runs right after the last unblock without polling.  */
+  const auto start = std::chrono::steady_clock::now ();
+  sched.unblock ();
+  while (!blockable &&
+         std::chrono::steady_clock::now () - start < milliseconds (1000))
+    {
+      std::this_thread::yield ();
+    }
+  if (!blockable ||
+      std::chrono::steady_clock::now () - start > milliseconds (200))
+    {
+      fail ("Held job not run on unblock");
+    }
+  if (sched.unblock () || sched.blocked ())
+    {
+      fail ("Block count mismatch");
+    }
+}
+
+static void
+check_shutdown ()
+{
+  std::atomic<int> runs (0);
+  {
+    Scheduler sched;
+    sched.schedule (milliseconds (60000), [&runs] () { runs++; });
+  }
+  if (runs)
+    {
+      fail ("Job run at shutdown");
+    }
+}
+
+int main()
+{
+  check_order ();
+  check_coalesce ();
+  check_block ();
+  check_shutdown ();
+  return 0;
+}
@@ -0,0 +1,238 @@
+/* t-singleflight.cpp - Test for sharing results of operations.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "singleflight.h"
+#include "t-common.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define NTHREADS 8
+
+/* Callers that arrive while the leader runs share its result.  */
+static void
+check_concurrent ()
+{
+  SingleFlight<const std::string> flights;
+  std::atomic<int> calls (0);
+  std::atomic<bool> started (false);
+  std::atomic<int> shared (0);
+  std::vector<std::shared_ptr<const std::string> > results (NTHREADS);
+  std::vector<std::thread> threads;
+
+  auto op = [&] (bool &retain) {
+      calls++;
+      started = true;
+      std::this_thread::sleep_for (std::chrono::milliseconds (100));
+      retain = true;
+      return std::make_shared<const std::string> ("result");
+    };
+  for (int i = 0; i < NTHREADS; i++)
+    {
+      threads.push_back (std::thread ([&, i] () {
+          bool r_shared;
+          results[i] = flights.run ("key", op, &r_shared);
+          if (r_shared)
+            {
+              shared++;
+            }
+        }));
+      /* Make sure the first thread is the leader.  */
+      while (!i && !started)
+        {
+          std::this_thread::sleep_for (std::chrono::milliseconds (1));
+        }
+    }
+  for (auto &thread: threads)
+    {
+      thread.join ();
+    }
+  if (calls != 1 || shared != NTHREADS - 1)
+    {
+      fail ("Concurrent callers not shared");
+    }
+  for (const auto &result: results)
+    {
+      if (result != results[0] || *result != "result")
+        {
+          fail ("Different results");
+        }
+    }
+
+  /* Other keys run on their own.  */
+  bool r_shared;
+  flights.run ("other", op, &r_shared);
+  if (calls != 2 || r_shared)
+    {
+      fail ("Different key shared");
+    }
+}
+
+/* Failed results are neither handed to waiters nor retained.  */
+static void
+check_failures ()
+{
+  SingleFlight<const std::string> flights;
+  int calls = 0;
+  bool r_shared;
+
+  auto failing = [&calls] (bool &retain) {
+      calls++;
+      retain = true;
+      return std::shared_ptr<const std::string> ();
+    };
+  if (flights.run ("key", failing, &r_shared) ||
+      flights.run ("key", failing, &r_shared) || calls != 2 || r_shared)
+    {
+      fail ("Failure retained");
+    }
+
+  auto throwing = [&calls] (bool &) -> std::shared_ptr<const std::string> {
+      calls++;
+      throw std::runtime_error ("broken");
+    };
+  for (int i = 0; i < 2; i++)
+    {
+      try
+        {
+          flights.run ("key", throwing);
+          fail ("Exception not passed on");
+        }
+      catch (const std::runtime_error &)
+        {
+        }
+    }
+  if (calls != 4)
+    {
+      fail ("Exception retained");
+    }
+
+  /* Results the leader does not retain are not shared.  */
+  auto unshared = [&calls] (bool &retain) {
+      calls++;
+      retain = false;
+      return std::make_shared<const std::string> ("private");
+    };
+  const auto first = flights.run ("key", unshared, &r_shared);
+  const auto second = flights.run ("key", unshared, &r_shared);
+  if (calls != 6 || first == second || r_shared)
+    {
+      fail ("Unretained result shared");
+    }
+
+  /* Waiters of a failed leader run the operation themselves.  */
+  std::atomic<int> waiter_calls (0);
+  std::atomic<bool> started (false);
+  std::vector<std::thread> threads;
+  std::vector<std::shared_ptr<const std::string> > results (NTHREADS);
+  for (int i = 0; i < NTHREADS; i++)
+    {
+      threads.push_back (std::thread ([&, i] () {
+          results[i] = flights.run ("waiters", [&, i] (bool &retain) {
+              waiter_calls++;
+              started = true;
+              retain = true;
+              if (!i)
+                {
+                  std::this_thread::sleep_for
+                    (std::chrono::milliseconds (100));
+                  return std::shared_ptr<const std::string> ();
+                }
+              return std::make_shared<const std::string> ("second");
+            });
+        }));
+      while (!i && !started)
+        {
+          std::this_thread::sleep_for (std::chrono::milliseconds (1));
+        }
+    }
+  for (auto &thread: threads)
+    {
+      thread.join ();
+    }
+  if (results[0] || waiter_calls != 2)
+    {
+      fail ("Waiters of a failed leader not rerun once");
+    }
+  for (int i = 1; i < NTHREADS; i++)
+    {
+      if (!results[i] || results[i] != results[1])
+        {
+          fail ("Waiters did not share the second result");
+        }
+    }
+}
+
+/* Good results are kept while they are used and not longer than
+   the retention time.  */
+static void
+check_expiry ()
+{
+  int calls = 0;
+  bool r_shared;
+  auto op = [&calls] (bool &retain) {
+      calls++;
+      retain = true;
+      return std::make_shared<const std::string> (std::to_string (calls));
+    };
+
+  SingleFlight<const std::string> flights;
+  auto result = flights.run ("key", op, &r_shared);
+  if (flights.run ("key", op, &r_shared) != result || !r_shared ||
+      calls != 1)
+    {
+      fail ("Result not retained");
+    }
+  /* Only a weak reference is kept.  */
+  result.reset ();
+  result = flights.run ("key", op, &r_shared);
+  if (calls != 2 || r_shared || *result != "2")
+    {
+      fail ("Unused result retained");
+    }
+  flights.clear ();
+  if (flights.run ("key", op, &r_shared) == result || calls != 3)
+    {
+      fail ("Clear failed");
+    }
+
+  SingleFlight<const std::string> short_flights (std::chrono::seconds (0));
+  result = short_flights.run ("key", op);
+  std::this_thread::sleep_for (std::chrono::milliseconds (10));
+  if (short_flights.run ("key", op, &r_shared) == result || r_shared ||
+      calls != 5)
+    {
+      fail ("Result retained too long");
+    }
+}
+
+int main()
+{
+  check_concurrent ();
+  check_failures ();
+  check_expiry ();
+  return 0;
+}
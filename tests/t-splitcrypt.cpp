@@ -0,0 +1,142 @@
+/* t-splitcrypt.cpp - Test for encrypting to multiple recipient sets.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "splitcrypt.h"
+#include "workerpool.h"
+#include <gpgme.h>
+#include <gpgme++/context.h>
+#include <gpgme++/data.h>
+#include <gpgme++/decryptionresult.h>
+
+/* Keys in the test homedir. The last one has no secret key. */
+static const char *fprs[] = {
+  "1BA323932B3FAA826132C79E8D9860C58F246DE6",
+  "00949E2AF4A985AFB572FDD214B79E26050467AA",
+  "CA739AC832766152139B5C49FC4FAB94C727D4BB",
+  "AA138400650CBFDD96710605E6C9BBFD0838FFFD",
+  NULL
+};
+
+static void
+fail (const char *msg, int i)
+{
+  fprintf (stderr, "FAIL: %s (set %i)\n", msg, i);
+  exit (1);
+}
+
+int main()
+{
+  putenv ((char*) "GNUPGHOME=" GPGHOMEDIR);
+  gpgme_check_version (NULL);
+
+  auto ctx = GpgME::Context::create (GpgME::OpenPGP);
+  std::vector<std::vector<GpgME::Key> > sets;
+  for (int i = 0; fprs[i]; i++)
+    {
+      GpgME::Error err;
+      const auto key = ctx->key (fprs[i], err, false);
+      if (err || key.isNull ())
+        {
+          fail ("Failed to find key", i);
+        }
+      sets.push_back (std::vector<GpgME::Key> (1, key));
+    }
+
+  std::string text;
+  for (int i = 0; i < 2000; i++)
+    {
+      text += "Content-Type: text/plain\r\n\r\nThe same plaintext for all.\r\n";
+    }
+  const auto plaintext = std::make_shared<const std::string> (text);
+
+  WorkerPool pool (3, 2);
+  const auto results = split_encrypt (GpgME::OpenPGP, plaintext, sets, &pool);
+  if (results.size () != sets.size ())
+    {
+      fail ("Wrong number of results", -1);
+    }
+
+  for (size_t i = 0; i < results.size (); i++)
+    {
+      const auto &result = results[i];
+      if (result.err || !result.ciphertext)
+        {
+          fail ("Encryption failed", (int) i);
+        }
+      if (result.keys.size () != 1 ||
+          strcmp (result.keys[0].primaryFingerprint (), fprs[i]))
+        {
+          fail ("Result order does not match", (int) i);
+        }
+
+      GpgME::Data input (result.ciphertext->c_str (),
+                         result.ciphertext->size (), false);
+      GpgME::Data output;
+      const auto decResult = ctx->decrypt (input, output);
+      if (!fprs[i + 1])
+        {
+          /* No secret key for the last set. */
+          if (!decResult.error ())
+            {
+              fail ("Decrypted without secret key", (int) i);
+            }
+          continue;
+        }
+      if (decResult.error ())
+        {
+          fail ("Decryption failed", (int) i);
+        }
+      if (output.toString () != *plaintext)
+        {
+          fail ("Plaintext mismatch", (int) i);
+        }
+    }
+
+  /* The cache only hands out results for the right batch and
+     key set and only once.  */
+  const auto cache = SplitCryptCache::instance ();
+  const auto batch = cache->new_batch ();
+  const auto other = cache->new_batch ();
+  if (batch == other)
+    {
+      fail ("Batch ids are not unique", -1);
+    }
+  cache->put (batch, GpgME::OpenPGP, false, sets[0], results[0].ciphertext);
+  if (cache->take (other, GpgME::OpenPGP, false, sets[0]) ||
+      cache->take (batch, GpgME::OpenPGP, true, sets[0]) ||
+      cache->take (batch, GpgME::OpenPGP, false, sets[1]))
+    {
+      fail ("Cache returned a result for the wrong request", -1);
+    }
+  if (cache->take (batch, GpgME::OpenPGP, false, sets[0]) !=
+      results[0].ciphertext)
+    {
+      fail ("Cache did not return the result", -1);
+    }
+  if (cache->take (batch, GpgME::OpenPGP, false, sets[0]) || cache->size ())
+    {
+      fail ("Cache returned a result twice", -1);
+    }
+
+  fprintf (stderr, "Pass: split encryption\n");
+  exit(0);
+}
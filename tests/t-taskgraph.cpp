@@ -0,0 +1,155 @@
+/* t-taskgraph.cpp - Test for the task graph.
+ * Copyright (C) 2020 g10 Code GmbH
+ *
+ * This file is part of GpgOL.
+ *
+ * GpgOL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * GpgOL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "common_indep.h"
+#include "taskgraph.h"
+#include "t-common.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Wait up to five seconds for flag.  */
+static bool
+wait_for (const std::atomic<bool> &flag)
+{
+  for (int i = 0; i < 500 && !flag; i++)
+    {
+      std::this_thread::sleep_for (std::chrono::milliseconds (10));
+    }
+  return flag;
+}
+
+static std::mutex s_mutex;
+static std::vector<std::string> s_order;
+
+static void
+record (const std::string &name)
+{
+  std::lock_guard<std::mutex> lock (s_mutex);
+  s_order.push_back (name);
+}
+
+static size_t
+position (const std::string &name)
+{
+  std::lock_guard<std::mutex> lock (s_mutex);
+  for (size_t i = 0; i < s_order.size (); i++)
+    {
+      if (s_order[i] == name)
+        {
+          return i;
+        }
+    }
+  fail ("Task did not run");
+  return 0;
+}
+
+int main()
+{
+  /* Like the startup: two listings that have to run at the same
+     time, a card check and tasks that wait for them.  */
+  std::atomic<bool> pgp_running (false);
+  std::atomic<bool> cms_running (false);
+  std::atomic<bool> parallel (true);
+  TaskGraph graph ("test");
+  const int pgp = graph.add ("pgp", [&] () {
+      pgp_running = true;
+      parallel = parallel && wait_for (cms_running);
+      record ("pgp");
+    });
+  const int cms = graph.add ("cms", [&] () {
+      cms_running = true;
+      parallel = parallel && wait_for (pgp_running);
+      std::this_thread::sleep_for (std::chrono::milliseconds (20));
+      record ("cms");
+    });
+  const int card = graph.add ("card", [] () {
+      record ("card");
+      throw std::runtime_error ("no card");
+    });
+  graph.add ("pgp secret", [] () { record ("pgp secret"); },
+             { pgp, card });
+  const int cms_secret = graph.add ("cms secret",
+                                    [] () { record ("cms secret"); },
+                                    { cms, card });
+  graph.add ("last", [] () { record ("last"); }, { cms_secret, pgp });
+
+  if (graph.add ("bad", [] () {}, { 42 }) != -1 ||
+      graph.add ("self", [] () {}, { (int) graph.size () }) != -1 ||
+      graph.size () != 6)
+    {
+      fail ("Unknown dependency accepted");
+    }
+
+  graph.run ();
+
+  if (!parallel)
+    {
+      fail ("Independent tasks not run in parallel");
+    }
+  if (s_order.size () != 6 ||
+      position ("pgp secret") < position ("pgp") ||
+      position ("pgp secret") < position ("card") ||
+      position ("cms secret") < position ("cms") ||
+      position ("cms secret") < position ("card") ||
+      position ("last") != 5)
+    {
+      fail ("Dependencies not respected");
+    }
+
+  const auto timings = graph.timings ();
+  if (timings.size () != 6 || timings[1].name != "cms" ||
+      timings[1].took < 20 ||
+      timings[4].started < timings[1].started + timings[1].took ||
+      graph.elapsed () < timings[4].started + timings[4].took)
+    {
+      fail ("Wrong timings");
+    }
+
+  /* A graph runs once and can't be changed afterwards.  */
+  graph.run ();
+  if (s_order.size () != 6 || graph.add ("late", [] () {}) != -1)
+    {
+      fail ("Graph run twice");
+    }
+
+  /* Detached and empty graphs.  */
+  std::atomic<bool> done (false);
+  auto detached = std::make_shared<TaskGraph> ("detached");
+  detached->add ("one", [&done] () { done = true; });
+  TaskGraph::run_detached (detached);
+  if (!wait_for (done))
+    {
+      fail ("Detached graph not run");
+    }
+  /* The thread holds a reference until the run is over.  */
+  for (int i = 0; i < 500 && detached.use_count () > 1; i++)
+    {
+      std::this_thread::sleep_for (std::chrono::milliseconds (10));
+    }
+  TaskGraph ("empty").run ();
+  return 0;
+}